@@ -0,0 +1,111 @@
+/**
+Times cgroup setup (mkdir + limits + moving a process in) and teardown (rmdir) for each backend available
+on this host, so the v1 and v2 paths can be compared. Needs to run as root.
+Usage: ./cgroup_bench [iterations]
+*/
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cgroups.h"
+
+static double now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+static void report(const char* backend, const char* phase, double* samples, int n) {
+  qsort(samples, n, sizeof(double), compare_doubles);
+  double total = 0;
+  for (int i = 0; i < n; ++i) {
+    total += samples[i];
+  }
+  printf("%s %-8s mean=%8.1fus p50=%8.1fus p99=%8.1fus max=%8.1fus\n", backend, phase,
+    total / n, samples[n / 2], samples[(n * 99) / 100], samples[n - 1]);
+}
+
+static void bench_backend(cgroup_version_t version, int iterations, container_params_t* options) {
+  double* startup = calloc(iterations, sizeof(double));
+  double* teardown = calloc(iterations, sizeof(double));
+  const char* name = version == CGROUP_V2 ? "v2" : "v1";
+
+  // The backends narrate what they are doing on stdout, keep that out of the numbers we print.
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+
+  for (int i = 0; i < iterations; ++i) {
+    // A process that does nothing until it is killed stands in for the container.
+    pid_t pid = fork();
+    if (pid == 0) {
+      pause();
+      _exit(0);
+    }
+
+    dup2(devnull, STDOUT_FILENO);
+    cgroup_t cgroup = { .version = version, .name = "bench", .dir_fd = -1 };
+    double start = now_us();
+    setup_cgroups(&cgroup, options);
+    attach_to_cgroups(&cgroup, pid);
+    startup[i] = now_us() - start;
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    start = now_us();
+    clean_up_cgroups(&cgroup);
+    teardown[i] = now_us() - start;
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+  }
+
+  close(devnull);
+  close(saved_stdout);
+  report(name, "startup", startup, iterations);
+  report(name, "teardown", teardown, iterations);
+  free(startup);
+  free(teardown);
+}
+
+int main(int argc, char const *argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 200;
+  if (iterations <= 0) {
+    fprintf(stderr, "Usage: ./cgroup_bench [iterations]\n");
+    return 1;
+  }
+
+  container_params_t options = {
+    .mem_limit = "41943040",
+    .mem_plus_swap_limit = "41943040",
+    .pid_limit = "10",
+    .cpu_period = "100000",
+    .cpu_quota = "20000"
+  };
+
+  // Only one of the two layouts is ever mounted at /sys/fs/cgroup, so only that backend can be measured.
+  struct stat st;
+  cgroup_version_t version = detect_cgroup_version();
+  if (version == CGROUP_V1 && stat("/sys/fs/cgroup/memory", &st) != 0) {
+    fprintf(stderr, "No cgroup hierarchy found under /sys/fs/cgroup\n");
+    return 1;
+  }
+  printf("cgroup v%d, %d iterations\n", version, iterations);
+  bench_backend(version, iterations, &options);
+  return 0;
+}
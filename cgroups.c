@@ -0,0 +1,970 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <linux/magic.h>
+
+#include "cgroups.h"
+
+#define CGROUP_PATH_V1                "/sys/fs/cgroup"
+#define CGROUP_DIR_MODE               (S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH)
+
+// Every container gets its own directory under a shared drydock parent in each hierarchy.
+#define CGROUP_V1_PARENT_FORMAT       "/sys/fs/cgroup/%s/drydock"
+#define CGROUP_V1_DIR_FORMAT          "/sys/fs/cgroup/%s/drydock/%s"
+#define CGROUP_PROCS                  "cgroup.procs"
+
+// memory namespace
+#define CGROUP_MEMORY_LIMIT           "memory.limit_in_bytes"
+#define CGROUP_MEM_PLUS_SWAP_LIMIT    "memory.memsw.limit_in_bytes"
+
+// pid namespace
+#define CGROUP_PID_LIMIT              "pids.max"
+
+// cpu namespace
+#define CGROUP_CPU_PERIOD             "cpu.cfs_period_us"
+#define CGROUP_CPU_QUOTA              "cpu.cfs_quota_us"
+
+// cpuset namespace
+#define CGROUP_CPUSET_CPUS            "cpuset.cpus"
+#define CGROUP_CPUSET_MEMS            "cpuset.mems"
+
+// blkio namespace, each limit is "<major>:<minor> <value>" for one disk
+#define CGROUP_BLKIO_READ_BPS         "blkio.throttle.read_bps_device"
+#define CGROUP_BLKIO_WRITE_BPS        "blkio.throttle.write_bps_device"
+#define CGROUP_BLKIO_READ_IOPS        "blkio.throttle.read_iops_device"
+#define CGROUP_BLKIO_WRITE_IOPS       "blkio.throttle.write_iops_device"
+
+// Hybrid hosts mount a unified hierarchy without controllers next to the v1 ones. It still accounts pressure
+// stall information, so containers get a directory there just for their *.pressure files.
+#define CGROUP_V1_UNIFIED             "unified"
+#define CGROUP_V1_UNIFIED_PATH        "/sys/fs/cgroup/unified"
+
+// unified hierarchy, everything lives in one directory
+#define CGROUP_PATH_V2                "/sys/fs/cgroup"
+#define CGROUP_V2_SUBTREE_CONTROL     "cgroup.subtree_control"
+#define CGROUP_V2_CONTROLLERS         "+memory +pids +cpu"
+#define CGROUP_V2_CPUSET_CONTROLLER   "+cpuset"
+#define CGROUP_V2_IO_CONTROLLER       "+io"
+#define CGROUP_V2_IO_MAX              "io.max"
+#define CGROUP_V2_IO_LATENCY          "io.latency"
+#define CGROUP_V2_PARENT              "/sys/fs/cgroup/drydock"
+#define CGROUP_V2_DIR_FORMAT          "/sys/fs/cgroup/drydock/%s"
+
+// v1 reports no memory limit as a page-rounded LONG_MAX, anything this big means unlimited.
+#define CGROUP_V1_UNLIMITED_MEMORY    (1LL << 62)
+// Smallest limits an update may set, less is more likely a typo than a plan.
+#define CGROUP_MIN_MEMORY             (4LL << 20)
+
+static const char* v1_controllers[] = { "memory", "pids", "cpu" };
+#define NUM_V1_CONTROLLERS            (sizeof(v1_controllers) / sizeof(v1_controllers[0]))
+
+#define MAX_V1_DIRS                   (NUM_V1_CONTROLLERS + 3)
+
+// The hierarchies a container has directories in: cpuset only if it is pinned, blkio only if its I/O is limited
+// and unified only on a hybrid host.
+static size_t v1_dirs(cgroup_t* cgroup, const char* controllers[MAX_V1_DIRS]) {
+  size_t count = 0;
+  for (size_t i = 0; i < NUM_V1_CONTROLLERS; ++i) {
+    controllers[count++] = v1_controllers[i];
+  }
+  if (cgroup->cpuset) {
+    controllers[count++] = "cpuset";
+  }
+  if (cgroup->blkio) {
+    controllers[count++] = "blkio";
+  }
+  if (cgroup->psi) {
+    controllers[count++] = CGROUP_V1_UNIFIED;
+  }
+  return count;
+}
+
+static bool has_io_limits(container_params_t* options) {
+  return options->io_read_bps || options->io_write_bps || options->io_read_iops || options->io_write_iops ||
+    options->io_latency_us;
+}
+
+FILE* fopen_in_cgroup(const char* dir, const char* file) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  return fopen(path, "w");
+}
+
+
+cgroup_version_t detect_cgroup_version() {
+  // On a unified host /sys/fs/cgroup itself is cgroup2, on v1 and hybrid hosts it is a tmpfs of v1 mounts.
+  struct statfs fs;
+  if (statfs(CGROUP_PATH_V2, &fs) == 0 && fs.f_type == CGROUP2_SUPER_MAGIC) {
+    return CGROUP_V2;
+  }
+  return CGROUP_V1;
+}
+
+
+void setup_memory_cgroup(cgroup_t* cgroup, container_params_t* options) {
+  puts("Setting memory limits for container...");
+
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), CGROUP_V1_DIR_FORMAT, "memory", cgroup->name);
+
+  if (mkdir(dir, CGROUP_DIR_MODE) == -1) {
+    perror("Failed to create CGROUP_MEMORY_DIR");
+    fputs(">>>>>>>> Warning: No memory or swap limits will be set! <<<<<<<<\n", stderr);
+    return;
+  }
+  FILE* f = fopen_in_cgroup(dir, CGROUP_MEMORY_LIMIT);
+  if (f) {
+    size_t num_bytes = strlen(options->mem_limit);
+    if (fwrite(options->mem_limit, sizeof(char), num_bytes, f) != num_bytes) {
+      perror("Failed to write memory limit to CGROUP_MEMORY_LIMIT");
+      fputs(">>>>>>>> Warning: Memory limit not set! <<<<<<<<\n", stderr);
+    }
+    if (fclose(f) != 0) {
+      perror("Failed to close CGROUP_MEMORY_LIMIT");
+    }
+  }
+  else {
+    perror("Failed to open CGROUP_MEMORY_LIMIT");
+    perror("Failed to write memory limit to CGROUP_MEMORY_LIMIT");
+    fputs(">>>>>>>> Warning: Memory limit not set! <<<<<<<<\n", stderr);
+  }
+
+  f = fopen_in_cgroup(dir, CGROUP_MEM_PLUS_SWAP_LIMIT);
+  if (f) {
+    size_t num_bytes = strlen(options->mem_plus_swap_limit);
+    if (fwrite(options->mem_plus_swap_limit, sizeof(char), num_bytes, f) != num_bytes) {
+      perror("Failed to write memory plus swap limit to CGROUP_MEM_PLUS_SWAP_LIMIT");
+      fputs(">>>>>>>> Warning: Memory plus swap limit not set! <<<<<<<<\n", stderr);
+      fputs(">>>>>>>> Note: If container exceeds memory limit, it will use swap instead of killing processes! <<<<<<<<\n", stderr);
+    }
+    if (fclose(f) != 0) {
+      perror("Failed to close CGROUP_MEM_PLUS_SWAP_LIMIT");
+    }
+  }
+  else {
+    perror("Failed to open CGROUP_MEM_PLUS_SWAP_LIMIT");
+    fputs(">>>>>>>> Warning: Memory plus swap limit not set! <<<<<<<<\n", stderr);
+    fputs(">>>>>>>> Note: If container exceeds memory limit, it will use swap instead of killing processes! <<<<<<<<\n", stderr);
+  }
+}
+
+
+void setup_pid_cgroup(cgroup_t* cgroup, container_params_t* options) {
+  puts("Setting number of processes limit for container...");
+
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), CGROUP_V1_DIR_FORMAT, "pids", cgroup->name);
+
+  if (mkdir(dir, CGROUP_DIR_MODE) == -1) {
+    perror("Failed to create CGROUP_PID_DIR");
+    fputs(">>>>>>>> Warning: No PID limits will be set! <<<<<<<<\n", stderr);
+    return;
+  }
+  FILE* f = fopen_in_cgroup(dir, CGROUP_PID_LIMIT);
+  if (f) {
+    size_t num_bytes = strlen(options->pid_limit);
+    if (fwrite(options->pid_limit, sizeof(char), num_bytes, f) != num_bytes) {
+      perror("Failed to write PID limit to CGROUP_PID_LIMIT");
+      fputs(">>>>>>>> Warning: PID limit not set! <<<<<<<<\n", stderr);
+    }
+    if (fclose(f) != 0) {
+      perror("Failed to close CGROUP_PID_LIMIT");
+    }
+  }
+  else {
+    perror("Failed to open CGROUP_PID_LIMIT");
+    fputs(">>>>>>>> Warning: PID limit not set! <<<<<<<<\n", stderr);
+  }
+}
+
+
+void setup_cpu_cgroup(cgroup_t* cgroup, container_params_t* options) {
+  puts("Setting CPU limits for container...");
+
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), CGROUP_V1_DIR_FORMAT, "cpu", cgroup->name);
+
+  if (mkdir(dir, CGROUP_DIR_MODE) == -1) {
+    perror("Failed to create CGROUP_CPU_DIR");
+    fputs(">>>>>>>> Warning: No CPU limits will be set! <<<<<<<<\n", stderr);
+    return;
+  }
+  FILE* f = fopen_in_cgroup(dir, CGROUP_CPU_PERIOD);
+  if (f) {
+    size_t num_bytes = strlen(options->cpu_period);
+    if (fwrite(options->cpu_period, sizeof(char), num_bytes, f) != num_bytes) {
+      perror("Failed to write CPU period to CGROUP_CPU_PERIOD");
+      fputs(">>>>>>>> Warning: CPU limit may be set to something very strange! <<<<<<<<\n", stderr);
+    }
+    if (fclose(f) != 0) {
+      perror("Failed to close CGROUP_CPU_PERIOD");
+    }
+  }
+  else {
+    perror("Failed to open CGROUP_CPU_PERIOD");
+    fputs(">>>>>>>> Warning: CPU may be set to something very strange! <<<<<<<<\n", stderr);
+  }
+
+  f = fopen_in_cgroup(dir, CGROUP_CPU_QUOTA);
+  if (f) {
+    size_t num_bytes = strlen(options->cpu_quota);
+    if (fwrite(options->cpu_quota, sizeof(char), num_bytes, f) != num_bytes) {
+      perror("Failed to write CPU quota to CGROUP_CPU_PERIOD");
+      fputs(">>>>>>>> Warning: CPU limit may be set to something very strange! <<<<<<<<\n", stderr);
+    }
+    if (fclose(f) != 0) {
+      perror("Failed to close CGROUP_CPU_QUOTA");
+    }
+  }
+  else {
+    perror("Failed to open CGROUP_CPU_QUOTA");
+    fputs(">>>>>>>> Warning: CPU may be set to something very strange! <<<<<<<<\n", stderr);
+  }
+}
+
+void setup_network_cgroup(cgroup_t* cgroup, container_params_t* options) {
+
+}
+
+
+static int inherit_cpuset_knob(const char* from, const char* to, const char* knob) {
+  // Copies knob down unless to already has a value of its own.
+  char path[PATH_MAX];
+  char value[4096];
+  snprintf(path, sizeof(path), "%s/%s", to, knob);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  ssize_t got = fd == -1 ? -1 : read(fd, value, sizeof(value) - 1);
+  if (fd != -1) {
+    close(fd);
+  }
+  if (got > 1) {
+    return 0;
+  }
+  snprintf(path, sizeof(path), "%s/%s", from, knob);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  got = fd == -1 ? -1 : read(fd, value, sizeof(value) - 1);
+  if (fd != -1) {
+    close(fd);
+  }
+  if (got <= 0) {
+    return -1;
+  }
+  value[got] = '\0';
+  snprintf(path, sizeof(path), "%s/%s", to, knob);
+  return write_cgroup_knob(AT_FDCWD, path, value);
+}
+
+
+void setup_cpuset_cgroup(cgroup_t* cgroup, container_params_t* options) {
+  if (!options->cpuset) {
+    return;
+  }
+  puts("Pinning container to its CPUs...");
+
+  // A new v1 cpuset has no CPUs or memory nodes, and nothing can join it until it has both. The drydock parent
+  // gets everything the root has and each container gets the parent's memory nodes, unless it was placed on a node.
+  char root[PATH_MAX];
+  char parent[PATH_MAX];
+  char dir[PATH_MAX];
+  snprintf(root, sizeof(root), "%s/cpuset", CGROUP_PATH_V1);
+  snprintf(parent, sizeof(parent), CGROUP_V1_PARENT_FORMAT, "cpuset");
+  snprintf(dir, sizeof(dir), CGROUP_V1_DIR_FORMAT, "cpuset", cgroup->name);
+  if ((mkdir(parent, CGROUP_DIR_MODE) == -1 && errno != EEXIST) ||
+    inherit_cpuset_knob(root, parent, CGROUP_CPUSET_CPUS) == -1 ||
+    inherit_cpuset_knob(root, parent, CGROUP_CPUSET_MEMS) == -1) {
+    fprintf(stderr, "Failed to set up %s: %s\n", parent, strerror(errno));
+    fputs(">>>>>>>> Warning: Container will not be pinned to its CPUs! <<<<<<<<\n", stderr);
+    return;
+  }
+  if (mkdir(dir, CGROUP_DIR_MODE) == -1 && errno != EEXIST) {
+    perror("Failed to create CGROUP_CPUSET_DIR");
+    fputs(">>>>>>>> Warning: Container will not be pinned to its CPUs! <<<<<<<<\n", stderr);
+    return;
+  }
+  cgroup->cpuset = true;
+  char path[sizeof(dir) + sizeof(CGROUP_CPUSET_CPUS)];
+  snprintf(path, sizeof(path), "%s/%s", dir, CGROUP_CPUSET_CPUS);
+  if (write_cgroup_knob(AT_FDCWD, path, options->cpuset) == -1) {
+    perror("Failed to write CPUs to CGROUP_CPUSET_CPUS");
+    fputs(">>>>>>>> Warning: Container will not be pinned to its CPUs! <<<<<<<<\n", stderr);
+  }
+  snprintf(path, sizeof(path), "%s/%s", dir, CGROUP_CPUSET_MEMS);
+  if (options->cpuset_mems ? write_cgroup_knob(AT_FDCWD, path, options->cpuset_mems) == -1 :
+    inherit_cpuset_knob(parent, dir, CGROUP_CPUSET_MEMS) == -1) {
+    perror("Failed to write memory nodes to CGROUP_CPUSET_MEMS");
+    fputs(">>>>>>>> Warning: Container will not be pinned to its memory nodes! <<<<<<<<\n", stderr);
+  }
+}
+
+
+void setup_blkio_cgroup(cgroup_t* cgroup, container_params_t* options) {
+  if (!has_io_limits(options)) {
+    return;
+  }
+  puts("Setting block I/O limits for container...");
+
+  const char* on = options->io_device ? options->io_device : options->container_root_path;
+  char device[32];
+  if (find_io_device(on, device, sizeof(device)) == -1) {
+    fprintf(stderr, "Failed to find the disk %s is on: %s\n", on, strerror(errno));
+    fputs(">>>>>>>> Warning: No block I/O limits will be set! <<<<<<<<\n", stderr);
+    return;
+  }
+  if (options->io_latency_us) {
+    fputs(">>>>>>>> Warning: io_latency_us needs cgroup v2, no latency target will be set! <<<<<<<<\n", stderr);
+  }
+
+  char parent[PATH_MAX];
+  char dir[PATH_MAX];
+  snprintf(parent, sizeof(parent), CGROUP_V1_PARENT_FORMAT, "blkio");
+  snprintf(dir, sizeof(dir), CGROUP_V1_DIR_FORMAT, "blkio", cgroup->name);
+  if ((mkdir(parent, CGROUP_DIR_MODE) == -1 && errno != EEXIST) ||
+    (mkdir(dir, CGROUP_DIR_MODE) == -1 && errno != EEXIST)) {
+    perror("Failed to create CGROUP_BLKIO_DIR");
+    fputs(">>>>>>>> Warning: No block I/O limits will be set! <<<<<<<<\n", stderr);
+    return;
+  }
+  cgroup->blkio = true;
+
+  // The throttle only sees I/O that reaches the disk from the container itself. Buffered writes are flushed by
+  // the kernel's writeback threads on v1, so only reads, direct and synchronous writes are held to these.
+  const char* knobs[] = { CGROUP_BLKIO_READ_BPS, CGROUP_BLKIO_WRITE_BPS, CGROUP_BLKIO_READ_IOPS,
+    CGROUP_BLKIO_WRITE_IOPS };
+  const char* limits[] = { options->io_read_bps, options->io_write_bps, options->io_read_iops,
+    options->io_write_iops };
+  for (size_t i = 0; i < sizeof(knobs) / sizeof(knobs[0]); ++i) {
+    char path[sizeof(dir) + sizeof(CGROUP_BLKIO_WRITE_IOPS)];
+    char value[64];
+    if (!limits[i]) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, knobs[i]);
+    snprintf(value, sizeof(value), "%s %s", device, limits[i]);
+    if (write_cgroup_knob(AT_FDCWD, path, value) == -1) {
+      fprintf(stderr, "Failed to write %s to %s: %s\n", value, knobs[i], strerror(errno));
+      fputs(">>>>>>>> Warning: Block I/O limit not set! <<<<<<<<\n", stderr);
+    }
+  }
+}
+
+
+void setup_psi_cgroup(cgroup_t* cgroup) {
+  // Nothing is limited here, so a host without the hybrid mount only loses pressure reporting.
+  struct statfs fs;
+  if (statfs(CGROUP_V1_UNIFIED_PATH, &fs) != 0 || fs.f_type != CGROUP2_SUPER_MAGIC) {
+    return;
+  }
+  char parent[PATH_MAX];
+  char dir[PATH_MAX];
+  snprintf(parent, sizeof(parent), CGROUP_V1_PARENT_FORMAT, CGROUP_V1_UNIFIED);
+  snprintf(dir, sizeof(dir), CGROUP_V1_DIR_FORMAT, CGROUP_V1_UNIFIED, cgroup->name);
+  if ((mkdir(parent, CGROUP_DIR_MODE) == -1 && errno != EEXIST) ||
+    (mkdir(dir, CGROUP_DIR_MODE) == -1 && errno != EEXIST)) {
+    fprintf(stderr, "Failed to create %s, no pressure stall information: %s\n", dir, strerror(errno));
+    return;
+  }
+  cgroup->psi = true;
+}
+
+
+int find_io_device(const char* path, char* device, size_t len) {
+  unsigned int major_num;
+  unsigned int minor_num;
+  char rest;
+  if (sscanf(path, "%u:%u%c", &major_num, &minor_num, &rest) != 2) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+      return -1;
+    }
+    dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+    major_num = major(dev);
+    minor_num = minor(dev);
+  }
+  // Major 0 is everything without a disk behind it, like tmpfs or an overlay.
+  if (major_num == 0) {
+    errno = ENODEV;
+    return -1;
+  }
+
+  // Limits can only be set on whole disks, and in sysfs a partition is a directory inside its disk's.
+  char sys_path[PATH_MAX];
+  snprintf(sys_path, sizeof(sys_path), "/sys/dev/block/%u:%u/partition", major_num, minor_num);
+  if (access(sys_path, F_OK) == 0) {
+    char disk[32];
+    snprintf(sys_path, sizeof(sys_path), "/sys/dev/block/%u:%u/../dev", major_num, minor_num);
+    int fd = open(sys_path, O_RDONLY | O_CLOEXEC);
+    ssize_t got = fd == -1 ? -1 : read(fd, disk, sizeof(disk) - 1);
+    if (fd != -1) {
+      close(fd);
+    }
+    if (got <= 0) {
+      return -1;
+    }
+    disk[got] = '\0';
+    if (sscanf(disk, "%u:%u", &major_num, &minor_num) != 2) {
+      errno = ENODEV;
+      return -1;
+    }
+  }
+  snprintf(device, len, "%u:%u", major_num, minor_num);
+  return 0;
+}
+
+
+int format_cpu_quota(double cores, char* quota, size_t len) {
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  long long quota_us = (long long) (cores * CGROUP_CPU_PERIOD_US + 0.5);
+  if (quota_us < CGROUP_MIN_CPU_QUOTA || (online > 0 && cores > online)) {
+    return -1;
+  }
+  snprintf(quota, len, "%lld", quota_us);
+  return 0;
+}
+
+
+bool valid_cpuset(const char* cpus) {
+  long configured = sysconf(_SC_NPROCESSORS_CONF);
+  const char* c = cpus;
+  do {
+    char* end;
+    long first = strtol(c, &end, 10);
+    long last = first;
+    if (end == c || first < 0) {
+      return false;
+    }
+    if (*end == '-') {
+      c = end + 1;
+      last = strtol(c, &end, 10);
+      if (end == c || last < first) {
+        return false;
+      }
+    }
+    if (configured > 0 && last >= configured) {
+      return false;
+    }
+    c = end;
+  } while (*c++ == ',');
+  return c[-1] == '\0';
+}
+
+
+int write_cgroup_knob(int dir_fd, const char* knob, const char* value) {
+  int fd = openat(dir_fd, knob, O_WRONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+  size_t len = strlen(value);
+  ssize_t written = write(fd, value, len);
+  int saved_errno = errno;
+  close(fd);
+  if (written != (ssize_t) len) {
+    errno = written == -1 ? saved_errno : EIO;
+    return -1;
+  }
+  return 0;
+}
+
+
+static void setup_unified_io(int dir_fd, container_params_t* options) {
+  // All four caps go into one line of io.max. Writeback is charged to the cgroup that dirtied the pages on v2,
+  // so buffered writes are held to them as well.
+  if (!has_io_limits(options)) {
+    return;
+  }
+  const char* on = options->io_device ? options->io_device : options->container_root_path;
+  char device[32];
+  if (find_io_device(on, device, sizeof(device)) == -1) {
+    fprintf(stderr, "Failed to find the disk %s is on: %s\n", on, strerror(errno));
+    fputs(">>>>>>>> Warning: No block I/O limits will be set! <<<<<<<<\n", stderr);
+    return;
+  }
+  char io_max[256];
+  int used = snprintf(io_max, sizeof(io_max), "%s", device);
+  const char* keys[] = { "rbps", "wbps", "riops", "wiops" };
+  const char* limits[] = { options->io_read_bps, options->io_write_bps, options->io_read_iops,
+    options->io_write_iops };
+  bool capped = false;
+  for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+    if (limits[i] && used < (int) sizeof(io_max)) {
+      used += snprintf(io_max + used, sizeof(io_max) - used, " %s=%s", keys[i], limits[i]);
+      capped = true;
+    }
+  }
+  if (capped && write_cgroup_knob(dir_fd, CGROUP_V2_IO_MAX, io_max) == -1) {
+    fprintf(stderr, "Failed to write %s to io.max: %s\n", io_max, strerror(errno));
+    fputs(">>>>>>>> Warning: Block I/O limits not set! <<<<<<<<\n", stderr);
+  }
+
+  // A target makes the kernel throttle siblings that push this container's I/O latency past it.
+  if (!options->io_latency_us) {
+    return;
+  }
+  char io_latency[64];
+  snprintf(io_latency, sizeof(io_latency), "%s target=%s", device, options->io_latency_us);
+  if (write_cgroup_knob(dir_fd, CGROUP_V2_IO_LATENCY, io_latency) == -1) {
+    fprintf(stderr, "Failed to write %s to io.latency: %s\n", io_latency, strerror(errno));
+    fputs(">>>>>>>> Warning: No I/O latency target will be set! <<<<<<<<\n", stderr);
+  }
+}
+
+
+int setup_unified_cgroup(cgroup_t* cgroup, container_params_t* options) {
+  puts("Setting memory, number of processes and CPU limits for container...");
+
+  // Controllers have to be enabled in each parent before they show up in our directory. The drydock parent
+  // only ever holds other cgroups, so it is allowed to hand them down.
+  if (mkdir(CGROUP_V2_PARENT, CGROUP_DIR_MODE) == -1 && errno != EEXIST) {
+    perror("Failed to create CGROUP_V2_PARENT");
+  }
+  const char* parents[] = { CGROUP_PATH_V2, CGROUP_V2_PARENT };
+  for (size_t i = 0; i < sizeof(parents) / sizeof(parents[0]); ++i) {
+    int parent_fd = open(parents[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (parent_fd == -1 || write_cgroup_knob(parent_fd, CGROUP_V2_SUBTREE_CONTROL, CGROUP_V2_CONTROLLERS) == -1) {
+      fprintf(stderr, "Failed to enable controllers in %s: %s\n", parents[i], strerror(errno));
+      fputs(">>>>>>>> Warning: Some resource limits may not be available! <<<<<<<<\n", stderr);
+    }
+    // Only for a pinned container, cpuset has a cost on every fork and migration.
+    if (parent_fd != -1 && options->cpuset &&
+      write_cgroup_knob(parent_fd, CGROUP_V2_SUBTREE_CONTROL, CGROUP_V2_CPUSET_CONTROLLER) == -1) {
+      fprintf(stderr, "Failed to enable cpuset in %s: %s\n", parents[i], strerror(errno));
+    }
+    // Likewise io, only for a container with I/O limits.
+    if (parent_fd != -1 && has_io_limits(options) &&
+      write_cgroup_knob(parent_fd, CGROUP_V2_SUBTREE_CONTROL, CGROUP_V2_IO_CONTROLLER) == -1) {
+      fprintf(stderr, "Failed to enable io in %s: %s\n", parents[i], strerror(errno));
+    }
+    if (parent_fd != -1) {
+      close(parent_fd);
+    }
+  }
+
+  // A leftover directory from a container that died before cleaning up is empty and safe to reuse.
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), CGROUP_V2_DIR_FORMAT, cgroup->name);
+  if (mkdir(dir, CGROUP_DIR_MODE) == -1 && errno != EEXIST) {
+    perror("Failed to create CGROUP_V2_DIR");
+    fputs(">>>>>>>> Warning: No resource limits will be set! <<<<<<<<\n", stderr);
+    return -1;
+  }
+  int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1) {
+    perror("Failed to open CGROUP_V2_DIR");
+    fputs(">>>>>>>> Warning: No resource limits will be set! <<<<<<<<\n", stderr);
+    return -1;
+  }
+
+  if (write_cgroup_knob(dir_fd, "memory.max", options->mem_limit) == -1) {
+    perror("Failed to write memory limit to memory.max");
+    fputs(">>>>>>>> Warning: Memory limit not set! <<<<<<<<\n", stderr);
+  }
+
+  // v1 limits memory plus swap together, v2 limits swap on its own.
+  unsigned long long mem = strtoull(options->mem_limit, NULL, 10);
+  unsigned long long mem_plus_swap = strtoull(options->mem_plus_swap_limit, NULL, 10);
+  char swap_limit[32];
+  snprintf(swap_limit, sizeof(swap_limit), "%llu", mem_plus_swap > mem ? mem_plus_swap - mem : 0);
+  if (write_cgroup_knob(dir_fd, "memory.swap.max", swap_limit) == -1) {
+    perror("Failed to write swap limit to memory.swap.max");
+    fputs(">>>>>>>> Warning: Swap limit not set! <<<<<<<<\n", stderr);
+    fputs(">>>>>>>> Note: If container exceeds memory limit, it will use swap instead of killing processes! <<<<<<<<\n", stderr);
+  }
+
+  if (write_cgroup_knob(dir_fd, "pids.max", options->pid_limit) == -1) {
+    perror("Failed to write PID limit to pids.max");
+    fputs(">>>>>>>> Warning: PID limit not set! <<<<<<<<\n", stderr);
+  }
+
+  // v1 spells "no quota" as -1, v2 as max.
+  char cpu_max[64];
+  snprintf(cpu_max, sizeof(cpu_max), "%s %s", options->cpu_quota[0] == '-' ? "max" : options->cpu_quota,
+    options->cpu_period);
+  if (write_cgroup_knob(dir_fd, "cpu.max", cpu_max) == -1) {
+    perror("Failed to write CPU quota and period to cpu.max");
+    fputs(">>>>>>>> Warning: No CPU limits will be set! <<<<<<<<\n", stderr);
+  }
+
+  // Memory nodes are inherited on v2 unless the container was placed on a node of its own.
+  if (options->cpuset && write_cgroup_knob(dir_fd, CGROUP_CPUSET_CPUS, options->cpuset) == -1) {
+    perror("Failed to write CPUs to cpuset.cpus");
+    fputs(">>>>>>>> Warning: Container will not be pinned to its CPUs! <<<<<<<<\n", stderr);
+  }
+  if (options->cpuset && options->cpuset_mems &&
+    write_cgroup_knob(dir_fd, CGROUP_CPUSET_MEMS, options->cpuset_mems) == -1) {
+    perror("Failed to write memory nodes to cpuset.mems");
+    fputs(">>>>>>>> Warning: Container will not be pinned to its memory nodes! <<<<<<<<\n", stderr);
+  }
+
+  setup_unified_io(dir_fd, options);
+  return dir_fd;
+}
+
+
+void setup_cgroups(cgroup_t* cgroup, container_params_t* options) {
+  puts("Setting up cgroups for resource limits...");
+
+  // //mount -t cgroup -o all cgroup /sys/fs/cgroup
+  // puts("Mounting /sys/fs/cgroup if necessary...");
+  // if (mount("cgroup", CGROUP_PATH_V1, "cgroup", 0, "") != 0 && errno != EBUSY) {
+  //   perror("Mounting /sys/fs/cgroup failed");
+  //   fputs(">>>>>>>> Warning: No resource limits will be set! <<<<<<<<\n", stderr);
+  //   return;
+  // }
+
+  // Everything here happens before the container exists, so the limits are already in place by the time
+  // its first instruction runs.
+  cgroup->dir_fd = -1;
+  cgroup->cpuset = false;
+  cgroup->blkio = false;
+  cgroup->psi = false;
+  if (cgroup->version == CGROUP_V2) {
+    cgroup->dir_fd = setup_unified_cgroup(cgroup, options);
+    return;
+  }
+
+  // Each container's directory lives under a drydock parent that is shared by everyone.
+  for (size_t i = 0; i < NUM_V1_CONTROLLERS; ++i) {
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), CGROUP_V1_PARENT_FORMAT, v1_controllers[i]);
+    if (mkdir(parent, CGROUP_DIR_MODE) == -1 && errno != EEXIST) {
+      fprintf(stderr, "Failed to create %s: %s\n", parent, strerror(errno));
+    }
+  }
+
+  setup_memory_cgroup(cgroup, options);
+  setup_pid_cgroup(cgroup, options);
+  setup_cpu_cgroup(cgroup, options);
+  setup_network_cgroup(cgroup, options);
+  setup_cpuset_cgroup(cgroup, options);
+  setup_blkio_cgroup(cgroup, options);
+  setup_psi_cgroup(cgroup);
+}
+
+
+int attach_to_cgroups(cgroup_t* cgroup, pid_t container_pid) {
+  puts("Moving container into its cgroups...");
+
+  // Use snprintf to find the number of bytes we need to store the PID as a string.
+  // Note: snprintf does not count the NULL byte in its return value.
+  size_t container_pid_str_len = snprintf(NULL, 0, "%u", container_pid);
+  char container_pid_str[++container_pid_str_len]; // Need to increment container_pid_len by 1.
+  snprintf(container_pid_str, container_pid_str_len, "%u", container_pid);
+
+  if (cgroup->version == CGROUP_V2) {
+    if (cgroup->dir_fd == -1 || write_cgroup_knob(cgroup->dir_fd, CGROUP_PROCS, container_pid_str) == -1) {
+      perror("Failed to write container PID to cgroup.procs");
+      return -1;
+    }
+    return 0;
+  }
+
+  // Every controller is tried so each failure gets reported, but missing any of them fails the attach.
+  int result = 0;
+  const char* controllers[MAX_V1_DIRS];
+  size_t num_dirs = v1_dirs(cgroup, controllers);
+  for (size_t i = 0; i < num_dirs; ++i) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), CGROUP_V1_DIR_FORMAT, controllers[i], cgroup->name);
+    FILE* f = fopen_in_cgroup(dir, CGROUP_PROCS);
+    if (!f) {
+      fprintf(stderr, "Failed to open %s/%s: %s\n", dir, CGROUP_PROCS, strerror(errno));
+      result = -1;
+      continue;
+    }
+    if (fwrite(container_pid_str, sizeof(char), container_pid_str_len, f) != container_pid_str_len) {
+      fprintf(stderr, "Failed to write container PID to %s/%s: %s\n", dir, CGROUP_PROCS, strerror(errno));
+      result = -1;
+    }
+    // cgroup.procs only takes the write once it is flushed, which is where a bad pid shows up.
+    if (fclose(f) != 0) {
+      fprintf(stderr, "Failed to close %s/%s: %s\n", dir, CGROUP_PROCS, strerror(errno));
+      result = -1;
+    }
+  }
+  return result;
+}
+
+
+void clean_up_cgroups(cgroup_t* cgroup) {
+  puts("Cleaning up cgroups...");
+  if (cgroup->dir_fd != -1) {
+    close(cgroup->dir_fd);
+    cgroup->dir_fd = -1;
+  }
+
+  char dir[PATH_MAX];
+  if (cgroup->version == CGROUP_V2) {
+    snprintf(dir, sizeof(dir), CGROUP_V2_DIR_FORMAT, cgroup->name);
+    if (rmdir(dir) != 0) {
+      perror("Deleting cgroup failed");
+    }
+    return;
+  }
+
+  const char* controllers[MAX_V1_DIRS];
+  size_t num_dirs = v1_dirs(cgroup, controllers);
+  for (size_t i = 0; i < num_dirs; ++i) {
+    snprintf(dir, sizeof(dir), CGROUP_V1_DIR_FORMAT, controllers[i], cgroup->name);
+    if (rmdir(dir) != 0) {
+      fprintf(stderr, "Deleting %s cgroup failed: %s\n", controllers[i], strerror(errno));
+    }
+  }
+}
+
+
+static void knob_path(cgroup_version_t version, const char* controller, const char* name, const char* knob,
+  char* path, size_t len) {
+  // No name is the drydock parent.
+  if (version == CGROUP_V2 && name) {
+    snprintf(path, len, CGROUP_V2_DIR_FORMAT "/%s", name, knob);
+  }
+  else if (version == CGROUP_V2) {
+    snprintf(path, len, CGROUP_V2_PARENT "/%s", knob);
+  }
+  else if (name) {
+    snprintf(path, len, CGROUP_V1_DIR_FORMAT "/%s", controller, name, knob);
+  }
+  else {
+    snprintf(path, len, CGROUP_V1_PARENT_FORMAT "/%s", controller, knob);
+  }
+}
+
+
+static int read_knob(cgroup_version_t version, const char* controller, const char* name, const char* knob,
+  char* buf, size_t len) {
+  char path[PATH_MAX];
+  knob_path(version, controller, name, knob, path, sizeof(path));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+  ssize_t got = read(fd, buf, len - 1);
+  close(fd);
+  if (got <= 0) {
+    return -1;
+  }
+  buf[got] = '\0';
+  return 0;
+}
+
+
+static long long read_limit(cgroup_version_t version, const char* controller, const char* name, const char* knob) {
+  // A knob that isn't there limits nothing, and neither does "max", v1's -1 or its page-rounded LONG_MAX.
+  char buf[64];
+  if (read_knob(version, controller, name, knob, buf, sizeof(buf)) == -1 || strncmp(buf, "max", 3) == 0) {
+    return CGROUP_LIMIT_MAX;
+  }
+  long long value = strtoll(buf, NULL, 10);
+  return value < 0 || value >= CGROUP_V1_UNLIMITED_MEMORY ? CGROUP_LIMIT_MAX : value;
+}
+
+
+int read_cgroup_limits(cgroup_version_t version, const char* name, cgroup_limits_t* limits) {
+  char path[PATH_MAX];
+  knob_path(version, "pids", name, "", path, sizeof(path));
+  if (access(path, F_OK) != 0) {
+    return -1;
+  }
+  limits->mem_limit = read_limit(version, "memory", name, version == CGROUP_V2 ? "memory.max" : CGROUP_MEMORY_LIMIT);
+  limits->pid_limit = read_limit(version, "pids", name, CGROUP_PID_LIMIT);
+  if (version == CGROUP_V2) {
+    long long swap = read_limit(version, "memory", name, "memory.swap.max");
+    limits->mem_plus_swap_limit = limits->mem_limit == CGROUP_LIMIT_MAX || swap == CGROUP_LIMIT_MAX ?
+      CGROUP_LIMIT_MAX : limits->mem_limit + swap;
+    char buf[64];
+    long long quota, period;
+    limits->cpu_quota = CGROUP_LIMIT_MAX;
+    limits->cpu_period = CGROUP_CPU_PERIOD_US;
+    if (read_knob(version, "cpu", name, "cpu.max", buf, sizeof(buf)) == 0) {
+      if (sscanf(buf, "%lld %lld", &quota, &period) == 2) {
+        limits->cpu_quota = quota;
+        limits->cpu_period = period;
+      }
+      else if (sscanf(buf, "max %lld", &period) == 1) {
+        limits->cpu_period = period;
+      }
+    }
+    return 0;
+  }
+  limits->mem_plus_swap_limit = read_limit(version, "memory", name, CGROUP_MEM_PLUS_SWAP_LIMIT);
+  limits->cpu_quota = read_limit(version, "cpu", name, CGROUP_CPU_QUOTA);
+  limits->cpu_period = read_limit(version, "cpu", name, CGROUP_CPU_PERIOD);
+  if (limits->cpu_period == CGROUP_LIMIT_MAX) {
+    limits->cpu_period = CGROUP_CPU_PERIOD_US;
+  }
+  return 0;
+}
+
+
+typedef struct {
+  const char* controller;
+  const char* knob;
+  char old_value[64];
+  char new_value[64];
+} knob_change_t;
+
+
+static void format_limit(cgroup_version_t version, const char* knob, long long value, long long period, char* buf,
+  size_t len) {
+  // v1 spells no limit as -1 except in pids.max, v2 always as max, and v2 keeps the CPU period next to the quota.
+  const char* unlimited = version == CGROUP_V2 || strcmp(knob, CGROUP_PID_LIMIT) == 0 ? "max" : "-1";
+  if (value == CGROUP_LIMIT_MAX) {
+    snprintf(buf, len, "%s", unlimited);
+  }
+  else {
+    snprintf(buf, len, "%lld", value);
+  }
+  if (version == CGROUP_V2 && strcmp(knob, "cpu.max") == 0) {
+    size_t used = strlen(buf);
+    snprintf(buf + used, len - used, " %lld", period);
+  }
+}
+
+
+static void add_change(knob_change_t* changes, int* num_changes, cgroup_version_t version, const char* controller,
+  const char* knob, long long old_value, long long new_value, long long period) {
+  if (old_value == new_value) {
+    return;
+  }
+  knob_change_t* change = &changes[(*num_changes)++];
+  change->controller = controller;
+  change->knob = knob;
+  format_limit(version, knob, old_value, period, change->old_value, sizeof(change->old_value));
+  format_limit(version, knob, new_value, period, change->new_value, sizeof(change->new_value));
+}
+
+
+static bool above(long long limit, long long ceiling) {
+  return ceiling != CGROUP_LIMIT_MAX && (limit == CGROUP_LIMIT_MAX || limit > ceiling);
+}
+
+
+int update_cgroup_limits(cgroup_t* cgroup, const cgroup_update_t* update, cgroup_limits_t* before,
+  cgroup_limits_t* after, char* error, size_t len) {
+  cgroup_version_t version = cgroup->version;
+  cgroup_limits_t parent;
+  if (read_cgroup_limits(version, cgroup->name, before) == -1) {
+    snprintf(error, len, "%s has no cgroup, it is not running", cgroup->name);
+    return -1;
+  }
+  // Without the parent's limits there is nothing to check against, so nothing is changed.
+  if (read_cgroup_limits(version, NULL, &parent) == -1) {
+    snprintf(error, len, "could not read the limits of the drydock parent cgroup");
+    return -1;
+  }
+
+  // Everything is checked before anything is written.
+  cgroup_limits_t target = *before;
+  if (update->mem_limit != CGROUP_LIMIT_KEEP) {
+    if (update->mem_limit != CGROUP_LIMIT_MAX && update->mem_limit < CGROUP_MIN_MEMORY) {
+      snprintf(error, len, "memory limit must be at least %lld bytes", CGROUP_MIN_MEMORY);
+      return -1;
+    }
+    if (above(update->mem_limit, parent.mem_limit)) {
+      snprintf(error, len, "memory limit is above the drydock parent's %lld bytes", parent.mem_limit);
+      return -1;
+    }
+    target.mem_limit = update->mem_limit;
+    // The container keeps as much swap as it had.
+    if (before->mem_plus_swap_limit != CGROUP_LIMIT_MAX && before->mem_limit != CGROUP_LIMIT_MAX) {
+      target.mem_plus_swap_limit = target.mem_limit == CGROUP_LIMIT_MAX ? CGROUP_LIMIT_MAX :
+        target.mem_limit + before->mem_plus_swap_limit - before->mem_limit;
+    }
+  }
+  if (update->pid_limit != CGROUP_LIMIT_KEEP) {
+    if (update->pid_limit != CGROUP_LIMIT_MAX && update->pid_limit < 1) {
+      snprintf(error, len, "pids limit must be at least 1");
+      return -1;
+    }
+    if (above(update->pid_limit, parent.pid_limit)) {
+      snprintf(error, len, "pids limit is above the drydock parent's %lld", parent.pid_limit);
+      return -1;
+    }
+    target.pid_limit = update->pid_limit;
+  }
+  if (update->cpus != CGROUP_LIMIT_KEEP) {
+    // The same bound format_cpu_quota puts on a limit at launch.
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (update->cpus != CGROUP_LIMIT_MAX && online > 0 && update->cpus > online) {
+      snprintf(error, len, "CPU limit is above the %ld online CPUs", online);
+      return -1;
+    }
+    target.cpu_quota = update->cpus == CGROUP_LIMIT_MAX ? CGROUP_LIMIT_MAX :
+      (long long) (update->cpus * before->cpu_period + 0.5);
+    if (target.cpu_quota != CGROUP_LIMIT_MAX && target.cpu_quota < CGROUP_MIN_CPU_QUOTA) {
+      snprintf(error, len, "CPU limit must be at least %.3f CPUs", (double) CGROUP_MIN_CPU_QUOTA / before->cpu_period);
+      return -1;
+    }
+    // Compared as CPUs, the parent may count them in a different period.
+    if (parent.cpu_quota != CGROUP_LIMIT_MAX &&
+      (update->cpus == CGROUP_LIMIT_MAX || update->cpus > (double) parent.cpu_quota / parent.cpu_period)) {
+      snprintf(error, len, "CPU limit is above the drydock parent's %.2f CPUs",
+        (double) parent.cpu_quota / parent.cpu_period);
+      return -1;
+    }
+  }
+
+  knob_change_t changes[4];
+  int num_changes = 0;
+  if (version == CGROUP_V2) {
+    add_change(changes, &num_changes, version, "memory", "memory.max", before->mem_limit, target.mem_limit, 0);
+    add_change(changes, &num_changes, version, "cpu", "cpu.max", before->cpu_quota, target.cpu_quota,
+      before->cpu_period);
+  }
+  else {
+    // v1 never lets the memory limit go above memory plus swap, so a raise moves memory plus swap out of the way
+    // first and a cut brings the memory limit down first.
+    char memsw[PATH_MAX];
+    knob_path(version, "memory", cgroup->name, CGROUP_MEM_PLUS_SWAP_LIMIT, memsw, sizeof(memsw));
+    bool has_memsw = access(memsw, F_OK) == 0;
+    bool raise = above(target.mem_limit, before->mem_limit);
+    if (!raise) {
+      add_change(changes, &num_changes, version, "memory", CGROUP_MEMORY_LIMIT, before->mem_limit, target.mem_limit, 0);
+    }
+    if (has_memsw) {
+      add_change(changes, &num_changes, version, "memory", CGROUP_MEM_PLUS_SWAP_LIMIT, before->mem_plus_swap_limit,
+        target.mem_plus_swap_limit, 0);
+    }
+    if (raise) {
+      add_change(changes, &num_changes, version, "memory", CGROUP_MEMORY_LIMIT, before->mem_limit, target.mem_limit, 0);
+    }
+    add_change(changes, &num_changes, version, "cpu", CGROUP_CPU_QUOTA, before->cpu_quota, target.cpu_quota, 0);
+  }
+  add_change(changes, &num_changes, version, "pids", CGROUP_PID_LIMIT, before->pid_limit, target.pid_limit, 0);
+
+  // Each knob is one write, and if one is refused the ones before it are put back in reverse order.
+  int done = 0;
+  char path[PATH_MAX];
+  for (; done < num_changes; ++done) {
+    knob_path(version, changes[done].controller, cgroup->name, changes[done].knob, path, sizeof(path));
+    if (write_cgroup_knob(AT_FDCWD, path, changes[done].new_value) == -1) {
+      snprintf(error, len, "could not write %s to %s: %s", changes[done].new_value, changes[done].knob,
+        strerror(errno));
+      break;
+    }
+  }
+  if (done < num_changes) {
+    while (done-- > 0) {
+      knob_path(version, changes[done].controller, cgroup->name, changes[done].knob, path, sizeof(path));
+      if (write_cgroup_knob(AT_FDCWD, path, changes[done].old_value) == -1) {
+        fprintf(stderr, "Failed to put %s back to %s: %s\n", changes[done].knob, changes[done].old_value,
+          strerror(errno));
+      }
+    }
+    return -1;
+  }
+  // A container that exits right after the writes leaves nothing to read back, report what was written.
+  if (read_cgroup_limits(version, cgroup->name, after) == -1) {
+    *after = target;
+  }
+  return 0;
+}
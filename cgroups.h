@@ -0,0 +1,102 @@
+#pragma once
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#include "container.h"
+
+typedef enum {
+  CGROUP_V1 = 1, // One hierarchy per controller under /sys/fs/cgroup/<controller>.
+  CGROUP_V2 = 2  // Single unified hierarchy mounted at /sys/fs/cgroup.
+} cgroup_version_t;
+
+// CPU limits are a number of cores. The period stays fixed and the quota is that many cores' worth of it.
+#define CGROUP_CPU_PERIOD_US          100000
+#define CGROUP_DEFAULT_CPU_CORES      0.2
+#define CGROUP_MIN_CPU_QUOTA          1000 // The kernel's own minimum, in microseconds.
+
+// Limits as numbers, CGROUP_LIMIT_MAX for none. In an update, CGROUP_LIMIT_KEEP leaves one as it is.
+#define CGROUP_LIMIT_MAX              -1
+#define CGROUP_LIMIT_KEEP             -2
+
+typedef struct {
+  long long mem_limit; // Bytes.
+  long long mem_plus_swap_limit; // Bytes, v2 keeps swap on its own and this is the sum of the two.
+  long long pid_limit;
+  long long cpu_quota; // Microseconds per cpu_period.
+  long long cpu_period;
+} cgroup_limits_t;
+
+typedef struct {
+  long long mem_limit;
+  long long pid_limit;
+  double cpus; // Cores, fractions allowed, the period is left as it is.
+} cgroup_update_t;
+
+typedef struct {
+  cgroup_version_t version;
+  const char* name; // Directory name under each drydock parent, unique per container.
+  int dir_fd; // Open cgroup2 directory usable with CLONE_INTO_CGROUP, -1 on v1 or if setup failed.
+  bool cpuset; // v1 only, a cpuset directory was made for the container.
+  bool blkio; // v1 only, a blkio directory was made for the container.
+  bool psi; // v1 only, it also has a directory in the hybrid unified hierarchy, for pressure stall information.
+} cgroup_t;
+
+cgroup_version_t detect_cgroup_version();
+void setup_cgroups(cgroup_t* cgroup, container_params_t* options);
+int attach_to_cgroups(cgroup_t* cgroup, pid_t container_pid);
+void clean_up_cgroups(cgroup_t* cgroup);
+
+// v1 backend, one directory per controller.
+FILE* fopen_in_cgroup(const char* dir, const char* file);
+void setup_memory_cgroup(cgroup_t* cgroup, container_params_t* options);
+void setup_pid_cgroup(cgroup_t* cgroup, container_params_t* options);
+void setup_cpu_cgroup(cgroup_t* cgroup, container_params_t* options);
+void setup_network_cgroup(cgroup_t* cgroup, container_params_t* options);
+void setup_cpuset_cgroup(cgroup_t* cgroup, container_params_t* options);
+void setup_blkio_cgroup(cgroup_t* cgroup, container_params_t* options);
+void setup_psi_cgroup(cgroup_t* cgroup);
+
+// v2 backend, every controller in the same directory.
+int setup_unified_cgroup(cgroup_t* cgroup, container_params_t* options);
+
+/**
+ * Writes the quota that gives cores CPUs every CGROUP_CPU_PERIOD_US into quota.
+ * returns 0 on success, -1 if cores is not more than nothing and no more than the machine has
+ * */
+int format_cpu_quota(double cores, char* quota, size_t len);
+
+/**
+ * Finds the disk that I/O limits for path have to name, path being a block device, major:minor, or any file on one.
+ * A partition's limits go on the disk it is part of.
+ * returns 0 with the disk's major:minor in device, -1 if path is not on a block device
+ * */
+int find_io_device(const char* path, char* device, size_t len);
+
+/**
+ * Checks a cpuset list like 4-7 or 0,2,5-6 only names CPUs the machine has.
+ * returns true if it does
+ * */
+bool valid_cpuset(const char* cpus);
+
+/**
+ * Reads the limits a running container's cgroup has now, name NULL reads those of the drydock parent.
+ * returns 0 on success, -1 if the cgroup is not there
+ * */
+int read_cgroup_limits(cgroup_version_t version, const char* name, cgroup_limits_t* limits);
+
+/**
+ * Changes a running container's limits. The new ones are checked against the drydock parent's before anything is
+ * written, and if one knob can't be written those already changed are put back, so it is all or nothing.
+ * before and after get the limits as they were and as they are now.
+ * returns 0 on success, -1 with the reason in error
+ * */
+int update_cgroup_limits(cgroup_t* cgroup, const cgroup_update_t* update, cgroup_limits_t* before,
+  cgroup_limits_t* after, char* error, size_t len);
+
+/**
+ * Writes value into the knob file inside an open cgroup directory with a single write.
+ * returns 0 on success, -1 with errno set on failure
+ * */
+int write_cgroup_knob(int dir_fd, const char* knob, const char* value);
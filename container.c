@@ -12,64 +12,76 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
 
 #include "container.h"
+#include "cgroups.h"
+#include "netns_pool.h"
+#include "numa.h"
+#include "rootfs.h"
+#include "trace.h"
 
 #define CHILD_STACK_SIZE              (1024 * 1024) // Get scary memory errors if 1024 and 2*1024.
-#define CGROUP_PATH_V1                "/sys/fs/cgroup"
 
-// memory namespace
-#define CGROUP_MEMORY_DIR             "/sys/fs/cgroup/memory/drydock"
-#define CGROUP_MEMORY_PROCS           "/sys/fs/cgroup/memory/drydock/cgroup.procs"
-#define CGROUP_MEMORY_LIMIT           "/sys/fs/cgroup/memory/drydock/memory.limit_in_bytes"
-#define CGROUP_MEM_PLUS_SWAP_LIMIT    "/sys/fs/cgroup/memory/drydock/memory.memsw.limit_in_bytes"
+// Read end is only valid in the child when it was not cloned directly into its cgroup.
+static int cgroup_sync_pipe[2] = { -1, -1 };
 
-// pid namespace
-#define CGROUP_PID_DIR                "/sys/fs/cgroup/pids/drydock/"
-#define CGROUP_PID_PROCS              "/sys/fs/cgroup/pids/drydock/cgroup.procs"
-#define CGROUP_PID_LIMIT              "/sys/fs/cgroup/pids/drydock/pids.max"
-
-// cpu namespace
-#define CGROUP_CPU_DIR                "/sys/fs/cgroup/cpu/drydock/"
-#define CGROUP_CPU_PROCS              "/sys/fs/cgroup/cpu/drydock/cgroup.procs"
-#define CGROUP_CPU_PERIOD             "/sys/fs/cgroup/cpu/drydock/cpu.cfs_period_us"
-#define CGROUP_CPU_QUOTA              "/sys/fs/cgroup/cpu/drydock/cpu.cfs_quota_us"
-
-// network namespace to join
-#define NETWORK_NAMESPACE             "/var/run/netns/netns0"
-
-static bool* cgroups_done;
+// Filled in by the zygote protocol, exec_command ends up pointing into these.
+static char zygote_command[ZYGOTE_MAX_COMMAND];
+static char* zygote_argv[ZYGOTE_MAX_ARGS + 1];
 
 void container_print_usage() {
-  printf("./container [config_file] container executable\n");
+  printf("./container [-o] [-n name] [-t trace_file] [-N node] [config_file] container executable\n");
+  printf("./container [-o] [-n name] [-t trace_file] [-N node] -z zygote_fd [config_file] container\n");
+  printf("  -o  mount container as a read-only image under a throwaway overlay instead of chrooting into it\n");
+  printf("  -N  place container on the CPUs and memory of NUMA node, if its CPU limit fits and cpus isn't set\n");
 }
 
-void zombie_slayer() {
-  int status;
+int zombie_slayer() {
+  int status = 0;
   int result;
   // TODO Switch to signal rather than blocking call? Only if init needs to do other things.
-  while ((result = waitpid((pid_t) -1, 0, 0)) <= 0) {
+  while ((result = waitpid((pid_t) -1, &status, 0)) <= 0) {
     if (result == -1) {
       perror("Container ran into error waiting on processes");
     }
   }
+  return status;
 }
 
 
 int setup_container_process(void* options_ptr) {
   container_params_t* options = (container_params_t*) options_ptr;
 
-  // Busy wait until all of that cgroup stuff has been setup from main.
-  puts("Waiting for all cgroups to be setup...");
-  while(!(*cgroups_done)) {}
+  // If we were not cloned straight into our cgroups, block until main has moved us there.
+  // Reading EOF means main gave up on us, so don't run anything unconstrained.
+  uint64_t phase_start = trace_now();
+  if (cgroup_sync_pipe[0] != -1) {
+    puts("Waiting for all cgroups to be setup...");
+    close(cgroup_sync_pipe[1]);
+    char go;
+    ssize_t result;
+    while ((result = read(cgroup_sync_pipe[0], &go, sizeof(go))) == -1 && errno == EINTR) {}
+    if (result != sizeof(go)) {
+      fputs("Container was never added to its cgroups, refusing to start\n", stderr);
+      exit(EXIT_FAILURE);
+    }
+    close(cgroup_sync_pipe[0]);
+    trace_span("wait_for_cgroups", TRACE_CONTAINER, phase_start);
+  }
 
+  phase_start = trace_now();
   if (unshare(CLONE_NEWIPC) == -1) {
     perror("Failed to create new namespaces for container process");
     exit(EXIT_FAILURE);
   }
+  trace_span("unshare_ipc", TRACE_CONTAINER, phase_start);
 
   puts("Joining a network namespace...");
-  int fd = open(NETWORK_NAMESPACE, O_RDONLY, 0);
+  phase_start = trace_now();
+  int fd = open(options->network_namespace, O_RDONLY, 0);
   if (fd < 0) {
     perror("Failed to open namespace path");
     exit(EXIT_FAILURE);
@@ -78,28 +90,60 @@ int setup_container_process(void* options_ptr) {
     perror("Failed to set the network namespace");
   }
   close(fd);
+  trace_span("setns_network", TRACE_CONTAINER, phase_start);
 
-  // Need to change to the new root directory before chroot or it is very easy to potentially escape.
-  printf("chdir-ing to %s\n", options->container_root_path);
-  if (chdir(options->container_root_path) == -1) {
-    perror("Failed to navigate to container path");
-    exit(EXIT_FAILURE);
+  if (options->overlay_lower != NULL) {
+    printf("Mounting overlay of %s...\n", options->overlay_lower);
+    phase_start = trace_now();
+    if (enter_overlay_rootfs(options->overlay_lower) == -1) {
+      exit(EXIT_FAILURE);
+    }
+    trace_span("pivot_root", TRACE_CONTAINER, phase_start);
   }
-  // We can now chroot from our current working directory.
-  puts("Chrooting into container...");
-  if (chroot("./") == -1) {
-    perror("Chroot failed");
-    exit(EXIT_FAILURE);
+  else {
+    // Need to change to the new root directory before chroot or it is very easy to potentially escape.
+    printf("chdir-ing to %s\n", options->container_root_path);
+    phase_start = trace_now();
+    if (chdir(options->container_root_path) == -1) {
+      perror("Failed to navigate to container path");
+      exit(EXIT_FAILURE);
+    }
+    // We can now chroot from our current working directory.
+    puts("Chrooting into container...");
+    if (chroot("./") == -1) {
+      perror("Chroot failed");
+      exit(EXIT_FAILURE);
+    }
+    trace_span("chroot", TRACE_CONTAINER, phase_start);
   }
 
   puts("Mounting /proc...");
+  phase_start = trace_now();
   if (mount("proc", "/proc", "proc", 0, "") != 0) {
     perror("Mounting /proc failed");
     exit(EXIT_FAILURE);
   }
+  trace_span("mount_proc", TRACE_CONTAINER, phase_start);
+
+  // Everything up to here is the expensive part of starting a container. A zygote parks now until it is told
+  // what to run.
+  phase_start = trace_now();
+  if (options->zygote_fd != -1) {
+    if (wait_for_zygote_command(options) == -1) {
+      exit(EXIT_FAILURE);
+    }
+    trace_span("zygote_parked", TRACE_CONTAINER, phase_start);
+  }
+
+  // Lets a zygote tell whoever is waiting whether the exec actually happened, the pipe closing on exec means it did.
+  int exec_status_pipe[2] = { -1, -1 };
+  if (options->zygote_fd != -1 && pipe2(exec_status_pipe, O_CLOEXEC) == -1) {
+    perror("Failed to create exec status pipe");
+  }
 
   // We are now PID 1 of our namespace, so time to act like init and clean up after anything that gets orphaned.
   // To do this, we are going to fork and have the user's program run in a new process in our new namespaces.
+  phase_start = trace_now();
   pid_t child_pid = fork();
   if (child_pid == -1) {
     perror("Forking process to exec failed");
@@ -107,247 +151,320 @@ int setup_container_process(void* options_ptr) {
   }
   // Child.
   if (child_pid == 0) {
+    trace_span("fork", TRACE_CONTAINER, phase_start);
     fprintf(stderr, "Going to exec in container this command: %s\n", options->exec_command[0]);
+    // The client's own stdio, so the command talks to it directly rather than through the server.
+    for (int i = 0; i < ZYGOTE_STDIO_FDS; i++) {
+      if (options->stdio_fds[i] != -1 && dup2(options->stdio_fds[i], i) == -1) {
+        perror("Failed to attach client stdio");
+        exit(EXIT_FAILURE);
+      }
+    }
+    trace_instant("exec", TRACE_CONTAINER);
     execvp(options->exec_command[0], options->exec_command);
     perror("Exec in container failed");
+    if (exec_status_pipe[1] != -1) {
+      int exec_errno = errno;
+      write(exec_status_pipe[1], &exec_errno, sizeof(exec_errno));
+    }
     exit(EXIT_FAILURE); // Only get here if something went wrong.
   }
 
+  if (options->zygote_fd != -1) {
+    int exec_errno = 0;
+    if (exec_status_pipe[0] != -1) {
+      close(exec_status_pipe[1]);
+      if (read(exec_status_pipe[0], &exec_errno, sizeof(exec_errno)) != sizeof(exec_errno)) {
+        exec_errno = 0;
+      }
+      close(exec_status_pipe[0]);
+    }
+    if (send(options->zygote_fd, &exec_errno, sizeof(exec_errno), MSG_NOSIGNAL) == -1) {
+      perror("Failed to report exec status to zygote owner");
+    }
+    close(options->zygote_fd);
+    for (int i = 0; i < ZYGOTE_STDIO_FDS; i++) {
+      if (options->stdio_fds[i] != -1) {
+        close(options->stdio_fds[i]);
+      }
+    }
+  }
+
   // We are now free to act as init and reap zombies.
-  zombie_slayer();
+  phase_start = trace_now();
+  int status = zombie_slayer();
+  trace_span("run", TRACE_CONTAINER, phase_start);
+  if (options->exit_status_fd != -1) {
+    write(options->exit_status_fd, &status, sizeof(status));
+    close(options->exit_status_fd);
+  }
 
   puts("Shutting down container...");
+  phase_start = trace_now();
   if (umount("proc") != 0) {
     perror("Unmounting /proc failed");
   }
+  trace_span("umount_proc", TRACE_CONTAINER, phase_start);
 
   exit(EXIT_SUCCESS);
 }
 
 
-void setup_memory_cgroup(container_params_t* options, char* container_pid, size_t container_pid_len) {
-  puts("Setting memory limits for container...");
-
-  if (mkdir(CGROUP_MEMORY_DIR, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1) {
-    perror("Failed to create CGROUP_MEMORY_DIR");
-    fputs(">>>>>>>> Warning: No memory or swap limits will be set! <<<<<<<<\n", stderr);
-    return;
+int wait_for_zygote_command(container_params_t* options) {
+  // The command we are about to exec must not inherit the zygote socket.
+  if (fcntl(options->zygote_fd, F_SETFD, FD_CLOEXEC) == -1) {
+    perror("Failed to mark zygote socket close-on-exec");
   }
-  FILE* f = fopen(CGROUP_MEMORY_LIMIT, "w");
-  if (f) {
-    size_t num_bytes = strlen(options->mem_limit);
-    if (fwrite(options->mem_limit, sizeof(char), num_bytes, f) != num_bytes) {
-      perror("Failed to write memory limit to CGROUP_MEMORY_LIMIT");
-      fputs(">>>>>>>> Warning: Memory limit not set! <<<<<<<<\n", stderr);
-    }
-    if (fclose(f) != 0) {
-      perror("Failed to close CGROUP_MEMORY_LIMIT");
-    }
+
+  puts("Container is ready, waiting for a command...");
+  fflush(stdout);
+  char ready[ZYGOTE_MAX_READY];
+  int ready_len = snprintf(ready, sizeof(ready), "%c%s", ZYGOTE_READY,
+                           options->network_namespace ? options->network_namespace : "");
+  if (ready_len >= (int) sizeof(ready)) {
+    ready_len = 1;
   }
-  else {
-    perror("Failed to open CGROUP_MEMORY_LIMIT");
-    perror("Failed to write memory limit to CGROUP_MEMORY_LIMIT");
-    fputs(">>>>>>>> Warning: Memory limit not set! <<<<<<<<\n", stderr);
+  if (send(options->zygote_fd, ready, ready_len, MSG_NOSIGNAL) != ready_len) {
+    perror("Failed to tell zygote owner we are ready");
+    return -1;
   }
 
-  f = fopen(CGROUP_MEM_PLUS_SWAP_LIMIT, "w");
-  if (f) {
-    size_t num_bytes = strlen(options->mem_plus_swap_limit);
-    if (fwrite(options->mem_plus_swap_limit, sizeof(char), num_bytes, f) != num_bytes) {
-      perror("Failed to write memory plus swap limit to CGROUP_MEM_PLUS_SWAP_LIMIT");
-      fputs(">>>>>>>> Warning: Memory plus swap limit not set! <<<<<<<<\n", stderr);
-      fputs(">>>>>>>> Note: If container exceeds memory limit, it will use swap instead of killing processes! <<<<<<<<\n", stderr);
+  struct iovec iov = { .iov_base = zygote_command, .iov_len = sizeof(zygote_command) - 1 };
+  union {
+    struct cmsghdr header;
+    char buf[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+  } control;
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof(control.buf),
+  };
+  ssize_t len;
+  // Close-on-exec until the command's child dup2s them into place, so nothing else ends up holding them.
+  while ((len = recvmsg(options->zygote_fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {}
+  if (len <= 0) {
+    // The owner going away without handing us a command just means this zygote was never needed.
+    if (len == -1) {
+      perror("Failed to receive command for zygote");
     }
-    if (fclose(f) != 0) {
-      perror("Failed to close CGROUP_MEM_PLUS_SWAP_LIMIT");
+    return -1;
+  }
+  zygote_command[len] = '\0';
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    int fds[ZYGOTE_MAX_FDS];
+    int num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+    if (num_fds < ZYGOTE_STDIO_FDS || (msg.msg_flags & MSG_CTRUNC)) {
+      fputs("Zygote was handed an incomplete set of stdio fds\n", stderr);
+      for (int i = 0; i < num_fds; i++) {
+        close(fds[i]);
+      }
+      return -1;
+    }
+    memcpy(options->stdio_fds, fds, sizeof(options->stdio_fds));
+    if (num_fds > ZYGOTE_STDIO_FDS) {
+      options->exit_status_fd = fds[ZYGOTE_STDIO_FDS];
     }
-  }
-  else {
-    perror("Failed to open CGROUP_MEM_PLUS_SWAP_LIMIT");
-    fputs(">>>>>>>> Warning: Memory plus swap limit not set! <<<<<<<<\n", stderr);
-    fputs(">>>>>>>> Note: If container exceeds memory limit, it will use swap instead of killing processes! <<<<<<<<\n", stderr);
   }
 
-  f = fopen(CGROUP_MEMORY_PROCS, "w");
-  if (f) {;
-    if (fwrite(container_pid, sizeof(char), container_pid_len, f) != container_pid_len) {
-      perror("Failed to write container PID to CGROUP_MEMORY_PROCS");
-      fputs(">>>>>>>> Warning: No memory or swap limits will be set! <<<<<<<<\n", stderr);
-    }
-    if (fclose(f) != 0) {
-      perror("Failed to close CGROUP_MEMORY_PROCS");
-    }
+  // Arguments are packed back to back, each one NUL terminated.
+  int argc = 0;
+  for (char* arg = zygote_command; arg < zygote_command + len && argc < ZYGOTE_MAX_ARGS; arg += strlen(arg) + 1) {
+    zygote_argv[argc++] = arg;
   }
-  else {
-    perror("Failed to write container PID to CGROUP_MEMORY_PROCS");
-    fputs(">>>>>>>> Warning: No memory or swap limits will be set! <<<<<<<<\n", stderr);
+  zygote_argv[argc] = NULL;
+  if (argc == 0 || zygote_argv[0][0] == '\0') {
+    fputs("Zygote was handed an empty command\n", stderr);
+    return -1;
   }
-}
 
+  options->exec_command = zygote_argv;
+  return 0;
+}
 
-void setup_pid_cgroup(container_params_t* options, char* container_pid, size_t container_pid_len) {
-  puts("Setting number of processes limit for container...");
-
-  if (mkdir(CGROUP_PID_DIR, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1) {
-    perror("Failed to create CGROUP_PID_DIR");
-    fputs(">>>>>>>> Warning: No PID limits will be set! <<<<<<<<\n", stderr);
-    return;
-  }
-  FILE* f = fopen(CGROUP_PID_LIMIT, "w");
-  if (f) {
-    size_t num_bytes = strlen(options->pid_limit);
-    if (fwrite(options->pid_limit, sizeof(char), num_bytes, f) != num_bytes) {
-      perror("Failed to write PID limit to CGROUP_PID_LIMIT");
-      fputs(">>>>>>>> Warning: PID limit not set! <<<<<<<<\n", stderr);
-    }
-    if (fclose(f) != 0) {
-      perror("Failed to close CGROUP_PID_LIMIT");
-    }
-  }
-  else {
-    perror("Failed to open CGROUP_PID_LIMIT");
-    fputs(">>>>>>>> Warning: PID limit not set! <<<<<<<<\n", stderr);
-  }
 
-  f = fopen(CGROUP_PID_PROCS, "w");
-  if (f) {;
-    if (fwrite(container_pid, sizeof(char), container_pid_len, f) != container_pid_len) {
-      perror("Failed to write container PID to CGROUP_PID_PROCS");
-      fputs(">>>>>>>> Warning: No PID limits will be set! <<<<<<<<\n", stderr);
-    }
-    if (fclose(f) != 0) {
-      perror("Failed to close CGROUP_PID_PROCS");
-    }
-  }
-  else {
-    perror("Failed to write container PID to CGROUP_PID_PROCS");
-    fputs(">>>>>>>> Warning: No PID limits will be set! <<<<<<<<\n", stderr);
-  }
+pid_t clone_into_cgroup(int namespaces, int cgroup_fd) {
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+  // clone3 with no stack behaves like fork, so the child simply returns 0 and carries on from here.
+  struct clone_args args = {
+    .flags = namespaces | CLONE_INTO_CGROUP,
+    .exit_signal = SIGCHLD,
+    .cgroup = cgroup_fd
+  };
+  return syscall(SYS_clone3, &args, sizeof(args));
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
 }
 
 
-void setup_cpu_cgroup(container_params_t* options, char* container_pid, size_t container_pid_len) {
-  puts("Setting CPU limits for container...");
+pid_t launch_container(container_params_t* options, int namespaces, cgroup_t* cgroup) {
+  // Don't let the child inherit (and print a second time) anything still sitting in our stdio buffers.
+  fflush(NULL);
 
-  if (mkdir(CGROUP_CPU_DIR, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1) {
-    perror("Failed to create CGROUP_CPU_DIR");
-    fputs(">>>>>>>> Warning: No CPU limits will be set! <<<<<<<<\n", stderr);
-    return;
-  }
-  FILE* f = fopen(CGROUP_CPU_PERIOD, "w");
-  if (f) {
-    size_t num_bytes = strlen(options->cpu_period);
-    if (fwrite(options->cpu_period, sizeof(char), num_bytes, f) != num_bytes) {
-      perror("Failed to write CPU period to CGROUP_CPU_PERIOD");
-      fputs(">>>>>>>> Warning: CPU limit may be set to something very strange! <<<<<<<<\n", stderr);
+  // Fast path: the kernel places the child in its cgroup as part of the clone itself, so there is nothing to
+  // wait for and no window where the container runs without limits.
+  uint64_t phase_start = trace_now();
+  if (cgroup->dir_fd >= 0) {
+    pid_t child_pid = clone_into_cgroup(namespaces, cgroup->dir_fd);
+    if (child_pid == 0) {
+      exit(setup_container_process(options));
     }
-    if (fclose(f) != 0) {
-      perror("Failed to close CGROUP_CPU_PERIOD");
+    if (child_pid > 0) {
+      trace_span("clone3_into_cgroup", TRACE_HOST, phase_start);
+      return child_pid;
     }
+    // ENOSYS on kernels older than 5.7, EINVAL/E2BIG if clone_args does not know about cgroups yet.
+    perror("clone3 into cgroup failed, falling back to clone");
   }
-  else {
-    perror("Failed to open CGROUP_CPU_PERIOD");
-    fputs(">>>>>>>> Warning: CPU may be set to something very strange! <<<<<<<<\n", stderr);
+
+  // Slow path: clone normally and have the child block on a pipe until we have moved it into its cgroups.
+  if (pipe2(cgroup_sync_pipe, O_CLOEXEC) == -1) {
+    perror("Failed to create cgroup handshake pipe");
+    return -1;
   }
 
-  f = fopen(CGROUP_CPU_QUOTA, "w");
-  if (f) {
-    size_t num_bytes = strlen(options->cpu_quota);
-    if (fwrite(options->cpu_quota, sizeof(char), num_bytes, f) != num_bytes) {
-      perror("Failed to write CPU quota to CGROUP_CPU_PERIOD");
-      fputs(">>>>>>>> Warning: CPU limit may be set to something very strange! <<<<<<<<\n", stderr);
-    }
-    if (fclose(f) != 0) {
-      perror("Failed to close CGROUP_CPU_QUOTA");
-    }
+  // Got this from man page.
+  char* child_stack = mmap(NULL, CHILD_STACK_SIZE, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (child_stack == MAP_FAILED) {
+    perror("Mmap failed to allocate memory for stack");
+    close(cgroup_sync_pipe[0]);
+    close(cgroup_sync_pipe[1]);
+    cgroup_sync_pipe[0] = cgroup_sync_pipe[1] = -1;
+    return -1;
   }
-  else {
-    perror("Failed to open CGROUP_CPU_QUOTA");
-    fputs(">>>>>>>> Warning: CPU may be set to something very strange! <<<<<<<<\n", stderr);
+
+  char* child_stack_ptr = child_stack + CHILD_STACK_SIZE; // Stack grows down.
+  pid_t child_pid = clone(setup_container_process, child_stack_ptr, SIGCHLD | namespaces, options);
+  close(cgroup_sync_pipe[0]);
+  cgroup_sync_pipe[0] = -1;
+  if (child_pid == -1) {
+    perror("Cloning process to create container failed");
+    close(cgroup_sync_pipe[1]);
+    cgroup_sync_pipe[1] = -1;
+    munmap(child_stack, CHILD_STACK_SIZE);
+    return -1;
   }
 
-  f = fopen(CGROUP_CPU_PROCS, "w");
-  if (f) {;
-    if (fwrite(container_pid, sizeof(char), container_pid_len, f) != container_pid_len) {
-      perror("Failed to write container PID to CGROUP_PID_PROCS");
-      fputs(">>>>>>>> Warning: No PID limits will be set! <<<<<<<<\n", stderr);
-    }
-    if (fclose(f) != 0) {
-      perror("Failed to close CGROUP_PID_PROCS");
-    }
+  // The child has its own copy of the stack now since we did not share memory with it.
+  if (munmap(child_stack, CHILD_STACK_SIZE) == -1) {
+    perror("Failed to free mmapped stack");
   }
-  else {
-    perror("Failed to write container PID to CGROUP_CPU_PROCS");
-    fputs(">>>>>>>> Warning: No CPU limits will be set! <<<<<<<<\n", stderr);
+  trace_span("clone", TRACE_HOST, phase_start);
+
+  phase_start = trace_now();
+  if (attach_to_cgroups(cgroup, child_pid) == -1) {
+    // The child reads EOF without a go byte and refuses to run, it must not start without its limits.
+    fputs("Could not move the container into its cgroups, not starting it\n", stderr);
+    close(cgroup_sync_pipe[1]);
+    cgroup_sync_pipe[1] = -1;
+    kill(child_pid, SIGKILL);
+    waitpid(child_pid, NULL, 0);
+    return -1;
   }
-}
 
-void setup_network_cgroup(container_params_t* options, char* container_pid, size_t container_pid_len) {
+  // Wake the container up. If this fails it will see EOF instead and bail out.
+  char go = 1;
+  if (write(cgroup_sync_pipe[1], &go, sizeof(go)) != sizeof(go)) {
+    perror("Failed to signal container that cgroups are ready");
+  }
+  close(cgroup_sync_pipe[1]);
+  cgroup_sync_pipe[1] = -1;
+  trace_span("attach_to_cgroups", TRACE_HOST, phase_start);
 
+  return child_pid;
 }
 
 
-void setup_cgroups(container_params_t* options, pid_t container_pid) {
-  puts("Setting up cgroups for resource limits...");
-
-  // //mount -t cgroup -o all cgroup /sys/fs/cgroup
-  // puts("Mounting /sys/fs/cgroup if necessary...");
-  // if (mount("cgroup", CGROUP_PATH_V1, "cgroup", 0, "") != 0 && errno != EBUSY) {
-  //   perror("Mounting /sys/fs/cgroup failed");
-  //   fputs(">>>>>>>> Warning: No resource limits will be set! <<<<<<<<\n", stderr);
-  //   return;
-  // }
-
-  // Use snprintf to find the number of bytes we need to store the PID as a string.
-  // Note: snprintf does not count the NULL byte in its return value.
-  size_t container_pid_str_len = snprintf(NULL, 0, "%u", container_pid);
-  char container_pid_str[++container_pid_str_len]; // Need to increment container_pid_len by 1.
-  snprintf(container_pid_str, container_pid_str_len, "%u", container_pid);
-
-  setup_memory_cgroup(options, container_pid_str, container_pid_str_len);
-  setup_pid_cgroup(options, container_pid_str, container_pid_str_len);
-  setup_cpu_cgroup(options, container_pid_str, container_pid_str_len);
-  setup_network_cgroup(options, container_pid_str, container_pid_str_len);
-
-  return;
-}
-
+int main(int argc, char** argv) {
+  char default_name[32];
+  snprintf(default_name, sizeof(default_name), "%d", getpid());
+
+  // CPU limits are in cores, the period stays fixed and the quota is that many cores' worth of it.
+  char cpu_period[16];
+  char cpu_quota[32];
+  snprintf(cpu_period, sizeof(cpu_period), "%d", CGROUP_CPU_PERIOD_US);
+  format_cpu_quota(CGROUP_DEFAULT_CPU_CORES, cpu_quota, sizeof(cpu_quota));
+  container_params_t options = {
+    .name = default_name,
+    .zygote_fd = -1,
+    .stdio_fds = { -1, -1, -1 },
+    .exit_status_fd = -1,
+    .mem_limit = "41943040",
+    .mem_plus_swap_limit = "41943040",
+    .pid_limit = "10",
+    .cpu_period = cpu_period,
+    .cpu_quota = cpu_quota,
+    .cpuset = NULL,
+    .cpuset_mems = NULL,
+    .io_device = NULL,
+    .io_read_bps = NULL,
+    .io_write_bps = NULL,
+    .io_read_iops = NULL,
+    .io_write_iops = NULL,
+    .io_latency_us = NULL
+  };
 
-void clean_up_cgroups() {
-  puts("Cleaning up cgroups...");
-  if (rmdir("/sys/fs/cgroup/memory/drydock") != 0) {
-    perror("Deleting memory cgroup failed");
-  }
-  if (rmdir("/sys/fs/cgroup/pids/drydock") != 0) {
-    perror("Deleting pid cgroup failed");
-  }
-  if (rmdir("/sys/fs/cgroup/cpu/drydock") != 0) {
-    perror("Deleting cpu cgroup failed");
+  // Runtimes started by the dry-dock server pick up tracing from its environment.
+  char* trace_path = getenv("DRYDOCK_TRACE");
+  bool overlay = false;
+  char overlay_lower[PATH_MAX];
+  int numa_node = -1;
+  double cpu_cores = CGROUP_DEFAULT_CPU_CORES;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "+on:t:z:N:")) != -1) {
+    switch (opt) {
+      case 'o':
+        overlay = true;
+        break;
+      case 'n':
+        options.name = optarg;
+        break;
+      case 't':
+        trace_path = optarg;
+        break;
+      case 'z':
+        options.zygote_fd = atoi(optarg);
+        break;
+      case 'N':
+        numa_node = atoi(optarg);
+        break;
+      default:
+        container_print_usage();
+        return EXIT_FAILURE;
+    }
   }
-}
 
-
-int main(int argc, char** argv) {
-  if (argc < 3) {
+  // A zygote gets its command later, so it only needs the container path.
+  int positional = argc - optind;
+  int required = options.zygote_fd == -1 ? 2 : 1;
+  if (positional < required || positional > required + 1) {
     container_print_usage();
     return EXIT_FAILURE;
   }
+  char* config_path = positional > required ? argv[optind] : NULL;
 
-  // TODO: CPU period should probably be held fixed with the CPU quota computed as a fraction of it.
-  container_params_t options = {
-    .container_root_path = argv[argc-2],
-    .exec_command = &argv[argc-1],
-    .mem_limit = "41943040",
-    .mem_plus_swap_limit = "41943040",
-    .pid_limit = "10",
-    .cpu_period = "1000000",
-    .cpu_quota = "200000"
-  };
+  trace_init(trace_path, options.name);
+  uint64_t launch_start = trace_now();
+  uint64_t phase_start = launch_start;
+  if (options.zygote_fd == -1) {
+    options.container_root_path = argv[argc-2];
+    options.exec_command = &argv[argc-1];
+  }
+  else {
+    options.container_root_path = argv[argc-1];
+  }
 
-  if(argc==3){
+  if(config_path == NULL){
   	printf("No config file specified, using default cgroup values\n");
   }else{
-    int config = open(argv[1], O_RDONLY);
+    int config = open(config_path, O_RDONLY);
     if(config == -1){
       perror("Cannot open config_file");
       return EXIT_FAILURE;
@@ -382,63 +499,157 @@ int main(int argc, char** argv) {
       printf("Changing pid_limit to: %s\n", pointer+11);
       options.pid_limit = pointer+11;
     }
+    // CPU% is a percentage of one core, kept for old config files, cpu_cores says the same in cores.
+    double cores = -1;
     if((pointer = strstr(token, "CPU%:")) != NULL){
 	  if(strlen(pointer) < 7){printf("No CPU%% value specified!\n"); return EXIT_FAILURE;}
       printf("Changing CPU%%: %s\n", pointer+6);
-      int new_quota = atoi(pointer+6)*10000;
-      if(new_quota < 0){
-        printf("Cannot change CPU usage to negative amount...and why would you?\n");
-        return EXIT_FAILURE;}
-        if(new_quota > 1000000){
-          printf("Cannot change CPU usage over 100%%...nice try though\n");
-          return EXIT_FAILURE;
-        }
-	  }
+      cores = atof(pointer+6) / 100;
+    }
+    if((pointer = strstr(token, "cpu_cores:")) != NULL){
+      if(strlen(pointer) < 12){printf("No cpu_cores value specified!\n"); return EXIT_FAILURE;}
+      printf("Changing cpu_cores to: %s\n", pointer+11);
+      cores = atof(pointer+11);
+    }
+    if(cores != -1 && format_cpu_quota(cores, cpu_quota, sizeof(cpu_quota)) == -1){
+      printf("CPU limit must be between %.2f cores and the %ld this machine has\n",
+        (double) CGROUP_MIN_CPU_QUOTA / CGROUP_CPU_PERIOD_US, sysconf(_SC_NPROCESSORS_ONLN));
+      return EXIT_FAILURE;
+    }
+    if(cores != -1){
+      cpu_cores = cores;
+    }
+    if((pointer = strstr(token, "cpus:")) != NULL){
+      if(strlen(pointer) < 7){printf("No cpus value specified!\n"); return EXIT_FAILURE;}
+      if(!valid_cpuset(pointer+6)){
+        printf("cpus must list CPUs this machine has, like 4-7 or 0,2\n");
+        return EXIT_FAILURE;
+      }
+      printf("Pinning to cpus: %s\n", pointer+6);
+      options.cpuset = pointer+6;
+    }
+    // Disk I/O caps and the latency target all apply to one disk, the rootfs's unless io_device says otherwise.
+    if((pointer = strstr(token, "io_device:")) != NULL){
+      if(strlen(pointer) < 12){printf("No io_device value specified!\n"); return EXIT_FAILURE;}
+      printf("Limiting I/O on: %s\n", pointer+11);
+      options.io_device = pointer+11;
+    }
+    if((pointer = strstr(token, "io_read_bps:")) != NULL){
+      if(strlen(pointer) < 14){printf("No io_read_bps value specified!\n"); return EXIT_FAILURE;}
+      printf("Changing io_read_bps to: %s\n", pointer+13);
+      options.io_read_bps = pointer+13;
+    }
+    if((pointer = strstr(token, "io_write_bps:")) != NULL){
+      if(strlen(pointer) < 15){printf("No io_write_bps value specified!\n"); return EXIT_FAILURE;}
+      printf("Changing io_write_bps to: %s\n", pointer+14);
+      options.io_write_bps = pointer+14;
+    }
+    if((pointer = strstr(token, "io_read_iops:")) != NULL){
+      if(strlen(pointer) < 15){printf("No io_read_iops value specified!\n"); return EXIT_FAILURE;}
+      printf("Changing io_read_iops to: %s\n", pointer+14);
+      options.io_read_iops = pointer+14;
+    }
+    if((pointer = strstr(token, "io_write_iops:")) != NULL){
+      if(strlen(pointer) < 16){printf("No io_write_iops value specified!\n"); return EXIT_FAILURE;}
+      printf("Changing io_write_iops to: %s\n", pointer+15);
+      options.io_write_iops = pointer+15;
+    }
+    if((pointer = strstr(token, "io_latency_us:")) != NULL){
+      if(strlen(pointer) < 16){printf("No io_latency_us value specified!\n"); return EXIT_FAILURE;}
+      printf("Changing io_latency_us to: %s\n", pointer+15);
+      options.io_latency_us = pointer+15;
+    }
        token = strtok(NULL, "\n");
       }
     }
+
+    // A container that fits on one node keeps its CPUs and its memory there, instead of paying for remote memory
+    // every time the scheduler moves it across. Explicit cpus win, whoever set them knows better.
+    numa_topology_t topology;
+    char numa_mems[16];
+    if (numa_node != -1 && !options.cpuset) {
+      const numa_node_t* node = read_numa_topology(NUMA_NODE_PATH, &topology) == 0 ?
+        find_numa_node(&topology, numa_node) : NULL;
+      if (!node) {
+        fprintf(stderr, "There is no NUMA node %d with CPUs and memory, not placing container\n", numa_node);
+      }
+      else if (cpu_cores > node->num_cpus) {
+        printf("%.2f cores don't fit on NUMA node %d's %d CPUs, not placing container\n", cpu_cores, numa_node,
+          node->num_cpus);
+      }
+      else {
+        printf("Placing container on NUMA node %d, cpus: %s\n", numa_node, node->cpus);
+        snprintf(numa_mems, sizeof(numa_mems), "%d", numa_node);
+        options.cpuset = (char*) node->cpus;
+        options.cpuset_mems = numa_mems;
+      }
+    }
     // Determines what new namespaces we will create for our containerized process.
-    // Note, NEWIPC is going to be set from within that process since we need to synchronize over cgroups_done.
+    // Note, NEWIPC is going to be set from within that process once it is inside its cgroups.
 
     // int namespaces = CLONE_NEWPID | CLONE_NEWNET | CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWUSER;
     int namespaces = CLONE_NEWPID | CLONE_NEWNET | CLONE_NEWNS;
-    int clone_flags = SIGCHLD;
-
-    // Got this from man page.
-    char* child_stack = mmap(NULL, CHILD_STACK_SIZE, PROT_READ | PROT_WRITE,
-      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
-      if (child_stack == MAP_FAILED) {
-        perror("Mmap failed to allocate memory for stack");
-      }
-
-      cgroups_done = mmap(0, sizeof(bool), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    trace_span("parse_options", TRACE_HOST, phase_start);
 
-      char* child_stack_ptr = child_stack + CHILD_STACK_SIZE; // Stack grows down.
-      pid_t child_pid = clone(setup_container_process, child_stack_ptr, clone_flags | namespaces, &options);
-      if (child_pid == -1) {
-        perror("Cloning process to create container failed");
+    if (overlay) {
+      phase_start = trace_now();
+      if (prepare_overlay_rootfs(options.container_root_path, overlay_lower, sizeof(overlay_lower)) == -1) {
+        trace_flush();
         return EXIT_FAILURE;
       }
+      options.overlay_lower = overlay_lower;
+      trace_span("prepare_overlay", TRACE_HOST, phase_start);
+    }
 
-      setup_cgroups(&options, child_pid);
+    // Every container gets a network namespace of its own out of the pool.
+    netns_lease_t netns;
+    phase_start = trace_now();
+    if (acquire_netns(&netns) == -1) {
+      trace_flush();
+      return EXIT_FAILURE;
+    }
+    options.network_namespace = netns.path;
+    trace_span("acquire_netns", TRACE_HOST, phase_start);
+
+    // Create the cgroups and write their limits before the container exists. On a unified hierarchy this
+    // also gives us the directory to clone straight into, v1 hierarchies fall back to the pipe handshake.
+    cgroup_t cgroup = { .version = detect_cgroup_version(), .name = options.name, .dir_fd = -1 };
+    printf("Using cgroup v%d\n", cgroup.version);
+    phase_start = trace_now();
+    setup_cgroups(&cgroup, &options);
+    trace_span("setup_cgroups", TRACE_HOST, phase_start);
+
+    pid_t child_pid = launch_container(&options, namespaces, &cgroup);
+    if (child_pid == -1) {
+      clean_up_cgroups(&cgroup);
+      release_netns(&netns);
+      trace_flush();
+      return EXIT_FAILURE;
+    }
 
-      *cgroups_done = true;
+    // Only the container itself should be holding the zygote socket, so its owner sees it go away with it.
+    if (options.zygote_fd != -1) {
+      close(options.zygote_fd);
+    }
 
-      int status;
-      if (waitpid((pid_t) -1, &status, 0) == -1) {
-        perror("Waitpid for container failed");
-      }
+    phase_start = trace_now();
+    int status;
+    if (waitpid(child_pid, &status, 0) == -1) {
+      perror("Waitpid for container failed");
+    }
+    trace_span("wait_for_container", TRACE_HOST, phase_start);
 
-      if (munmap(child_stack, CHILD_STACK_SIZE) == -1) {
-        perror("Failed to free mmapped stack");
-      }
+    // Need to delete cgroups here because the container no longer has access.
+    phase_start = trace_now();
+    clean_up_cgroups(&cgroup);
+    trace_span("clean_up_cgroups", TRACE_HOST, phase_start);
 
-      if (munmap(cgroups_done, sizeof(bool)) == -1) {
-        perror("Failed to free mmapped flag");
-      }
+    phase_start = trace_now();
+    release_netns(&netns);
+    trace_span("release_netns", TRACE_HOST, phase_start);
 
-      // Need to delete cgroups here because the container no longer has access.
-      clean_up_cgroups();
+    trace_span("launch", TRACE_HOST, launch_start);
+    trace_flush();
 
-      return EXIT_SUCCESS;
-    }
+    return EXIT_SUCCESS;
+  }
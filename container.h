@@ -3,21 +3,45 @@
 #include <sys/types.h>
 #include <stdbool.h>
 
+// Zygote protocol, spoken over a SOCK_SEQPACKET socket handed to the runtime with -z.
+// The container sends ZYGOTE_READY once it is fully set up, followed in the same message by the path of the network
+// namespace it leased so its owner can keep track of it. Then the server sends the command as NUL separated
+// arguments in a single message and gets back an int that is 0 once it has been exec'd, or an errno.
+// The command may carry file descriptors with it as SCM_RIGHTS: stdin, stdout and stderr for the command, then
+// optionally a pipe the runtime writes the command's wait status to once it has exited.
+#define ZYGOTE_READY                  'R'
+#define ZYGOTE_MAX_READY              128
+#define ZYGOTE_MAX_COMMAND            4096
+#define ZYGOTE_MAX_ARGS               64
+#define ZYGOTE_STDIO_FDS              3
+#define ZYGOTE_MAX_FDS                (ZYGOTE_STDIO_FDS + 1)
+
 typedef struct {
+  char* name; // Unique per running container, used to name its cgroups.
+  int zygote_fd; // -1 unless the command will be handed over later through the zygote protocol.
   char* container_root_path;
+  char* overlay_lower; // Absolute path of container_root_path when it is mounted as an overlay, NULL to chroot into it.
+  char* network_namespace; // Path of the namespace to setns into, leased from the pool.
   char** exec_command;
+  int stdio_fds[ZYGOTE_STDIO_FDS]; // Handed over with a zygote command, -1 to keep the runtime's own.
+  int exit_status_fd; // Where to write the command's wait status when it exits, -1 if nobody asked.
   char* mem_limit;
   char* mem_plus_swap_limit;
   char* pid_limit;
   char* cpu_period; // Period in microseconds before the CPU time used towards a quota is reset.
-  char* cpu_quota;
+  char* cpu_quota; // CPU time in microseconds the container may use per period, -1 for no limit.
+  char* cpuset; // CPUs the container is pinned to as a list like 4-7 or 0,2, NULL to run on any.
+  char* cpuset_mems; // Memory nodes it allocates from when pinned, NULL for all of the parent's.
+  char* io_device; // Disk the I/O limits apply to, a path on it or major:minor, NULL for the one holding the rootfs.
+  char* io_read_bps; // Bytes per second, NULL for no limit, and the same for the rest of the I/O limits.
+  char* io_write_bps;
+  char* io_read_iops;
+  char* io_write_iops;
+  char* io_latency_us; // Latency target in microseconds that protects the container from its neighbours, v2 only.
 } container_params_t;
 
 void container_print_usage();
 int setup_container_process(void* options_ptr);
-void setup_cgroups(container_params_t* options, pid_t container_pid);
-void setup_memory_cgroup(container_params_t* options, char* container_pid, size_t container_pid_len);
-void setup_pid_cgroup(container_params_t* options, char* container_pid, size_t container_pid_len);
-void setup_cpu_cgroup(container_params_t* options, char* container_pid, size_t container_pid_len);
-void clean_up_cgroups();
-void zombie_slayer();
+int wait_for_zygote_command(container_params_t* options);
+pid_t clone_into_cgroup(int namespaces, int cgroup_fd);
+int zombie_slayer();
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "conn_io.h"
+
+// An emptied buffer bigger than this is given back rather than kept around for an idle connection.
+#define IO_KEEP_CAP (4 * IO_READ_CHUNK)
+
+static int reserve(io_buffer_t *buf, size_t extra) {
+    // Makes room for extra more bytes at the end, sliding the contents down before growing.
+    if (buf->cap - buf->end >= extra)
+        return 0;
+    if (buf->start > 0) {
+        memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+        buf->end -= buf->start;
+        buf->start = 0;
+        if (buf->cap - buf->end >= extra)
+            return 0;
+    }
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap - buf->end < extra)
+        cap *= 2;
+    char *data = realloc(buf->data, cap);
+    if (!data)
+        return -1;
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+static void release_if_empty(io_buffer_t *buf) {
+    if (buf->start != buf->end)
+        return;
+    buf->start = buf->end = 0;
+    if (buf->cap > IO_KEEP_CAP) {
+        free(buf->data);
+        buf->data = NULL;
+        buf->cap = 0;
+    }
+}
+
+static int wait_for(conn_io_t *io, short events) {
+    // Only reached on a non-blocking socket that would block.
+    struct pollfd pfd = { .fd = io->fd, .events = events };
+    while (true) {
+        io->syscalls++;
+        int ready = poll(&pfd, 1, -1);
+        if (ready == -1 && errno == EINTR)
+            continue;
+        return ready == -1 ? -1 : 0;
+    }
+}
+
+static ssize_t receive(conn_io_t *io, struct iovec *iov, int iovcnt) {
+    // recvmsg that also picks up any file descriptors sent along with the data.
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(IO_MAX_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = iovcnt,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t got;
+    do {
+        io->syscalls++;
+        got = recvmsg(io->fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (got == -1 && errno == EINTR);
+    if (got == -1)
+        return -1;
+    io_collect_fds(io, &msg);
+    return got;
+}
+
+void io_init(conn_io_t *io, int fd) {
+    memset(io, 0, sizeof(*io));
+    io->fd = fd;
+}
+
+void io_free(conn_io_t *io) {
+    free(io->in.data);
+    free(io->out.data);
+    io->in = (io_buffer_t) { 0 };
+    io->out = (io_buffer_t) { 0 };
+    for (int i = 0; i < io->num_fds; i++)
+        close(io->fds[i]);
+    io->num_fds = 0;
+    io_drop_out_fds(io);
+}
+
+
+void io_collect_fds(conn_io_t *io, struct msghdr *msg) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int fds[IO_MAX_FDS];
+        memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+        for (int i = 0; i < num_fds; i++) {
+            if (io->num_fds < IO_MAX_FDS)
+                io->fds[io->num_fds++] = fds[i];
+            else
+                close(fds[i]);
+        }
+    }
+    // Any that didn't fit in control were never installed in our table, there is nothing to close.
+}
+
+int io_append(conn_io_t *io, const void *data, size_t len) {
+    if (reserve(&io->in, len) == -1)
+        return -1;
+    memcpy(io->in.data + io->in.end, data, len);
+    io->in.end += len;
+    return 0;
+}
+
+io_status_t io_fill(conn_io_t *io) {
+    io_buffer_t *in = &io->in;
+    release_if_empty(in);
+    if (in->start > 0 && in->cap - in->end < IO_READ_CHUNK) {
+        memmove(in->data, in->data + in->start, in->end - in->start);
+        in->end -= in->start;
+        in->start = 0;
+    }
+    // Whatever doesn't fit in the buffer lands here and is copied over, the buffer only grows for data that has
+    // actually arrived.
+    char extra[IO_READ_CHUNK];
+    struct iovec iov[2] = {
+        { .iov_base = in->data + in->end, .iov_len = in->cap - in->end },
+        { .iov_base = extra, .iov_len = sizeof(extra) },
+    };
+    ssize_t got = receive(io, iov, 2);
+    if (got == -1)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? IO_AGAIN : IO_ERROR;
+    if (got == 0)
+        return IO_EOF;
+
+    size_t room = iov[0].iov_len;
+    if ((size_t) got <= room) {
+        in->end += got;
+    }
+    else {
+        in->end += room;
+        if (reserve(in, got - room) == -1) {
+            errno = ENOMEM;
+            return IO_ERROR;
+        }
+        memcpy(in->data + in->end, extra, got - room);
+        in->end += got - room;
+    }
+    return (size_t) got == room + sizeof(extra) ? IO_MORE : IO_OK;
+}
+
+int io_wait_readable(conn_io_t *io, size_t len) {
+    while (io_readable(io) < len) {
+        io_status_t status = io_fill(io);
+        if (status == IO_AGAIN && wait_for(io, POLLIN) == 0)
+            continue;
+        if (status != IO_OK && status != IO_MORE)
+            return -1;
+    }
+    return 0;
+}
+
+size_t io_readable(conn_io_t *io) {
+    return io->in.end - io->in.start;
+}
+
+const char *io_peek(conn_io_t *io) {
+    return io->in.data + io->in.start;
+}
+
+void io_consume(conn_io_t *io, size_t len) {
+    io->in.start += len;
+    release_if_empty(&io->in);
+}
+
+int io_take_fds(conn_io_t *io, int *fds, int count) {
+    if (count > io->num_fds)
+        count = io->num_fds;
+    memcpy(fds, io->fds, count * sizeof(int));
+    io->num_fds -= count;
+    memmove(io->fds, io->fds + count, io->num_fds * sizeof(int));
+    return count;
+}
+
+
+int io_next_frame(conn_io_t *io, frame_header_t *header, const char **payload, size_t max) {
+    size_t readable = io_readable(io);
+    if (readable < sizeof(*header))
+        return 0;
+    memcpy(header, io_peek(io), sizeof(*header));
+    if (header->length > max)
+        return -1;
+    if (readable - sizeof(*header) < header->length)
+        return 0;
+    *payload = io_peek(io) + sizeof(*header);
+    return 1;
+}
+
+int io_read_frame(conn_io_t *io, frame_header_t *header, void *payload, size_t max) {
+    if (io_wait_readable(io, sizeof(*header)) == -1)
+        return -1;
+    memcpy(header, io_peek(io), sizeof(*header));
+    if (header->length > max)
+        return -1;
+    io_consume(io, sizeof(*header));
+    size_t have = 0;
+    while (have < header->length) {
+        size_t left = header->length - have;
+        size_t buffered = io_readable(io);
+        if (buffered > 0) {
+            size_t take = buffered < left ? buffered : left;
+            memcpy((char *) payload + have, io_peek(io), take);
+            io_consume(io, take);
+            have += take;
+            continue;
+        }
+        if (left < IO_READ_CHUNK) {
+            if (io_wait_readable(io, left) == -1)
+                return -1;
+            continue;
+        }
+        // Big payloads skip the buffer and land where they are wanted, saving two copies of a log stream.
+        struct iovec iov = { .iov_base = (char *) payload + have, .iov_len = left };
+        ssize_t got = receive(io, &iov, 1);
+        if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_for(io, POLLIN) == 0)
+            continue;
+        if (got <= 0)
+            return -1;
+        have += got;
+    }
+    return header->length;
+}
+
+
+int io_queue(conn_io_t *io, const void *data, size_t len) {
+    if (len == 0)
+        return 0;
+    if (reserve(&io->out, len) == -1)
+        return -1;
+    memcpy(io->out.data + io->out.end, data, len);
+    io->out.end += len;
+    return 0;
+}
+
+int io_queue_frame(conn_io_t *io, const frame_header_t *header, const void *payload) {
+    // Both or neither, a header without its payload would throw the peer's framing off.
+    if (reserve(&io->out, sizeof(*header) + header->length) == -1)
+        return -1;
+    io_queue(io, header, sizeof(*header));
+    io_queue(io, payload, header->length);
+    return 0;
+}
+
+void io_attach_fds(conn_io_t *io, const int *fds, int num_fds) {
+    memcpy(io->out_fds, fds, num_fds * sizeof(int));
+    io->num_out_fds = num_fds;
+    io->own_out_fds = false;
+}
+
+void io_give_fds(conn_io_t *io, const int *fds, int num_fds) {
+    io_attach_fds(io, fds, num_fds);
+    io->own_out_fds = true;
+}
+
+void io_drop_out_fds(conn_io_t *io) {
+    for (int i = 0; io->own_out_fds && i < io->num_out_fds; i++)
+        close(io->out_fds[i]);
+    io->num_out_fds = 0;
+    io->own_out_fds = false;
+}
+
+io_status_t io_writev(conn_io_t *io, const struct iovec *iov, int iovcnt) {
+    struct iovec vec[IO_MAX_IOV];
+    int count = 0;
+    size_t queued = io_pending(io);
+    if (queued > 0)
+        vec[count++] = (struct iovec) { .iov_base = io->out.data + io->out.start, .iov_len = queued };
+    for (int i = 0; i < iovcnt && count < IO_MAX_IOV; i++) {
+        if (iov[i].iov_len > 0)
+            vec[count++] = iov[i];
+    }
+
+    size_t sent_total = 0;
+    int first = 0;
+    while (first < count) {
+        union {
+            struct cmsghdr header;
+            char buf[CMSG_SPACE(MAX_REQUEST_FDS * sizeof(int))];
+        } control;
+        struct msghdr msg = { .msg_iov = vec + first, .msg_iovlen = count - first };
+        if (io->num_out_fds > 0) {
+            msg.msg_control = control.buf;
+            msg.msg_controllen = CMSG_SPACE(io->num_out_fds * sizeof(int));
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(io->num_out_fds * sizeof(int));
+            memcpy(CMSG_DATA(cmsg), io->out_fds, io->num_out_fds * sizeof(int));
+        }
+        io->syscalls++;
+        // A peer that has gone away should be an error here, not a SIGPIPE.
+        ssize_t sent = sendmsg(io->fd, &msg, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return IO_ERROR;
+        }
+        // The fds went with the first byte, the peer has its own copies now.
+        io_drop_out_fds(io);
+        sent_total += sent;
+        while (first < count && (size_t) sent >= vec[first].iov_len)
+            sent -= vec[first++].iov_len;
+        if (first < count) {
+            vec[first].iov_base = (char *) vec[first].iov_base + sent;
+            vec[first].iov_len -= sent;
+        }
+    }
+
+    if (sent_total < queued) {
+        io->out.start += sent_total;
+        sent_total = 0;
+    }
+    else {
+        io->out.start = io->out.end;
+        sent_total -= queued;
+    }
+    // What is left of the caller's buffers is copied in, the caller can reuse them as soon as we return.
+    for (int i = 0; i < iovcnt; i++) {
+        size_t len = iov[i].iov_len;
+        if (sent_total >= len) {
+            sent_total -= len;
+            continue;
+        }
+        if (io_queue(io, (const char *) iov[i].iov_base + sent_total, len - sent_total) == -1) {
+            errno = ENOMEM;
+            return IO_ERROR;
+        }
+        sent_total = 0;
+    }
+    release_if_empty(&io->out);
+    return io_pending(io) > 0 ? IO_AGAIN : IO_OK;
+}
+
+io_status_t io_flush(conn_io_t *io) {
+    return io_writev(io, NULL, 0);
+}
+
+int io_flush_all(conn_io_t *io) {
+    io_status_t status;
+    while ((status = io_flush(io)) == IO_AGAIN) {
+        if (wait_for(io, POLLOUT) == -1)
+            return -1;
+    }
+    return status == IO_OK ? 0 : -1;
+}
+
+io_buffer_t io_detach_output(conn_io_t *io) {
+    io_buffer_t out = io->out;
+    io->out = (io_buffer_t) { 0 };
+    return out;
+}
+
+size_t io_pending(conn_io_t *io) {
+    return io->out.end - io->out.start;
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+
+/**
+ * Buffered I/O on a stream socket, blocking or not.
+ *
+ * Reads go into a per-connection buffer with readv, topped up by a 64 KB area on the stack, so a burst of small
+ * frames or a big one arrives in a single recvmsg without every idle connection holding a big buffer. Writes are
+ * queued and go out together in one sendmsg, and io_writev sends caller memory as is behind whatever is queued,
+ * copying only what the socket didn't take. File descriptors passed with SCM_RIGHTS are picked up by the same
+ * recvmsg and sent by the same sendmsg as the data.
+ *
+ * On a non-blocking socket nothing here waits, a call does what the socket allows and says what is left. Whatever
+ * was read before an error or EOF is still in the buffer, and whatever couldn't be written is still queued.
+ * */
+
+#define IO_READ_CHUNK (64 * 1024)   // asked for on every read on top of the room left in the buffer
+#define IO_MAX_IOV 16
+#define IO_MAX_FDS 64               // received and waiting to be taken
+
+typedef enum {
+    IO_OK,          // read something, or wrote everything
+    IO_MORE,        // read as much as was asked for, there may be more waiting
+    IO_AGAIN,       // the socket would block, or couldn't take everything
+    IO_EOF,
+    IO_ERROR,       // errno says why
+} io_status_t;
+
+typedef struct {
+    char *data;
+    size_t start;   // first byte not yet consumed or sent
+    size_t end;
+    size_t cap;
+} io_buffer_t;
+
+typedef struct {
+    int fd;
+    io_buffer_t in;
+    io_buffer_t out;
+    int fds[IO_MAX_FDS];        // received and not yet taken, oldest first
+    int num_fds;
+    int out_fds[MAX_REQUEST_FDS]; // go out with the next byte sent
+    int num_out_fds;
+    bool own_out_fds;           // closed once they have gone
+    unsigned long syscalls;     // recvmsg, sendmsg and poll calls made, for benchmarks
+} conn_io_t;
+
+/**
+ * Sets up io for fd, no memory is allocated until something is buffered
+ * */
+void io_init(conn_io_t *io, int fd);
+
+/**
+ * Frees the buffers and closes any received fds that were never taken and any owned ones that never went, fd
+ * itself is left open
+ * */
+void io_free(conn_io_t *io);
+
+/**
+ * Reads once from the socket into the buffer, collecting any fds sent along
+ * returns IO_OK if something was read and the socket looks drained, IO_MORE if it filled everything it asked for
+ * and there may be more, and IO_AGAIN, IO_EOF or IO_ERROR if nothing was read
+ * */
+io_status_t io_fill(conn_io_t *io);
+
+/**
+ * For reads done by someone else, like io_uring: picks up the fds in a msghdr that recvmsg filled in, and adds data
+ * that was read to the end of the buffer
+ * io_append returns 0 on success, -1 if out of memory
+ * */
+void io_collect_fds(conn_io_t *io, struct msghdr *msg);
+int io_append(conn_io_t *io, const void *data, size_t len);
+
+/**
+ * Waits, with poll if the socket is non-blocking, until at least len bytes are buffered
+ * returns 0 on success, -1 on error or EOF
+ * */
+int io_wait_readable(conn_io_t *io, size_t len);
+
+size_t io_readable(conn_io_t *io);
+const char *io_peek(conn_io_t *io);
+void io_consume(conn_io_t *io, size_t len);
+
+/**
+ * Takes up to count received fds, oldest first, the caller owns them afterwards
+ * returns the number taken
+ * */
+int io_take_fds(conn_io_t *io, int *fds, int count);
+
+/**
+ * Looks for a complete frame at the front of the buffer. payload points into the buffer and stays valid until the
+ * frame is consumed with io_consume(io, sizeof(frame_header_t) + header->length) or the buffer is filled again.
+ * returns 1 if there is one, 0 if it hasn't all arrived, -1 if its payload is larger than max
+ * */
+int io_next_frame(conn_io_t *io, frame_header_t *header, const char **payload, size_t max);
+
+/**
+ * Waits for the next frame and copies it out of the buffer, payload has room for max bytes
+ * returns the length of the payload, or -1 on error, on EOF or if the payload doesn't fit
+ * */
+int io_read_frame(conn_io_t *io, frame_header_t *header, void *payload, size_t max);
+
+/**
+ * Copies data onto the end of the output queue without sending anything
+ * returns 0 on success, -1 if out of memory
+ * */
+int io_queue(conn_io_t *io, const void *data, size_t len);
+int io_queue_frame(conn_io_t *io, const frame_header_t *header, const void *payload);
+
+/**
+ * Sends fds along with the next byte that goes out, which may belong to data queued earlier
+ * */
+void io_attach_fds(conn_io_t *io, const int *fds, int num_fds);
+
+/**
+ * Like io_attach_fds, but io takes the fds over and closes them once they have gone, or when it is freed
+ * */
+void io_give_fds(conn_io_t *io, const int *fds, int num_fds);
+
+/**
+ * Closes the fds waiting to go out if io owns them, and forgets them either way
+ * */
+void io_drop_out_fds(conn_io_t *io);
+
+/**
+ * Sends what is queued followed by the given buffers, up to IO_MAX_IOV - 1 of them at once, with as few sendmsg
+ * calls as the socket allows, and queues whatever didn't go
+ * returns IO_OK if everything went, IO_AGAIN if something is still queued, IO_ERROR on error
+ * */
+io_status_t io_writev(conn_io_t *io, const struct iovec *iov, int iovcnt);
+io_status_t io_flush(conn_io_t *io);
+
+/**
+ * Waits, with poll if the socket is non-blocking, until everything queued has gone
+ * returns 0 on success, -1 on error
+ * */
+int io_flush_all(conn_io_t *io);
+
+/**
+ * Hands the output queue over to the caller, for a send done by someone else, and starts a new empty one. The data
+ * waiting to go is out.data + out.start up to out.end, the caller frees out.data once it has gone
+ * */
+io_buffer_t io_detach_output(conn_io_t *io);
+
+size_t io_pending(conn_io_t *io);
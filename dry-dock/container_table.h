@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * The server's table of running containers, published read-only in shared memory so anyone can look at it without
+ * asking the server. Map TABLE_PATH once and read rows with table_read_row, which costs no syscalls however often
+ * it is called.
+ *
+ * Each row is guarded by a sequence lock. The server makes a row's seq odd before it changes the row and even again
+ * once it is done, so a reader copies the row and keeps it only if seq was even and the same before and after. The
+ * server never waits for readers. A reader that sees live go to 0, or server_pid gone, should map the table again,
+ * the server that published it has stopped and the next one publishes a new file.
+ * */
+
+#define TABLE_PATH "/dev/shm/drydock-containers"
+#define TABLE_MAGIC 0x3342415444445244ULL // "DRDDTAB3"
+#define TABLE_MAX_CONTAINERS 4096
+#define TABLE_SAMPLE_MS 1000            // how often usage is refreshed
+#define TABLE_PRESSURE_RESOURCES 3      // cpu, memory and io, in that order
+#define TABLE_READ_SPINS (1 << 20)      // a row odd for this long was left behind by a server that died writing it
+
+typedef enum {
+    TABLE_EMPTY,
+    TABLE_RUNNING,
+} table_state_t;
+
+typedef struct {
+    uint32_t seq;
+    uint32_t state;                     // table_state_t
+    char name[64];
+    int32_t pid;                        // the container runtime
+    uint32_t reattached;                // started by an earlier server
+    double created;                     // seconds since the epoch
+    char netns[64];
+    char rootfs[192];                   // cut short if it doesn't fit
+    // limits, -1 for none
+    int64_t mem_limit;                  // bytes
+    int64_t pids_limit;
+    double cpu_limit;                   // cores
+    // usage as of sampled, which is 0 until the first sample
+    int64_t mem_usage;                  // bytes
+    int64_t pids;
+    uint64_t cpu_usage_us;              // since the container started
+    double cpu_percent;                 // of one core, over the last sample interval
+    // NUMA, from memory.numa_stat
+    int32_t numa_node;                  // it was placed on, -1 if it floats
+    int32_t numa_home;                  // numa_node, or for one that floats the node holding most of its memory
+    double numa_local;                  // percent of its memory on numa_home, -1 until known
+    // pressure stalls, written as the server's triggers fire rather than sampled, indexed cpu, memory, io
+    uint32_t stalls[TABLE_PRESSURE_RESOURCES];          // times some task was stalled for 10% of 2 s
+    double stall_avg10[TABLE_PRESSURE_RESOURCES];       // percent of the 10 s before the last stall
+    double stalled_at[TABLE_PRESSURE_RESOURCES];        // seconds since the epoch, 0 for never
+    double sampled;                     // seconds since the epoch
+} __attribute__((aligned(64))) table_row_t;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t row_size;                  // sizeof(table_row_t), readers built against another layout should stop
+    uint32_t capacity;
+    uint32_t rows;                      // high water mark, rows past it have never been used
+    uint32_t live;                      // 0 once the server that published this has stopped
+    int32_t server_pid;
+    uint32_t sample_ms;
+} __attribute__((aligned(64))) table_header_t;
+
+/**
+ * Where row i of the table mapped at base is
+ * */
+static inline table_row_t *table_row(void *base, uint32_t i) {
+    return (table_row_t *) ((char *) base + sizeof(table_header_t)) + i;
+}
+
+/**
+ * Copies a consistent snapshot of row into out, retrying while the server is changing it
+ * returns true if the row holds a container, false if it is empty or never settles
+ * */
+static inline bool table_read_row(const table_row_t *row, table_row_t *out) {
+    for (int spins = 0; spins < TABLE_READ_SPINS; spins++) {
+        uint32_t before = __atomic_load_n(&row->seq, __ATOMIC_ACQUIRE);
+        if (before & 1)
+            continue;
+        memcpy(out, (const void *) row, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&row->seq, __ATOMIC_RELAXED) == before)
+            return out->state == TABLE_RUNNING;
+    }
+    return false;
+}
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "containerfile.h"
+
+static char *trim(char *s) {
+    while (isspace((unsigned char) *s))
+        s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char) end[-1]))
+        end--;
+    *end = '\0';
+    return s;
+}
+
+int parse_containerfile(const char *path, containerfile_t *file) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("fopen containerfile");
+        return -1;
+    }
+    memset(file, 0, sizeof(*file));
+
+    struct {
+        const char *key;
+        char *value;
+    } fields[] = {
+        { "container", file->container },
+        { "os", file->os },
+        { "tarball_path", file->tarball_path },
+        { "namespaces", file->namespaces },
+        { "rootfs", file->rootfs },
+        { "rootfs_mode", file->rootfs_mode },
+        { "config", file->config },
+        { "command", file->command },
+    };
+
+    char line[2 * CONTAINERFILE_MAX_VALUE];
+    while (fgets(line, sizeof(line), f)) {
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+        char *colon = strchr(line, ':');
+        if (!colon)
+            continue;
+        *colon = '\0';
+        char *key = trim(line);
+        char *value = trim(colon + 1);
+        for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+            if (strcmp(key, fields[i].key) == 0) {
+                snprintf(fields[i].value, CONTAINERFILE_MAX_VALUE, "%s", value);
+                break;
+            }
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+int pack_command(const char *command, char *out, int out_len) {
+    int used = 0;
+    const char *p = command;
+    while (*p) {
+        while (*p == ' ')
+            p++;
+        if (!*p)
+            break;
+        const char *end = strchr(p, ' ');
+        int len = end ? end - p : (int) strlen(p);
+        if (used + len + 1 > out_len)
+            return -1;
+        memcpy(out + used, p, len);
+        out[used + len] = '\0';
+        used += len + 1;
+        p += len;
+    }
+    return used ? used : -1;
+}
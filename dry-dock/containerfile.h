@@ -0,0 +1,30 @@
+#pragma once
+
+#define CONTAINERFILE_MAX_VALUE 1024
+
+/**
+ * Parsed contents of a containerfile, every field is an empty string if it was not given.
+ * */
+typedef struct {
+    char container[CONTAINERFILE_MAX_VALUE];    // name for the new container
+    char os[CONTAINERFILE_MAX_VALUE];
+    char tarball_path[CONTAINERFILE_MAX_VALUE]; // tarball, layers base first or store:<image>, unpacked into rootfs
+    char namespaces[CONTAINERFILE_MAX_VALUE];
+    char rootfs[CONTAINERFILE_MAX_VALUE];       // directory holding the unpacked image
+    char rootfs_mode[CONTAINERFILE_MAX_VALUE];  // "overlay" to share rootfs read-only, otherwise chroot into it
+    char config[CONTAINERFILE_MAX_VALUE];       // resource limits file handed to the container runtime
+    char command[CONTAINERFILE_MAX_VALUE];      // what to run, arguments separated by spaces
+} containerfile_t;
+
+/**
+ * Reads "key: value" lines from path into file, anything after a # is a comment
+ * returns 0 on success, -1 if the file could not be read
+ * */
+int parse_containerfile(const char *path, containerfile_t *file);
+
+/**
+ * Splits command on spaces into NUL terminated arguments packed back to back in out,
+ * which is the format the zygote protocol expects
+ * returns the number of bytes used in out, or -1 if it did not fit or there was nothing to run
+ * */
+int pack_command(const char *command, char *out, int out_len);
@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "conn_io.h"
+#include "protocol.h"
+
+#define BENCH_MAX_EVENTS 256
+
+typedef struct {
+    conn_io_t io;
+    bool connected;
+    bool greeted;       // the server's preface has arrived
+    long in_flight;     // requests sent and not yet answered
+    uint32_t *ids;      // of the requests in flight, so they can be written off if the connection breaks
+} client_t;
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int family;
+    bool unix_socket;
+    frame_type_t type;
+    const char *path;   // for FRAME_CREATE
+    int depth;          // frames in flight per connection
+    int batch;          // requests per frame
+    int epoll_fd;
+    long started;
+    long finished;
+    long errors;
+    long frames;
+    long total;
+    double *sent_ms;    // by request id
+    double *latencies_ms;
+} bench_t;
+
+// forward declare functions
+void print_usage();
+int resolve_server(bench_t *bench);
+int start_client(bench_t *bench, client_t *client);
+void fail_client(bench_t *bench, client_t *client);
+void fill_pipeline(bench_t *bench, client_t *client);
+bool read_responses(bench_t *bench, client_t *client);
+void handle_event(bench_t *bench, client_t *client, uint32_t events);
+void report(bench_t *bench, double elapsed_ms);
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Arguments:
+ * [-c <CONNECTIONS>] [-n <REQUESTS>] [-d <FRAMES_IN_FLIGHT>] [-b <REQUESTS_PER_FRAME>] [-f <PATH_TO_CONTAINERFILE>]
+ * [-u]
+ * Sends STATS requests, or CREATE requests for the containerfile if one is given, over the given number of
+ * connections, each keeping up to -d frames of -b requests in flight, then reports throughput and latency
+ * percentiles per request. -u goes over the Unix socket instead of TCP.
+ * */
+int main(int argc, char **argv) {
+    int concurrency = 100;
+    long total = 10000;
+    int depth = 1;
+    int batch = 1;
+    const char *containerfile = NULL;
+    bool unix_socket = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:d:b:f:u")) != -1) {
+        switch (opt) {
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 'n':
+            total = atol(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'f':
+            containerfile = optarg;
+            break;
+        case 'u':
+            unix_socket = true;
+            break;
+        default:
+            print_usage();
+            return 1;
+        }
+    }
+    if (concurrency < 1 || total < 1 || depth < 1 || batch < 1) {
+        print_usage();
+        return 1;
+    }
+    if (concurrency > total)
+        concurrency = total;
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    bench_t bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.total = total;
+    bench.unix_socket = unix_socket;
+    bench.depth = depth;
+    bench.batch = batch;
+    bench.type = FRAME_STATS;
+    char path[PATH_MAX];
+    if (containerfile) {
+        if (!realpath(containerfile, path)) {
+            perror("realpath");
+            return 1;
+        }
+        bench.type = FRAME_CREATE;
+        bench.path = path;
+    }
+    if (bench.type == FRAME_CREATE && !unix_socket) {
+        fprintf(stderr, "The server only serves stats over TCP, use -u to create containers\n");
+        return 1;
+    }
+    size_t request_size = sizeof(frame_header_t) + (bench.path ? strlen(bench.path) : 0);
+    if (batch * request_size > MAX_FRAME_SIZE) {
+        fprintf(stderr, "A batch of %d requests doesn't fit in a frame\n", batch);
+        return 1;
+    }
+    bench.sent_ms = malloc(total * sizeof(double));
+    bench.latencies_ms = malloc(total * sizeof(double));
+    client_t *clients = calloc(concurrency, sizeof(client_t));
+    bench.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!bench.sent_ms || !bench.latencies_ms || !clients || bench.epoll_fd == -1 || resolve_server(&bench) == -1)
+        return 1;
+    for (int i = 0; i < concurrency; i++) {
+        clients[i].ids = malloc((size_t) depth * batch * sizeof(uint32_t));
+        if (!clients[i].ids)
+            return 1;
+    }
+
+    double start = now_ms();
+    for (int i = 0; i < concurrency; i++) {
+        if (start_client(&bench, &clients[i]) == -1)
+            return 1;
+    }
+    while (bench.finished < bench.total) {
+        struct epoll_event events[BENCH_MAX_EVENTS];
+        int num_events = epoll_wait(bench.epoll_fd, events, BENCH_MAX_EVENTS, -1);
+        if (num_events == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return 1;
+        }
+        for (int i = 0; i < num_events; i++)
+            handle_event(&bench, events[i].data.ptr, events[i].events);
+    }
+    report(&bench, now_ms() - start);
+    return 0;
+}
+
+void print_usage() {
+    fprintf(stderr, "Usage: ./dry-dock-bench [-c connections] [-n requests] [-d frames_in_flight] "
+                    "[-b requests_per_frame] [-f containerfile] [-u]\n");
+}
+
+int resolve_server(bench_t *bench) {
+    if (bench->unix_socket) {
+        struct sockaddr_un *addr = (struct sockaddr_un *) &bench->addr;
+        addr->sun_family = AF_UNIX;
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", DRYDOCK_SOCKET_PATH);
+        bench->addr_len = sizeof(*addr);
+        bench->family = AF_UNIX;
+        return 0;
+    }
+    // Same address the dry-dock client would connect to.
+    struct addrinfo hints, *servinfo;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rv;
+    if ((rv = getaddrinfo(NULL, DRYDOCK_PORT, &hints, &servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+    struct addrinfo *p;
+    for (p = servinfo; p; p = p->ai_next) {
+        int fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+        if (fd == -1)
+            continue;
+        int connected = connect(fd, p->ai_addr, p->ai_addrlen);
+        close(fd);
+        if (connected == 0)
+            break;
+    }
+    if (!p) {
+        freeaddrinfo(servinfo);
+        fprintf(stderr, "No dry-dock-server listening on port %s\n", DRYDOCK_PORT);
+        return -1;
+    }
+    memcpy(&bench->addr, p->ai_addr, p->ai_addrlen);
+    bench->addr_len = p->ai_addrlen;
+    bench->family = p->ai_family;
+    freeaddrinfo(servinfo);
+    return 0;
+}
+
+int start_client(bench_t *bench, client_t *client) {
+    int fd = socket(bench->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    io_init(&client->io, fd);
+    client->connected = false;
+    client->greeted = false;
+    client->in_flight = 0;
+    // The preface goes out with the first frame, without waiting for the server's.
+    if (io_queue(&client->io, PROTOCOL_PREFACE, strlen(PROTOCOL_PREFACE)) == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &bench->addr, bench->addr_len) == -1 && errno != EINPROGRESS) {
+        perror("connect");
+        return -1;
+    }
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = client };
+    if (epoll_ctl(bench->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+void fail_client(bench_t *bench, client_t *client) {
+    // Whatever was in flight counts as failed, and a new connection carries on with the rest.
+    close(client->io.fd);
+    io_free(&client->io);
+    double now = now_ms();
+    for (long i = 0; i < client->in_flight; i++) {
+        bench->latencies_ms[bench->finished++] = now - bench->sent_ms[client->ids[i]];
+        bench->errors++;
+    }
+    if (bench->started < bench->total && start_client(bench, client) == -1)
+        exit(1);
+}
+
+void fill_pipeline(bench_t *bench, client_t *client) {
+    // Queues frames of up to batch requests for as long as fewer than depth frames' worth are in flight.
+    long window = (long) bench->depth * bench->batch;
+    uint32_t path_len = bench->path ? strlen(bench->path) : 0;
+    while (bench->started < bench->total && client->in_flight < window) {
+        long count = bench->total - bench->started;
+        if (count > bench->batch)
+            count = bench->batch;
+        if (client->in_flight + count > window)
+            break;
+        if (bench->batch > 1) {
+            frame_header_t header = { .length = count * (sizeof(frame_header_t) + path_len), .type = FRAME_BATCH };
+            if (io_queue(&client->io, &header, sizeof(header)) == -1)
+                exit(1);
+        }
+        double now = now_ms();
+        for (long i = 0; i < count; i++) {
+            uint32_t id = bench->started++;
+            frame_header_t header = { .length = path_len, .id = id, .type = bench->type };
+            if (io_queue_frame(&client->io, &header, bench->path) == -1)
+                exit(1);
+            bench->sent_ms[id] = now;
+            client->ids[client->in_flight++] = id;
+        }
+        bench->frames++;
+    }
+}
+
+bool read_responses(bench_t *bench, client_t *client) {
+    /**
+     * reads what the server has sent and accounts for every complete response in it
+     * return:
+     * false if the connection is broken, true otherwise
+    **/
+    while (true) {
+        io_status_t status = io_fill(&client->io);
+        if (status == IO_AGAIN)
+            return true;
+        if (status == IO_EOF || status == IO_ERROR)
+            return false;
+
+        size_t preface_len = strlen(PROTOCOL_PREFACE);
+        if (!client->greeted) {
+            if (io_readable(&client->io) < preface_len)
+                continue;
+            if (memcmp(io_peek(&client->io), PROTOCOL_PREFACE, preface_len) != 0)
+                return false;
+            io_consume(&client->io, preface_len);
+            client->greeted = true;
+        }
+        double now = now_ms();
+        frame_header_t header;
+        const char *payload;
+        int found;
+        while ((found = io_next_frame(&client->io, &header, &payload, MAX_RESPONSE_SIZE)) == 1) {
+            if (header.id >= bench->total)
+                return false;
+            io_consume(&client->io, sizeof(header) + header.length);
+            bench->latencies_ms[bench->finished++] = now - bench->sent_ms[header.id];
+            if (header.type != FRAME_OK)
+                bench->errors++;
+            // Responses can come back in any order.
+            for (long i = 0; i < client->in_flight; i++) {
+                if (client->ids[i] == header.id) {
+                    client->ids[i] = client->ids[--client->in_flight];
+                    break;
+                }
+            }
+        }
+        if (found == -1)
+            return false;
+        if (status != IO_MORE)
+            return true;
+    }
+}
+
+void handle_event(bench_t *bench, client_t *client, uint32_t events) {
+    if (!client->connected) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(client->io.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error) {
+            fprintf(stderr, "connect: %s\n", strerror(error));
+            exit(1);
+        }
+        client->connected = true;
+        fill_pipeline(bench, client);
+    }
+    else if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !read_responses(bench, client)) {
+        fail_client(bench, client);
+        return;
+    }
+    else {
+        fill_pipeline(bench, client);
+    }
+
+    if (io_flush(&client->io) == IO_ERROR) {
+        fail_client(bench, client);
+        return;
+    }
+    struct epoll_event event = {
+        .events = EPOLLIN | (io_pending(&client->io) > 0 ? EPOLLOUT : 0),
+        .data.ptr = client,
+    };
+    epoll_ctl(bench->epoll_fd, EPOLL_CTL_MOD, client->io.fd, &event);
+}
+
+void report(bench_t *bench, double elapsed_ms) {
+    qsort(bench->latencies_ms, bench->finished, sizeof(double), compare_doubles);
+    double percentiles[] = { 50, 90, 99, 99.9 };
+    printf("requests=%ld frames=%ld errors=%ld elapsed=%.2fs throughput=%.0f req/s\n", bench->finished,
+           bench->frames, bench->errors, elapsed_ms / 1e3, bench->finished / (elapsed_ms / 1e3));
+    printf("latency_ms");
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        long index = (long) (percentiles[i] / 100 * bench->finished);
+        if (index >= bench->finished)
+            index = bench->finished - 1;
+        printf(" p%g=%.3f", percentiles[i], bench->latencies_ms[index]);
+    }
+    printf(" max=%.3f\n", bench->latencies_ms[bench->finished - 1]);
+}
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "conn_io.h"
+#include "protocol.h"
+
+typedef struct {
+    int fd;
+    bool buffered;
+    long messages;
+    size_t size;            // payload bytes per message
+    unsigned long syscalls;
+} side_t;
+
+// forward declare functions
+void print_usage();
+void run_case(const char *name, bool buffered, long messages, size_t size);
+void *write_messages(void *arg);
+int read_messages(side_t *side);
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Arguments:
+ * [-n <SMALL_MESSAGES>] [-s <SMALL_SIZE>] [-m <LARGE_MB>] [-l <LARGE_SIZE>]
+ * Sends frames over a Unix socketpair from one thread to another, first small ones like control requests and then
+ * large ones like a log or stdio stream. Each is done the way the old write_all_to_socket/read_all_from_socket
+ * helpers did it, a send or recv for every header and every payload, and then through conn_io. Reports throughput
+ * and syscalls per message for both sides.
+ * */
+int main(int argc, char **argv) {
+    long small_messages = 1000000;
+    size_t small_size = 64;
+    long large_mb = 512;
+    size_t large_size = 256 * 1024;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:m:l:")) != -1) {
+        switch (opt) {
+        case 'n':
+            small_messages = atol(optarg);
+            break;
+        case 's':
+            small_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            large_mb = atol(optarg);
+            break;
+        case 'l':
+            large_size = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            print_usage();
+            return 1;
+        }
+    }
+    if (small_messages < 1 || large_mb < 1 || small_size > MAX_FRAME_SIZE || large_size < 1 ||
+        large_size > MAX_FRAME_SIZE) {
+        print_usage();
+        return 1;
+    }
+    long large_messages = (large_mb << 20) / large_size;
+    if (large_messages < 1)
+        large_messages = 1;
+
+    run_case("small unbuffered", false, small_messages, small_size);
+    run_case("small buffered", true, small_messages, small_size);
+    run_case("large unbuffered", false, large_messages, large_size);
+    run_case("large buffered", true, large_messages, large_size);
+    return 0;
+}
+
+void print_usage() {
+    fprintf(stderr, "Usage: ./dry-dock-iobench [-n small_messages] [-s small_size] [-m large_mb] [-l large_size]\n");
+}
+
+void run_case(const char *name, bool buffered, long messages, size_t size) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+    side_t writer = { .fd = fds[0], .buffered = buffered, .messages = messages, .size = size };
+    side_t reader = { .fd = fds[1], .buffered = buffered, .messages = messages, .size = size };
+    double start = now_s();
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, write_messages, &writer) != 0) {
+        fprintf(stderr, "Could not start the writer thread\n");
+        exit(1);
+    }
+    int result = read_messages(&reader);
+    pthread_join(thread, NULL);
+    double elapsed = now_s() - start;
+    close(fds[0]);
+    close(fds[1]);
+    if (result != 0) {
+        fprintf(stderr, "%s: messages arrived corrupted\n", name);
+        exit(1);
+    }
+    double bytes = (double) messages * (sizeof(frame_header_t) + size);
+    printf("%-17s %ld msgs of %zu B in %.2f s: %.0f msgs/s %.1f MB/s, syscalls/msg %.3f (write %.3f read %.3f)\n",
+           name, messages, size, elapsed, messages / elapsed, bytes / 1e6 / elapsed,
+           (double) (writer.syscalls + reader.syscalls) / messages, (double) writer.syscalls / messages,
+           (double) reader.syscalls / messages);
+}
+
+
+static int send_all(side_t *side, const void *buffer, size_t count) {
+    // What write_all_to_socket does.
+    size_t total = 0;
+    while (total < count) {
+        side->syscalls++;
+        ssize_t sent = send(side->fd, (const char *) buffer + total, count - total, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return -1;
+        total += sent;
+    }
+    return 0;
+}
+
+static int recv_all(side_t *side, void *buffer, size_t count) {
+    // What read_all_from_socket does.
+    size_t total = 0;
+    while (total < count) {
+        side->syscalls++;
+        ssize_t got = recv(side->fd, (char *) buffer + total, count - total, 0);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        total += got;
+    }
+    return 0;
+}
+
+void *write_messages(void *arg) {
+    side_t *side = arg;
+    char *payload = malloc(side->size + 1);
+    conn_io_t io;
+    io_init(&io, side->fd);
+    for (long i = 0; i < side->messages; i++) {
+        frame_header_t header = { .length = side->size, .id = i, .type = FRAME_OK };
+        memset(payload, 'a' + i % 26, side->size);
+        if (!side->buffered) {
+            if (send_all(side, &header, sizeof(header)) == -1 || send_all(side, payload, side->size) == -1)
+                break;
+        }
+        else if (side->size >= IO_READ_CHUNK) {
+            // Big enough to go straight from our memory, together with its header.
+            struct iovec iov[] = {
+                { .iov_base = &header, .iov_len = sizeof(header) },
+                { .iov_base = payload, .iov_len = side->size },
+            };
+            if (io_writev(&io, iov, 2) == IO_ERROR)
+                break;
+        }
+        else {
+            // Small ones pile up and go out a buffer's worth at a time, like responses queued during one pass of
+            // the server's event loop.
+            if (io_queue_frame(&io, &header, payload) == -1)
+                break;
+            if (io_pending(&io) >= IO_READ_CHUNK && io_flush_all(&io) == -1)
+                break;
+        }
+    }
+    io_flush_all(&io);
+    side->syscalls += io.syscalls;
+    io_free(&io);
+    free(payload);
+    shutdown(side->fd, SHUT_WR);
+    return NULL;
+}
+
+int read_messages(side_t *side) {
+    /**
+     * reads every message and checks it is the one that was sent
+     * return:
+     * 0 if they all arrived intact, -1 otherwise
+    **/
+    char *payload = malloc(side->size + 1);
+    conn_io_t io;
+    io_init(&io, side->fd);
+    int result = 0;
+    for (long i = 0; i < side->messages && result == 0; i++) {
+        frame_header_t header;
+        if (!side->buffered) {
+            if (recv_all(side, &header, sizeof(header)) == -1 || header.length != side->size ||
+                recv_all(side, payload, header.length) == -1)
+                result = -1;
+        }
+        else if (io_read_frame(&io, &header, payload, side->size) != (int) side->size) {
+            result = -1;
+        }
+        if (result == 0 && (header.id != (uint32_t) i || (side->size > 0 && payload[side->size - 1] != 'a' + i % 26)))
+            result = -1;
+    }
+    side->syscalls += io.syscalls;
+    io_free(&io);
+    free(payload);
+    return result;
+}
@@ -0,0 +1,1709 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "conn_io.h"
+#include "containerfile.h"
+#include "extract.h"
+#include "log_capture.h"
+#include "pressure.h"
+#include "protocol.h"
+#include "registry.h"
+#include "store.h"
+#include "table_writer.h"
+#include "uring.h"
+#include "worker_pool.h"
+#include "zygote_pool.h"
+#include "../cgroups.h"
+
+#define SERVER_MAX_EVENTS 256
+#define SERVER_DEFAULT_WORKERS 8
+#define SERVER_MAX_WORKERS WORKER_POOL_MAX_THREADS
+
+#define MAX_OUTPUT_BACKLOG (4 << 20) // stop reading requests from a client that isn't reading its responses
+
+#define URING_ENTRIES 4096
+#define URING_BUFFERS 1024          // shared by every connection, only a receive that has data holds one
+#define URING_BUFFER_SIZE (16 * 1024)
+#define URING_MAX_FIXED_FILES 16384
+// What a completion's user_data says finished, in the low bits of the connection pointer.
+#define URING_OP_RECEIVE 1
+#define URING_OP_SEND 2
+#define URING_OP_EXIT 3             // on a registry entry, epoll tags the runtime's pidfd the same way
+#define URING_OP_MASK 3
+
+typedef struct connection {
+    conn_io_t io;               // fds passed over the Unix socket wait here until a request takes them
+    bool allowed;               // a Unix socket peer SO_PEERCRED says is root or us, TCP only gets stats
+    bool unix_socket;           // so fds can be sent back
+    bool greeted;               // the client's preface has arrived and ours is on its way
+    bool read_closed;           // the client has shut down its side, we close once its responses are out
+    bool closed;                // freed once the workers are done with its requests
+    int pending;                // requests of this connection the workers have
+    uint32_t events;            // what epoll is watching for
+    struct connection *next;    // on the closed list
+    bool subscribed;            // to container events, which go out as progress on events_id
+    uint32_t events_id;
+    struct connection *prev_subscriber;
+    struct connection *next_subscriber;
+    // io_uring engine only
+    int slot;                   // in the fixed file table, -1 if the kernel looks the fd up every time
+    int inflight;               // operations the kernel has that point into this struct
+    bool receiving;
+    bool sending;
+    io_buffer_t sent;           // output handed to the send in flight, out of conn_io's way so it can't move
+    int send_fds[MAX_REQUEST_FDS]; // go with the send in flight, closed once it completes
+    int num_send_fds;
+    struct msghdr send_msg;
+    struct iovec send_iov;
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(MAX_REQUEST_FDS * sizeof(int))];
+    } send_control;
+    struct msghdr msg;          // for the receive in flight
+    struct iovec iov;
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(IO_MAX_FDS * sizeof(int))];
+    } control;
+} connection_t;
+
+/**
+ * What launching a container from a containerfile needs once the file is read and its image unpacked. A create -n
+ * shares one between all of its launches, so that work is done once however many containers it starts.
+ * */
+typedef struct {
+    containerfile_t file;
+    char command[CONTAINERFILE_MAX_VALUE + 1];
+    int command_len;
+    char unpacked[256];         // what unpacking the image took, empty if it was already there
+    // create -n only, kept by the event loop
+    uint32_t count;             // containers to launch
+    uint32_t done;              // launches finished, the last one sends the summary and frees this
+    uint32_t launched;          // of those, the ones that started
+    double start;
+} launch_spec_t;
+
+typedef enum {
+    JOB_CREATE,                 // reads the containerfile and launches one container
+    JOB_PREPARE,                // reads the containerfile of a create -n, its launches are queued afterwards
+    JOB_LAUNCH,                 // launches one of the containers of a create -n
+    JOB_UPDATE,                 // rewrites a running container's limits
+} job_kind_t;
+
+typedef struct job {
+    pool_task_t task;           // first, the worker pool hands this back to run_job
+    job_kind_t kind;
+    connection_t *conn;
+    uint32_t id;
+    launch_spec_t *spec;        // shared by a create -n's jobs
+    int fds[MAX_REQUEST_FDS];
+    int num_fds;
+    bool ok;
+    container_record_t container; // what a launch started, for the registry
+    update_request_t update;
+    char path[PATH_MAX];
+    char response[MAX_RESPONSE_SIZE];
+    struct job *next;           // on the finished list
+} job_t;
+
+/**
+ * Threads that serve requests which can block for a long time, unpacking an image or waiting on a container to
+ * start, so the event loop never does. Launches go in the pool's control lane and anything that has to unpack an
+ * image in its bulk lane, so a big image can't hold up containers whose image is ready.
+ * */
+typedef struct {
+    worker_pool_t pool;
+    pthread_mutex_t lock;
+    job_t *finished;            // responses ready to send, picked up by the event loop
+    int wake_fd;                // eventfd written whenever something is added to finished
+} workers_t;
+
+typedef struct {
+    unsigned long open;
+    unsigned long accepted;
+    unsigned long served;       // requests answered
+    unsigned long subscribed;   // to container events
+    unsigned long events_sent;
+    unsigned long events_dropped; // a subscriber had too much left to read already
+} connection_stats_t;
+
+static zygote_pool_t POOL;
+static placement_t PLACEMENT;
+static registry_t REGISTRY;         // kept by the event loop
+static table_writer_t TABLE;        // what dry-dock ps reads, mirrors REGISTRY
+static log_capture_t LOGS;
+static pressure_monitor_t PRESSURE;
+static bool WATCH_PRESSURE;         // the monitor could be set up
+static cgroup_version_t CGROUP_VERSION;
+static workers_t WORKERS;
+static connection_stats_t CONNECTIONS;
+static int EPOLL_FD = -1;
+static bool USE_URING;
+static uring_t RING;
+static int FREE_SLOTS[URING_MAX_FIXED_FILES];
+static int NUM_FREE_SLOTS;
+static uint64_t WAKE_COUNT;         // where the read on the workers' eventfd lands
+static uint64_t PRESSURE_COUNT;     // and the one on the pressure monitor's
+static unsigned long LOOP_SYSCALLS; // made by the event loop, io_uring_enter calls aside
+static bool RUNNING = true;
+// Connections closed while handling the current batch of events, freed once it is done since a later event in
+// the same batch can still point at them.
+static connection_t *CLOSED;
+static connection_t *SUBSCRIBERS;
+// Sentinels for epoll_event.data and io_uring user_data, everything else is a connection.
+static int LISTEN_TAG;
+static int UNIX_LISTEN_TAG;
+static int WAKE_TAG;
+static int PRESSURE_TAG;
+
+// forward declare functions
+int listen_on_port(const char *port);
+int listen_on_unix_socket(const char *path);
+int start_workers(int num_threads);
+void stop_workers();
+int start_epoll(int listen_fd, int unix_listen_fd);
+int start_uring(int listen_fd, int unix_listen_fd);
+void run_epoll(int listen_fd, int unix_listen_fd, int *spare_fd);
+void run_uring(int listen_fd, int unix_listen_fd, int *spare_fd);
+void accept_clients(int listen_fd, bool unix_socket, int *spare_fd);
+void handle_readable(connection_t *conn);
+bool serve_frame(connection_t *conn, const frame_header_t *header, const char *payload);
+void serve_request(connection_t *conn, const frame_header_t *header, const char *payload);
+void settle_connection(connection_t *conn);
+void collect_finished();
+void collect_pressure();
+void watch_exit(registry_entry_t *entry);
+void forget_container(registry_entry_t *entry);
+int handle_create(const char *containerfile_path, const int *fds, int num_fds, container_record_t *container,
+                  char *response, size_t len);
+int prepare_create(const char *containerfile_path, launch_spec_t *spec, char *response, size_t len);
+int handle_update(const update_request_t *request, double *cores, char *response, size_t len);
+int launch_prepared(const launch_spec_t *spec, const int *fds, int num_fds, container_record_t *container,
+                    char *response, size_t len);
+
+static void reap_children(int signum) {
+    // Container runtimes exit on their own once their container is done, nobody else is waiting on them.
+    (void) signum;
+    int saved_errno = errno;
+    while (waitpid((pid_t) -1, NULL, WNOHANG) > 0) {}
+    errno = saved_errno;
+}
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void raise_fd_limit() {
+    // Every client is a file descriptor, the default soft limit of 1024 would cap us well short of thousands.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static void release_connection(connection_t *conn) {
+    // The memory has to wait until no worker is serving one of its requests, the kernel has finished every
+    // operation on it, and we are past the events that might mention it.
+    if (conn->pending == 0 && conn->inflight == 0) {
+        conn->next = CLOSED;
+        CLOSED = conn;
+    }
+}
+
+static void close_connection(connection_t *conn) {
+    // Closing the fd also takes it out of the epoll set. With io_uring, shutting the socket down first ends the
+    // receive in flight, and the fixed file slot is emptied before it goes back on the free list.
+    if (conn->closed)
+        return;
+    conn->closed = true;
+    if (USE_URING) {
+        static const int no_file = -1;
+        LOOP_SYSCALLS++;
+        shutdown(conn->io.fd, SHUT_RDWR);
+        struct io_uring_sqe *sqe;
+        if (conn->slot != -1 && (sqe = uring_get_sqe(&RING))) {
+            sqe->opcode = IORING_OP_FILES_UPDATE;
+            sqe->fd = -1;
+            sqe->addr = (uintptr_t) &no_file;
+            sqe->len = 1;
+            sqe->off = conn->slot;
+            sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+            FREE_SLOTS[NUM_FREE_SLOTS++] = conn->slot;
+        }
+        conn->slot = -1;
+    }
+    if (conn->subscribed) {
+        if (conn->prev_subscriber)
+            conn->prev_subscriber->next_subscriber = conn->next_subscriber;
+        else
+            SUBSCRIBERS = conn->next_subscriber;
+        if (conn->next_subscriber)
+            conn->next_subscriber->prev_subscriber = conn->prev_subscriber;
+        conn->subscribed = false;
+        CONNECTIONS.subscribed--;
+    }
+    LOOP_SYSCALLS++;
+    close(conn->io.fd);
+    io_free(&conn->io);
+    CONNECTIONS.open--;
+    release_connection(conn);
+}
+
+static void free_closed() {
+    while (CLOSED) {
+        connection_t *next = CLOSED->next;
+        free(CLOSED);
+        CLOSED = next;
+    }
+}
+
+/**
+ * Arguments:
+ * -p <number of parked containers to keep per image/limits profile>
+ * -m <number of parked containers across all profiles, defaults to half the network namespaces>
+ * -w <number of worker threads serving create requests>
+ * -e <epoll|uring: how the event loop waits on sockets, uring falls back to epoll if the kernel can't do it>
+ * */
+int main(int argc, char **argv) {
+    size_t pool_size = ZYGOTE_POOL_DEFAULT_SIZE;
+    size_t max_parked = zygote_pool_default_max_parked();
+    int num_workers = SERVER_DEFAULT_WORKERS;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:m:w:e:")) != -1) {
+        switch (opt) {
+        case 'p':
+            pool_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            max_parked = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            num_workers = atoi(optarg);
+            break;
+        case 'e':
+            if (strcmp(optarg, "uring") != 0 && strcmp(optarg, "epoll") != 0) {
+                fprintf(stderr, "Unknown event loop %s, pick epoll or uring\n", optarg);
+                return 1;
+            }
+            USE_URING = strcmp(optarg, "uring") == 0;
+            break;
+        default:
+            fprintf(stderr, "Usage: ./dry-dock-server [-p pool_size] [-m max_parked] [-w workers] [-e epoll|uring]\n");
+            return 1;
+        }
+    }
+    if (num_workers < 1 || num_workers > SERVER_MAX_WORKERS) {
+        fprintf(stderr, "Workers must be between 1 and %d\n", SERVER_MAX_WORKERS);
+        return 1;
+    }
+
+    // A handler rather than SIG_IGN, ignoring SIGCHLD would carry over into the runtimes we exec and break
+    // their own waitpid calls.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = reap_children;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+    raise_fd_limit();
+    CGROUP_VERSION = detect_cgroup_version();
+
+    // TCP first, it fails if another server is already running, whose Unix socket we would otherwise replace.
+    int listen_fd = listen_on_port(DRYDOCK_PORT);
+    if (listen_fd == -1)
+        return 1;
+    int unix_listen_fd = listen_on_unix_socket(DRYDOCK_SOCKET_PATH);
+    if (unix_listen_fd == -1)
+        return 1;
+    // Only once we know we are the only server, the journal is compacted as it is opened.
+    if (registry_open(&REGISTRY) != 0 || table_writer_open(&TABLE) != 0)
+        return 1;
+    if (log_capture_start(&LOGS) != 0)
+        return 1;
+    placement_init(&PLACEMENT);
+    // What an earlier server placed still takes up room on its node.
+    for (registry_entry_t *entry = REGISTRY.entries; entry; entry = entry->next)
+        placement_claim(&PLACEMENT, entry->container.numa_node, entry->container.cpu_cores);
+    if (zygote_pool_init(&POOL, pool_size, max_parked, &PLACEMENT) != 0)
+        return 1;
+    // Without it containers run as before, there is just nothing to say when they stall.
+    WATCH_PRESSURE = pressure_monitor_start(&PRESSURE, CGROUP_VERSION) == 0;
+    if (start_workers(num_workers) != 0)
+        return 1;
+    if (USE_URING && start_uring(listen_fd, unix_listen_fd) != 0) {
+        fprintf(stderr, "io_uring is not available (%s), using epoll\n", strerror(errno));
+        USE_URING = false;
+    }
+    if (!USE_URING && start_epoll(listen_fd, unix_listen_fd) != 0)
+        return 1;
+    // Containers an earlier server started are watched and published like our own from here on.
+    for (registry_entry_t *entry = REGISTRY.entries; entry; entry = entry->next) {
+        entry->row = table_writer_add(&TABLE, &entry->container, true);
+        if (WATCH_PRESSURE)
+            entry->pressure = pressure_watch(&PRESSURE, entry->container.name, entry);
+        watch_exit(entry);
+    }
+    // Held in reserve so we can still accept and close a client once we're out of file descriptors, instead of
+    // leaving it in the backlog where the listen socket stays readable and the loop spins on it.
+    int spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if (USE_URING)
+        run_uring(listen_fd, unix_listen_fd, &spare_fd);
+    else
+        run_epoll(listen_fd, unix_listen_fd, &spare_fd);
+
+    close(listen_fd);
+    close(unix_listen_fd);
+    unlink(DRYDOCK_SOCKET_PATH);
+    stop_workers();
+    if (USE_URING)
+        uring_destroy(&RING);
+    zygote_pool_destroy(&POOL);
+    for (registry_entry_t *entry = REGISTRY.entries; entry; entry = entry->next)
+        pressure_unwatch(&PRESSURE, entry->pressure);
+    if (WATCH_PRESSURE)
+        pressure_monitor_stop(&PRESSURE);
+    log_capture_stop(&LOGS);
+    table_writer_close(&TABLE);
+    registry_close(&REGISTRY);
+    return 0;
+}
+
+
+int start_epoll(int listen_fd, int unix_listen_fd) {
+    if ((EPOLL_FD = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &LISTEN_TAG };
+    epoll_ctl(EPOLL_FD, EPOLL_CTL_ADD, listen_fd, &event);
+    event.data.ptr = &UNIX_LISTEN_TAG;
+    epoll_ctl(EPOLL_FD, EPOLL_CTL_ADD, unix_listen_fd, &event);
+    event.data.ptr = &WAKE_TAG;
+    epoll_ctl(EPOLL_FD, EPOLL_CTL_ADD, WORKERS.wake_fd, &event);
+    event.data.ptr = &PRESSURE_TAG;
+    if (WATCH_PRESSURE)
+        epoll_ctl(EPOLL_FD, EPOLL_CTL_ADD, PRESSURE.ready_fd, &event);
+    return 0;
+}
+
+void run_epoll(int listen_fd, int unix_listen_fd, int *spare_fd) {
+    while (RUNNING) {
+        struct epoll_event events[SERVER_MAX_EVENTS];
+        LOOP_SYSCALLS++;
+        int num_events = epoll_wait(EPOLL_FD, events, SERVER_MAX_EVENTS, -1);
+        if (num_events == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < num_events; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &LISTEN_TAG || tag == &UNIX_LISTEN_TAG) {
+                accept_clients(tag == &LISTEN_TAG ? listen_fd : unix_listen_fd, tag == &UNIX_LISTEN_TAG, spare_fd);
+            }
+            else if (tag == &WAKE_TAG) {
+                uint64_t count;
+                LOOP_SYSCALLS++;
+                read(WORKERS.wake_fd, &count, sizeof(count));
+                collect_finished();
+            }
+            else if (tag == &PRESSURE_TAG) {
+                uint64_t count;
+                LOOP_SYSCALLS++;
+                read(PRESSURE.ready_fd, &count, sizeof(count));
+                collect_pressure();
+            }
+            else if ((events[i].data.u64 & URING_OP_MASK) == URING_OP_EXIT) {
+                // Closing the pidfd takes it out of the epoll set.
+                forget_container((registry_entry_t *) (uintptr_t) (events[i].data.u64 & ~URING_OP_MASK));
+            }
+            else {
+                connection_t *conn = tag;
+                uint32_t ready = events[i].events;
+                if (!conn->closed && (ready & EPOLLIN))
+                    handle_readable(conn);
+                // A hangup after the client has shut down its side means nobody is left to read the responses.
+                if (!conn->closed && ((ready & EPOLLERR) || ((ready & EPOLLHUP) && conn->read_closed)))
+                    close_connection(conn);
+                if (!conn->closed && (ready & EPOLLOUT))
+                    settle_connection(conn);
+            }
+        }
+        free_closed();
+    }
+}
+
+
+int listen_on_port(const char *port) {
+    // No AI_PASSIVE, the control channel is only for local clients and they connect to loopback.
+    struct addrinfo hints, *servinfo, *p;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rv;
+    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+    int fd = -1;
+    for (p = servinfo; p; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol)) == -1)
+            continue;
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(servinfo);
+    if (fd == -1)
+        perror("bind/listen");
+    return fd;
+}
+
+
+int listen_on_unix_socket(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    char dir[sizeof(addr.sun_path)];
+    snprintf(dir, sizeof(dir), "%s", path);
+    mkdir(dirname(dir), 0755);
+    // Left over from a server that didn't shut down cleanly, we already know no other server is running.
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    // Anyone may connect, peers are checked with SO_PEERCRED once accepted so they get told why they can't.
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || chmod(path, 0666) == -1 ||
+        listen(fd, SOMAXCONN) == -1) {
+        perror("bind/listen unix socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static bool peer_allowed(int fd) {
+    // Only root and whoever the server runs as may start containers.
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+        return false;
+    return cred.uid == 0 || cred.uid == geteuid();
+}
+
+
+static bool needs_unpacking(const char *containerfile_path) {
+    // Just a look, whoever unpacks it reads the containerfile again and deals with any errors.
+    containerfile_t file;
+    if (parse_containerfile(containerfile_path, &file) != 0)
+        return false;
+    return file.tarball_path[0] && file.rootfs[0] && access(file.rootfs, F_OK) != 0;
+}
+
+static void run_job(pool_task_t *task) {
+    job_t *job = (job_t *) task;
+    bool reads_containerfile = job->kind == JOB_CREATE || job->kind == JOB_PREPARE;
+    if (reads_containerfile && task->lane == LANE_CONTROL && needs_unpacking(job->path)) {
+        // Unpacking can take minutes, it waits its turn with the other bulk work.
+        worker_pool_submit(&WORKERS.pool, task, 1, LANE_BULK);
+        return;
+    }
+
+    // The runtime has its own copies of the fds once it is launched.
+    switch (job->kind) {
+    case JOB_CREATE:
+        job->ok = handle_create(job->path, job->fds, job->num_fds, &job->container, job->response,
+                                sizeof(job->response)) == 0;
+        break;
+    case JOB_PREPARE:
+        job->ok = prepare_create(job->path, job->spec, job->response, sizeof(job->response)) == 0;
+        break;
+    case JOB_LAUNCH:
+        job->ok = launch_prepared(job->spec, job->fds, job->num_fds, &job->container, job->response,
+                                  sizeof(job->response)) == 0;
+        break;
+    case JOB_UPDATE:
+        job->ok = handle_update(&job->update, &job->container.cpu_cores, job->response, sizeof(job->response)) == 0;
+        break;
+    }
+    for (int i = 0; i < job->num_fds; i++)
+        close(job->fds[i]);
+
+    pthread_mutex_lock(&WORKERS.lock);
+    bool was_empty = !WORKERS.finished;
+    job->next = WORKERS.finished;
+    WORKERS.finished = job;
+    // One wakeup covers everything finished before the loop gets around to reading it.
+    if (was_empty) {
+        uint64_t one = 1;
+        write(WORKERS.wake_fd, &one, sizeof(one));
+    }
+    pthread_mutex_unlock(&WORKERS.lock);
+}
+
+int start_workers(int num_threads) {
+    pthread_mutex_init(&WORKERS.lock, NULL);
+    // Blocking, io_uring waits on it for us rather than failing the read, and epoll only reads when it is ready.
+    WORKERS.wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (WORKERS.wake_fd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+    return worker_pool_start(&WORKERS.pool, num_threads, run_job);
+}
+
+void stop_workers() {
+    // Requests still waiting in the queue are dropped, their clients see the connection close.
+    worker_pool_stop(&WORKERS.pool);
+    close(WORKERS.wake_fd);
+}
+
+
+static void respond(connection_t *conn, uint32_t id, frame_type_t type, const char *text) {
+    // Queued behind whatever else is waiting to go out, settle_connection sends it.
+    frame_header_t header = { .length = strlen(text), .id = id, .type = type };
+    if (io_queue_frame(&conn->io, &header, text) == -1) {
+        close_connection(conn);
+        return;
+    }
+    if (type != FRAME_PROGRESS)
+        CONNECTIONS.served++;
+}
+
+static void respond_with_fds(connection_t *conn, uint32_t id, const char *text, const int *fds, int num_fds) {
+    // Only one set of fds can wait to go out at a time, the caller checks there is none already.
+    frame_header_t header = { .length = strlen(text), .id = id, .type = FRAME_OK, .num_fds = num_fds };
+    io_give_fds(&conn->io, fds, num_fds);
+    if (io_queue_frame(&conn->io, &header, text) == -1) {
+        close_connection(conn);
+        return;
+    }
+    CONNECTIONS.served++;
+}
+
+static void count_io(connection_t *conn) {
+    LOOP_SYSCALLS += conn->io.syscalls;
+    conn->io.syscalls = 0;
+}
+
+static void settle_uring(connection_t *conn);
+
+void settle_connection(connection_t *conn) {
+    /**
+     * sends what it can of the responses so far, then closes the connection if it is done with or tells epoll
+     * what to wait for next
+    **/
+    if (conn->closed)
+        return;
+    if (USE_URING) {
+        settle_uring(conn);
+        return;
+    }
+    io_status_t status = io_flush(&conn->io);
+    count_io(conn);
+    if (status == IO_ERROR) {
+        close_connection(conn);
+        return;
+    }
+    size_t backlog = io_pending(&conn->io);
+    if (conn->read_closed && conn->pending == 0 && backlog == 0) {
+        close_connection(conn);
+        return;
+    }
+    uint32_t events = backlog > 0 ? EPOLLOUT : 0;
+    if (!conn->read_closed && backlog < MAX_OUTPUT_BACKLOG)
+        events |= EPOLLIN;
+    if (events == conn->events)
+        return;
+    struct epoll_event event = { .events = events, .data.ptr = conn };
+    LOOP_SYSCALLS++;
+    if (epoll_ctl(EPOLL_FD, EPOLL_CTL_MOD, conn->io.fd, &event) == -1) {
+        perror("epoll_ctl");
+        close_connection(conn);
+        return;
+    }
+    conn->events = events;
+}
+
+static void turn_away(int listen_fd, int *spare_fd) {
+    // Out of file descriptors, the spare one makes room to accept the client just to close it.
+    fprintf(stderr, "Out of file descriptors, turning a client away\n");
+    close(*spare_fd);
+    LOOP_SYSCALLS += 3;
+    int client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client_fd != -1)
+        close(client_fd);
+    *spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+static void start_receiving(connection_t *conn);
+
+static void add_connection(int client_fd, bool unix_socket) {
+    connection_t *conn = calloc(1, sizeof(connection_t));
+    if (!conn) {
+        close(client_fd);
+        return;
+    }
+    io_init(&conn->io, client_fd);
+    conn->slot = -1;
+    CONNECTIONS.open++;
+    CONNECTIONS.accepted++;
+    // Its requests are turned away one by one, so the client isn't still writing when we hang up.
+    LOOP_SYSCALLS++;
+    conn->allowed = unix_socket && peer_allowed(client_fd);
+    conn->unix_socket = unix_socket;
+    if (USE_URING) {
+        start_receiving(conn);
+        return;
+    }
+    conn->events = EPOLLIN;
+    struct epoll_event event = { .events = conn->events, .data.ptr = conn };
+    LOOP_SYSCALLS++;
+    if (epoll_ctl(EPOLL_FD, EPOLL_CTL_ADD, client_fd, &event) == -1) {
+        perror("epoll_ctl");
+        close_connection(conn);
+    }
+}
+
+void accept_clients(int listen_fd, bool unix_socket, int *spare_fd) {
+    while (true) {
+        // Close-on-exec everywhere, a container runtime holding a client's connection would keep it open forever.
+        LOOP_SYSCALLS++;
+        int client_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if ((errno == EMFILE || errno == ENFILE) && *spare_fd != -1) {
+                turn_away(listen_fd, spare_fd);
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+        add_connection(client_fd, unix_socket);
+    }
+}
+
+
+static bool serve_input(connection_t *conn) {
+    /**
+     * serves every complete frame that has arrived, leaving the start of the next one in the buffer
+     * return:
+     * false if the connection was closed, true otherwise
+    **/
+    size_t preface_len = strlen(PROTOCOL_PREFACE);
+    if (!conn->greeted) {
+        if (io_readable(&conn->io) < preface_len)
+            return true;
+        if (memcmp(io_peek(&conn->io), PROTOCOL_PREFACE, preface_len) != 0) {
+            fprintf(stderr, "Client did not verify itself\n");
+            close_connection(conn);
+            return false;
+        }
+        io_consume(&conn->io, preface_len);
+        conn->greeted = true;
+        if (io_queue(&conn->io, PROTOCOL_PREFACE, preface_len) == -1) {
+            close_connection(conn);
+            return false;
+        }
+    }
+    frame_header_t header;
+    const char *payload;
+    int found;
+    while ((found = io_next_frame(&conn->io, &header, &payload, MAX_FRAME_SIZE)) == 1) {
+        if (!serve_frame(conn, &header, payload))
+            return false;
+        io_consume(&conn->io, sizeof(header) + header.length);
+    }
+    if (found == -1) {
+        fprintf(stderr, "Client sent a %u byte frame\n", header.length);
+        close_connection(conn);
+        return false;
+    }
+    return true;
+}
+
+void handle_readable(connection_t *conn) {
+    // Frames are served as soon as they are complete, so the buffer never holds much more than the largest one.
+    while (true) {
+        io_status_t status = io_fill(&conn->io);
+        count_io(conn);
+        if (status == IO_ERROR) {
+            close_connection(conn);
+            return;
+        }
+        if (status == IO_EOF)
+            conn->read_closed = true;
+        if (!serve_input(conn))
+            return;
+        // The socket is level triggered, so rather than another read to see EAGAIN we let epoll tell us if
+        // anything is left after a short one.
+        if (status != IO_MORE)
+            break;
+    }
+    settle_connection(conn);
+}
+
+bool serve_frame(connection_t *conn, const frame_header_t *header, const char *payload) {
+    /**
+     * serves a request, or each of the requests in a batch
+     * return:
+     * false if the frame was malformed and the connection closed, true otherwise
+    **/
+    if (header->type != FRAME_BATCH) {
+        serve_request(conn, header, payload);
+        return !conn->closed;
+    }
+    uint32_t pos = 0;
+    while (pos < header->length && !conn->closed) {
+        frame_header_t request;
+        if (header->length - pos < sizeof(request)) {
+            fprintf(stderr, "Client sent a malformed batch\n");
+            close_connection(conn);
+            break;
+        }
+        memcpy(&request, payload + pos, sizeof(request));
+        pos += sizeof(request);
+        if (header->length - pos < request.length) {
+            fprintf(stderr, "Client sent a malformed batch\n");
+            close_connection(conn);
+            break;
+        }
+        if (request.type == FRAME_BATCH)
+            respond(conn, request.id, FRAME_ERROR, "ERROR batches can't be nested\n");
+        else
+            serve_request(conn, &request, payload + pos);
+        pos += request.length;
+    }
+    return !conn->closed;
+}
+
+static void serve_logs(connection_t *conn, uint32_t id, const char *payload, uint32_t length) {
+    // Opening a log and a pipe is quick, it doesn't need a worker.
+    uint32_t follow;
+    char name[sizeof(((container_record_t *) 0)->name)];
+    if (length <= sizeof(follow) || length - sizeof(follow) >= sizeof(name)) {
+        respond(conn, id, FRAME_ERROR, "ERROR bad container name\n");
+        return;
+    }
+    if (!conn->unix_socket) {
+        respond(conn, id, FRAME_ERROR, "ERROR logs are only sent over the Unix socket\n");
+        return;
+    }
+    if (conn->io.num_out_fds > 0) {
+        respond(conn, id, FRAME_ERROR, "ERROR busy sending another log, try again\n");
+        return;
+    }
+    memcpy(&follow, payload, sizeof(follow));
+    memcpy(name, payload + sizeof(follow), length - sizeof(follow));
+    name[length - sizeof(follow)] = '\0';
+
+    int fds[2];
+    loff_t offset;
+    LOOP_SYSCALLS += 3;
+    int num_fds = log_capture_open(&LOGS, name, follow, fds, &offset);
+    if (num_fds == -1) {
+        char error[MAX_RESPONSE_SIZE];
+        snprintf(error, sizeof(error), "ERROR no log for %s\n", name);
+        respond(conn, id, FRAME_ERROR, error);
+        return;
+    }
+    char text[64];
+    snprintf(text, sizeof(text), "OK %lld\n", (long long) offset);
+    respond_with_fds(conn, id, text, fds, num_fds);
+}
+
+static void serve_update(connection_t *conn, uint32_t id, const char *payload, uint32_t length) {
+    // Checked here against the registry, the cgroup writes go to a worker since cutting memory can mean waiting on
+    // the kernel to reclaim it.
+    update_request_t request;
+    if (length != sizeof(request)) {
+        respond(conn, id, FRAME_ERROR, "ERROR malformed update\n");
+        return;
+    }
+    memcpy(&request, payload, sizeof(request));
+    request.name[sizeof(request.name) - 1] = '\0';
+    if (request.mem_limit == UPDATE_KEEP && request.pid_limit == UPDATE_KEEP && request.cpus == UPDATE_KEEP) {
+        respond(conn, id, FRAME_ERROR, "ERROR the update changes no limits\n");
+        return;
+    }
+    registry_entry_t *entry = REGISTRY.entries;
+    while (entry && strcmp(entry->container.name, request.name) != 0)
+        entry = entry->next;
+    if (!entry) {
+        char error[MAX_RESPONSE_SIZE];
+        snprintf(error, sizeof(error), "ERROR no running container %s\n", request.name);
+        respond(conn, id, FRAME_ERROR, error);
+        return;
+    }
+    job_t *job = malloc(sizeof(job_t));
+    if (!job) {
+        respond(conn, id, FRAME_ERROR, "ERROR out of memory\n");
+        return;
+    }
+    job->kind = JOB_UPDATE;
+    job->conn = conn;
+    job->id = id;
+    job->spec = NULL;
+    job->num_fds = 0;
+    job->path[0] = '\0';
+    job->update = request;
+    job->task.next = NULL;
+    conn->pending++;
+    worker_pool_submit(&WORKERS.pool, &job->task, 1, LANE_CONTROL);
+}
+
+static void subscribe(connection_t *conn, uint32_t id) {
+    // Every event from now on goes to conn as progress on id, until it closes.
+    if (conn->subscribed) {
+        respond(conn, id, FRAME_ERROR, "ERROR already subscribed to events\n");
+        return;
+    }
+    conn->subscribed = true;
+    conn->events_id = id;
+    conn->prev_subscriber = NULL;
+    conn->next_subscriber = SUBSCRIBERS;
+    if (SUBSCRIBERS)
+        SUBSCRIBERS->prev_subscriber = conn;
+    SUBSCRIBERS = conn;
+    CONNECTIONS.subscribed++;
+    char text[128];
+    snprintf(text, sizeof(text), "watching %lu containers for pressure stalls\n", PRESSURE.watched);
+    respond(conn, id, FRAME_PROGRESS, text);
+}
+
+static void publish_event(const char *text) {
+    // Queued for every subscriber, one that is already far behind misses it rather than have it pile up.
+    for (connection_t *conn = SUBSCRIBERS; conn; conn = conn->next_subscriber) {
+        if (io_pending(&conn->io) + (conn->sent.end - conn->sent.start) >= MAX_OUTPUT_BACKLOG) {
+            CONNECTIONS.events_dropped++;
+            continue;
+        }
+        frame_header_t header = { .length = strlen(text), .id = conn->events_id, .type = FRAME_PROGRESS };
+        if (io_queue_frame(&conn->io, &header, text) == -1) {
+            CONNECTIONS.events_dropped++;
+            continue;
+        }
+        CONNECTIONS.events_sent++;
+    }
+}
+
+void serve_request(connection_t *conn, const frame_header_t *header, const char *payload) {
+    // Quick requests are answered on the spot and anything slow goes to the workers.
+    // The request's fds are taken even if it is refused, so they aren't mistaken for the next request's.
+    int fds[IO_MAX_FDS];
+    int taken = io_take_fds(&conn->io, fds, header->num_fds);
+    int num_fds = taken < MAX_REQUEST_FDS ? taken : MAX_REQUEST_FDS;
+    for (int i = num_fds; i < taken; i++)
+        close(fds[i]);
+
+    // A create -n's payload starts with how many containers it wants.
+    bool many = header->type == FRAME_CREATE_MANY;
+    uint32_t count = 1;
+    const char *path = payload;
+    uint32_t path_len = header->length;
+    if (many && header->length < sizeof(count)) {
+        path_len = 0;
+    }
+    else if (many) {
+        memcpy(&count, payload, sizeof(count));
+        path += sizeof(count);
+        path_len -= sizeof(count);
+    }
+
+    const char *error = NULL;
+    job_t *job = NULL;
+    launch_spec_t *spec = NULL;
+    // TCP has no peer credentials, so anyone who can reach loopback may only look.
+    if (!conn->allowed && (conn->unix_socket || header->type != FRAME_STATS)) {
+        error = conn->unix_socket ? "ERROR permission denied\n" : "ERROR only stats is served over TCP\n";
+    }
+    else if (taken < header->num_fds) {
+        error = "ERROR file descriptors missing\n";
+    }
+    else if (taken > MAX_REQUEST_FDS) {
+        error = "ERROR too many file descriptors\n";
+    }
+    else if (header->type == FRAME_DESTROY) {
+        RUNNING = false;
+    }
+    else if (header->type == FRAME_STATS) {
+        char stats[MAX_RESPONSE_SIZE];
+        zygote_pool_format_stats(&POOL, stats, sizeof(stats));
+        int len = strlen(stats);
+        snprintf(stats + len, sizeof(stats) - len, "connections: %lu open, %lu accepted, %lu served\n",
+                 CONNECTIONS.open, CONNECTIONS.accepted, CONNECTIONS.served);
+        len = strlen(stats);
+        snprintf(stats + len, sizeof(stats) - len, "events: %lu subscribers, %lu sent, %lu dropped\n",
+                 CONNECTIONS.subscribed, CONNECTIONS.events_sent, CONNECTIONS.events_dropped);
+        len = strlen(stats);
+        worker_pool_format_stats(&WORKERS.pool, stats + len, sizeof(stats) - len);
+        len = strlen(stats);
+        registry_format_stats(&REGISTRY, stats + len, sizeof(stats) - len);
+        len = strlen(stats);
+        log_capture_format_stats(&LOGS, stats + len, sizeof(stats) - len);
+        len = strlen(stats);
+        placement_format_stats(&PLACEMENT, stats + len, sizeof(stats) - len);
+        len = strlen(stats);
+        if (WATCH_PRESSURE)
+            pressure_format_stats(&PRESSURE, stats + len, sizeof(stats) - len);
+        else
+            snprintf(stats + len, sizeof(stats) - len, "pressure: not watched\n");
+        len = strlen(stats);
+        unsigned long syscalls = LOOP_SYSCALLS + RING.syscalls + PRESSURE.syscalls;
+        snprintf(stats + len, sizeof(stats) - len, "event loop: %s, %lu syscalls, %.2f per request served\n",
+                 USE_URING ? "io_uring" : "epoll", syscalls,
+                 CONNECTIONS.served ? (double) syscalls / CONNECTIONS.served : 0.0);
+        respond(conn, header->id, FRAME_OK, stats);
+    }
+    else if (header->type == FRAME_LOGS) {
+        serve_logs(conn, header->id, payload, header->length);
+    }
+    else if (header->type == FRAME_UPDATE) {
+        serve_update(conn, header->id, payload, header->length);
+    }
+    else if (header->type == FRAME_EVENTS) {
+        subscribe(conn, header->id);
+    }
+    else if (header->type != FRAME_CREATE && !many) {
+        error = "ERROR unrecognized request\n";
+    }
+    else if (path_len == 0 || path_len >= PATH_MAX) {
+        error = "ERROR bad containerfile path\n";
+    }
+    else if (count == 0 || count > MAX_CREATE_MANY) {
+        error = "ERROR bad container count\n";
+    }
+    else if (many && num_fds > 0) {
+        error = "ERROR containers created together can't share file descriptors\n";
+    }
+    else if (!(job = malloc(sizeof(job_t))) || (many && !(spec = malloc(sizeof(launch_spec_t))))) {
+        free(job);
+        error = "ERROR out of memory\n";
+    }
+    else {
+        job->kind = many ? JOB_PREPARE : JOB_CREATE;
+        job->conn = conn;
+        job->id = header->id;
+        job->spec = spec;
+        if (spec) {
+            spec->count = count;
+            spec->done = spec->launched = 0;
+            spec->start = now_s();
+        }
+        memcpy(job->fds, fds, num_fds * sizeof(int));
+        job->num_fds = num_fds;
+        memcpy(job->path, path, path_len);
+        job->path[path_len] = '\0';
+        job->task.next = NULL;
+        conn->pending++;
+        worker_pool_submit(&WORKERS.pool, &job->task, 1, LANE_CONTROL);
+        return;
+    }
+    for (int i = 0; i < num_fds; i++)
+        close(fds[i]);
+    if (error)
+        respond(conn, header->id, FRAME_ERROR, error);
+}
+
+static bool fan_out(job_t *prepared) {
+    /**
+     * queues a launch for each of the containers a create -n wants, now that its containerfile has been read
+     * return:
+     * false if none could be queued, true otherwise
+    **/
+    launch_spec_t *spec = prepared->spec;
+    job_t *first = NULL, *last = NULL;
+    uint32_t queued = 0;
+    for (; queued < spec->count; queued++) {
+        job_t *job = malloc(sizeof(job_t));
+        if (!job)
+            break;
+        job->kind = JOB_LAUNCH;
+        job->conn = prepared->conn;
+        job->id = prepared->id;
+        job->spec = spec;
+        job->num_fds = 0;
+        job->task.next = NULL;
+        if (last)
+            last->task.next = &job->task;
+        else
+            first = job;
+        last = job;
+    }
+    if (queued == 0) {
+        snprintf(prepared->response, sizeof(prepared->response), "ERROR out of memory\n");
+        prepared->ok = false;
+        return false;
+    }
+    // Short of memory for some, the summary reports however many there were.
+    spec->count = queued;
+    prepared->conn->pending += queued;
+    worker_pool_submit(&WORKERS.pool, &first->task, queued, LANE_CONTROL);
+    return true;
+}
+
+static void launch_finished(job_t *job) {
+    // Each container is reported as it comes up, and the last one to finish sends the summary.
+    launch_spec_t *spec = job->spec;
+    connection_t *conn = job->conn;
+    spec->done++;
+    if (job->ok)
+        spec->launched++;
+    if (!conn->closed)
+        respond(conn, job->id, FRAME_PROGRESS, job->response);
+    if (spec->done < spec->count)
+        return;
+    if (!conn->closed) {
+        char summary[MAX_RESPONSE_SIZE];
+        snprintf(summary, sizeof(summary), "%s %u of %u containers started in %.2f s\n%s",
+                 spec->launched == spec->count ? "OK" : "ERROR", spec->launched, spec->count,
+                 now_s() - spec->start, spec->unpacked);
+        respond(conn, job->id, spec->launched == spec->count ? FRAME_OK : FRAME_ERROR, summary);
+    }
+    free(spec);
+}
+
+void watch_exit(registry_entry_t *entry) {
+    // The pidfd turns readable once the runtime has exited, which it only does once its container has.
+    uintptr_t tag = (uintptr_t) entry | URING_OP_EXIT;
+    if (USE_URING) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&RING);
+        if (!sqe) {
+            perror("io_uring poll");
+            return;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = entry->pidfd;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = tag;
+        return;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = tag };
+    LOOP_SYSCALLS++;
+    if (epoll_ctl(EPOLL_FD, EPOLL_CTL_ADD, entry->pidfd, &event) == -1)
+        perror("epoll_ctl pidfd");
+}
+
+static void track_container(const container_record_t *container) {
+    // Nothing to track if the runtime has already exited and been reaped.
+    registry_entry_t *entry = registry_add(&REGISTRY, container);
+    if (entry) {
+        entry->row = table_writer_add(&TABLE, container, false);
+        if (WATCH_PRESSURE)
+            entry->pressure = pressure_watch(&PRESSURE, container->name, entry);
+        watch_exit(entry);
+    }
+}
+
+void forget_container(registry_entry_t *entry) {
+    placement_release(&PLACEMENT, entry->container.numa_node, entry->container.cpu_cores);
+    pressure_unwatch(&PRESSURE, entry->pressure);
+    if (entry->row != -1)
+        table_writer_remove(&TABLE, entry->row);
+    registry_remove(&REGISTRY, entry);
+}
+
+static void update_cores(const char *name, double cores) {
+    // The container may have exited while its update ran, then there is nothing left to keep in step.
+    registry_entry_t *entry = REGISTRY.entries;
+    while (entry && strcmp(entry->container.name, name) != 0)
+        entry = entry->next;
+    if (!entry)
+        return;
+    placement_adjust(&PLACEMENT, entry->container.numa_node, cores - entry->container.cpu_cores);
+    entry->container.cpu_cores = cores;
+    if (registry_update(&REGISTRY, entry) == -1)
+        fprintf(stderr, "Could not record the new CPU limit of %s\n", name);
+}
+
+void collect_pressure() {
+    // Each event is a trigger the kernel fired, nothing here reads a cgroup on a timer.
+    pressure_event_t events[PRESSURE_MAX_QUEUED];
+    int count = pressure_collect(&PRESSURE, events, PRESSURE_MAX_QUEUED);
+    time_t now = time(NULL);
+    struct tm local;
+    char when[16];
+    strftime(when, sizeof(when), "%H:%M:%S", localtime_r(&now, &local));
+    for (int i = 0; i < count; i++) {
+        registry_entry_t *entry = events[i].owner;
+        if (entry->row != -1)
+            table_writer_pressure(&TABLE, entry->row, events[i].resource, events[i].avg10);
+        char text[256];
+        snprintf(text, sizeof(text), "%s %s stalled on %s avg10=%.2f%% total=%.3fs\n", when, entry->container.name,
+                 pressure_resource_name(events[i].resource), events[i].avg10, events[i].total_s);
+        publish_event(text);
+    }
+    // Settling can close a subscriber, which unlinks it but leaves its next_subscriber as it was.
+    for (connection_t *conn = SUBSCRIBERS; count > 0 && conn; conn = conn->next_subscriber)
+        settle_connection(conn);
+}
+
+void collect_finished() {
+    pthread_mutex_lock(&WORKERS.lock);
+    job_t *job = WORKERS.finished;
+    WORKERS.finished = NULL;
+    pthread_mutex_unlock(&WORKERS.lock);
+    while (job) {
+        job_t *next = job->next;
+        connection_t *conn = job->conn;
+        // A create -n that got as far as its launches is answered by them.
+        bool answered = false;
+        if (job->kind == JOB_PREPARE && job->ok && !conn->closed)
+            answered = fan_out(job);
+        if (job->kind == JOB_PREPARE && !answered)
+            free(job->spec);
+        if (job->kind == JOB_LAUNCH) {
+            launch_finished(job);
+            answered = true;
+        }
+        if ((job->kind == JOB_CREATE || job->kind == JOB_LAUNCH) && job->ok)
+            track_container(&job->container);
+        if (job->kind == JOB_UPDATE && job->ok && job->container.cpu_cores >= 0)
+            update_cores(job->update.name, job->container.cpu_cores);
+        conn->pending--;
+        if (conn->closed) {
+            release_connection(conn);
+        }
+        else {
+            if (!answered)
+                respond(conn, job->id, job->ok ? FRAME_OK : FRAME_ERROR, job->response);
+            settle_connection(conn);
+        }
+        free(job);
+        job = next;
+    }
+}
+
+
+/**
+ * The io_uring engine. Everything the loop wants done is queued in the submission ring and handed to the kernel in
+ * the io_uring_enter that waits for the next completions. A multishot accept on each listen socket keeps delivering
+ * clients without being asked again, every connection keeps one receive in flight whose data lands in a buffer
+ * taken from a ring shared by all connections, and its responses go out with one send of everything queued.
+ * */
+
+static void target(struct io_uring_sqe *sqe, connection_t *conn) {
+    if (conn->slot != -1) {
+        sqe->fd = conn->slot;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    else {
+        sqe->fd = conn->io.fd;
+    }
+}
+
+static void arm_accept(int listen_fd, int *tag) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&RING);
+    if (!sqe) {
+        perror("io_uring accept");
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (uintptr_t) tag;
+}
+
+static void arm_wake() {
+    struct io_uring_sqe *sqe = uring_get_sqe(&RING);
+    if (!sqe) {
+        perror("io_uring read");
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = WORKERS.wake_fd;
+    sqe->addr = (uintptr_t) &WAKE_COUNT;
+    sqe->len = sizeof(WAKE_COUNT);
+    sqe->user_data = (uintptr_t) &WAKE_TAG;
+}
+
+static void arm_pressure() {
+    struct io_uring_sqe *sqe = uring_get_sqe(&RING);
+    if (!sqe) {
+        perror("io_uring read");
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = PRESSURE.ready_fd;
+    sqe->addr = (uintptr_t) &PRESSURE_COUNT;
+    sqe->len = sizeof(PRESSURE_COUNT);
+    sqe->user_data = (uintptr_t) &PRESSURE_TAG;
+}
+
+static void arm_receive(connection_t *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&RING);
+    if (!sqe) {
+        close_connection(conn);
+        return;
+    }
+    // The kernel picks the buffer, the iovec only says how much may go in it.
+    conn->iov = (struct iovec) { .iov_base = NULL, .iov_len = URING_BUFFER_SIZE };
+    conn->msg = (struct msghdr) {
+        .msg_iov = &conn->iov,
+        .msg_iovlen = 1,
+        .msg_control = conn->control.buf,
+        .msg_controllen = sizeof(conn->control.buf),
+    };
+    sqe->opcode = IORING_OP_RECVMSG;
+    target(sqe, conn);
+    sqe->addr = (uintptr_t) &conn->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_CMSG_CLOEXEC;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uintptr_t) conn | URING_OP_RECEIVE;
+    conn->receiving = true;
+    conn->inflight++;
+}
+
+static void arm_send(connection_t *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&RING);
+    if (!sqe) {
+        close_connection(conn);
+        return;
+    }
+    target(sqe, conn);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    if (conn->num_send_fds > 0) {
+        // Fds need a sendmsg, everything else is a plain send.
+        conn->send_iov = (struct iovec) { conn->sent.data + conn->sent.start, conn->sent.end - conn->sent.start };
+        conn->send_msg = (struct msghdr) {
+            .msg_iov = &conn->send_iov,
+            .msg_iovlen = 1,
+            .msg_control = conn->send_control.buf,
+            .msg_controllen = CMSG_SPACE(conn->num_send_fds * sizeof(int)),
+        };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&conn->send_msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(conn->num_send_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), conn->send_fds, conn->num_send_fds * sizeof(int));
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = (uintptr_t) &conn->send_msg;
+        sqe->len = 1;
+    }
+    else {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uintptr_t) (conn->sent.data + conn->sent.start);
+        sqe->len = conn->sent.end - conn->sent.start;
+    }
+    sqe->user_data = (uintptr_t) conn | URING_OP_SEND;
+    conn->sending = true;
+    conn->inflight++;
+}
+
+static void start_receiving(connection_t *conn) {
+    // The fd goes into the fixed file table in the same submission as the first receive, which is cancelled if
+    // that fails.
+    struct io_uring_sqe *sqe;
+    if (NUM_FREE_SLOTS > 0 && (sqe = uring_get_sqe(&RING))) {
+        conn->slot = FREE_SLOTS[--NUM_FREE_SLOTS];
+        sqe->opcode = IORING_OP_FILES_UPDATE;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t) &conn->io.fd;
+        sqe->len = 1;
+        sqe->off = conn->slot;
+        sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+    }
+    arm_receive(conn);
+}
+
+static void settle_uring(connection_t *conn) {
+    // Only one send at a time, what is queued meanwhile goes in the next one.
+    if (!conn->sending) {
+        if (conn->sent.start == conn->sent.end && io_pending(&conn->io) > 0) {
+            free(conn->sent.data);
+            conn->sent = io_detach_output(&conn->io);
+            // Fds go with the first byte of what was queued after them, which is in this send.
+            memcpy(conn->send_fds, conn->io.out_fds, conn->io.num_out_fds * sizeof(int));
+            conn->num_send_fds = conn->io.num_out_fds;
+            conn->io.num_out_fds = 0;
+            conn->io.own_out_fds = false;
+        }
+        if (conn->sent.start < conn->sent.end)
+            arm_send(conn);
+    }
+    if (conn->closed)
+        return;
+    size_t backlog = io_pending(&conn->io) + (conn->sent.end - conn->sent.start);
+    if (conn->read_closed && conn->pending == 0 && backlog == 0) {
+        close_connection(conn);
+        return;
+    }
+    if (!conn->receiving && !conn->read_closed && backlog < MAX_OUTPUT_BACKLOG)
+        arm_receive(conn);
+}
+
+static void received(connection_t *conn, int res, uint32_t flags) {
+    conn->receiving = false;
+    conn->inflight--;
+    if (res > 0)
+        io_collect_fds(&conn->io, &conn->msg);
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && !conn->closed && io_append(&conn->io, uring_buffer(&RING, bid), res) == -1)
+            close_connection(conn);
+        uring_recycle_buffer(&RING, bid);
+    }
+    if (conn->closed) {
+        // Anything that arrived after we hung up, fds included, is dropped.
+        io_free(&conn->io);
+        release_connection(conn);
+        return;
+    }
+    // Out of buffers only means every one was in use for a moment, they are all back by the next submission.
+    if (res < 0 && res != -ENOBUFS) {
+        close_connection(conn);
+        return;
+    }
+    if (res == 0)
+        conn->read_closed = true;
+    if (res > 0 && !serve_input(conn))
+        return;
+    settle_connection(conn);
+}
+
+static void sent(connection_t *conn, int res) {
+    conn->sending = false;
+    conn->inflight--;
+    // Whether they went or not, the fds are done with, a send that failed ends the connection.
+    for (int i = 0; i < conn->num_send_fds; i++)
+        close(conn->send_fds[i]);
+    conn->num_send_fds = 0;
+    if (res > 0)
+        conn->sent.start += res;
+    if (conn->closed || res <= 0 || conn->sent.start == conn->sent.end) {
+        free(conn->sent.data);
+        conn->sent = (io_buffer_t) { 0 };
+    }
+    if (conn->closed) {
+        release_connection(conn);
+        return;
+    }
+    if (res <= 0) {
+        close_connection(conn);
+        return;
+    }
+    settle_connection(conn);
+}
+
+int start_uring(int listen_fd, int unix_listen_fd) {
+    /**
+     * sets up the ring, its buffers and the fixed file table, and starts accepting on both listen sockets
+     * return:
+     * 0 on success, -1 with errno set if the kernel can't do what we need
+    **/
+    if (uring_init(&RING, URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE) == -1)
+        return -1;
+    // Without fixed files every operation looks the fd up, which still works.
+    struct rlimit limit;
+    unsigned slots = URING_MAX_FIXED_FILES;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < slots)
+        slots = limit.rlim_cur;
+    if (uring_register_files(&RING, slots) == 0) {
+        for (int slot = slots - 1; slot >= 0; slot--)
+            FREE_SLOTS[NUM_FREE_SLOTS++] = slot;
+    }
+    arm_accept(listen_fd, &LISTEN_TAG);
+    arm_accept(unix_listen_fd, &UNIX_LISTEN_TAG);
+    arm_wake();
+    if (WATCH_PRESSURE)
+        arm_pressure();
+    return 0;
+}
+
+void run_uring(int listen_fd, int unix_listen_fd, int *spare_fd) {
+    while (RUNNING) {
+        if (uring_submit_and_wait(&RING, 1) == -1) {
+            perror("io_uring_enter");
+            break;
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&RING))) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            uint32_t flags = cqe->flags;
+            uring_cqe_seen(&RING);
+            void *tag = (void *) (uintptr_t) (data & ~(uint64_t) URING_OP_MASK);
+            if (data == 0) {
+                // Only fixed file updates leave these, and only when they fail.
+                fprintf(stderr, "Could not update the fixed file table: %s\n", strerror(-res));
+            }
+            else if (tag == &LISTEN_TAG || tag == &UNIX_LISTEN_TAG) {
+                int fd = tag == &LISTEN_TAG ? listen_fd : unix_listen_fd;
+                if (res >= 0)
+                    add_connection(res, tag == &UNIX_LISTEN_TAG);
+                else if ((res == -EMFILE || res == -ENFILE) && *spare_fd != -1)
+                    turn_away(fd, spare_fd);
+                else if (res != -EINTR && res != -ECONNABORTED)
+                    fprintf(stderr, "accept: %s\n", strerror(-res));
+                // The kernel stops a multishot accept after an error, or if it runs out of room for completions.
+                if (!(flags & IORING_CQE_F_MORE))
+                    arm_accept(fd, tag);
+            }
+            else if (tag == &WAKE_TAG) {
+                collect_finished();
+                arm_wake();
+            }
+            else if (tag == &PRESSURE_TAG) {
+                collect_pressure();
+                arm_pressure();
+            }
+            else if ((data & URING_OP_MASK) == URING_OP_EXIT) {
+                forget_container(tag);
+            }
+            else if ((data & URING_OP_MASK) == URING_OP_RECEIVE) {
+                received(tag, res, flags);
+            }
+            else {
+                sent(tag, res);
+            }
+        }
+        free_closed();
+    }
+}
+
+
+int handle_create(const char *containerfile_path, const int *fds, int num_fds, container_record_t *container,
+                  char *response, size_t len) {
+    launch_spec_t spec;
+    if (num_fds != 0 && num_fds < 3) {
+        snprintf(response, len, "ERROR pass stdin, stdout and stderr or no fds at all\n");
+        return -1;
+    }
+    if (prepare_create(containerfile_path, &spec, response, len) != 0 ||
+        launch_prepared(&spec, fds, num_fds, container, response, len) != 0)
+        return -1;
+    size_t used = strlen(response);
+    snprintf(response + used, len - used, "%s", spec.unpacked);
+    return 0;
+}
+
+static int unpack_rootfs(const containerfile_t *file, const char *base_dir, extract_stats_t *stats) {
+    /**
+     * unpacks the containerfile's tarballs into its rootfs, a tarball_path of store:<name> takes the layers of
+     * image name in the layer store
+     * return:
+     * the same as extract_rootfs
+    **/
+    size_t prefix_len = strlen(STORE_IMAGE_PREFIX);
+    if (strncmp(file->tarball_path, STORE_IMAGE_PREFIX, prefix_len) != 0)
+        return extract_rootfs(file->tarball_path, base_dir, NULL, file->rootfs, stats);
+    // Every create comes through here, only an image that still has to be unpacked is worth hashing.
+    if (access(file->rootfs, F_OK) == 0)
+        return 0;
+    const char *name = file->tarball_path + prefix_len;
+    store_t store;
+    if (store_open(&store, STORE_DEFAULT_ROOT) != 0)
+        return -1;
+    uint8_t layers[STORE_MAX_LAYERS][SHA256_DIGEST_SIZE];
+    int num_layers = store_image_layers(&store, name, layers, STORE_MAX_LAYERS);
+    char blob_dir[PATH_MAX];
+    store_blob_dir(&store, blob_dir, sizeof(blob_dir));
+    // Each layer is unpacked through the fd opened here, its files are cloned from their blobs under blob_dir.
+    int fds[STORE_MAX_LAYERS];
+    int num_fds = 0;
+    char tarballs[STORE_MAX_LAYERS * 32] = "";
+    size_t used = 0;
+    while (num_fds < num_layers) {
+        int fd = store_open_blob(&store, layers[num_fds]);
+        if (fd == -1)
+            break;
+        used += snprintf(tarballs + used, sizeof(tarballs) - used, "%s/proc/self/fd/%d", num_fds ? " " : "", fd);
+        fds[num_fds++] = fd;
+    }
+    store_close(&store);
+    int result = -1;
+    if (num_layers > 0 && num_fds == num_layers)
+        result = extract_rootfs(tarballs, NULL, blob_dir, file->rootfs, stats);
+    else
+        fprintf(stderr, "Could not read image %s from the store\n", name);
+    for (int i = 0; i < num_fds; i++)
+        close(fds[i]);
+    return result;
+}
+
+int prepare_create(const char *containerfile_path, launch_spec_t *spec, char *response, size_t len) {
+    /**
+     * reads the containerfile and unpacks its image unless that has been done already, everything about a launch
+     * that is the same for each container started from it
+     * return:
+     * 0 on success, -1 with the reason in response
+    **/
+    containerfile_t *file = &spec->file;
+    char containerfile_dir[PATH_MAX];
+    snprintf(containerfile_dir, sizeof(containerfile_dir), "%s", containerfile_path);
+    extract_stats_t extracted;
+    int unpacked = 0;
+    spec->unpacked[0] = '\0';
+
+    if (parse_containerfile(containerfile_path, file) != 0) {
+        snprintf(response, len, "ERROR could not read %s\n", containerfile_path);
+    }
+    else if (file->rootfs[0] == '\0') {
+        snprintf(response, len, "ERROR containerfile has no rootfs\n");
+    }
+    else if (file->rootfs_mode[0] != '\0' && strcmp(file->rootfs_mode, "overlay") != 0) {
+        snprintf(response, len, "ERROR unknown rootfs_mode %s\n", file->rootfs_mode);
+    }
+    else if ((spec->command_len = pack_command(file->command, spec->command, sizeof(spec->command))) == -1) {
+        snprintf(response, len, "ERROR containerfile has no usable command\n");
+    }
+    else if (file->tarball_path[0] && (unpacked = unpack_rootfs(file, dirname(containerfile_dir), &extracted)) == -1) {
+        snprintf(response, len, "ERROR could not unpack %s into %s\n", file->tarball_path, file->rootfs);
+    }
+    else {
+        if (unpacked)
+            snprintf(spec->unpacked, sizeof(spec->unpacked),
+                     "unpacked %.1f MB, %llu files in %.2f s (%.1f MB/s, %.0f files/s)\n", extracted.bytes / 1e6,
+                     (unsigned long long) extracted.entries, extracted.seconds,
+                     extracted.bytes / 1e6 / extracted.seconds, extracted.entries / extracted.seconds);
+        return 0;
+    }
+    return -1;
+}
+
+int launch_prepared(const launch_spec_t *spec, const int *fds, int num_fds, container_record_t *container,
+                    char *response, size_t len) {
+    launched_t launched;
+    const containerfile_t *file = &spec->file;
+    bool overlay = strcmp(file->rootfs_mode, "overlay") == 0;
+    // A container without the client's stdio writes into pipes whose other ends are captured into its log.
+    int stdio[3];
+    int read_ends[2];
+    bool captured = num_fds == 0 && log_capture_pipes(stdio, read_ends) == 0;
+    if (captured) {
+        fds = stdio;
+        num_fds = 3;
+    }
+    int status = zygote_pool_launch(&POOL, file->rootfs, file->config[0] ? file->config : NULL, overlay,
+                                    spec->command, spec->command_len, fds, num_fds, &launched);
+    if (captured) {
+        // The container has its own copies of the write ends, it has to be the only one left holding them for
+        // the log to see it exit.
+        for (int i = 0; i < 3; i++)
+            close(stdio[i]);
+        if (status == 0) {
+            log_capture_add(&LOGS, launched.name, read_ends);
+        }
+        else {
+            close(read_ends[0]);
+            close(read_ends[1]);
+        }
+    }
+    if (status == 0) {
+        // Described here rather than by the event loop, it takes a trip through /proc.
+        memset(container, 0, sizeof(*container));
+        memcpy(container->name, launched.name, sizeof(container->name));
+        memcpy(container->netns, launched.netns, sizeof(container->netns));
+        memcpy(container->rootfs, file->rootfs, sizeof(container->rootfs));
+        memcpy(container->config, file->config, sizeof(container->config));
+        container->overlay = overlay;
+        container->pid = launched.pid;
+        container->numa_node = launched.numa_node;
+        container->cpu_cores = launched.cpu_cores;
+        registry_describe(container);
+    }
+    if (status == 0)
+        snprintf(response, len, "OK %s\n", launched.name);
+    else if (status == -1)
+        snprintf(response, len, "ERROR could not start a container\n");
+    else
+        snprintf(response, len, "ERROR exec failed: %s\n", strerror(status));
+    return status == 0 ? 0 : -1;
+}
+
+
+static void format_limit(long long value, bool bytes, char *buf, size_t len) {
+    if (value == CGROUP_LIMIT_MAX)
+        snprintf(buf, len, "max");
+    else if (bytes)
+        snprintf(buf, len, "%.1fM", value / 1048576.0);
+    else
+        snprintf(buf, len, "%lld", value);
+}
+
+int handle_update(const update_request_t *request, double *cores, char *response, size_t len) {
+    /**
+     * rewrites the limits of a running container's cgroup and describes what changed
+     * cores is set to the CPU limit it now has, all online CPUs for "max", or -1 if the update left it alone
+     * return:
+     * 0 on success, -1 with the reason in response
+    **/
+    *cores = -1;
+    cgroup_t cgroup = { .version = CGROUP_VERSION, .name = request->name, .dir_fd = -1 };
+    cgroup_update_t update = {
+        .mem_limit = request->mem_limit,
+        .pid_limit = request->pid_limit,
+        .cpus = request->cpus,
+    };
+    cgroup_limits_t before, after;
+    char error[256];
+    if (update_cgroup_limits(&cgroup, &update, &before, &after, error, sizeof(error)) != 0) {
+        snprintf(response, len, "ERROR %s\n", error);
+        return -1;
+    }
+    const char *names[] = { "memory", "memory+swap", "pids" };
+    const long long was[] = { before.mem_limit, before.mem_plus_swap_limit, before.pid_limit };
+    const long long now[] = { after.mem_limit, after.mem_plus_swap_limit, after.pid_limit };
+    int used = snprintf(response, len, "OK %s\n", request->name);
+    for (int i = 0; i < 3; i++) {
+        char from[32], to[32];
+        format_limit(was[i], i < 2, from, sizeof(from));
+        format_limit(now[i], i < 2, to, sizeof(to));
+        used += snprintf(response + used, len - used, "%-12s %s -> %s\n", names[i], from, to);
+    }
+    char from[32] = "max", to[32] = "max";
+    if (before.cpu_quota != CGROUP_LIMIT_MAX)
+        snprintf(from, sizeof(from), "%.2f CPUs", (double) before.cpu_quota / before.cpu_period);
+    if (after.cpu_quota != CGROUP_LIMIT_MAX)
+        snprintf(to, sizeof(to), "%.2f CPUs", (double) after.cpu_quota / after.cpu_period);
+    snprintf(response + used, len - used, "%-12s %s -> %s\n", "cpu", from, to);
+    if (request->cpus != CGROUP_LIMIT_KEEP)
+        *cores = after.cpu_quota == CGROUP_LIMIT_MAX ? sysconf(_SC_NPROCESSORS_ONLN)
+                                                     : (double) after.cpu_quota / after.cpu_period;
+    return 0;
+}
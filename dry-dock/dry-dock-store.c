@@ -0,0 +1,151 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "store.h"
+
+typedef struct {
+    store_t *store;
+    int bad;
+} verify_state_t;
+
+// forward declare functions
+void print_usage();
+void print_entry(const store_entry_t *entry, void *arg);
+void verify_entry(const store_entry_t *entry, void *arg);
+int copy_to_stdout(int fd);
+
+/**
+ * Arguments:
+ * [-r <STORE_ROOT>] import <IMAGE_NAME> <LAYER_TARBALL>...   base layer first
+ * [-r <STORE_ROOT>] layers <IMAGE_NAME>
+ * [-r <STORE_ROOT>] remove <IMAGE_NAME>
+ * [-r <STORE_ROOT>] put <FILE>
+ * [-r <STORE_ROOT>] cat <DIGEST>
+ * [-r <STORE_ROOT>] list
+ * [-r <STORE_ROOT>] verify
+ * */
+int main(int argc, char **argv) {
+    const char *root = STORE_DEFAULT_ROOT;
+    int opt;
+    while ((opt = getopt(argc, argv, "+r:")) != -1) {
+        switch (opt) {
+        case 'r':
+            root = optarg;
+            break;
+        default:
+            print_usage();
+            return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc < 1) {
+        print_usage();
+        return 1;
+    }
+
+    store_t store;
+    if (store_open(&store, root) == -1)
+        return 1;
+
+    int result = 0;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_HEX_SIZE];
+    if (strcmp(argv[0], "import") == 0 && argc >= 3) {
+        result = store_import_image(&store, argv[1], (const char **) argv + 2, argc - 2, digest);
+        if (result == 0) {
+            sha256_to_hex(digest, hex);
+            printf("%s sha256:%s\n", argv[1], hex);
+        }
+    }
+    else if (strcmp(argv[0], "layers") == 0 && argc == 2) {
+        uint8_t layers[STORE_MAX_LAYERS][SHA256_DIGEST_SIZE];
+        int num_layers = store_image_layers(&store, argv[1], layers, STORE_MAX_LAYERS);
+        if (num_layers == -1) {
+            fprintf(stderr, "No usable image named %s\n", argv[1]);
+            result = -1;
+        }
+        for (int i = 0; i < num_layers; i++) {
+            sha256_to_hex(layers[i], hex);
+            printf("sha256:%s\n", hex);
+        }
+    }
+    else if (strcmp(argv[0], "remove") == 0 && argc == 2) {
+        result = store_remove_image(&store, argv[1]);
+        if (result == -1)
+            fprintf(stderr, "No image named %s\n", argv[1]);
+    }
+    else if (strcmp(argv[0], "put") == 0 && argc == 2) {
+        int refs = store_put_file(&store, argv[1], digest);
+        if (refs == -1) {
+            result = -1;
+        }
+        else {
+            sha256_to_hex(digest, hex);
+            printf("sha256:%s refs=%d\n", hex, refs);
+        }
+    }
+    else if (strcmp(argv[0], "cat") == 0 && argc == 2) {
+        int fd = -1;
+        if (sha256_from_hex(argv[1], digest) == -1)
+            fprintf(stderr, "%s is not a sha256 digest\n", argv[1]);
+        else if ((fd = store_open_blob(&store, digest)) == -1)
+            fprintf(stderr, "Can't read blob %s: %s\n", argv[1], strerror(errno));
+        result = fd == -1 ? -1 : copy_to_stdout(fd);
+        if (fd != -1)
+            close(fd);
+    }
+    else if (strcmp(argv[0], "list") == 0 && argc == 1) {
+        result = store_foreach(&store, print_entry, NULL);
+    }
+    else if (strcmp(argv[0], "verify") == 0 && argc == 1) {
+        verify_state_t state = { .store = &store, .bad = 0 };
+        result = store_foreach(&store, verify_entry, &state);
+        if (state.bad) {
+            fprintf(stderr, "%d blobs failed verification\n", state.bad);
+            result = -1;
+        }
+    }
+    else {
+        print_usage();
+        result = -1;
+    }
+
+    store_close(&store);
+    return result == 0 ? 0 : 1;
+}
+
+void print_usage() {
+    fprintf(stderr, "Usage: ./dry-dock-store [-r store_root] <import NAME LAYER..., layers NAME, remove NAME, "
+                    "put FILE, cat DIGEST, list, verify>\n");
+}
+
+void print_entry(const store_entry_t *entry, void *arg) {
+    (void) arg;
+    char hex[SHA256_HEX_SIZE];
+    sha256_to_hex(entry->digest, hex);
+    printf("sha256:%s size=%llu refs=%u\n", hex, (unsigned long long) entry->size, entry->refs);
+}
+
+void verify_entry(const store_entry_t *entry, void *arg) {
+    verify_state_t *state = arg;
+    if (store_verify_blob(state->store, entry->digest) == -1) {
+        char hex[SHA256_HEX_SIZE];
+        sha256_to_hex(entry->digest, hex);
+        printf("sha256:%s %s\n", hex, strerror(errno));
+        state->bad++;
+    }
+}
+
+int copy_to_stdout(int fd) {
+    char buf[65536];
+    ssize_t got;
+    while ((got = read(fd, buf, sizeof(buf))) > 0) {
+        if (fwrite(buf, 1, got, stdout) != (size_t) got)
+            return -1;
+    }
+    return got == 0 ? 0 : -1;
+}
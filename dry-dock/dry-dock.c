@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -7,42 +9,108 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
 
-#include "utils.h"
+#include "protocol.h"
+#include "conn_io.h"
+#include "container_table.h"
 
-#define DRYDOCK_PORT "2048"
 #define SERVER_PATH "./dry-dock-server"
-#define VERIFICATION_MESSAGE "DRYDOCK"
-#define VERIFICATION_RESPONSE "DRYDOCK"
-#define DESTROY_MESSAGE "KILL"
+#define STALLED_RECENTLY_S 5.0  // a stall stays in ps this long, its trigger fires every 2 s at most
 
 static int SOCKFD = -1;
+static int USING_UNIX_SOCKET = 0;
+static int PREFACE_CHECKED = 0;
+static conn_io_t CONN;
+static const char *RESOURCE_NAMES[TABLE_PRESSURE_RESOURCES] = { "cpu", "mem", "io" };
 
 // forward declare functions
-void initialize_server();
+void initialize_server(char **server_args);
 void destroy_server();
-void create_container();
+void create_containers(char **containerfile_paths, int count, int attach);
+void create_many(const char *containerfile_path, uint32_t count);
+void print_stats();
+void print_containers();
+void print_logs(const char *name, uint32_t follow);
+void update_container(char **args, int count);
+void print_events();
+int connect_over_tcp();
+int connect_to_server();
+int send_request(const int *fds, int num_fds);
+int read_response(frame_header_t *header, char *text);
 
 /**
  * Arguments:
- * init
+ * init [-p <POOL_SIZE>] [-m <MAX_PARKED>] [-w <WORKERS>] [-e <epoll|uring>]
  * destroy
- * create <PATH_TO_CONTAINERFILE>
+ * create [-a] <PATH_TO_CONTAINERFILE>...  -a runs the command on our stdin/stdout/stderr and waits for it
+ * create -n <COUNT> <PATH_TO_CONTAINERFILE>  starts COUNT containers from it, printing each name as it comes up
+ * stats
+ * ps  lists running containers from the server's shared table, without talking to the server
+ * logs [-f] <NAME>  prints what a container started without -a wrote, -f keeps printing until it exits
+ * update <NAME> [--mem <BYTES[K|M|G]|max>] [--cpu <CPUS|max>] [--pids <COUNT|max>]  changes a running container's
+ *   limits and prints them before and after
+ * events  prints container events as they happen, for now a line whenever one stalls on cpu, memory or io
  * */
 int main(int argc, char **argv) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: ./dry-dock <init, destroy, create> <options>\n");
+        fprintf(stderr, "Usage: ./dry-dock <init, destroy, create, stats, ps, logs, update, events> <options>\n");
         return 1;
     }
 
     if (strncmp(argv[1], "init", strlen("init")) == 0) {
-        initialize_server();
+        initialize_server(argv + 1);
     }
     else if (strncmp(argv[1], "destroy", strlen("destroy")) == 0) {
         destroy_server();
     }
+    else if (strncmp(argv[1], "create", strlen("create")) == 0 && argc == 5 && strcmp(argv[2], "-n") == 0) {
+        long count = atol(argv[3]);
+        if (count < 1 || count > MAX_CREATE_MANY) {
+            fprintf(stderr, "Can create between 1 and %d containers at once\n", MAX_CREATE_MANY);
+            return 1;
+        }
+        create_many(argv[4], count);
+    }
     else if (strncmp(argv[1], "create", strlen("create")) == 0) {
-        create_container();
+        int attach = argc >= 3 && strcmp(argv[2], "-a") == 0;
+        if (argc < 3 + attach || (attach && argc > 4)) {
+            fprintf(stderr, "Usage: ./dry-dock create <PATH_TO_CONTAINERFILE>...\n"
+                            "       ./dry-dock create -a <PATH_TO_CONTAINERFILE>\n"
+                            "       ./dry-dock create -n <COUNT> <PATH_TO_CONTAINERFILE>\n");
+            return 1;
+        }
+        create_containers(argv + 2 + attach, argc - 2 - attach, attach);
+    }
+    else if (strncmp(argv[1], "stats", strlen("stats")) == 0) {
+        print_stats();
+    }
+    else if (strcmp(argv[1], "ps") == 0) {
+        print_containers();
+    }
+    else if (strcmp(argv[1], "logs") == 0) {
+        int follow = argc >= 3 && strcmp(argv[2], "-f") == 0;
+        if (argc != 3 + follow) {
+            fprintf(stderr, "Usage: ./dry-dock logs [-f] <NAME>\n");
+            return 1;
+        }
+        print_logs(argv[2 + follow], follow);
+    }
+    else if (strcmp(argv[1], "update") == 0) {
+        update_container(argv + 2, argc - 2);
+    }
+    else if (strcmp(argv[1], "events") == 0) {
+        print_events();
     }
     else {
         fprintf(stderr, "Unrecognized command\n");
@@ -52,15 +120,14 @@ int main(int argc, char **argv) {
 }
 
 
-int connect_and_verify_server() {
+int connect_over_tcp() {
     /**
-     *  tries to connect to dry-dock server, verifies it is the correct server with an initial message
+     * tries to connect to dry-dock server over TCP, read_response checks it is the correct server
      * return:
      * 0 on success, sets SOCKFD to the TCP socket
      * -1 on connect error
-     * -2 on server exists but did not pass verification
     **/
-    struct addrinfo hints, *servinfo;
+    struct addrinfo hints, *servinfo, *p;
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
@@ -70,32 +137,51 @@ int connect_and_verify_server() {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
         return -1;
     }
-    if ((SOCKFD = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol)) == -1) {
-        perror("socket");
-        return -1;
-    }
-    if (connect(SOCKFD, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
+    // Loopback can resolve to both ::1 and 127.0.0.1, the server only needs to be on one of them.
+    for (p = servinfo; p; p = p->ai_next) {
+        if ((SOCKFD = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+            continue;
+        if (connect(SOCKFD, p->ai_addr, p->ai_addrlen) == 0)
+            break;
         close(SOCKFD);
+        SOCKFD = -1;
+    }
+    if (SOCKFD == -1) {
+        freeaddrinfo(servinfo);
         perror("client: connect");
         return -1;
     }
     freeaddrinfo(servinfo); servinfo = NULL;
-    if (write_all_to_socket(SOCKFD, VERIFICATION_MESSAGE, strlen(VERIFICATION_MESSAGE))) {
-        fprintf(stderr, "Could not write verification message to server\n");
-        return -2;
-    }
-    int vr_len = strlen(VERIFICATION_RESPONSE);
-    char buf[vr_len];
-    int read;
-    if ((read = read_all_from_socket(SOCKFD, buf, vr_len) != vr_len) || strncmp(buf, VERIFICATION_RESPONSE, vr_len) != 0) {
-        fprintf(stderr, "Did not receive proper response from server\n");
-        return -2;
-    }
     return 0;
 }
 
 
-void initialize_server() {
+int connect_to_server() {
+    /**
+     * connects over the Unix socket if the server has one, where it checks who we are with SO_PEERCRED and
+     * the server's preface is only a formality, and over TCP otherwise, where only stats is served, then queues
+     * our preface on CONN
+     * return:
+     * 0 on success, sets SOCKFD, -1 on error
+    **/
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", DRYDOCK_SOCKET_PATH);
+    if ((SOCKFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) != -1) {
+        if (connect(SOCKFD, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+            USING_UNIX_SOCKET = 1;
+        else {
+            close(SOCKFD);
+            SOCKFD = -1;
+        }
+    }
+    if (!USING_UNIX_SOCKET && connect_over_tcp() != 0)
+        return -1;
+    io_init(&CONN, SOCKFD);
+    return io_queue(&CONN, PROTOCOL_PREFACE, strlen(PROTOCOL_PREFACE));
+}
+
+
+void initialize_server(char **server_args) {
     // replace process image with the servers
     pid_t child = fork();
     if (child == -1) {
@@ -103,7 +189,9 @@ void initialize_server() {
         exit(1);
     }
     else if (child == 0) {
-        execlp(SERVER_PATH, SERVER_PATH);
+        // server_args[0] is "init", which stands in for the server's argv[0]
+        server_args[0] = SERVER_PATH;
+        execv(SERVER_PATH, server_args);
         // should never get here
         exit(1);
     }
@@ -112,14 +200,424 @@ void initialize_server() {
 
 
 void destroy_server() {
-    if (connect_and_verify_server() != 0) {
+    frame_header_t header = { .type = FRAME_DESTROY };
+    if (connect_to_server() != 0 || io_queue_frame(&CONN, &header, NULL) != 0 || send_request(NULL, 0) != 0) {
         fprintf(stderr, "Cannot destroy server\n");
         exit(1);
     }
-    write_all_to_socket(SOCKFD, DESTROY_MESSAGE, strlen(DESTROY_MESSAGE));
 }
 
 
-void create_container() {
-    
+int send_request(const int *fds, int num_fds) {
+    /**
+     * sends everything queued on CONN, the preface and the request frames, passing the server fds if there are
+     * any
+     * return:
+     * 0 on success, -1 on error
+    **/
+    if (num_fds > 0 && !USING_UNIX_SOCKET) {
+        fprintf(stderr, "Passing file descriptors needs the server's Unix socket at %s\n", DRYDOCK_SOCKET_PATH);
+        return -1;
+    }
+    // The fds go with the first byte, ahead of the request that takes them.
+    io_attach_fds(&CONN, fds, num_fds);
+    if (io_flush_all(&CONN) != 0) {
+        perror("Could not send request to server");
+        return -1;
+    }
+    return 0;
+}
+
+
+int read_response(frame_header_t *header, char *text) {
+    /**
+     * reads the next response into header and text, which has room for MAX_RESPONSE_SIZE + 1 bytes and is left
+     * NUL terminated
+     * return:
+     * 0 on success, -1 on error
+    **/
+    if (!PREFACE_CHECKED) {
+        int preface_len = strlen(PROTOCOL_PREFACE);
+        if (io_wait_readable(&CONN, preface_len) != 0 || strncmp(io_peek(&CONN), PROTOCOL_PREFACE, preface_len) != 0) {
+            fprintf(stderr, "Did not receive proper response from server\n");
+            return -1;
+        }
+        io_consume(&CONN, preface_len);
+        PREFACE_CHECKED = 1;
+    }
+    int len = io_read_frame(&CONN, header, text, MAX_RESPONSE_SIZE);
+    if (len == -1) {
+        fprintf(stderr, "Lost the connection to the server\n");
+        return -1;
+    }
+    text[len] = '\0';
+    return 0;
+}
+
+
+void create_containers(char **containerfile_paths, int count, int attach) {
+    // One frame, a batch if there is more than one containerfile, and the responses come back as each finishes.
+    char **paths = calloc(count, sizeof(char *));
+    if (!paths) {
+        perror("calloc");
+        exit(1);
+    }
+    frame_header_t batch = { .type = FRAME_BATCH };
+    for (int i = 0; i < count; i++) {
+        // The server does not share our working directory.
+        if (!(paths[i] = realpath(containerfile_paths[i], NULL))) {
+            perror(containerfile_paths[i]);
+            exit(1);
+        }
+        batch.length += sizeof(frame_header_t) + strlen(paths[i]);
+    }
+    if (connect_to_server() != 0 || (count > 1 && io_queue(&CONN, &batch, sizeof(batch)) != 0)) {
+        fprintf(stderr, "Cannot reach server\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        frame_header_t header = {
+            .length = strlen(paths[i]),
+            .id = i,
+            .type = FRAME_CREATE,
+            .num_fds = attach ? 4 : 0,
+        };
+        if (io_queue_frame(&CONN, &header, paths[i]) != 0) {
+            perror("io_queue_frame");
+            exit(1);
+        }
+    }
+
+    // With -a the container gets our stdio as is and writes its command's wait status into the pipe once it
+    // exits. Only the container runtime holds the write end once we have sent it, so EOF means it went away.
+    int status_pipe[2] = { -1, -1 };
+    if (attach && pipe2(status_pipe, O_CLOEXEC) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    int fds[] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, status_pipe[1] };
+    int result = send_request(fds, attach ? 4 : 0);
+    if (attach)
+        close(status_pipe[1]);
+    if (result != 0)
+        exit(1);
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        frame_header_t header;
+        char text[MAX_RESPONSE_SIZE + 1];
+        if (read_response(&header, text) != 0)
+            exit(1);
+        if (count > 1 && header.id < (uint32_t) count)
+            printf("%s: ", paths[header.id]);
+        fputs(text, stdout);
+        failed |= header.type != FRAME_OK;
+    }
+    close(SOCKFD);
+    if (failed)
+        exit(1);
+    if (!attach)
+        return;
+    fflush(stdout);
+    int status;
+    ssize_t got;
+    while ((got = read(status_pipe[0], &status, sizeof(status))) == -1 && errno == EINTR) {}
+    if (got != sizeof(status)) {
+        fprintf(stderr, "Container exited without reporting a status\n");
+        exit(1);
+    }
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+}
+
+
+void create_many(const char *containerfile_path, uint32_t count) {
+    // The server reads the containerfile once and launches them in parallel. Each name is printed as soon as it
+    // arrives, flushed so whoever reads our output can start using that container.
+    char *path = realpath(containerfile_path, NULL);
+    if (!path) {
+        perror(containerfile_path);
+        exit(1);
+    }
+    frame_header_t header = { .length = sizeof(count) + strlen(path), .type = FRAME_CREATE_MANY };
+    if (connect_to_server() != 0 || io_queue(&CONN, &header, sizeof(header)) != 0 ||
+        io_queue(&CONN, &count, sizeof(count)) != 0 || io_queue(&CONN, path, strlen(path)) != 0) {
+        fprintf(stderr, "Cannot reach server\n");
+        exit(1);
+    }
+    if (send_request(NULL, 0) != 0)
+        exit(1);
+    char text[MAX_RESPONSE_SIZE + 1];
+    do {
+        if (read_response(&header, text) != 0)
+            exit(1);
+        fputs(text, stdout);
+        fflush(stdout);
+    } while (header.type == FRAME_PROGRESS);
+    close(SOCKFD);
+    free(path);
+    if (header.type != FRAME_OK)
+        exit(1);
+}
+
+
+void print_stats() {
+    frame_header_t header = { .type = FRAME_STATS };
+    char text[MAX_RESPONSE_SIZE + 1];
+    if (connect_to_server() != 0 || io_queue_frame(&CONN, &header, NULL) != 0) {
+        fprintf(stderr, "Cannot reach server\n");
+        exit(1);
+    }
+    if (send_request(NULL, 0) != 0 || read_response(&header, text) != 0)
+        exit(1);
+    fputs(text, stdout);
+    close(SOCKFD);
+    if (header.type != FRAME_OK)
+        exit(1);
+}
+
+
+void print_events() {
+    // The server keeps sending until we hang up, each line flushed so it can be piped into something watching.
+    frame_header_t header = { .type = FRAME_EVENTS };
+    char text[MAX_RESPONSE_SIZE + 1];
+    if (connect_to_server() != 0 || io_queue_frame(&CONN, &header, NULL) != 0) {
+        fprintf(stderr, "Cannot reach server\n");
+        exit(1);
+    }
+    if (send_request(NULL, 0) != 0)
+        exit(1);
+    do {
+        if (read_response(&header, text) != 0)
+            exit(1);
+        fputs(text, header.type == FRAME_ERROR ? stderr : stdout);
+        fflush(stdout);
+    } while (header.type == FRAME_PROGRESS);
+    close(SOCKFD);
+    exit(1);
+}
+
+
+static void format_bytes(int64_t bytes, char *buf, size_t len) {
+    if (bytes < 0)
+        snprintf(buf, len, "-");
+    else
+        snprintf(buf, len, "%.1fM", bytes / 1048576.0);
+}
+
+void print_containers() {
+    // Straight from the table the server publishes, no locks are taken and the server never knows we looked.
+    int fd = open(TABLE_PATH, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(table_header_t)) {
+        fprintf(stderr, "No container table at %s, is the server running?\n", TABLE_PATH);
+        exit(1);
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    table_header_t *header = base;
+    if (header->magic != TABLE_MAGIC || header->row_size != sizeof(table_row_t) ||
+        sizeof(table_header_t) + (size_t) header->capacity * sizeof(table_row_t) > (size_t) st.st_size) {
+        fprintf(stderr, "%s is not a container table this client understands\n", TABLE_PATH);
+        exit(1);
+    }
+    // A server that was killed never got to say so.
+    if (!__atomic_load_n(&header->live, __ATOMIC_ACQUIRE) || (kill(header->server_pid, 0) == -1 && errno == ESRCH)) {
+        fprintf(stderr, "The server that published %s has stopped\n", TABLE_PATH);
+        exit(1);
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    double now = ts.tv_sec + ts.tv_nsec / 1e9;
+    printf("%-20s %8s %8s %6s %6s %17s %9s %5s %6s %-20s  %-22s %s\n", "NAME", "PID", "UP", "CPU%", "CPUS", "MEMORY",
+           "PIDS", "NODE", "LOCAL", "STALLED", "NETNS", "ROOTFS");
+    uint32_t rows = __atomic_load_n(&header->rows, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < rows && i < header->capacity; i++) {
+        table_row_t row;
+        if (!table_read_row(table_row(base, i), &row))
+            continue;
+        char up[16], cpus[16], usage[16], limit[16], pids[24], memory[40], node[16], local[16], stalled[64];
+        snprintf(up, sizeof(up), "%.0fs", now > row.created ? now - row.created : 0.0);
+        if (row.cpu_limit < 0)
+            snprintf(cpus, sizeof(cpus), "-");
+        else
+            snprintf(cpus, sizeof(cpus), "%.2f", row.cpu_limit);
+        format_bytes(row.mem_usage, usage, sizeof(usage));
+        format_bytes(row.mem_limit, limit, sizeof(limit));
+        snprintf(memory, sizeof(memory), "%s/%s", usage, limit);
+        if (row.pids < 0)
+            snprintf(pids, sizeof(pids), "-");
+        else if (row.pids_limit < 0)
+            snprintf(pids, sizeof(pids), "%lld/-", (long long) row.pids);
+        else
+            snprintf(pids, sizeof(pids), "%lld/%lld", (long long) row.pids, (long long) row.pids_limit);
+        // A container that floats shows the node most of its memory is on, marked with a ~.
+        if (row.numa_home < 0)
+            snprintf(node, sizeof(node), "-");
+        else
+            snprintf(node, sizeof(node), "%s%d", row.numa_node < 0 ? "~" : "", row.numa_home);
+        if (row.numa_local < 0)
+            snprintf(local, sizeof(local), "-");
+        else
+            snprintf(local, sizeof(local), "%.0f%%", row.numa_local);
+        // What it has stalled on lately, with how much of the last 10 s it spent stalled.
+        int used = 0;
+        for (int r = 0; r < TABLE_PRESSURE_RESOURCES; r++) {
+            if (row.stalled_at[r] > 0 && now - row.stalled_at[r] < STALLED_RECENTLY_S)
+                used += snprintf(stalled + used, sizeof(stalled) - used, "%s%s:%.0f%%", used ? " " : "",
+                                 RESOURCE_NAMES[r], row.stall_avg10[r]);
+        }
+        if (used == 0)
+            snprintf(stalled, sizeof(stalled), "-");
+        printf("%-20s %8d %8s %6.1f %6s %17s %9s %5s %6s %-20s  %-22s %s%s\n", row.name, row.pid, up, row.cpu_percent,
+               cpus, memory, pids, node, local, stalled, row.netns[0] ? row.netns : "-", row.rootfs,
+               row.reattached ? " (re-attached)" : "");
+    }
+    munmap(base, st.st_size);
+}
+
+
+static int copy_to_stdout(int fd, loff_t *offset, size_t len) {
+    /**
+     * copies len bytes of fd, from *offset if offset isn't NULL and to EOF if len is SIZE_MAX, to stdout in the
+     * kernel where it can, falling back on read and write for a stdout like a terminal that can't take it
+     * return:
+     * 0 on success, -1 on error
+    **/
+    bool in_kernel = true;
+    while (len > 0) {
+        size_t chunk = len < (1 << 20) ? len : (1 << 20);
+        ssize_t moved = -1;
+        if (in_kernel) {
+            moved = offset ? sendfile(STDOUT_FILENO, fd, offset, chunk) : splice(fd, NULL, STDOUT_FILENO, NULL, chunk, 0);
+            if (moved == -1 && errno == EINVAL) {
+                in_kernel = false;
+                continue;
+            }
+        }
+        else {
+            char buf[64 * 1024];
+            moved = offset ? pread(fd, buf, chunk < sizeof(buf) ? chunk : sizeof(buf), *offset)
+                           : read(fd, buf, chunk < sizeof(buf) ? chunk : sizeof(buf));
+            for (ssize_t written = 0, w; written < moved; written += w) {
+                if ((w = write(STDOUT_FILENO, buf + written, moved - written)) == -1)
+                    return -1;
+            }
+            if (moved > 0 && offset)
+                *offset += moved;
+        }
+        if (moved == -1 && errno == EINTR)
+            continue;
+        if (moved <= 0)
+            return moved == 0 ? 0 : -1;
+        if (len != SIZE_MAX)
+            len -= moved;
+    }
+    return 0;
+}
+
+
+void print_logs(const char *name, uint32_t follow) {
+    // The server hands over the log itself and, to follow it, a pipe that carries on where the log ends, so the
+    // output never passes through the server and this reads it as fast as the kernel can copy it.
+    frame_header_t header = { .length = sizeof(follow) + strlen(name), .type = FRAME_LOGS };
+    char text[MAX_RESPONSE_SIZE + 1];
+    if (connect_to_server() != 0 || io_queue(&CONN, &header, sizeof(header)) != 0 ||
+        io_queue(&CONN, &follow, sizeof(follow)) != 0 || io_queue(&CONN, name, strlen(name)) != 0) {
+        fprintf(stderr, "Cannot reach server\n");
+        exit(1);
+    }
+    if (send_request(NULL, 0) != 0 || read_response(&header, text) != 0)
+        exit(1);
+    if (header.type != FRAME_OK) {
+        fputs(text, stderr);
+        exit(1);
+    }
+    int fds[2] = { -1, -1 };
+    if (header.num_fds < 1 || header.num_fds > 2 || io_take_fds(&CONN, fds, header.num_fds) != header.num_fds) {
+        fprintf(stderr, "Server did not send the log\n");
+        exit(1);
+    }
+    close(SOCKFD);
+    loff_t offset = 0;
+    loff_t end = strtoll(text + strlen("OK "), NULL, 10);
+    if (copy_to_stdout(fds[0], &offset, end) != 0 || (fds[1] != -1 && copy_to_stdout(fds[1], NULL, SIZE_MAX) != 0)) {
+        perror("Could not print the log");
+        exit(1);
+    }
+}
+
+
+static int parse_limit(const char *value, const char *units, bool fractions, double *limit) {
+    /**
+     * reads a limit, "max" for none, with an optional K, M or G suffix if units allows it. Without a suffix it
+     * has to be a whole number unless fractions allows it
+     * return:
+     * 0 on success, -1 if it isn't one
+    **/
+    if (strcmp(value, "max") == 0) {
+        *limit = UPDATE_UNLIMITED;
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    *limit = strtod(value, &end);
+    if (errno || end == value || *limit < 0)
+        return -1;
+    const char *unit = *end ? strchr(units, *end) : NULL;
+    if (unit)
+        *limit *= 1 << (10 * (unit - units + 1));
+    else if (!fractions && *limit != (long long) *limit)
+        return -1;
+    return *end && (!unit || end[1]) ? -1 : 0;
+}
+
+
+void update_container(char **args, int count) {
+    // Everything not given is left as it is, but something has to be given and every flag needs its value.
+    update_request_t request = { .mem_limit = UPDATE_KEEP, .pid_limit = UPDATE_KEEP, .cpus = UPDATE_KEEP };
+    if (count < 3 || count % 2 == 0) {
+        fprintf(stderr, "Usage: ./dry-dock update <NAME> [--mem <BYTES[K|M|G]|max>] [--cpu <CPUS|max>] "
+                        "[--pids <COUNT|max>]\n"
+                        "       at least one of --mem, --cpu and --pids, each with a value\n");
+        exit(1);
+    }
+    if (strlen(args[0]) >= sizeof(request.name)) {
+        fprintf(stderr, "No container is called %s\n", args[0]);
+        exit(1);
+    }
+    snprintf(request.name, sizeof(request.name), "%s", args[0]);
+    for (int i = 1; i + 1 < count; i += 2) {
+        double limit;
+        int bad;
+        if (strcmp(args[i], "--mem") == 0 && !(bad = parse_limit(args[i + 1], "KMG", false, &limit)))
+            request.mem_limit = limit;
+        else if (strcmp(args[i], "--pids") == 0 && !(bad = parse_limit(args[i + 1], "", false, &limit)))
+            request.pid_limit = limit;
+        else if (strcmp(args[i], "--cpu") == 0 && !(bad = parse_limit(args[i + 1], "", true, &limit)))
+            request.cpus = limit;
+        else
+            bad = 1;
+        if (bad) {
+            fprintf(stderr, "Bad %s %s\n", args[i], args[i + 1]);
+            exit(1);
+        }
+    }
+
+    frame_header_t header = { .length = sizeof(request), .type = FRAME_UPDATE };
+    char text[MAX_RESPONSE_SIZE + 1];
+    if (connect_to_server() != 0 || io_queue_frame(&CONN, &header, &request) != 0) {
+        fprintf(stderr, "Cannot reach server\n");
+        exit(1);
+    }
+    if (send_request(NULL, 0) != 0 || read_response(&header, text) != 0)
+        exit(1);
+    fputs(text, header.type == FRAME_OK ? stdout : stderr);
+    close(SOCKFD);
+    if (header.type != FRAME_OK)
+        exit(1);
 }
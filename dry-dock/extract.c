@@ -0,0 +1,1134 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "extract.h"
+
+#define TAR_BLOCK 512
+#define READ_CHUNK (256 * 1024)
+
+// Files up to this size are read into memory and written by a worker, bigger ones are streamed straight to
+// disk by the reader so memory use stays bounded.
+#define EXTRACT_SMALL_FILE (4 << 20)
+// How much file data may be waiting on the workers before the reader stops to let them catch up.
+#define EXTRACT_MAX_IN_FLIGHT (64 << 20)
+#define EXTRACT_MAX_QUEUED 4096
+// Buckets for counting the paths of queued files, a collision only costs waiting on the workers when we needn't.
+#define EXTRACT_PENDING_SLOTS 8192
+
+#define WHITEOUT_PREFIX ".wh."
+#define OPAQUE_WHITEOUT ".wh..wh..opq"
+
+typedef struct {
+    int fd;
+    bool gzip;
+    bool gzip_ended;        // finished a gzip member, there may be another one concatenated after it
+    z_stream z;
+    unsigned char in[READ_CHUNK];
+    size_t in_pos;          // plain tarballs only, what is left of the bytes read while sniffing the format
+    size_t in_len;
+    uint64_t compressed_bytes;
+} stream_t;
+
+typedef struct {
+    char path[PATH_MAX];
+    char link[PATH_MAX];
+    char type;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    uint64_t size;
+    dev_t dev;
+    char blob[PATH_MAX];    // a regular file from the layer store, its contents are in this blob
+    uint64_t blob_size;
+} tar_entry_t;
+
+typedef struct job {
+    struct job *next;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    size_t size;
+    char *path;             // points just past data
+    char data[];
+} job_t;
+
+typedef struct {
+    char *path;
+    char *target;
+} hardlink_t;
+
+typedef struct {
+    char *path;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+} dir_fixup_t;
+
+typedef struct {
+    int root_fd;
+    int blob_dir_fd;        // -1 unless the tarballs come from the layer store
+    mode_t umask;
+    uid_t euid;
+    gid_t egid;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t room;    // a job finished, for the reader waiting on the queue to drain
+    job_t *head;
+    job_t *tail;
+    size_t queued_bytes;    // includes jobs being written right now
+    int queued_jobs;
+    bool closing;
+    int error;              // first errno a worker hit
+    // Queued files by a hash of their path, and by a hash of each directory above them.
+    uint16_t pending_paths[EXTRACT_PENDING_SLOTS];
+    uint16_t pending_dirs[EXTRACT_PENDING_SLOTS];
+    pthread_t workers[EXTRACT_MAX_WORKERS];
+    int num_workers;
+
+    // Hard links wait until the files they point at have been written, and directories get their real mode
+    // and mtime at the end since creating files in them changes their mtime and a read-only mode would stop us.
+    hardlink_t *hardlinks;
+    size_t num_hardlinks;
+    size_t hardlinks_cap;
+    dir_fixup_t *dirs;
+    size_t num_dirs;
+    size_t dirs_cap;
+
+    extract_stats_t *stats;
+} extractor_t;
+
+static int open_beneath(int root_fd, const char *path, int flags, mode_t mode) {
+    // RESOLVE_IN_ROOT treats root_fd as /, so absolute symlinks in the image resolve the way they will once the
+    // container is chrooted and nothing can point us outside of it.
+    struct open_how how = {
+        .flags = flags | O_CLOEXEC,
+        .mode = flags & O_CREAT ? mode : 0,
+        .resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS,
+    };
+    return syscall(SYS_openat2, root_fd, path[0] ? path : ".", &how, sizeof(how));
+}
+
+static int empty_dir(int dir_fd);
+
+static bool single_component(const char *name) {
+    return name[0] && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && !strchr(name, '/');
+}
+
+static int remove_entry(int dir_fd, const char *name) {
+    // Only ever something directly inside dir_fd, "." or ".." would empty the directory holding it.
+    if (!single_component(name)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (unlinkat(dir_fd, name, 0) == 0 || errno == ENOENT)
+        return 0;
+    if (errno != EISDIR)
+        return -1;
+    struct open_how how = {
+        .flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS,
+    };
+    int fd = syscall(SYS_openat2, dir_fd, name, &how, sizeof(how));
+    if (fd == -1)
+        return -1;
+    if (empty_dir(fd) == -1)
+        return -1;
+    return unlinkat(dir_fd, name, AT_REMOVEDIR);
+}
+
+static int empty_dir(int dir_fd) {
+    // Takes ownership of dir_fd.
+    DIR *dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return -1;
+    }
+    int result = 0;
+    struct dirent *d;
+    while ((d = readdir(dir))) {
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+            continue;
+        if (remove_entry(dirfd(dir), d->d_name) == -1)
+            result = -1;
+    }
+    closedir(dir);
+    return result;
+}
+
+static int make_dirs(extractor_t *x, char *path);
+
+static int open_parent(extractor_t *x, char *path, const char **base) {
+    /**
+     * opens the directory holding path, creating it and anything above it that is missing
+     * return:
+     * a directory fd with *base pointing at path's last component, or -1 on error
+    **/
+    char *slash = strrchr(path, '/');
+    if (!slash) {
+        *base = path;
+        return open_beneath(x->root_fd, "", O_PATH | O_DIRECTORY, 0);
+    }
+    *slash = '\0';
+    *base = slash + 1;
+    int fd = open_beneath(x->root_fd, path, O_PATH | O_DIRECTORY, 0);
+    // Tarballs don't always list a directory before what is in it.
+    if (fd == -1 && errno == ENOENT && make_dirs(x, path) == 0)
+        fd = open_beneath(x->root_fd, path, O_PATH | O_DIRECTORY, 0);
+    *slash = '/';
+    return fd;
+}
+
+static int make_dirs(extractor_t *x, char *path) {
+    const char *base;
+    int fd = open_parent(x, path, &base);
+    if (fd == -1)
+        return -1;
+    int result = mkdirat(fd, base, 0755);
+    close(fd);
+    return result == -1 && errno != EEXIST ? -1 : 0;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static int create_file(extractor_t *x, char *path, mode_t mode) {
+    // The common case, a new file in a directory that already exists, is a single openat2.
+    int fd = open_beneath(x->root_fd, path, O_WRONLY | O_CREAT | O_EXCL, mode & 0777);
+    if (fd != -1 || (errno != EEXIST && errno != ENOENT))
+        return fd;
+    const char *base;
+    int dir_fd = open_parent(x, path, &base);
+    if (dir_fd == -1)
+        return -1;
+    fd = openat(dir_fd, base, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, mode & 0777);
+    // Whatever a lower layer had here gets replaced, not written through, it might be a link to something else.
+    if (fd == -1 && errno == EEXIST && remove_entry(dir_fd, base) == 0)
+        fd = openat(dir_fd, base, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, mode & 0777);
+    close(dir_fd);
+    return fd;
+}
+
+static int finish_file(extractor_t *x, int fd, mode_t created_mode, mode_t mode, uid_t uid, gid_t gid,
+                       time_t mtime) {
+    // Closes fd. Only makes the calls that change something, most images are all root owned plain modes.
+    int result = 0;
+    if ((uid != x->euid || gid != x->egid) && fchown(fd, uid, gid) == -1)
+        result = -1;
+    // fchown clears setuid bits, so the mode goes on after it.
+    if (mode != (created_mode & ~x->umask) && fchmod(fd, mode) == -1)
+        result = -1;
+    struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, { .tv_sec = mtime } };
+    if (futimens(fd, times) == -1)
+        result = -1;
+    if (close(fd) == -1)
+        result = -1;
+    return result;
+}
+
+static int write_job(extractor_t *x, job_t *job) {
+    int fd = create_file(x, job->path, job->mode);
+    if (fd == -1)
+        return -1;
+    if (write_all(fd, job->data, job->size) == -1) {
+        close(fd);
+        return -1;
+    }
+    return finish_file(x, fd, job->mode & 0777, job->mode, job->uid, job->gid, job->mtime);
+}
+
+static void count_pending(extractor_t *x, const char *path, int delta) {
+    // Called with x->lock held. FNV-1a, so the hash so far at each / is the hash of that directory.
+    uint32_t hash = 2166136261u;
+    for (const char *p = path; *p; p++) {
+        if (*p == '/')
+            x->pending_dirs[hash % EXTRACT_PENDING_SLOTS] += delta;
+        hash = (hash ^ (unsigned char) *p) * 16777619u;
+    }
+    x->pending_paths[hash % EXTRACT_PENDING_SLOTS] += delta;
+}
+
+static bool is_pending(extractor_t *x, const char *path, bool below) {
+    // Whether a queued file may be at path or at a directory above it, or with below, anywhere under it.
+    uint32_t hash = 2166136261u;
+    bool pending = false;
+    pthread_mutex_lock(&x->lock);
+    for (const char *p = path; *p && !pending; p++) {
+        if (*p == '/')
+            pending = x->pending_paths[hash % EXTRACT_PENDING_SLOTS] > 0;
+        hash = (hash ^ (unsigned char) *p) * 16777619u;
+    }
+    pending = pending || x->pending_paths[hash % EXTRACT_PENDING_SLOTS] > 0 ||
+              (below && x->pending_dirs[hash % EXTRACT_PENDING_SLOTS] > 0);
+    pthread_mutex_unlock(&x->lock);
+    return pending;
+}
+
+static void *worker(void *arg) {
+    extractor_t *x = arg;
+    pthread_mutex_lock(&x->lock);
+    while (true) {
+        while (!x->head && !x->closing)
+            pthread_cond_wait(&x->work_ready, &x->lock);
+        if (!x->head)
+            break;
+        job_t *job = x->head;
+        x->head = job->next;
+        if (!x->head)
+            x->tail = NULL;
+        pthread_mutex_unlock(&x->lock);
+
+        int error = write_job(x, job) == -1 ? errno : 0;
+        if (error)
+            fprintf(stderr, "extract %s: %s\n", job->path, strerror(error));
+
+        pthread_mutex_lock(&x->lock);
+        if (error && !x->error)
+            x->error = error;
+        x->queued_bytes -= job->size;
+        x->queued_jobs--;
+        count_pending(x, job->path, -1);
+        pthread_cond_signal(&x->room);
+        free(job);
+    }
+    pthread_mutex_unlock(&x->lock);
+    return NULL;
+}
+
+static int queue_job(extractor_t *x, job_t *job) {
+    pthread_mutex_lock(&x->lock);
+    while (!x->error && x->queued_jobs > 0 &&
+           (x->queued_bytes + job->size > EXTRACT_MAX_IN_FLIGHT || x->queued_jobs >= EXTRACT_MAX_QUEUED))
+        pthread_cond_wait(&x->room, &x->lock);
+    int error = x->error;
+    if (!error) {
+        job->next = NULL;
+        if (x->tail)
+            x->tail->next = job;
+        else
+            x->head = job;
+        x->tail = job;
+        x->queued_bytes += job->size;
+        x->queued_jobs++;
+        count_pending(x, job->path, 1);
+        pthread_cond_signal(&x->work_ready);
+    }
+    pthread_mutex_unlock(&x->lock);
+    if (error) {
+        free(job);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+static int drain(extractor_t *x) {
+    // Waits for every queued file to be written.
+    pthread_mutex_lock(&x->lock);
+    while (x->queued_jobs > 0)
+        pthread_cond_wait(&x->room, &x->lock);
+    int error = x->error;
+    pthread_mutex_unlock(&x->lock);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+static int stream_open(stream_t *s, const char *path) {
+    memset(s, 0, sizeof(*s));
+    s->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (s->fd == -1) {
+        perror("open tarball");
+        return -1;
+    }
+    posix_fadvise(s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    ssize_t got = read(s->fd, s->in, sizeof(s->in));
+    if (got == -1) {
+        perror("read tarball");
+        close(s->fd);
+        return -1;
+    }
+    s->compressed_bytes = got;
+    s->gzip = got >= 2 && s->in[0] == 0x1f && s->in[1] == 0x8b;
+    if (!s->gzip) {
+        s->in_len = got;
+        return 0;
+    }
+    s->z.next_in = s->in;
+    s->z.avail_in = got;
+    // 16 + MAX_WBITS asks zlib for the gzip wrapper rather than the zlib one.
+    if (inflateInit2(&s->z, 16 + MAX_WBITS) != Z_OK) {
+        fprintf(stderr, "inflateInit2 failed\n");
+        close(s->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void stream_close(stream_t *s) {
+    if (s->gzip)
+        inflateEnd(&s->z);
+    close(s->fd);
+}
+
+static ssize_t stream_read(stream_t *s, void *buf, size_t len) {
+    /**
+     * reads up to len bytes of tar, inflating straight into buf
+     * return:
+     * bytes read, 0 at the end of the tarball, -1 on error
+    **/
+    if (!s->gzip) {
+        if (s->in_pos < s->in_len) {
+            size_t take = s->in_len - s->in_pos < len ? s->in_len - s->in_pos : len;
+            memcpy(buf, s->in + s->in_pos, take);
+            s->in_pos += take;
+            return take;
+        }
+        ssize_t got = read(s->fd, buf, len);
+        if (got > 0)
+            s->compressed_bytes += got;
+        return got;
+    }
+
+    s->z.next_out = buf;
+    s->z.avail_out = len;
+    while (s->z.avail_out > 0) {
+        if (s->z.avail_in == 0) {
+            ssize_t got = read(s->fd, s->in, sizeof(s->in));
+            if (got == -1)
+                return -1;
+            if (got == 0) {
+                if (!s->gzip_ended) {
+                    fprintf(stderr, "tarball is truncated\n");
+                    errno = EIO;
+                    return -1;
+                }
+                break;
+            }
+            s->compressed_bytes += got;
+            s->z.next_in = s->in;
+            s->z.avail_in = got;
+        }
+        if (s->gzip_ended) {
+            // gzip allows members to be concatenated, the output is all of them back to back.
+            inflateReset(&s->z);
+            s->gzip_ended = false;
+        }
+        int rc = inflate(&s->z, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END) {
+            s->gzip_ended = true;
+        }
+        else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            fprintf(stderr, "inflate: %s\n", s->z.msg ? s->z.msg : "corrupt data");
+            errno = EIO;
+            return -1;
+        }
+    }
+    return len - s->z.avail_out;
+}
+
+static int stream_read_full(stream_t *s, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t got = stream_read(s, p, len);
+        if (got == 0) {
+            fprintf(stderr, "tarball is truncated\n");
+            errno = EIO;
+        }
+        if (got <= 0)
+            return -1;
+        p += got;
+        len -= got;
+    }
+    return 0;
+}
+
+static int stream_skip(stream_t *s, uint64_t len) {
+    char buf[64 * 1024];
+    while (len > 0) {
+        size_t take = len < sizeof(buf) ? len : sizeof(buf);
+        if (stream_read_full(s, buf, take) == -1)
+            return -1;
+        len -= take;
+    }
+    return 0;
+}
+
+static uint64_t padding(uint64_t size) {
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+static uint64_t parse_number(const char *field, size_t len) {
+    // GNU tar stores numbers too big for octal as big endian base-256 with the top bit set.
+    if ((unsigned char) field[0] & 0x80) {
+        uint64_t value = (unsigned char) field[0] & 0x7f;
+        for (size_t i = 1; i < len; i++)
+            value = value << 8 | (unsigned char) field[i];
+        return value;
+    }
+    uint64_t value = 0;
+    size_t i = 0;
+    while (i < len && field[i] == ' ')
+        i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value << 3 | (field[i] - '0');
+    return value;
+}
+
+static bool valid_checksum(const unsigned char *block) {
+    uint64_t expected = parse_number((const char *) block + 148, 8);
+    uint64_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += i >= 148 && i < 156 ? ' ' : block[i];
+    return sum == expected;
+}
+
+static int clean_path(const char *in, char *out, size_t len) {
+    /**
+     * turns a path from a tarball into one relative to the destination, dropping leading /s and ./s
+     * return:
+     * 0 on success, -1 if it has a .. in it or is too long
+    **/
+    size_t used = 0;
+    while (*in) {
+        const char *end = strchrnul(in, '/');
+        size_t part = end - in;
+        if (part == 2 && in[0] == '.' && in[1] == '.')
+            return -1;
+        if (part > 0 && !(part == 1 && in[0] == '.')) {
+            if (used + (used > 0) + part + 1 > len)
+                return -1;
+            if (used > 0)
+                out[used++] = '/';
+            memcpy(out + used, in, part);
+            used += part;
+        }
+        in = *end ? end + 1 : end;
+    }
+    out[used] = '\0';
+    return 0;
+}
+
+static int read_long_value(stream_t *s, uint64_t size, char *out, size_t len) {
+    // Body of a GNU long name entry, the name is NUL terminated inside it.
+    if (size >= len) {
+        fprintf(stderr, "tarball has a name longer than PATH_MAX\n");
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (stream_read_full(s, out, size) == -1 || stream_skip(s, padding(size)) == -1)
+        return -1;
+    out[size] = '\0';
+    return 0;
+}
+
+static int read_pax(stream_t *s, uint64_t size, tar_entry_t *next, uint64_t *file_size) {
+    // Records look like "<length> <key>=<value>\n". We only care about the ones that override the header.
+    if (size > (1 << 20)) {
+        fprintf(stderr, "tarball has an oversized pax header\n");
+        errno = EINVAL;
+        return -1;
+    }
+    char *records = malloc(size + 1);
+    if (!records || stream_read_full(s, records, size) == -1 || stream_skip(s, padding(size)) == -1) {
+        free(records);
+        return -1;
+    }
+    records[size] = '\0';
+    char *p = records;
+    while (p < records + size) {
+        char *key;
+        unsigned long record_len = strtoul(p, &key, 10);
+        if (record_len == 0 || *key != ' ' || p + record_len > records + size || p[record_len - 1] != '\n')
+            break;
+        key++;
+        p[record_len - 1] = '\0';
+        char *value = strchr(key, '=');
+        if (value) {
+            *value++ = '\0';
+            if (strcmp(key, "path") == 0)
+                snprintf(next->path, PATH_MAX, "%s", value);
+            else if (strcmp(key, "linkpath") == 0)
+                snprintf(next->link, PATH_MAX, "%s", value);
+            else if (strcmp(key, "size") == 0)
+                *file_size = strtoull(value, NULL, 10);
+            else if (strcmp(key, EXTRACT_BLOB_KEY) == 0)
+                snprintf(next->blob, PATH_MAX, "%s", value);
+            else if (strcmp(key, EXTRACT_BLOB_SIZE_KEY) == 0)
+                next->blob_size = strtoull(value, NULL, 10);
+        }
+        p += record_len;
+    }
+    free(records);
+    return 0;
+}
+
+static int append(void **array, size_t *count, size_t *cap, size_t elem_size) {
+    if (*count == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 64;
+        void *grown = realloc(*array, new_cap * elem_size);
+        if (!grown)
+            return -1;
+        *array = grown;
+        *cap = new_cap;
+    }
+    (*count)++;
+    return 0;
+}
+
+static int set_attributes_at(extractor_t *x, int dir_fd, const char *base, const tar_entry_t *entry) {
+    // For symlinks and device nodes, which we can't open to use the f* calls on.
+    if ((entry->uid != x->euid || entry->gid != x->egid) &&
+        fchownat(dir_fd, base, entry->uid, entry->gid, AT_SYMLINK_NOFOLLOW) == -1)
+        return -1;
+    if (entry->type != '2' && fchmodat(dir_fd, base, entry->mode, 0) == -1)
+        return -1;
+    struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, { .tv_sec = entry->mtime } };
+    return utimensat(dir_fd, base, times, AT_SYMLINK_NOFOLLOW);
+}
+
+static int make_node(extractor_t *x, tar_entry_t *entry) {
+    const char *base;
+    int dir_fd = open_parent(x, entry->path, &base);
+    if (dir_fd == -1)
+        return -1;
+    mode_t format = entry->type == '3' ? S_IFCHR : entry->type == '4' ? S_IFBLK : S_IFIFO;
+    int result = -1;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (entry->type == '2')
+            result = symlinkat(entry->link, dir_fd, base);
+        else
+            result = mknodat(dir_fd, base, format | (entry->mode & 0777), entry->dev);
+        if (result == 0 || errno != EEXIST || remove_entry(dir_fd, base) == -1)
+            break;
+    }
+    if (result == 0)
+        result = set_attributes_at(x, dir_fd, base, entry);
+    close(dir_fd);
+    return result;
+}
+
+static int make_dir(extractor_t *x, tar_entry_t *entry) {
+    if (entry->path[0]) {
+        const char *base;
+        int dir_fd = open_parent(x, entry->path, &base);
+        if (dir_fd == -1)
+            return -1;
+        int result = mkdirat(dir_fd, base, 0700);
+        if (result == -1 && errno == EEXIST) {
+            struct stat st;
+            result = fstatat(dir_fd, base, &st, AT_SYMLINK_NOFOLLOW);
+            if (result == 0 && !S_ISDIR(st.st_mode) && (result = remove_entry(dir_fd, base)) == 0)
+                result = mkdirat(dir_fd, base, 0700);
+        }
+        close(dir_fd);
+        if (result == -1)
+            return -1;
+    }
+    char *path = strdup(entry->path);
+    if (!path || append((void **) &x->dirs, &x->num_dirs, &x->dirs_cap, sizeof(dir_fixup_t)) == -1) {
+        free(path);
+        return -1;
+    }
+    x->dirs[x->num_dirs - 1] = (dir_fixup_t) {
+        .path = path, .mode = entry->mode, .uid = entry->uid, .gid = entry->gid, .mtime = entry->mtime,
+    };
+    return 0;
+}
+
+static int apply_whiteout(extractor_t *x, tar_entry_t *entry) {
+    // Whiteouts remove something a lower layer put there, which workers may still be writing.
+    if (drain(x) == -1)
+        return -1;
+    // Unlike everything else, a whiteout never creates the directories above it.
+    char *slash = strrchr(entry->path, '/');
+    const char *base = slash ? slash + 1 : entry->path;
+    if (slash)
+        *slash = '\0';
+    int dir_fd = open_beneath(x->root_fd, slash ? entry->path : "", O_PATH | O_DIRECTORY, 0);
+    if (slash)
+        *slash = '/';
+    // No lower layer has the directory, so there is nothing in it to remove.
+    if (dir_fd == -1)
+        return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+    int result;
+    if (strcmp(base, OPAQUE_WHITEOUT) == 0) {
+        // Marks a directory whose lower layer contents are all hidden. docker writes it straight after the
+        // directory itself, so there is nothing from this layer in there yet.
+        int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        result = fd == -1 ? -1 : empty_dir(fd);
+    }
+    else if (single_component(base + strlen(WHITEOUT_PREFIX))) {
+        result = remove_entry(dir_fd, base + strlen(WHITEOUT_PREFIX));
+    }
+    else {
+        fprintf(stderr, "tarball has a whiteout for %s, which is outside its directory\n", entry->path);
+        errno = EINVAL;
+        result = -1;
+    }
+    close(dir_fd);
+    return result;
+}
+
+static int write_large_file(extractor_t *x, stream_t *s, tar_entry_t *entry) {
+    int fd = create_file(x, entry->path, entry->mode);
+    if (fd == -1)
+        return -1;
+    char *buf = malloc(READ_CHUNK);
+    uint64_t left = entry->size;
+    while (buf && left > 0) {
+        size_t take = left < READ_CHUNK ? left : READ_CHUNK;
+        if (stream_read_full(s, buf, take) == -1 || write_all(fd, buf, take) == -1)
+            break;
+        left -= take;
+    }
+    free(buf);
+    if (left > 0) {
+        close(fd);
+        return -1;
+    }
+    return finish_file(x, fd, entry->mode & 0777, entry->mode, entry->uid, entry->gid, entry->mtime);
+}
+
+static int copy_blob(int fd, int blob_fd, uint64_t size) {
+    // A reflink shares the blob's extents, otherwise the kernel copies it without it passing through us.
+    if (ioctl(fd, FICLONE, blob_fd) == 0)
+        return 0;
+    loff_t in = 0, out = 0;
+    while (size > 0) {
+        ssize_t copied = copy_file_range(blob_fd, &in, fd, &out, size, 0);
+        if (copied == 0)
+            errno = EIO;
+        if (copied <= 0)
+            return -1;
+        size -= copied;
+    }
+    return 0;
+}
+
+static int clone_blob(extractor_t *x, tar_entry_t *entry) {
+    if (x->blob_dir_fd == -1) {
+        fprintf(stderr, "extract %s: names a blob but the tarball isn't from the layer store\n", entry->path);
+        errno = EINVAL;
+        return -1;
+    }
+    // The store checked the blob against its digest when it was imported, its size is all that is left to check.
+    struct open_how how = {
+        .flags = O_RDONLY | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS,
+    };
+    int blob_fd = syscall(SYS_openat2, x->blob_dir_fd, entry->blob, &how, sizeof(how));
+    struct stat st;
+    if (blob_fd == -1 || fstat(blob_fd, &st) == -1 || (uint64_t) st.st_size != entry->blob_size) {
+        if (blob_fd != -1) {
+            close(blob_fd);
+            errno = EBADMSG;
+        }
+        return -1;
+    }
+    int fd = create_file(x, entry->path, entry->mode);
+    if (fd == -1 || copy_blob(fd, blob_fd, entry->blob_size) == -1) {
+        close(blob_fd);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    close(blob_fd);
+    return finish_file(x, fd, entry->mode & 0777, entry->mode, entry->uid, entry->gid, entry->mtime);
+}
+
+static int extract_file(extractor_t *x, stream_t *s, tar_entry_t *entry) {
+    if (entry->blob[0])
+        return clone_blob(x, entry);
+    if (entry->size > EXTRACT_SMALL_FILE)
+        return write_large_file(x, s, entry);
+    size_t path_len = strlen(entry->path) + 1;
+    job_t *job = malloc(sizeof(job_t) + entry->size + path_len);
+    if (!job)
+        return -1;
+    job->mode = entry->mode;
+    job->uid = entry->uid;
+    job->gid = entry->gid;
+    job->mtime = entry->mtime;
+    job->size = entry->size;
+    job->path = job->data + entry->size;
+    memcpy(job->path, entry->path, path_len);
+    if (stream_read_full(s, job->data, entry->size) == -1) {
+        free(job);
+        return -1;
+    }
+    return queue_job(x, job);
+}
+
+static int defer_hardlink(extractor_t *x, tar_entry_t *entry) {
+    char target[PATH_MAX];
+    if (clean_path(entry->link, target, sizeof(target)) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    char *path = strdup(entry->path);
+    char *target_copy = strdup(target);
+    if (!path || !target_copy ||
+        append((void **) &x->hardlinks, &x->num_hardlinks, &x->hardlinks_cap, sizeof(hardlink_t)) == -1) {
+        free(path);
+        free(target_copy);
+        return -1;
+    }
+    x->hardlinks[x->num_hardlinks - 1] = (hardlink_t) { .path = path, .target = target_copy };
+    return 0;
+}
+
+static int make_hardlinks(extractor_t *x) {
+    int result = 0;
+    for (size_t i = 0; i < x->num_hardlinks; i++) {
+        hardlink_t *link = &x->hardlinks[i];
+        const char *base, *target_base;
+        int dir_fd = open_parent(x, link->path, &base);
+        int target_fd = open_parent(x, link->target, &target_base);
+        int rc = -1;
+        if (dir_fd != -1 && target_fd != -1) {
+            rc = linkat(target_fd, target_base, dir_fd, base, 0);
+            if (rc == -1 && errno == EEXIST && remove_entry(dir_fd, base) == 0)
+                rc = linkat(target_fd, target_base, dir_fd, base, 0);
+        }
+        if (rc == -1) {
+            fprintf(stderr, "extract %s: link to %s: %s\n", link->path, link->target, strerror(errno));
+            result = -1;
+        }
+        if (dir_fd != -1)
+            close(dir_fd);
+        if (target_fd != -1)
+            close(target_fd);
+        free(link->path);
+        free(link->target);
+    }
+    x->num_hardlinks = 0;
+    return result;
+}
+
+static int fix_dirs(extractor_t *x) {
+    int result = 0;
+    for (size_t i = 0; i < x->num_dirs; i++) {
+        dir_fixup_t *dir = &x->dirs[i];
+        int fd = open_beneath(x->root_fd, dir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW, 0);
+        // A later layer may have replaced it with something else, which is then not ours to fix.
+        if (fd != -1 && finish_file(x, fd, 0700, dir->mode, dir->uid, dir->gid, dir->mtime) == -1) {
+            fprintf(stderr, "extract %s/: %s\n", dir->path, strerror(errno));
+            result = -1;
+        }
+        free(dir->path);
+    }
+    x->num_dirs = 0;
+    return result;
+}
+
+static int extract_entry(extractor_t *x, stream_t *s, tar_entry_t *entry) {
+    const char *base = strrchr(entry->path, '/');
+    base = base ? base + 1 : entry->path;
+    if (strncmp(base, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0)
+        return apply_whiteout(x, entry) == -1 || stream_skip(s, entry->size) == -1 ? -1 : 0;
+    // The last entry for a path wins, so nothing is created where a worker has yet to write an earlier file, or
+    // above one. Only a directory can leave what is under it in place. Hard links wait for the workers anyway.
+    if (entry->type != '1' && is_pending(x, entry->path, entry->type != '5') && drain(x) == -1)
+        return -1;
+
+    bool regular = entry->type == '0' || entry->type == '\0' || entry->type == '7';
+    int result;
+    switch (entry->type) {
+    case '0':
+    case '\0':
+    case '7':
+        result = extract_file(x, s, entry);
+        break;
+    case '1':
+        result = defer_hardlink(x, entry);
+        break;
+    case '2':
+    case '3':
+    case '4':
+    case '6':
+        result = make_node(x, entry);
+        break;
+    case '5':
+        result = make_dir(x, entry);
+        break;
+    default:
+        fprintf(stderr, "extract %s: skipping unsupported entry type '%c'\n", entry->path, entry->type);
+        return stream_skip(s, entry->size);
+    }
+    if (result == -1) {
+        fprintf(stderr, "extract %s: %s\n", entry->path, strerror(errno));
+        return -1;
+    }
+    x->stats->entries++;
+    if (regular)
+        x->stats->bytes += entry->blob[0] ? entry->blob_size : entry->size;
+    // Regular files have already read their contents.
+    return regular ? 0 : stream_skip(s, entry->size);
+}
+
+static int extract_stream(extractor_t *x, stream_t *s) {
+    unsigned char block[TAR_BLOCK];
+    // What long name and pax headers say about the entry after them.
+    tar_entry_t next = { .path = "", .link = "", .blob = "" };
+    uint64_t pax_size = UINT64_MAX;
+    tar_entry_t entry;
+
+    while (true) {
+        if (stream_read_full(s, block, sizeof(block)) == -1)
+            return -1;
+        // The archive ends with zero blocks. Some writers stop after the first, so don't insist on two.
+        bool zero = true;
+        for (int i = 0; i < TAR_BLOCK && zero; i++)
+            zero = block[i] == 0;
+        if (zero)
+            return 0;
+        if (!valid_checksum(block)) {
+            fprintf(stderr, "not a tarball, or it is corrupt\n");
+            errno = EINVAL;
+            return -1;
+        }
+
+        const char *header = (const char *) block;
+        char type = header[156];
+        uint64_t size = parse_number(header + 124, 12);
+        if (type == 'L' || type == 'K') {
+            if (read_long_value(s, size, type == 'L' ? next.path : next.link, PATH_MAX) == -1)
+                return -1;
+            continue;
+        }
+        if (type == 'x') {
+            if (read_pax(s, size, &next, &pax_size) == -1)
+                return -1;
+            continue;
+        }
+        if (type == 'g') {
+            if (stream_skip(s, size + padding(size)) == -1)
+                return -1;
+            continue;
+        }
+
+        char name[PATH_MAX];
+        if (next.path[0])
+            snprintf(name, sizeof(name), "%s", next.path);
+        else if (memcmp(header + 257, "ustar", 5) == 0 && header[345])
+            snprintf(name, sizeof(name), "%.155s/%.100s", header + 345, header);
+        else
+            snprintf(name, sizeof(name), "%.100s", header);
+        if (clean_path(name, entry.path, sizeof(entry.path)) == -1) {
+            fprintf(stderr, "extract %s: refusing a path outside the rootfs\n", name);
+            errno = EINVAL;
+            return -1;
+        }
+        if (next.link[0])
+            snprintf(entry.link, sizeof(entry.link), "%s", next.link);
+        else
+            snprintf(entry.link, sizeof(entry.link), "%.100s", header + 157);
+        entry.type = type;
+        entry.mode = parse_number(header + 100, 8) & 07777;
+        entry.uid = parse_number(header + 108, 8);
+        entry.gid = parse_number(header + 116, 8);
+        entry.size = pax_size != UINT64_MAX ? pax_size : size;
+        entry.mtime = parse_number(header + 136, 12);
+        entry.dev = makedev(parse_number(header + 329, 8), parse_number(header + 337, 8));
+        snprintf(entry.blob, sizeof(entry.blob), "%s", next.blob);
+        entry.blob_size = next.blob_size;
+        // Links and device nodes claim no data even if the size field says otherwise.
+        if (type != '0' && type != '\0' && type != '7' && type != '5')
+            entry.size = 0;
+        uint64_t pad = padding(entry.size);
+        next.path[0] = next.link[0] = next.blob[0] = '\0';
+        next.blob_size = 0;
+        pax_size = UINT64_MAX;
+
+        if (extract_entry(x, s, &entry) == -1 || stream_skip(s, pad) == -1)
+            return -1;
+    }
+}
+
+int extract_tarballs(const char **paths, int num_paths, const char *dest, const char *blob_dir, int num_workers,
+                     extract_stats_t *stats) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(stats, 0, sizeof(*stats));
+
+    extractor_t x;
+    memset(&x, 0, sizeof(x));
+    x.stats = stats;
+    x.root_fd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (x.root_fd == -1) {
+        perror("open extract destination");
+        return -1;
+    }
+    x.blob_dir_fd = -1;
+    if (blob_dir && (x.blob_dir_fd = open(blob_dir, O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        perror("open blob directory");
+        close(x.root_fd);
+        return -1;
+    }
+    x.umask = umask(0);
+    umask(x.umask);
+    x.euid = geteuid();
+    x.egid = getegid();
+    pthread_mutex_init(&x.lock, NULL);
+    pthread_cond_init(&x.work_ready, NULL);
+    pthread_cond_init(&x.room, NULL);
+
+    if (num_workers <= 0)
+        num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers > EXTRACT_MAX_WORKERS)
+        num_workers = EXTRACT_MAX_WORKERS;
+    for (x.num_workers = 0; x.num_workers < num_workers; x.num_workers++) {
+        if (pthread_create(&x.workers[x.num_workers], NULL, worker, &x) != 0)
+            break;
+    }
+
+    int result = x.num_workers > 0 ? 0 : -1;
+    for (int i = 0; i < num_paths && result == 0; i++) {
+        stream_t *s = malloc(sizeof(stream_t));
+        if (!s || stream_open(s, paths[i]) == -1) {
+            free(s);
+            result = -1;
+            break;
+        }
+        result = extract_stream(&x, s);
+        if (result == -1)
+            fprintf(stderr, "could not unpack %s\n", paths[i]);
+        stats->compressed_bytes += s->compressed_bytes;
+        stream_close(s);
+        free(s);
+        // The next layer may replace or white out anything in this one.
+        if (drain(&x) == -1 || make_hardlinks(&x) == -1)
+            result = -1;
+    }
+
+    pthread_mutex_lock(&x.lock);
+    x.closing = true;
+    pthread_cond_broadcast(&x.work_ready);
+    pthread_mutex_unlock(&x.lock);
+    for (int i = 0; i < x.num_workers; i++)
+        pthread_join(x.workers[i], NULL);
+    // Only jobs queued after an error are left, nobody took them.
+    while (x.head) {
+        job_t *next = x.head->next;
+        free(x.head);
+        x.head = next;
+    }
+    if (result == 0 && fix_dirs(&x) == -1)
+        result = -1;
+    for (size_t i = 0; i < x.num_dirs; i++)
+        free(x.dirs[i].path);
+    for (size_t i = 0; i < x.num_hardlinks; i++) {
+        free(x.hardlinks[i].path);
+        free(x.hardlinks[i].target);
+    }
+    free(x.dirs);
+    free(x.hardlinks);
+    pthread_cond_destroy(&x.room);
+    pthread_cond_destroy(&x.work_ready);
+    pthread_mutex_destroy(&x.lock);
+    close(x.root_fd);
+    if (x.blob_dir_fd != -1)
+        close(x.blob_dir_fd);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return result;
+}
+
+int extract_rootfs(const char *tarballs, const char *base_dir, const char *blob_dir, const char *rootfs,
+                   extract_stats_t *stats) {
+    struct stat st;
+    if (stat(rootfs, &st) == 0)
+        return 0;
+
+    char list[PATH_MAX * 4];
+    snprintf(list, sizeof(list), "%s", tarballs);
+    char resolved[EXTRACT_MAX_TARBALLS][PATH_MAX];
+    const char *paths[EXTRACT_MAX_TARBALLS];
+    int num_paths = 0;
+    char *save;
+    for (char *p = strtok_r(list, " ", &save); p; p = strtok_r(NULL, " ", &save)) {
+        if (num_paths == EXTRACT_MAX_TARBALLS) {
+            fprintf(stderr, "more than %d tarballs\n", EXTRACT_MAX_TARBALLS);
+            return -1;
+        }
+        if (p[0] == '/' || !base_dir)
+            snprintf(resolved[num_paths], PATH_MAX, "%s", p);
+        else
+            snprintf(resolved[num_paths], PATH_MAX, "%s/%s", base_dir, p);
+        paths[num_paths] = resolved[num_paths];
+        num_paths++;
+    }
+    if (num_paths == 0)
+        return 0;
+
+    char scratch[PATH_MAX];
+    // Per thread, the server may be unpacking the same image for two requests at once.
+    if (snprintf(scratch, sizeof(scratch), "%s.unpacking-%d", rootfs, gettid()) >= (int) sizeof(scratch)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (mkdir(scratch, 0755) == -1) {
+        perror("mkdir rootfs");
+        return -1;
+    }
+    int result = extract_tarballs(paths, num_paths, scratch, blob_dir, 0, stats);
+    if (result == 0) {
+        if (rename(scratch, rootfs) == 0)
+            return 1;
+        // Someone else unpacked it first, theirs is as good as ours.
+        if (errno != EEXIST && errno != ENOTEMPTY) {
+            perror("rename rootfs");
+            result = -1;
+        }
+    }
+    // remove_entry only takes a name directly inside the directory it is given.
+    char *slash = strrchr(scratch, '/');
+    if (!slash) {
+        remove_entry(AT_FDCWD, scratch);
+        return result;
+    }
+    *slash = '\0';
+    int parent_fd = open(slash == scratch ? "/" : scratch, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (parent_fd != -1) {
+        remove_entry(parent_fd, slash + 1);
+        close(parent_fd);
+    }
+    return result;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Unpacks image tarballs into a directory tree without holding a whole tarball in memory.
+ *
+ * One thread reads and decompresses the tarball and walks its headers, creating directories, links and device
+ * nodes as it goes. The contents of regular files are handed to worker threads that create and fill them with
+ * paths resolved relative to the destination's directory fd, so many small files are written in parallel while
+ * the next part of the tarball is being inflated. Layers from the layer store hold no file contents, each file
+ * is cloned from its own blob instead. Paths are resolved as if the destination were / so neither
+ * "../" nor a symlink in the image can make us write outside it.
+ * */
+
+#define EXTRACT_MAX_WORKERS 16
+#define EXTRACT_MAX_TARBALLS 64
+
+typedef struct {
+    uint64_t compressed_bytes;  // read from the tarballs
+    uint64_t bytes;             // of file contents written
+    uint64_t entries;           // files, directories, links and device nodes created
+    double seconds;
+} extract_stats_t;
+
+// Pax records the layer store writes in place of a file's contents, naming the blob that holds them.
+#define EXTRACT_BLOB_KEY "DRYDOCK.blob"
+#define EXTRACT_BLOB_SIZE_KEY "DRYDOCK.size"
+
+/**
+ * Unpacks each tarball in turn into dest, which must already exist, so that later ones overwrite earlier ones
+ * the way image layers stack. Tarballs can be gzipped or plain, and the .wh. whiteout files layers use to
+ * delete something from a lower layer are honoured. Files whose entry names a blob are cloned from it, with a
+ * reflink where the filesystem can, and blob_dir is what those names are relative to, NULL for tarballs that
+ * don't come from the layer store. num_workers of 0 means one per CPU.
+ * returns 0 on success, -1 on error
+ * */
+int extract_tarballs(const char **paths, int num_paths, const char *dest, const char *blob_dir, int num_workers,
+                     extract_stats_t *stats);
+
+/**
+ * Unpacks the space separated tarballs, base first, into rootfs unless rootfs already exists. Relative tarball
+ * paths are taken relative to base_dir, blob_dir is as for extract_tarballs. Everything is written to a scratch directory next to rootfs and renamed
+ * into place at the end, so a container never sees a half unpacked rootfs.
+ * returns 1 if it unpacked, 0 if rootfs was already there, -1 on error
+ * */
+int extract_rootfs(const char *tarballs, const char *base_dir, const char *blob_dir, const char *rootfs,
+                   extract_stats_t *stats);
@@ -0,0 +1,188 @@
+/**
+Unpacks layers with hostile whiteouts and checks nothing outside the rootfs is touched, and that the last entry
+for a path wins even while workers are still writing the earlier ones.
+Run it with `make test` in dry-dock/, it exits non-zero if a check fails.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "extract.h"
+
+#define TAR_BLOCK 512
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+    if (!ok)
+        failures++;
+}
+
+static void add_entry(FILE *tar, const char *name, char type, const char *body) {
+    // For a symlink, body is its target.
+    unsigned char header[TAR_BLOCK] = { 0 };
+    size_t size = body && type != '2' ? strlen(body) : 0;
+    snprintf((char *) header, 100, "%s", name);
+    if (type == '2')
+        snprintf((char *) header + 157, 100, "%s", body);
+    snprintf((char *) header + 100, 8, "%07o", type == '5' ? 0755 : 0644);
+    snprintf((char *) header + 108, 8, "%07o", 0);
+    snprintf((char *) header + 116, 8, "%07o", 0);
+    snprintf((char *) header + 124, 12, "%011o", (unsigned int) size);
+    snprintf((char *) header + 136, 12, "%011o", 0);
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    unsigned int sum = 0;
+    memset(header + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += header[i];
+    snprintf((char *) header + 148, 8, "%06o", sum);
+    fwrite(header, 1, TAR_BLOCK, tar);
+    if (size > 0) {
+        char padded[TAR_BLOCK] = { 0 };
+        memcpy(padded, body, size);
+        fwrite(padded, 1, TAR_BLOCK, tar);
+    }
+}
+
+static void write_tarball(const char *path, const char *whiteout) {
+    FILE *tar = fopen(path, "w");
+    if (!tar) {
+        perror("fopen tarball");
+        exit(1);
+    }
+    add_entry(tar, "./dir/", '5', NULL);
+    add_entry(tar, "./dir/file", '0', "hello\n");
+    add_entry(tar, whiteout, '0', NULL);
+    char end[2 * TAR_BLOCK] = { 0 };
+    fwrite(end, 1, sizeof(end), tar);
+    fclose(tar);
+}
+
+static void write_replacing(const char *path) {
+    // Enough files ahead of them that the workers are still busy when the replacements are read.
+    FILE *tar = fopen(path, "w");
+    if (!tar) {
+        perror("fopen tarball");
+        exit(1);
+    }
+    for (int i = 0; i < 500; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "./filler%d", i);
+        add_entry(tar, name, '0', "filler\n");
+    }
+    add_entry(tar, "./link", '0', "file\n");
+    add_entry(tar, "./link", '2', "filler0");
+    add_entry(tar, "./dir", '0', "file\n");
+    add_entry(tar, "./dir/", '5', NULL);
+    add_entry(tar, "./twice", '0', "first\n");
+    add_entry(tar, "./twice", '0', "second\n");
+    add_entry(tar, "./fifo", '0', "file\n");
+    add_entry(tar, "./fifo", '6', NULL);
+    char end[2 * TAR_BLOCK] = { 0 };
+    fwrite(end, 1, sizeof(end), tar);
+    fclose(tar);
+}
+
+static mode_t kind(const char *dir, const char *name) {
+    char path[4096];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return lstat(path, &st) == 0 ? st.st_mode & S_IFMT : 0;
+}
+
+static int holds(const char *dir, const char *name, const char *contents) {
+    char path[4096], buf[64] = "";
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    size_t got = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[got] = '\0';
+    return strcmp(buf, contents) == 0;
+}
+
+static int exists(const char *dir, const char *name) {
+    char path[4096];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return lstat(path, &st) == 0;
+}
+
+int main(void) {
+    char dir[] = "/tmp/extract_test.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    // Each of these names the directory holding the whiteout, or the one above it.
+    const char *hostile[] = { "./.wh...", "./.wh..", "./.wh.", "./dir/.wh...", "./dir/.wh.." };
+    for (size_t i = 0; i < sizeof(hostile) / sizeof(hostile[0]); i++) {
+        char tarball[4096], rootfs[4096], victim[4096], what[256];
+        snprintf(tarball, sizeof(tarball), "%s/layer%zu.tar", dir, i);
+        snprintf(rootfs, sizeof(rootfs), "%s/rootfs%zu", dir, i);
+        snprintf(victim, sizeof(victim), "%s/victim", dir);
+        write_tarball(tarball, hostile[i]);
+        FILE *f = fopen(victim, "w");
+        fclose(f);
+
+        extract_stats_t stats;
+        int result = extract_rootfs(tarball, NULL, NULL, rootfs, &stats);
+        snprintf(what, sizeof(what), "%s is refused", hostile[i]);
+        check(result == -1, what);
+        snprintf(what, sizeof(what), "%s leaves the directory holding the rootfs alone", hostile[i]);
+        check(exists(dir, "victim") && exists(dir, "layer0.tar"), what);
+        snprintf(what, sizeof(what), "%s leaves no rootfs or scratch directory behind", hostile[i]);
+        char scratch[64];
+        snprintf(scratch, sizeof(scratch), "rootfs%zu.unpacking-%d", i, gettid());
+        check(!exists(dir, rootfs + strlen(dir) + 1) && !exists(dir, scratch), what);
+    }
+
+    // An ordinary whiteout still removes what a lower layer put there.
+    char base[4096], upper[4096], tarballs[8192], rootfs[4096];
+    snprintf(base, sizeof(base), "%s/base.tar", dir);
+    snprintf(upper, sizeof(upper), "%s/upper.tar", dir);
+    snprintf(rootfs, sizeof(rootfs), "%s/rootfs", dir);
+    write_tarball(base, "./dir/.wh.missing");
+    write_tarball(upper, "./dir/.wh.file");
+    snprintf(tarballs, sizeof(tarballs), "%s %s", base, upper);
+    extract_stats_t stats;
+    check(extract_rootfs(tarballs, NULL, NULL, rootfs, &stats) == 1, "a layer can white out a lower layer's file");
+    check(exists(rootfs, "dir") && !exists(rootfs, "dir/file"), "the whited out file is gone, its directory isn't");
+
+    // A whiteout for something in a directory no layer has leaves it that way.
+    char missing[4096], bare[4096];
+    snprintf(missing, sizeof(missing), "%s/missing.tar", dir);
+    snprintf(bare, sizeof(bare), "%s/bare", dir);
+    write_tarball(missing, "./nowhere/deeper/.wh.file");
+    check(extract_rootfs(missing, NULL, NULL, bare, &stats) == 1, "a whiteout in a missing directory is fine");
+    check(!exists(bare, "nowhere"), "and creates nothing");
+
+    // Run it a few times, the workers lagging behind the reader is what would let an earlier file win.
+    int all_ok = 1;
+    char replacing[4096];
+    snprintf(replacing, sizeof(replacing), "%s/replacing.tar", dir);
+    write_replacing(replacing);
+    for (int i = 0; i < 20; i++) {
+        char replaced[4096];
+        snprintf(replaced, sizeof(replaced), "%s/replaced%d", dir, i);
+        all_ok &= extract_rootfs(replacing, NULL, NULL, replaced, &stats) == 1 && kind(replaced, "link") == S_IFLNK &&
+                  kind(replaced, "dir") == S_IFDIR && holds(replaced, "twice", "second\n") &&
+                  kind(replaced, "fifo") == S_IFIFO;
+    }
+    check(all_ok, "an entry replacing an earlier file in the same layer wins");
+
+    char cleanup[4200];
+    snprintf(cleanup, sizeof(cleanup), "rm -rf %s", dir);
+    system(cleanup);
+    return failures > 0;
+}
@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "log_capture.h"
+
+#define LOG_MAX_EVENTS 64
+
+static bool valid_name(const char *name) {
+    // Names end up in a path, so nothing that could leave LOG_DIR.
+    if (!name[0] || name[0] == '.' || strlen(name) >= sizeof(((capture_t *) 0)->name))
+        return false;
+    for (const char *c = name; *c; c++) {
+        if (!(*c >= 'a' && *c <= 'z') && !(*c >= 'A' && *c <= 'Z') && !(*c >= '0' && *c <= '9') &&
+            *c != '-' && *c != '_' && *c != '.')
+            return false;
+    }
+    return true;
+}
+
+static void log_path(const char *name, char *path, size_t len) {
+    snprintf(path, len, "%s/%s.log", LOG_DIR, name);
+}
+
+// Must hold logs->lock.
+static capture_t *find_capture(log_capture_t *logs, const char *name) {
+    for (capture_t *capture = logs->captures; capture; capture = capture->next) {
+        if (strcmp(capture->name, name) == 0)
+            return capture;
+    }
+    return NULL;
+}
+
+// Must hold logs->lock.
+static void drop_follower(capture_t *capture, int i) {
+    close(capture->followers[i]);
+    capture->followers[i] = capture->followers[--capture->num_followers];
+}
+
+// Must hold logs->lock.
+static void finish(log_capture_t *logs, capture_t *capture) {
+    // Followers see EOF once the container can't write anything more.
+    close(capture->file);
+    while (capture->num_followers > 0)
+        drop_follower(capture, 0);
+    capture_t **link = &logs->captures;
+    while (*link != capture)
+        link = &(*link)->next;
+    *link = capture->next;
+    free(capture);
+}
+
+// Must hold logs->lock.
+static void close_stream(log_capture_t *logs, capture_stream_t *stream) {
+    epoll_ctl(logs->epoll_fd, EPOLL_CTL_DEL, stream->fd, NULL);
+    close(stream->fd);
+    stream->fd = -1;
+    capture_t *capture = stream->capture;
+    if (capture->streams[0].fd == -1 && capture->streams[1].fd == -1)
+        finish(logs, capture);
+}
+
+// Must hold logs->lock.
+static void drain(log_capture_t *logs, capture_stream_t *stream, uint32_t events) {
+    /**
+     * moves everything waiting in a stream's pipe into its log, teeing it to each follower first
+    **/
+    capture_t *capture = stream->capture;
+    int avail = 0;
+    logs->syscalls++;
+    if (ioctl(stream->fd, FIONREAD, &avail) == -1 || avail <= 0) {
+        // Nothing left, and nobody left to write more.
+        if (events & (EPOLLHUP | EPOLLERR))
+            close_stream(logs, stream);
+        return;
+    }
+
+    for (int i = 0; i < capture->num_followers; i++) {
+        logs->syscalls++;
+        ssize_t teed = tee(stream->fd, capture->followers[i], avail, SPLICE_F_NONBLOCK);
+        if (teed == -1 && errno != EAGAIN) {
+            // The follower has gone away.
+            drop_follower(capture, i--);
+            continue;
+        }
+        if (teed < 0)
+            teed = 0;
+        logs->followed += teed;
+        logs->dropped += avail - teed;
+    }
+
+    size_t left = avail;
+    while (left > 0) {
+        logs->syscalls++;
+        ssize_t moved = splice(stream->fd, NULL, capture->file, &capture->offset, left,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved == -1 && errno == EINTR)
+            continue;
+        if (moved <= 0) {
+            // A log we can't write to mustn't leave the pipe full, or the container would block on its next write.
+            fprintf(stderr, "Could not write the log of %s: %s\n", capture->name, strerror(errno));
+            char discard[4096];
+            while (left > 0 && (moved = read(stream->fd, discard, left < sizeof(discard) ? left : sizeof(discard))) > 0)
+                left -= moved;
+            break;
+        }
+        left -= moved;
+        logs->written += moved;
+    }
+}
+
+static void *run_capture(void *arg) {
+    log_capture_t *logs = arg;
+    // A follower that has gone away should be an EPIPE from tee, not a signal that takes the server down.
+    sigset_t pipe_signal;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, NULL);
+
+    while (true) {
+        struct epoll_event events[LOG_MAX_EVENTS];
+        int num_events = epoll_wait(logs->epoll_fd, events, LOG_MAX_EVENTS, -1);
+        if (num_events == -1 && errno == EINTR)
+            continue;
+        if (num_events == -1) {
+            perror("epoll_wait on container logs");
+            return NULL;
+        }
+        pthread_mutex_lock(&logs->lock);
+        logs->syscalls++;
+        for (int i = 0; i < num_events; i++) {
+            if (events[i].data.ptr == &logs->stop_fd) {
+                pthread_mutex_unlock(&logs->lock);
+                return NULL;
+            }
+            capture_stream_t *stream = events[i].data.ptr;
+            if (stream->fd != -1)
+                drain(logs, stream, events[i].events);
+        }
+        pthread_mutex_unlock(&logs->lock);
+    }
+}
+
+int log_capture_start(log_capture_t *logs) {
+    memset(logs, 0, sizeof(*logs));
+    pthread_mutex_init(&logs->lock, NULL);
+    mkdir(LOG_DIR, 0755);
+    logs->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    logs->stop_fd = eventfd(0, EFD_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &logs->stop_fd };
+    if (logs->epoll_fd == -1 || logs->stop_fd == -1 ||
+        epoll_ctl(logs->epoll_fd, EPOLL_CTL_ADD, logs->stop_fd, &event) == -1) {
+        perror("Could not set up log capture");
+        return -1;
+    }
+    if (pthread_create(&logs->thread, NULL, run_capture, logs) != 0) {
+        fprintf(stderr, "Could not start the log capture thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+void log_capture_stop(log_capture_t *logs) {
+    uint64_t one = 1;
+    write(logs->stop_fd, &one, sizeof(one));
+    pthread_join(logs->thread, NULL);
+    while (logs->captures) {
+        capture_t *capture = logs->captures;
+        for (int i = 0; i < 2; i++) {
+            if (capture->streams[i].fd != -1)
+                close(capture->streams[i].fd);
+            capture->streams[i].fd = -1;
+        }
+        finish(logs, capture);
+    }
+    close(logs->epoll_fd);
+    close(logs->stop_fd);
+}
+
+int log_capture_pipes(int stdio[3], int read_ends[2]) {
+    int out[2], err[2];
+    stdio[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (stdio[0] == -1)
+        return -1;
+    if (pipe2(out, O_CLOEXEC) == -1) {
+        close(stdio[0]);
+        return -1;
+    }
+    if (pipe2(err, O_CLOEXEC) == -1) {
+        close(stdio[0]);
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+    // Room for a burst while the capture thread catches up, it only needs to be set on one end.
+    fcntl(out[0], F_SETPIPE_SZ, LOG_PIPE_SIZE);
+    fcntl(err[0], F_SETPIPE_SZ, LOG_PIPE_SIZE);
+    stdio[1] = out[1];
+    stdio[2] = err[1];
+    read_ends[0] = out[0];
+    read_ends[1] = err[0];
+    return 0;
+}
+
+int log_capture_add(log_capture_t *logs, const char *name, int read_ends[2]) {
+    /**
+     * opens the container's log and hands the read ends to the capture thread
+     * return:
+     * 0 on success, -1 on error with read_ends closed
+    **/
+    char path[PATH_MAX];
+    capture_t *capture = valid_name(name) ? calloc(1, sizeof(capture_t)) : NULL;
+    if (capture) {
+        log_path(name, path, sizeof(path));
+        capture->file = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    }
+    if (!capture || capture->file == -1) {
+        fprintf(stderr, "Could not open the log of %s\n", name);
+        free(capture);
+        close(read_ends[0]);
+        close(read_ends[1]);
+        return -1;
+    }
+    snprintf(capture->name, sizeof(capture->name), "%s", name);
+
+    pthread_mutex_lock(&logs->lock);
+    for (int i = 0; i < 2; i++) {
+        capture_stream_t *stream = &capture->streams[i];
+        stream->capture = capture;
+        stream->fd = read_ends[i];
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = stream };
+        if (epoll_ctl(logs->epoll_fd, EPOLL_CTL_ADD, stream->fd, &event) == -1) {
+            perror("epoll_ctl container log");
+            close(stream->fd);
+            stream->fd = -1;
+        }
+    }
+    capture->next = logs->captures;
+    logs->captures = capture;
+    if (capture->streams[0].fd == -1 && capture->streams[1].fd == -1)
+        finish(logs, capture);
+    pthread_mutex_unlock(&logs->lock);
+    return 0;
+}
+
+int log_capture_open(log_capture_t *logs, const char *name, bool follow, int fds[2], loff_t *offset) {
+    /**
+     * opens a log for reading, and a follower pipe that picks up exactly where it ends
+     * return:
+     * the number of fds opened, or -1 if there is no such log
+    **/
+    if (!valid_name(name))
+        return -1;
+    char path[PATH_MAX];
+    log_path(name, path, sizeof(path));
+    // Under the lock so no output can land between the offset we give out and the follower being added.
+    pthread_mutex_lock(&logs->lock);
+    fds[0] = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fds[0] == -1 || fstat(fds[0], &st) == -1) {
+        pthread_mutex_unlock(&logs->lock);
+        if (fds[0] != -1)
+            close(fds[0]);
+        return -1;
+    }
+    capture_t *capture = find_capture(logs, name);
+    *offset = capture ? capture->offset : st.st_size;
+    int count = 1;
+    int follower[2];
+    if (follow && capture && capture->num_followers < LOG_MAX_FOLLOWERS && pipe2(follower, O_CLOEXEC) == 0) {
+        fcntl(follower[1], F_SETPIPE_SZ, LOG_FOLLOW_BUFFER);
+        capture->followers[capture->num_followers++] = follower[1];
+        fds[count++] = follower[0];
+    }
+    pthread_mutex_unlock(&logs->lock);
+    return count;
+}
+
+void log_capture_format_stats(log_capture_t *logs, char *buf, size_t len) {
+    pthread_mutex_lock(&logs->lock);
+    int capturing = 0;
+    int following = 0;
+    for (capture_t *capture = logs->captures; capture; capture = capture->next) {
+        capturing++;
+        following += capture->num_followers;
+    }
+    snprintf(buf, len,
+             "logs: %d containers captured, %d followers, %.1f MB written, %.1f MB followed, %.1f MB missed by slow "
+             "followers, %lu syscalls\n",
+             capturing, following, logs->written / 1e6, logs->followed / 1e6, logs->dropped / 1e6, logs->syscalls);
+    pthread_mutex_unlock(&logs->lock);
+}
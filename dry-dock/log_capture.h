@@ -0,0 +1,85 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * Captures what containers write to stdout and stderr without the data ever passing through the server.
+ *
+ * A container started without the client's stdio gets the write ends of two pipes instead. A thread of our own
+ * waits on the read ends and splices whatever arrives into the container's log file, so it goes from one kernel
+ * buffer to another. Anyone following the log gets a pipe of their own, and the data is teed into it before it is
+ * spliced away. A follower's pipe is a LOG_FOLLOW_BUFFER ring in the kernel: a follower that falls that far behind
+ * misses what didn't fit rather than holding the container up.
+ * */
+
+#define LOG_DIR "/var/log/drydock"
+#define LOG_PIPE_SIZE (1 << 20)
+#define LOG_FOLLOW_BUFFER (1 << 20)
+#define LOG_MAX_FOLLOWERS 16
+
+struct capture;
+
+typedef struct {
+    struct capture *capture;
+    int fd;                     // read end of the pipe the container writes to, -1 once it has closed
+} capture_stream_t;
+
+typedef struct capture {
+    char name[64];
+    capture_stream_t streams[2]; // stdout and stderr
+    int file;
+    loff_t offset;              // where the next byte goes in file
+    int followers[LOG_MAX_FOLLOWERS];
+    int num_followers;
+    struct capture *next;
+} capture_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    capture_t *captures;
+    int epoll_fd;
+    int stop_fd;
+    pthread_t thread;
+    unsigned long long written;     // bytes spliced into log files
+    unsigned long long followed;    // bytes teed to followers
+    unsigned long long dropped;     // bytes followers missed
+    unsigned long syscalls;
+} log_capture_t;
+
+/**
+ * Starts the thread that moves container output into log files
+ * returns 0 on success, -1 on error
+ * */
+int log_capture_start(log_capture_t *logs);
+
+/**
+ * Stops the thread, output still in the pipes is left there
+ * */
+void log_capture_stop(log_capture_t *logs);
+
+/**
+ * Makes stdin, stdout and stderr for a container whose output is to be captured: /dev/null, and the write ends of
+ * two pipes whose read ends go in read_ends. The caller closes its copies of all five once the container has them
+ * returns 0 on success, -1 on error
+ * */
+int log_capture_pipes(int stdio[3], int read_ends[2]);
+
+/**
+ * Starts capturing what comes out of read_ends into the log of container name, taking them over
+ * returns 0 on success, -1 if the log could not be opened, in which case read_ends have been closed
+ * */
+int log_capture_add(log_capture_t *logs, const char *name, int read_ends[2]);
+
+/**
+ * Opens container name's log for reading, and if follow is set and the container is still running, a pipe that
+ * gets everything written to the log after *offset bytes. fds gets the log, then the pipe if there is one
+ * returns how many fds were opened, or -1 if there is no such log
+ * */
+int log_capture_open(log_capture_t *logs, const char *name, bool follow, int fds[2], loff_t *offset);
+
+/**
+ * Writes human readable counts of what has been captured and followed into buf
+ * */
+void log_capture_format_stats(log_capture_t *logs, char *buf, size_t len);
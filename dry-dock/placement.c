@@ -0,0 +1,139 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../cgroups.h"
+#include "placement.h"
+
+void placement_init(placement_t *placement) {
+    memset(placement, 0, sizeof(*placement));
+    pthread_mutex_init(&placement->lock, NULL);
+    if (read_numa_topology(NUMA_NODE_PATH, &placement->topology) == -1)
+        placement->topology.num_nodes = 0;
+    // With one node there is nothing to choose, and a cpuset would only cost every fork and migration.
+    placement->enabled = placement->topology.num_nodes > 1;
+}
+
+// Must hold placement->lock.
+static int node_index(placement_t *placement, int node) {
+    for (int i = 0; i < placement->topology.num_nodes; i++) {
+        if (placement->topology.nodes[i].id == node)
+            return i;
+    }
+    return -1;
+}
+
+int placement_pick(placement_t *placement, double cores) {
+    if (!placement->enabled)
+        return -1;
+    pthread_mutex_lock(&placement->lock);
+    // Least committed relative to its size after taking this one, so a bigger node takes a bigger share.
+    int best = -1;
+    double best_share = 0;
+    for (int i = 0; i < placement->topology.num_nodes; i++) {
+        const numa_node_t *node = &placement->topology.nodes[i];
+        double share = (placement->committed[i] + cores) / node->num_cpus;
+        if (cores <= node->num_cpus && (best == -1 || share < best_share)) {
+            best = i;
+            best_share = share;
+        }
+    }
+    if (best == -1) {
+        placement->floating++;
+        pthread_mutex_unlock(&placement->lock);
+        return -1;
+    }
+    placement->committed[best] += cores;
+    placement->containers[best]++;
+    placement->placed++;
+    int node = placement->topology.nodes[best].id;
+    pthread_mutex_unlock(&placement->lock);
+    return node;
+}
+
+void placement_claim(placement_t *placement, int node, double cores) {
+    if (!placement->enabled || node == -1)
+        return;
+    pthread_mutex_lock(&placement->lock);
+    int i = node_index(placement, node);
+    if (i != -1) {
+        placement->committed[i] += cores;
+        placement->containers[i]++;
+    }
+    pthread_mutex_unlock(&placement->lock);
+}
+
+void placement_release(placement_t *placement, int node, double cores) {
+    if (!placement->enabled || node == -1)
+        return;
+    pthread_mutex_lock(&placement->lock);
+    int i = node_index(placement, node);
+    if (i != -1 && placement->containers[i] > 0) {
+        placement->containers[i]--;
+        placement->committed[i] -= cores;
+        // Don't let rounding leave a node looking busy once it is empty.
+        if (placement->containers[i] == 0 || placement->committed[i] < 0)
+            placement->committed[i] = 0;
+    }
+    pthread_mutex_unlock(&placement->lock);
+}
+
+void placement_adjust(placement_t *placement, int node, double delta) {
+    if (!placement->enabled || node == -1)
+        return;
+    pthread_mutex_lock(&placement->lock);
+    int i = node_index(placement, node);
+    if (i != -1) {
+        placement->committed[i] += delta;
+        if (placement->committed[i] < 0)
+            placement->committed[i] = 0;
+    }
+    pthread_mutex_unlock(&placement->lock);
+}
+
+double placement_config_cores(const char *config) {
+    /**
+     * the same keys the runtime reads, the last one in the file wins
+     * return:
+     * the limit in cores, CGROUP_DEFAULT_CPU_CORES if the file doesn't set one or can't be read
+    **/
+    double cores = CGROUP_DEFAULT_CPU_CORES;
+    char buf[1000];
+    int fd = config ? open(config, O_RDONLY | O_CLOEXEC) : -1;
+    ssize_t got = fd == -1 ? -1 : read(fd, buf, sizeof(buf) - 1);
+    if (fd != -1)
+        close(fd);
+    if (got <= 0)
+        return cores;
+    buf[got] = '\0';
+    char *saveptr;
+    for (char *line = strtok_r(buf, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        char *value;
+        if ((value = strstr(line, "CPU%:")) && strlen(value) >= 7)
+            cores = atof(value + 6) / 100;
+        if ((value = strstr(line, "cpu_cores:")) && strlen(value) >= 12)
+            cores = atof(value + 11);
+    }
+    return cores;
+}
+
+void placement_format_stats(placement_t *placement, char *buf, size_t len) {
+    pthread_mutex_lock(&placement->lock);
+    if (!placement->enabled) {
+        snprintf(buf, len, "numa: %d node%s, placement off\n", placement->topology.num_nodes,
+                 placement->topology.num_nodes == 1 ? "" : "s");
+        pthread_mutex_unlock(&placement->lock);
+        return;
+    }
+    int used = snprintf(buf, len, "numa: %lu placed, %lu floating", placement->placed, placement->floating);
+    for (int i = 0; i < placement->topology.num_nodes && used > 0 && (size_t) used < len; i++) {
+        const numa_node_t *node = &placement->topology.nodes[i];
+        used += snprintf(buf + used, len - used, ", node%d %.2f/%d cpus for %u", node->id, placement->committed[i],
+                         node->num_cpus, placement->containers[i]);
+    }
+    if (used > 0 && (size_t) used < len)
+        snprintf(buf + used, len - used, "\n");
+    pthread_mutex_unlock(&placement->lock);
+}
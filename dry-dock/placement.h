@@ -0,0 +1,60 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "../numa.h"
+
+/**
+ * Which NUMA node each container goes on. Every container, parked or running, commits its CPU limit to the node it
+ * was placed on until it exits, and the next one goes on the node with the smallest share of its CPUs committed
+ * among those it fits on whole. A container that fits on none, or a machine with a single node, is left to float.
+ * */
+
+typedef struct {
+    pthread_mutex_t lock;
+    numa_topology_t topology;
+    bool enabled;                       // more than one node to choose from
+    double committed[NUMA_MAX_NODES];   // cores, indexed like topology.nodes
+    unsigned containers[NUMA_MAX_NODES];
+    unsigned long placed;
+    unsigned long floating;             // didn't fit on any node
+} placement_t;
+
+/**
+ * Reads the machine's topology, placement is off if it has fewer than two nodes
+ * */
+void placement_init(placement_t *placement);
+
+/**
+ * Picks the node for a container limited to cores and commits them to it
+ * returns the node's id, or -1 to leave the container floating
+ * */
+int placement_pick(placement_t *placement, double cores);
+
+/**
+ * Commits cores to node for a container that is already there, one an earlier server placed
+ * */
+void placement_claim(placement_t *placement, int node, double cores);
+
+/**
+ * Gives back what placement_pick or placement_claim committed to node, nothing happens for node -1
+ * */
+void placement_release(placement_t *placement, int node, double cores);
+
+/**
+ * Changes what a container already on node has committed there by delta cores, after its CPU limit changed
+ * */
+void placement_adjust(placement_t *placement, int node, double delta);
+
+/**
+ * Reads the CPU limit a runtime config file asks for the way the runtime does, NULL is the runtime's default
+ * returns the limit in cores
+ * */
+double placement_config_cores(const char *config);
+
+/**
+ * Writes human readable per node commitments into buf
+ * */
+void placement_format_stats(placement_t *placement, char *buf, size_t len);
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "pressure.h"
+
+static const char *RESOURCE_NAMES[NUM_PRESSURE_RESOURCES] = { "cpu", "memory", "io" };
+
+static void pressure_path(pressure_monitor_t *monitor, const char *name, pressure_resource_t resource, char *path,
+                          size_t len) {
+    if (monitor->version == CGROUP_V2)
+        snprintf(path, len, "/sys/fs/cgroup/drydock/%s/%s.pressure", name, RESOURCE_NAMES[resource]);
+    else
+        snprintf(path, len, "/sys/fs/cgroup/unified/drydock/%s/%s.pressure", name, RESOURCE_NAMES[resource]);
+}
+
+// Must hold monitor->lock.
+static void drop_trigger(pressure_monitor_t *monitor, pressure_trigger_t *trigger) {
+    if (trigger->fd == -1)
+        return;
+    monitor->syscalls += 2;
+    epoll_ctl(monitor->epoll_fd, EPOLL_CTL_DEL, trigger->fd, NULL);
+    close(trigger->fd);
+    trigger->fd = -1;
+}
+
+static bool read_pressure(pressure_trigger_t *trigger, double *avg10, double *total_s) {
+    // The same file, read from the start, gives the averages behind the trigger.
+    char buf[256];
+    ssize_t got = pread(trigger->fd, buf, sizeof(buf) - 1, 0);
+    if (got <= 0)
+        return false;
+    buf[got] = '\0';
+    unsigned long long total_us;
+    if (sscanf(buf, "some avg10=%lf %*s %*s total=%llu", avg10, &total_us) != 2)
+        return false;
+    *total_s = total_us / 1e6;
+    return true;
+}
+
+// Must hold monitor->lock.
+static bool fired(pressure_monitor_t *monitor, pressure_trigger_t *trigger, uint32_t ready) {
+    /**
+     * queues an event for a trigger epoll says is ready
+     * return:
+     * true if an event was queued
+    **/
+    // A cgroup that has been removed leaves its triggers in error for good, they would only spin the thread.
+    if (ready & EPOLLERR) {
+        drop_trigger(monitor, trigger);
+        return false;
+    }
+    monitor->events[trigger->resource]++;
+    if (monitor->num_queued == PRESSURE_MAX_QUEUED) {
+        monitor->dropped++;
+        return false;
+    }
+    pressure_event_t *event = &monitor->queued[monitor->num_queued++];
+    monitor->syscalls++;
+    if (!read_pressure(trigger, &event->avg10, &event->total_s))
+        event->avg10 = event->total_s = -1;
+    event->owner = trigger->watch->owner;
+    event->resource = trigger->resource;
+    return true;
+}
+
+static void *run_pressure(void *arg) {
+    pressure_monitor_t *monitor = arg;
+    while (true) {
+        struct epoll_event ready[PRESSURE_MAX_EVENTS];
+        int num_ready = epoll_wait(monitor->epoll_fd, ready, PRESSURE_MAX_EVENTS, -1);
+        if (num_ready == -1 && errno == EINTR)
+            continue;
+        if (num_ready == -1) {
+            perror("epoll_wait on pressure triggers");
+            return NULL;
+        }
+        pthread_mutex_lock(&monitor->lock);
+        monitor->syscalls++;
+        bool queued = false;
+        for (int i = 0; i < num_ready; i++) {
+            if (ready[i].data.ptr == &monitor->control_fd) {
+                uint64_t count;
+                monitor->syscalls++;
+                read(monitor->control_fd, &count, sizeof(count));
+                continue;
+            }
+            pressure_trigger_t *trigger = ready[i].data.ptr;
+            if (trigger->fd != -1)
+                queued |= fired(monitor, trigger, ready[i].events);
+        }
+        while (monitor->retired) {
+            pressure_watch_t *next = monitor->retired->next;
+            free(monitor->retired);
+            monitor->retired = next;
+        }
+        if (queued) {
+            uint64_t one = 1;
+            monitor->syscalls++;
+            write(monitor->ready_fd, &one, sizeof(one));
+        }
+        bool stopping = monitor->stopping;
+        pthread_mutex_unlock(&monitor->lock);
+        if (stopping)
+            return NULL;
+    }
+}
+
+int pressure_monitor_start(pressure_monitor_t *monitor, cgroup_version_t version) {
+    memset(monitor, 0, sizeof(*monitor));
+    pthread_mutex_init(&monitor->lock, NULL);
+    monitor->version = version;
+    monitor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    monitor->control_fd = eventfd(0, EFD_CLOEXEC);
+    monitor->ready_fd = eventfd(0, EFD_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &monitor->control_fd };
+    if (monitor->epoll_fd == -1 || monitor->control_fd == -1 || monitor->ready_fd == -1 ||
+        epoll_ctl(monitor->epoll_fd, EPOLL_CTL_ADD, monitor->control_fd, &event) == -1) {
+        perror("Could not set up pressure monitoring");
+        return -1;
+    }
+    if (pthread_create(&monitor->thread, NULL, run_pressure, monitor) != 0) {
+        fprintf(stderr, "Could not start the pressure monitoring thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+void pressure_monitor_stop(pressure_monitor_t *monitor) {
+    uint64_t one = 1;
+    pthread_mutex_lock(&monitor->lock);
+    monitor->stopping = true;
+    pthread_mutex_unlock(&monitor->lock);
+    write(monitor->control_fd, &one, sizeof(one));
+    pthread_join(monitor->thread, NULL);
+    close(monitor->epoll_fd);
+    close(monitor->control_fd);
+    close(monitor->ready_fd);
+}
+
+pressure_watch_t *pressure_watch(pressure_monitor_t *monitor, const char *name, void *owner) {
+    pressure_watch_t *watch = calloc(1, sizeof(pressure_watch_t));
+    if (!watch)
+        return NULL;
+    watch->owner = owner;
+    // The kernel only accepts a trigger on a file opened for writing, and keeps it until that file is closed.
+    char trigger_spec[64];
+    snprintf(trigger_spec, sizeof(trigger_spec), "some %d %d", PRESSURE_STALL_US, PRESSURE_WINDOW_US);
+    int armed = 0;
+    pthread_mutex_lock(&monitor->lock);
+    for (int i = 0; i < NUM_PRESSURE_RESOURCES; i++) {
+        pressure_trigger_t *trigger = &watch->triggers[i];
+        trigger->watch = watch;
+        trigger->resource = i;
+        char path[PATH_MAX];
+        pressure_path(monitor, name, i, path, sizeof(path));
+        monitor->syscalls++;
+        trigger->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (trigger->fd == -1)
+            continue;
+        struct epoll_event event = { .events = EPOLLPRI, .data.ptr = trigger };
+        monitor->syscalls += 2;
+        if (write(trigger->fd, trigger_spec, strlen(trigger_spec) + 1) == -1 ||
+            epoll_ctl(monitor->epoll_fd, EPOLL_CTL_ADD, trigger->fd, &event) == -1) {
+            fprintf(stderr, "Could not set a trigger on %s: %s\n", path, strerror(errno));
+            close(trigger->fd);
+            trigger->fd = -1;
+            continue;
+        }
+        armed++;
+    }
+    if (armed > 0)
+        monitor->watched++;
+    pthread_mutex_unlock(&monitor->lock);
+    if (armed == 0) {
+        free(watch);
+        return NULL;
+    }
+    return watch;
+}
+
+void pressure_unwatch(pressure_monitor_t *monitor, pressure_watch_t *watch) {
+    if (!watch)
+        return;
+    pthread_mutex_lock(&monitor->lock);
+    for (int i = 0; i < NUM_PRESSURE_RESOURCES; i++)
+        drop_trigger(monitor, &watch->triggers[i]);
+    // The owner is going away too, its events mustn't be handed back.
+    int kept = 0;
+    for (int i = 0; i < monitor->num_queued; i++) {
+        if (monitor->queued[i].owner != watch->owner)
+            monitor->queued[kept++] = monitor->queued[i];
+    }
+    monitor->num_queued = kept;
+    watch->next = monitor->retired;
+    monitor->retired = watch;
+    monitor->watched--;
+    pthread_mutex_unlock(&monitor->lock);
+    uint64_t one = 1;
+    write(monitor->control_fd, &one, sizeof(one));
+}
+
+int pressure_collect(pressure_monitor_t *monitor, pressure_event_t *events, int max) {
+    pthread_mutex_lock(&monitor->lock);
+    int count = monitor->num_queued < max ? monitor->num_queued : max;
+    memcpy(events, monitor->queued, count * sizeof(pressure_event_t));
+    monitor->num_queued -= count;
+    memmove(monitor->queued, monitor->queued + count, monitor->num_queued * sizeof(pressure_event_t));
+    pthread_mutex_unlock(&monitor->lock);
+    return count;
+}
+
+const char *pressure_resource_name(pressure_resource_t resource) {
+    return RESOURCE_NAMES[resource];
+}
+
+void pressure_format_stats(pressure_monitor_t *monitor, char *buf, size_t len) {
+    pthread_mutex_lock(&monitor->lock);
+    snprintf(buf, len,
+             "pressure: %lu containers watched, stalls over %d%% of %.0f s: %lu cpu, %lu memory, %lu io, "
+             "%lu dropped, %lu syscalls\n",
+             monitor->watched, PRESSURE_STALL_US * 100 / PRESSURE_WINDOW_US, PRESSURE_WINDOW_US / 1e6,
+             monitor->events[PRESSURE_CPU], monitor->events[PRESSURE_MEMORY], monitor->events[PRESSURE_IO],
+             monitor->dropped, monitor->syscalls);
+    pthread_mutex_unlock(&monitor->lock);
+}
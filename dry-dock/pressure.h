@@ -0,0 +1,115 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "../cgroups.h"
+
+/**
+ * Finds out which containers are stalled on which resource from the kernel's pressure stall information, without
+ * sampling anything. Each container's cpu.pressure, memory.pressure and io.pressure get a trigger, which the kernel
+ * fires at most once per PRESSURE_WINDOW_US, and only if some of the container's tasks were stalled on that resource
+ * for more than PRESSURE_STALL_US of it. A thread of our own waits on the triggers and queues an event for each one
+ * that fires, so a container that isn't stalling costs nothing at all.
+ *
+ * The triggers can't go in the event loop's epoll set by way of an epoll set of their own: polling a trigger uses up
+ * what it reported, so the outer set would swallow it while checking the inner one.
+ *
+ * On a v1 host the files are those of the container's directory in the hybrid unified hierarchy, which the runtime
+ * makes for just this. A host without one, or a kernel without PSI, gets no pressure events.
+ * */
+
+// Without CAP_SYS_RESOURCE the kernel only takes windows that are a multiple of 2 s.
+#define PRESSURE_STALL_US 200000        // 10% of the window
+#define PRESSURE_WINDOW_US 2000000
+#define PRESSURE_MAX_EVENTS 64          // taken from the kernel at once
+#define PRESSURE_MAX_QUEUED 256         // waiting for the caller, more are dropped
+
+typedef enum {
+    PRESSURE_CPU,
+    PRESSURE_MEMORY,
+    PRESSURE_IO,
+    NUM_PRESSURE_RESOURCES,
+} pressure_resource_t;
+
+struct pressure_watch;
+
+typedef struct {
+    struct pressure_watch *watch;
+    pressure_resource_t resource;
+    int fd;                             // -1 once unwatched or the kernel has said the cgroup is gone
+} pressure_trigger_t;
+
+typedef struct pressure_watch {
+    pressure_trigger_t triggers[NUM_PRESSURE_RESOURCES];
+    void *owner;                        // handed back with each of its events
+    struct pressure_watch *next;        // on the retired list
+} pressure_watch_t;
+
+/**
+ * A trigger that fired, with what the pressure file said right after.
+ * */
+typedef struct {
+    void *owner;                        // of the watch
+    pressure_resource_t resource;
+    double avg10;                       // percent of the last 10 s some task was stalled
+    double total_s;                     // stalled since the container started
+} pressure_event_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    cgroup_version_t version;
+    int epoll_fd;                       // the triggers, only the thread waits on it
+    int control_fd;                     // eventfd that wakes the thread to stop or to free what was unwatched
+    int ready_fd;                       // eventfd written whenever events are queued, the caller waits on it
+    pthread_t thread;
+    bool stopping;
+    // Unwatched, but an epoll_wait that had already returned could still hand the thread one of their triggers,
+    // so they are freed by the thread once it is done with what it was given.
+    pressure_watch_t *retired;
+    pressure_event_t queued[PRESSURE_MAX_QUEUED];
+    int num_queued;
+    unsigned long watched;              // containers
+    unsigned long events[NUM_PRESSURE_RESOURCES];
+    unsigned long dropped;              // the caller had too many waiting already
+    unsigned long syscalls;
+} pressure_monitor_t;
+
+/**
+ * Starts the thread that waits on the triggers, the caller waits for ready_fd to be readable and reads it
+ * returns 0 on success, -1 on error
+ * */
+int pressure_monitor_start(pressure_monitor_t *monitor, cgroup_version_t version);
+
+/**
+ * Stops the thread, the caller unwatches every container first
+ * */
+void pressure_monitor_stop(pressure_monitor_t *monitor);
+
+/**
+ * Sets triggers on container name's cgroup
+ * returns the watch, or NULL if the cgroup has no pressure files
+ * */
+pressure_watch_t *pressure_watch(pressure_monitor_t *monitor, const char *name, void *owner);
+
+/**
+ * Removes a container's triggers, along with any of its events that haven't been collected. NULL is ignored
+ * */
+void pressure_unwatch(pressure_monitor_t *monitor, pressure_watch_t *watch);
+
+/**
+ * Takes the events queued since the last call, oldest first
+ * returns how many were put in events, at most max
+ * */
+int pressure_collect(pressure_monitor_t *monitor, pressure_event_t *events, int max);
+
+/**
+ * returns cpu, memory or io
+ * */
+const char *pressure_resource_name(pressure_resource_t resource);
+
+/**
+ * Writes human readable counts of containers watched and events seen into buf
+ * */
+void pressure_format_stats(pressure_monitor_t *monitor, char *buf, size_t len);
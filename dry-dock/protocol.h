@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+
+// Shared between the dry-dock client and dry-dock-server.
+//
+// A client connects and sends PROTOCOL_PREFACE, and from then on everything in either direction is a frame: a
+// frame_header_t followed by length bytes of payload. The server sends PROTOCOL_PREFACE back ahead of its first
+// frame, which is how a TCP client knows it reached a dry-dock server, and the client doesn't have to wait for it
+// before sending requests. Numbers are in host byte order, both ends are on the same machine.
+//
+// A connection stays open for as many requests as the client wants to send, and it can send the next one before
+// the last is answered. Every request carries an id the client picks and its response carries the same id.
+// Responses go out as requests finish, so a quick one can overtake a create that is still unpacking an image.
+// The payload of a FRAME_BATCH frame is a run of request frames, served as if they had been sent one by one,
+// each with its own response.
+//
+// A FRAME_CREATE_MANY launches count containers from one containerfile, which is read and unpacked only once. As
+// each container comes up, or fails to, a FRAME_PROGRESS with its name or the reason goes out, and the request's
+// FRAME_OK or FRAME_ERROR comes last and sums them up. Every request gets exactly one OK or ERROR.
+//
+// Over the Unix socket the server knows who the client is from SO_PEERCRED. A create request can carry the
+// client's stdin, stdout and stderr as SCM_RIGHTS, followed optionally by the write end of a pipe that gets the
+// command's wait status, and they are handed to the container as is. The fds go with the request's bytes, or any
+// earlier ones, and num_fds in its header says how many of those received so far, oldest first, are its own.
+//
+// Responses carry fds the same way. The FRAME_OK to a FRAME_LOGS has the container's log file opened for reading
+// and, if it asked to follow a running container, the read end of a pipe that gets everything written to the log
+// from the offset its text gives on, until the container exits.
+//
+// A FRAME_EVENTS subscribes the connection to container events. Each one goes out as a FRAME_PROGRESS with the
+// request's id and a line of text, for as long as the connection stays open. It never gets an OK, the client closes
+// the connection when it has seen enough. A subscriber that stops reading misses events rather than holding them up.
+
+#define DRYDOCK_PORT "2048"
+#define DRYDOCK_SOCKET_PATH "/var/run/drydock/dry-dock.sock"
+#define PROTOCOL_PREFACE "DRYDOCK1"
+
+typedef enum {
+    FRAME_CREATE = 1,   // payload is the absolute path of a containerfile
+    FRAME_STATS,
+    FRAME_DESTROY,      // shuts the server down, there is no response
+    FRAME_BATCH,        // payload is request frames, which can't be batches themselves
+    FRAME_CREATE_MANY,  // payload is a uint32_t count followed by the absolute path of a containerfile
+    FRAME_LOGS,         // payload is a uint32_t that is 1 to follow followed by a container name, Unix socket only
+    FRAME_UPDATE,       // payload is an update_request_t
+    FRAME_EVENTS,       // no payload, subscribes to container events
+    FRAME_OK = 16,      // response, payload is text for the user
+    FRAME_ERROR,        // response, payload is text for the user
+    FRAME_PROGRESS,     // response that isn't the last for its request, payload is text for the user
+} frame_type_t;
+
+typedef struct {
+    uint32_t length;    // of the payload that follows
+    uint32_t id;        // picked by the client, the response to a request has the same one
+    uint16_t type;      // frame_type_t
+    uint16_t num_fds;   // file descriptors the request takes
+} frame_header_t;
+
+// Limits for a running container, fields the update doesn't change are UPDATE_KEEP.
+#define UPDATE_UNLIMITED -1
+#define UPDATE_KEEP -2
+
+typedef struct {
+    char name[64];
+    int64_t mem_limit;  // bytes
+    int64_t pid_limit;
+    double cpus;        // fractions allowed
+} update_request_t;
+
+#define MAX_FRAME_SIZE (1 << 20) // payload, enough for a batch of thousands of creates
+#define MAX_RESPONSE_SIZE 4096
+#define MAX_REQUEST_FDS 4 // stdin, stdout, stderr and the exit status pipe
+#define MAX_CREATE_MANY 4096
@@ -0,0 +1,401 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/magic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+
+#include "registry.h"
+
+#define REGISTRY_MAGIC "DDJRNL1"
+#define REGISTRY_TMP_PATH REGISTRY_PATH ".tmp"
+
+// Where cgroups.c puts a container's cgroup, v1 is checked through the pids hierarchy.
+#define REGISTRY_CGROUP_V2_FORMAT "/sys/fs/cgroup/drydock/%s"
+#define REGISTRY_CGROUP_V1_FORMAT "/sys/fs/cgroup/pids/drydock/%s"
+
+typedef enum {
+    RECORD_NONE,                // never written, the journal ends here
+    RECORD_ADD,
+    RECORD_REMOVE,
+    RECORD_UPDATE,              // replaces what the add it targets says about the container
+} record_type_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+} journal_header_t;
+
+typedef struct {
+    uint32_t crc;               // of the rest of the header and length bytes of container
+    uint32_t type;
+    uint32_t target;            // for a remove or update, the index of the add it is about
+    uint32_t length;
+    container_record_t container;
+} journal_record_t;
+
+_Static_assert(sizeof(journal_record_t) <= REGISTRY_RECORD_SIZE, "a journal record must fit in its slot");
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int pidfd_open(pid_t pid) {
+    return syscall(__NR_pidfd_open, pid, 0);
+}
+
+static unsigned long long start_time(pid_t pid) {
+    // Field 22 of /proc/<pid>/stat, counted from the end of the command name since that can hold spaces. A zombie
+    // counts as gone.
+    char path[64];
+    char buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    ssize_t got = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (got <= 0)
+        return 0;
+    buf[got] = '\0';
+    char *field = strrchr(buf, ')');
+    if (!field || field[1] != ' ' || field[2] == 'Z')
+        return 0;
+    for (int i = 2; field && i < 22; i++)
+        field = strchr(field + 1, ' ');
+    return field ? strtoull(field + 1, NULL, 10) : 0;
+}
+
+static journal_record_t *record_at(registry_t *reg, uint32_t index) {
+    return (journal_record_t *) (reg->map + (size_t) index * REGISTRY_RECORD_SIZE);
+}
+
+static uint32_t checksum(const journal_record_t *record) {
+    size_t len = offsetof(journal_record_t, container) - offsetof(journal_record_t, type) + record->length;
+    return crc32(0, (const unsigned char *) &record->type, len);
+}
+
+static void write_record(char *map, uint32_t index, record_type_t type, uint32_t target,
+                         const container_record_t *container) {
+    // The checksum goes in last, until then a reader takes this for the end of the journal.
+    journal_record_t *record = (journal_record_t *) (map + (size_t) index * REGISTRY_RECORD_SIZE);
+    record->type = type;
+    record->target = target;
+    record->length = container ? sizeof(*container) : 0;
+    if (container)
+        memcpy(&record->container, container, sizeof(*container));
+    __atomic_store_n(&record->crc, checksum(record), __ATOMIC_RELEASE);
+}
+
+static char *map_journal(int fd, uint32_t capacity, bool fresh) {
+    size_t size = (size_t) capacity * REGISTRY_RECORD_SIZE;
+    if (fresh && ftruncate(fd, size) == -1)
+        return NULL;
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    if (fresh) {
+        journal_header_t *header = (journal_header_t *) map;
+        memcpy(header->magic, REGISTRY_MAGIC, sizeof(header->magic));
+        header->record_size = REGISTRY_RECORD_SIZE;
+    }
+    return map;
+}
+
+static int compact(registry_t *reg) {
+    /**
+     * rewrites the journal with one record per live container and puts it in place of the old one
+     * return:
+     * 0 on success, -1 if the old journal is still the one in use
+    **/
+    uint32_t capacity = REGISTRY_MIN_RECORDS;
+    while (capacity < 2 * (reg->live + 1))
+        capacity *= 2;
+    int fd = open(REGISTRY_TMP_PATH, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return -1;
+    char *map = map_journal(fd, capacity, true);
+    if (!map) {
+        close(fd);
+        unlink(REGISTRY_TMP_PATH);
+        return -1;
+    }
+    uint32_t used = 1;
+    for (registry_entry_t *entry = reg->entries; entry; entry = entry->next)
+        write_record(map, used++, RECORD_ADD, 0, &entry->container);
+    if (rename(REGISTRY_TMP_PATH, REGISTRY_PATH) == -1) {
+        munmap(map, (size_t) capacity * REGISTRY_RECORD_SIZE);
+        close(fd);
+        unlink(REGISTRY_TMP_PATH);
+        return -1;
+    }
+
+    used = 1;
+    for (registry_entry_t *entry = reg->entries; entry; entry = entry->next)
+        entry->index = used++;
+    if (reg->map)
+        munmap(reg->map, (size_t) reg->capacity * REGISTRY_RECORD_SIZE);
+    if (reg->fd != -1)
+        close(reg->fd);
+    reg->fd = fd;
+    reg->map = map;
+    reg->capacity = capacity;
+    reg->used = used;
+    reg->compactions++;
+    return 0;
+}
+
+static int append(registry_t *reg, record_type_t type, uint32_t target, const container_record_t *container) {
+    /**
+     * adds a record to the end of the journal, compacting or growing it first if it is full
+     * return:
+     * the record's index, or -1 if there was no room for it
+    **/
+    // Mostly dead records, rewriting them makes more room than growing would. The container a remove is for has
+    // already been left out, and the one an update is for was written as it is now.
+    if (reg->used == reg->capacity && reg->live * 2 < reg->used && compact(reg) == 0 && type != RECORD_ADD)
+        return 0;
+    if (reg->used == reg->capacity) {
+        size_t old_size = (size_t) reg->capacity * REGISTRY_RECORD_SIZE;
+        if (ftruncate(reg->fd, old_size * 2) == -1)
+            return -1;
+        char *map = mremap(reg->map, old_size, old_size * 2, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED)
+            return -1;
+        reg->map = map;
+        reg->capacity *= 2;
+    }
+    write_record(reg->map, reg->used, type, target, container);
+    return reg->used++;
+}
+
+static void link_entry(registry_t *reg, registry_entry_t *entry) {
+    entry->prev = NULL;
+    entry->next = reg->entries;
+    if (reg->entries)
+        reg->entries->prev = entry;
+    reg->entries = entry;
+    reg->live++;
+}
+
+static void unlink_entry(registry_t *reg, registry_entry_t *entry) {
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        reg->entries = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    reg->live--;
+}
+
+static bool still_running(registry_entry_t *entry) {
+    /**
+     * checks a container from the journal is still there, taking a pidfd on its runtime if it is
+     * return:
+     * true if its runtime is the same process and its cgroup still exists
+    **/
+    container_record_t *container = &entry->container;
+    if (container->pid <= 0 || access(container->cgroup, F_OK) != 0)
+        return false;
+    if (start_time(container->pid) != container->start_time)
+        return false;
+    entry->pidfd = pidfd_open(container->pid);
+    if (entry->pidfd == -1)
+        return false;
+    // The pid could have been reused between the two looks, once the pidfd is open it can't be any more.
+    if (start_time(container->pid) != container->start_time) {
+        close(entry->pidfd);
+        entry->pidfd = -1;
+        return false;
+    }
+    return true;
+}
+
+static void replay(registry_t *reg) {
+    // Adds are kept by index until the end so a remove can find the one it cancels without a search.
+    registry_entry_t **added = calloc(reg->capacity, sizeof(registry_entry_t *));
+    uint32_t index = 1;
+    for (; added && index < reg->capacity; index++) {
+        journal_record_t *record = record_at(reg, index);
+        if (record->type == RECORD_NONE)
+            break;
+        if (record->length > sizeof(record->container) || record->crc != checksum(record)) {
+            fprintf(stderr, "Registry journal ends in a torn record at %u, ignoring it\n", index);
+            break;
+        }
+        if (record->type == RECORD_ADD) {
+            registry_entry_t *entry = calloc(1, sizeof(registry_entry_t));
+            if (!entry)
+                break;
+            memcpy(&entry->container, &record->container, sizeof(entry->container));
+            added[index] = entry;
+        }
+        else if (record->type == RECORD_UPDATE && record->target < index && added[record->target]) {
+            memcpy(&added[record->target]->container, &record->container, sizeof(record->container));
+        }
+        else if (record->type == RECORD_REMOVE && record->target < index) {
+            free(added[record->target]);
+            added[record->target] = NULL;
+        }
+    }
+    reg->replayed = index - 1;
+
+    for (uint32_t i = 1; added && i < index; i++) {
+        registry_entry_t *entry = added[i];
+        if (!entry)
+            continue;
+        entry->pidfd = -1;
+        if (still_running(entry)) {
+            entry->reattached = true;
+            link_entry(reg, entry);
+            reg->reattached++;
+        }
+        else {
+            fprintf(stderr, "Container %s is gone, forgetting it\n", entry->container.name);
+            free(entry);
+            reg->gone++;
+        }
+    }
+    free(added);
+}
+
+int registry_open(registry_t *reg) {
+    /**
+     * opens the journal, replays it and keeps whatever is still running
+     * return:
+     * 0 on success, -1 on error
+    **/
+    double start = now_ms();
+    memset(reg, 0, sizeof(*reg));
+    reg->fd = -1;
+    mkdir("/var/run/drydock", 0755);
+    int fd = open(REGISTRY_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror("Could not open the registry journal");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("Could not open the registry journal");
+        close(fd);
+        return -1;
+    }
+
+    // Anything that doesn't look like a journal is started over, there is no container it could tell us about.
+    uint32_t capacity = st.st_size / REGISTRY_RECORD_SIZE;
+    bool fresh = capacity < 2 || st.st_size % REGISTRY_RECORD_SIZE != 0;
+    if (fresh)
+        capacity = REGISTRY_MIN_RECORDS;
+    reg->map = map_journal(fd, capacity, fresh);
+    if (!reg->map) {
+        perror("Could not map the registry journal");
+        close(fd);
+        return -1;
+    }
+    reg->fd = fd;
+    reg->capacity = capacity;
+    journal_header_t *header = (journal_header_t *) reg->map;
+    if (!fresh && (memcmp(header->magic, REGISTRY_MAGIC, sizeof(header->magic)) != 0 ||
+                   header->record_size != REGISTRY_RECORD_SIZE))
+        fprintf(stderr, "%s is not a registry journal, starting a new one\n", REGISTRY_PATH);
+    else
+        replay(reg);
+
+    if (compact(reg) == -1) {
+        perror("Could not compact the registry journal");
+        registry_close(reg);
+        return -1;
+    }
+    reg->compactions = 0;
+    reg->replay_ms = now_ms() - start;
+    fprintf(stderr, "Registry replayed %u records in %.2fms, %lu containers still running, %lu gone\n",
+            reg->replayed, reg->replay_ms, reg->reattached, reg->gone);
+    return 0;
+}
+
+void registry_close(registry_t *reg) {
+    registry_entry_t *entry = reg->entries;
+    while (entry) {
+        registry_entry_t *next = entry->next;
+        if (entry->pidfd != -1)
+            close(entry->pidfd);
+        free(entry);
+        entry = next;
+    }
+    reg->entries = NULL;
+    reg->live = 0;
+    if (reg->map)
+        munmap(reg->map, (size_t) reg->capacity * REGISTRY_RECORD_SIZE);
+    if (reg->fd != -1)
+        close(reg->fd);
+    reg->map = NULL;
+    reg->fd = -1;
+}
+
+registry_entry_t *registry_add(registry_t *reg, const container_record_t *container) {
+    registry_entry_t *entry = calloc(1, sizeof(registry_entry_t));
+    if (!entry)
+        return NULL;
+    memcpy(&entry->container, container, sizeof(entry->container));
+    // A runtime that has been reaped already can't be watched, and there is nothing left to remember.
+    entry->pidfd = pidfd_open(container->pid);
+    if (entry->pidfd == -1) {
+        free(entry);
+        return NULL;
+    }
+    int index = append(reg, RECORD_ADD, 0, container);
+    if (index == -1) {
+        perror("Could not record a container in the registry journal");
+        close(entry->pidfd);
+        free(entry);
+        return NULL;
+    }
+    entry->index = index;
+    link_entry(reg, entry);
+    return entry;
+}
+
+int registry_update(registry_t *reg, registry_entry_t *entry) {
+    return append(reg, RECORD_UPDATE, entry->index, &entry->container) == -1 ? -1 : 0;
+}
+
+void registry_remove(registry_t *reg, registry_entry_t *entry) {
+    unlink_entry(reg, entry);
+    // Failing to record this is harmless, the next start finds the runtime gone.
+    append(reg, RECORD_REMOVE, entry->index, NULL);
+    close(entry->pidfd);
+    free(entry);
+    if (reg->used - 1 > 2 * reg->live + REGISTRY_COMPACT_SLACK && compact(reg) == -1)
+        perror("Could not compact the registry journal");
+}
+
+int registry_describe(container_record_t *container) {
+    struct statfs fs;
+    bool unified = statfs("/sys/fs/cgroup", &fs) == 0 && fs.f_type == CGROUP2_SUPER_MAGIC;
+    snprintf(container->cgroup, sizeof(container->cgroup),
+             unified ? REGISTRY_CGROUP_V2_FORMAT : REGISTRY_CGROUP_V1_FORMAT, container->name);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    container->created = ts.tv_sec + ts.tv_nsec / 1e9;
+    container->start_time = start_time(container->pid);
+    return container->start_time ? 0 : -1;
+}
+
+void registry_format_stats(registry_t *reg, char *buf, size_t len) {
+    snprintf(buf, len,
+             "registry: %zu containers, journal %u of %u records, %lu compactions\n"
+             "registry start: replayed %u records in %.2fms, %lu containers re-attached, %lu gone\n",
+             reg->live, reg->used, reg->capacity, reg->compactions, reg->replayed, reg->replay_ms,
+             reg->reattached, reg->gone);
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "containerfile.h"
+
+/**
+ * Every container the server has started and that is still running, kept in an append-only journal of fixed size
+ * records that is mmap'd, so recording a container is a copy into the page cache rather than a write. A record is
+ * only believed if its checksum matches, so a server killed halfway through one leaves nothing worse than a record
+ * that is ignored. The journal only has to outlive the server, not the machine, the containers don't either.
+ *
+ * A restarted server replays the journal and keeps the containers whose runtime is still the same process and whose
+ * cgroup is still there, the rest are forgotten. Once removals make up most of the journal it is rewritten with just
+ * the live records and renamed over the old one.
+ * */
+
+#define REGISTRY_PATH "/var/run/drydock/registry.journal"
+#define REGISTRY_RECORD_SIZE 4096   // a page, so a record is never split over two
+#define REGISTRY_MIN_RECORDS 1024
+#define REGISTRY_COMPACT_SLACK 1024 // dead records tolerated on top of as many as are live
+
+/**
+ * What the journal says about a container.
+ * */
+typedef struct {
+    char name[64];                  // also names its cgroup
+    pid_t pid;                      // the container runtime, it exits once the container has
+    unsigned long long start_time;  // of pid in clock ticks after boot, tells it apart from a later process
+    double created;                 // seconds since the epoch
+    char cgroup[128];
+    char netns[64];                 // empty if the runtime didn't say
+    char rootfs[CONTAINERFILE_MAX_VALUE];
+    char config[CONTAINERFILE_MAX_VALUE];
+    bool overlay;
+    int numa_node;                  // it was placed on, -1 if it floats
+    double cpu_cores;               // committed to numa_node until it exits
+} container_record_t;
+
+typedef struct registry_entry {
+    container_record_t container;
+    int pidfd;                      // readable once the runtime exits
+    uint32_t index;                 // of its record in the journal
+    bool reattached;                // started by an earlier server
+    int row;                        // in the shared container table, -1 if it isn't there, kept by the server
+    struct pressure_watch *pressure; // its stall triggers, NULL if it has none, kept by the server
+    struct registry_entry *prev;
+    struct registry_entry *next;
+} registry_entry_t;
+
+typedef struct {
+    int fd;
+    char *map;
+    uint32_t capacity;              // records the file has room for, the first holds the header
+    uint32_t used;
+    size_t live;
+    registry_entry_t *entries;
+    // what the last start found
+    uint32_t replayed;
+    unsigned long reattached;
+    unsigned long gone;
+    double replay_ms;
+    unsigned long compactions;
+} registry_t;
+
+/**
+ * Opens the journal at REGISTRY_PATH, creating it if there is none, and replays it. Containers that are still
+ * running are kept with a pidfd each and the journal is compacted down to them
+ * returns 0 on success, -1 on error
+ * */
+int registry_open(registry_t *reg);
+
+/**
+ * Flushes nothing, the journal is always up to date, but unmaps it and closes every pidfd. The containers keep
+ * running and the next server picks them up
+ * */
+void registry_close(registry_t *reg);
+
+/**
+ * Records a container that has just been started
+ * returns its entry, or NULL if the runtime has already gone or the journal could not grow
+ * */
+registry_entry_t *registry_add(registry_t *reg, const container_record_t *container);
+
+/**
+ * Records that entry->container has changed, its limits were updated
+ * returns 0 on success, -1 if the journal could not grow
+ * */
+int registry_update(registry_t *reg, registry_entry_t *entry);
+
+/**
+ * Forgets a container whose runtime has exited, freeing entry
+ * */
+void registry_remove(registry_t *reg, registry_entry_t *entry);
+
+/**
+ * Fills in where a container's cgroup is and when its runtime started, everything else is up to the caller
+ * returns 0 on success, -1 if the runtime has already gone
+ * */
+int registry_describe(container_record_t *container);
+
+/**
+ * Writes human readable counts and the cost of the last replay into buf
+ * */
+void registry_format_stats(registry_t *reg, char *buf, size_t len);
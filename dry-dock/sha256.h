@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_HEX_SIZE (2 * SHA256_DIGEST_SIZE + 1)
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;        // bytes hashed so far
+    uint8_t block[64];
+    size_t block_len;
+} sha256_t;
+
+void sha256_init(sha256_t *ctx);
+void sha256_update(sha256_t *ctx, const void *data, size_t len);
+void sha256_final(sha256_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * Writes digest as lowercase hex into hex, which needs SHA256_HEX_SIZE bytes
+ * */
+void sha256_to_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char *hex);
+
+/**
+ * Parses a digest written by sha256_to_hex, with or without a "sha256:" prefix
+ * returns 0 on success, -1 if hex is not a digest
+ * */
+int sha256_from_hex(const char *hex, uint8_t digest[SHA256_DIGEST_SIZE]);
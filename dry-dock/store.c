@@ -0,0 +1,1134 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "extract.h"
+#include "store.h"
+
+#define STORE_INDEX_MAGIC "DDSTORE1"
+#define STORE_INDEX_VERSION 1
+#define STORE_INITIAL_CAPACITY 1024
+#define STORE_MAX_NAME 128
+
+#define STORE_SLOT_EMPTY 0
+#define STORE_SLOT_USED 1
+#define STORE_SLOT_DELETED 2    // tombstone, keeps probe chains running through it intact
+
+// Grow once this many tenths of the slots are used or tombstones.
+#define STORE_MAX_LOAD 7
+
+#define COPY_CHUNK (1 << 20)
+
+#define TAR_BLOCK 512
+// The same limit extract.c puts on a pax header.
+#define MAX_PAX_HEADER (1 << 20)
+
+struct store_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t deleted;
+    uint64_t reserved;
+};
+
+static store_entry_t *index_entries(store_t *store) {
+    return (store_entry_t *) (store->index + 1);
+}
+
+static size_t index_size(uint32_t capacity) {
+    return sizeof(store_index_header_t) + (size_t) capacity * sizeof(store_entry_t);
+}
+
+static void store_path(store_t *store, const char *name, char *path, size_t len) {
+    snprintf(path, len, "%s/%s", store->root, name);
+}
+
+static void blob_name(const uint8_t digest[SHA256_DIGEST_SIZE], char *name, size_t len) {
+    char hex[SHA256_HEX_SIZE];
+    sha256_to_hex(digest, hex);
+    // Sharded on the first byte so no directory ends up with every blob in it.
+    snprintf(name, len, "%.2s/%s", hex, hex);
+}
+
+void store_blob_dir(store_t *store, char *path, size_t len) {
+    snprintf(path, len, "%s/blobs/sha256", store->root);
+}
+
+void store_blob_path(store_t *store, const uint8_t digest[SHA256_DIGEST_SIZE], char *path, size_t len) {
+    char name[SHA256_HEX_SIZE + 4];
+    blob_name(digest, name, sizeof(name));
+    snprintf(path, len, "%s/blobs/sha256/%s", store->root, name);
+}
+
+static void unmap_index(store_t *store) {
+    if (store->index)
+        munmap(store->index, store->mapped_len);
+    if (store->index_fd != -1)
+        close(store->index_fd);
+    store->index = NULL;
+    store->index_fd = -1;
+}
+
+static int map_index(store_t *store) {
+    unmap_index(store);
+    char path[PATH_MAX];
+    store_path(store, "index", path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror("open store index");
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    store_index_header_t *index = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (index == MAP_FAILED) {
+        perror("mmap store index");
+        close(fd);
+        return -1;
+    }
+    if ((size_t) st.st_size < sizeof(*index) || memcmp(index->magic, STORE_INDEX_MAGIC, 8) != 0 ||
+        index->version != STORE_INDEX_VERSION || (size_t) st.st_size < index_size(index->capacity)) {
+        fprintf(stderr, "%s is not a store index\n", path);
+        munmap(index, st.st_size);
+        close(fd);
+        return -1;
+    }
+    store->index = index;
+    store->index_fd = fd;
+    store->index_ino = st.st_ino;
+    store->mapped_len = st.st_size;
+    return 0;
+}
+
+/**
+ * Finds the slot for digest by linear probing from the digest's first bytes, which are already uniformly
+ * distributed.
+ * returns the entry holding digest, otherwise the slot it should be inserted into, or NULL if the table is full
+ * */
+static store_entry_t *find_slot(store_index_header_t *index, const uint8_t digest[SHA256_DIGEST_SIZE]) {
+    store_entry_t *entries = (store_entry_t *) (index + 1);
+    store_entry_t *free_slot = NULL;
+    uint32_t start;
+    memcpy(&start, digest, sizeof(start));
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        store_entry_t *entry = &entries[(start + i) % index->capacity];
+        if (entry->state == STORE_SLOT_EMPTY)
+            return free_slot ? free_slot : entry;
+        if (entry->state == STORE_SLOT_DELETED) {
+            if (!free_slot)
+                free_slot = entry;
+        }
+        else if (memcmp(entry->digest, digest, SHA256_DIGEST_SIZE) == 0) {
+            return entry;
+        }
+    }
+    return free_slot;
+}
+
+static store_entry_t *find_entry(store_t *store, const uint8_t digest[SHA256_DIGEST_SIZE]) {
+    store_entry_t *entry = find_slot(store->index, digest);
+    if (entry && entry->state == STORE_SLOT_USED && memcmp(entry->digest, digest, SHA256_DIGEST_SIZE) == 0)
+        return entry;
+    return NULL;
+}
+
+/**
+ * Writes a fresh index with room for capacity entries, copying over the live entries of old if given, and
+ * swaps it in with a rename so processes that still have the old one mapped notice the new inode.
+ * Must hold the store lock exclusively.
+ * */
+static int write_index(store_t *store, uint32_t capacity, store_index_header_t *old) {
+    char path[PATH_MAX], tmp_path[PATH_MAX];
+    store_path(store, "index", path, sizeof(path));
+    store_path(store, "index.new", tmp_path, sizeof(tmp_path));
+
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1 || ftruncate(fd, index_size(capacity)) == -1) {
+        perror("create store index");
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    store_index_header_t *index = mmap(NULL, index_size(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (index == MAP_FAILED) {
+        perror("mmap store index");
+        close(fd);
+        return -1;
+    }
+    memcpy(index->magic, STORE_INDEX_MAGIC, 8);
+    index->version = STORE_INDEX_VERSION;
+    index->capacity = capacity;
+    if (old) {
+        store_entry_t *entries = (store_entry_t *) (old + 1);
+        for (uint32_t i = 0; i < old->capacity; i++) {
+            if (entries[i].state == STORE_SLOT_USED) {
+                *find_slot(index, entries[i].digest) = entries[i];
+                index->used++;
+            }
+        }
+    }
+    int result = msync(index, index_size(capacity), MS_SYNC);
+    munmap(index, index_size(capacity));
+    close(fd);
+    if (result == -1 || rename(tmp_path, path) == -1) {
+        perror("replace store index");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Must hold the store lock exclusively.
+static int make_room(store_t *store) {
+    store_index_header_t *index = store->index;
+    if ((uint64_t) (index->used + index->deleted + 1) * 10 <= (uint64_t) index->capacity * STORE_MAX_LOAD)
+        return 0;
+    // Mostly tombstones only needs a rebuild at the same size.
+    uint32_t capacity = (uint64_t) (index->used + 1) * 10 > (uint64_t) index->capacity * STORE_MAX_LOAD / 2 ?
+                        index->capacity * 2 : index->capacity;
+    if (write_index(store, capacity, index) == -1)
+        return -1;
+    return map_index(store);
+}
+
+static int lock_store(store_t *store, int operation) {
+    while (flock(store->lock_fd, operation) == -1) {
+        if (errno != EINTR) {
+            perror("lock store");
+            return -1;
+        }
+    }
+    // Someone else may have grown the index since we mapped it.
+    char path[PATH_MAX];
+    struct stat st;
+    store_path(store, "index", path, sizeof(path));
+    if (stat(path, &st) == -1 || (st.st_ino != store->index_ino && map_index(store) == -1)) {
+        flock(store->lock_fd, LOCK_UN);
+        return -1;
+    }
+    return 0;
+}
+
+static void unlock_store(store_t *store) {
+    flock(store->lock_fd, LOCK_UN);
+}
+
+int store_open(store_t *store, const char *root) {
+    memset(store, 0, sizeof(*store));
+    store->lock_fd = -1;
+    store->index_fd = -1;
+    snprintf(store->root, sizeof(store->root), "%s", root);
+
+    const char *dirs[] = { "", "/blobs", "/blobs/sha256", "/images", "/tmp" };
+    char path[PATH_MAX];
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        snprintf(path, sizeof(path), "%s%s", root, dirs[i]);
+        if (mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1 && errno != EEXIST) {
+            fprintf(stderr, "mkdir %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+
+    store_path(store, "lock", path, sizeof(path));
+    store->lock_fd = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (store->lock_fd == -1) {
+        perror("open store lock");
+        return -1;
+    }
+    if (flock(store->lock_fd, LOCK_EX) == -1) {
+        perror("lock store");
+        store_close(store);
+        return -1;
+    }
+    store_path(store, "index", path, sizeof(path));
+    int result = 0;
+    if (access(path, F_OK) != 0)
+        result = write_index(store, STORE_INITIAL_CAPACITY, NULL);
+    if (result == 0)
+        result = map_index(store);
+    unlock_store(store);
+    if (result == -1)
+        store_close(store);
+    return result;
+}
+
+void store_close(store_t *store) {
+    if (store->index)
+        msync(store->index, store->mapped_len, MS_ASYNC);
+    unmap_index(store);
+    if (store->lock_fd != -1)
+        close(store->lock_fd);
+    store->lock_fd = -1;
+}
+
+int store_lookup(store_t *store, const uint8_t digest[SHA256_DIGEST_SIZE], store_entry_t *entry) {
+    if (lock_store(store, LOCK_SH) == -1)
+        return -1;
+    store_entry_t *found = find_entry(store, digest);
+    if (found)
+        *entry = *found;
+    unlock_store(store);
+    return found ? 0 : -1;
+}
+
+int store_ref(store_t *store, const uint8_t digest[SHA256_DIGEST_SIZE]) {
+    if (lock_store(store, LOCK_EX) == -1)
+        return -1;
+    store_entry_t *entry = find_entry(store, digest);
+    int refs = entry ? (int) ++entry->refs : -1;
+    unlock_store(store);
+    return refs;
+}
+
+int store_unref(store_t *store, const uint8_t digest[SHA256_DIGEST_SIZE]) {
+    if (lock_store(store, LOCK_EX) == -1)
+        return -1;
+    store_entry_t *entry = find_entry(store, digest);
+    int refs = -1;
+    if (entry) {
+        refs = entry->refs > 0 ? (int) --entry->refs : 0;
+        if (refs == 0) {
+            char path[PATH_MAX];
+            store_blob_path(store, digest, path, sizeof(path));
+            if (unlink(path) == -1 && errno != ENOENT)
+                perror("unlink blob");
+            entry->state = STORE_SLOT_DELETED;
+            store->index->used--;
+            store->index->deleted++;
+        }
+    }
+    unlock_store(store);
+    return refs;
+}
+
+/**
+ * Moves the finished temporary copy at tmp_path into place as the blob for digest, or throws it away if
+ * another process stored the same blob while we were copying. Either way adds a reference.
+ * returns the blob's reference count, or -1 on error
+ * */
+static int add_blob(store_t *store, const uint8_t digest[SHA256_DIGEST_SIZE], uint64_t size, const char *tmp_path) {
+    if (lock_store(store, LOCK_EX) == -1) {
+        unlink(tmp_path);
+        return -1;
+    }
+    int refs = -1;
+    store_entry_t *entry = find_entry(store, digest);
+    if (entry) {
+        unlink(tmp_path);
+        refs = ++entry->refs;
+    }
+    else if (make_room(store) == 0) {
+        char path[PATH_MAX];
+        store_blob_path(store, digest, path, sizeof(path));
+        char *shard = strrchr(path, '/');
+        *shard = '\0';
+        if (mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1 && errno != EEXIST)
+            perror("mkdir blob shard");
+        *shard = '/';
+        if (rename(tmp_path, path) == -1) {
+            perror("store blob");
+            unlink(tmp_path);
+        }
+        else {
+            entry = find_slot(store->index, digest);
+            if (entry->state == STORE_SLOT_DELETED)
+                store->index->deleted--;
+            memcpy(entry->digest, digest, SHA256_DIGEST_SIZE);
+            entry->size = size;
+            entry->refs = 1;
+            entry->state = STORE_SLOT_USED;
+            store->index->used++;
+            refs = 1;
+        }
+    }
+    unlock_store(store);
+    return refs;
+}
+
+static int open_tmp_blob(store_t *store, char *tmp_path, size_t len) {
+    snprintf(tmp_path, len, "%s/tmp/blob.XXXXXX", store->root);
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd == -1) {
+        perror("create temporary blob");
+        return -1;
+    }
+    // Blobs are shared by everything that references them, nobody gets to edit one in place.
+    fchmod(fd, S_IRUSR | S_IRGRP | S_IROTH);
+    return fd;
+}
+
+static int hash_fd(int fd, uint8_t digest[SHA256_DIGEST_SIZE], uint64_t *size) {
+    char *buf = malloc(COPY_CHUNK);
+    if (!buf)
+        return -1;
+    sha256_t ctx;
+    sha256_init(&ctx);
+    ssize_t got;
+    while ((got = read(fd, buf, COPY_CHUNK)) != 0) {
+        if (got == -1) {
+            if (errno == EINTR)
+                continue;
+            free(buf);
+            return -1;
+        }
+        sha256_update(&ctx, buf, got);
+    }
+    free(buf);
+    sha256_final(&ctx, digest);
+    *size = ctx.length;
+    return 0;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t wrote = write(fd, buf, len);
+        if (wrote == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += wrote;
+        len -= wrote;
+    }
+    return 0;
+}
+
+int store_put_file(store_t *store, const char *path, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // Hash first without writing anything, the common case for a shared base layer is that it is stored already.
+    uint64_t size;
+    if (hash_fd(fd, digest, &size) == -1) {
+        fprintf(stderr, "read %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    int refs = store_ref(store, digest);
+    if (refs != -1) {
+        close(fd);
+        return refs;
+    }
+
+    // Hash again while copying, so the blob is named after what was actually written even if the file
+    // changed underneath us.
+    char tmp_path[PATH_MAX];
+    int tmp_fd = open_tmp_blob(store, tmp_path, sizeof(tmp_path));
+    char *buf = malloc(COPY_CHUNK);
+    if (tmp_fd == -1 || !buf || lseek(fd, 0, SEEK_SET) == -1) {
+        free(buf);
+        close(fd);
+        if (tmp_fd != -1) {
+            close(tmp_fd);
+            unlink(tmp_path);
+        }
+        return -1;
+    }
+    sha256_t ctx;
+    sha256_init(&ctx);
+    ssize_t got;
+    while ((got = read(fd, buf, COPY_CHUNK)) != 0) {
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got == -1 || write_all(tmp_fd, buf, got) == -1)
+            break;
+        sha256_update(&ctx, buf, got);
+    }
+    free(buf);
+    close(fd);
+    if (got != 0 || fsync(tmp_fd) == -1) {
+        perror("copy blob");
+        close(tmp_fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(tmp_fd);
+    sha256_final(&ctx, digest);
+    return add_blob(store, digest, ctx.length, tmp_path);
+}
+
+// Without sync the caller syncs the filesystem itself once it has stored everything it is going to.
+static int put_data(store_t *store, const void *data, size_t len, bool sync, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    sha256_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+    int refs = store_ref(store, digest);
+    if (refs != -1)
+        return refs;
+
+    char tmp_path[PATH_MAX];
+    int fd = open_tmp_blob(store, tmp_path, sizeof(tmp_path));
+    if (fd == -1)
+        return -1;
+    if (write_all(fd, data, len) == -1 || (sync && fsync(fd) == -1)) {
+        perror("write blob");
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(fd);
+    return add_blob(store, digest, len, tmp_path);
+}
+
+int store_put_buffer(store_t *store, const void *data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    return put_data(store, data, len, true, digest);
+}
+
+int store_open_blob(store_t *store, const uint8_t digest[SHA256_DIGEST_SIZE]) {
+    store_entry_t entry;
+    if (store_lookup(store, digest, &entry) == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+    char path[PATH_MAX];
+    store_blob_path(store, digest, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    // Blobs were hashed on their way in, from then on the index is trusted.
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if ((uint64_t) st.st_size != entry.size) {
+        fprintf(stderr, "Blob %s is not the size the index has for it\n", path);
+        close(fd);
+        errno = EBADMSG;
+        return -1;
+    }
+    return fd;
+}
+
+int store_verify_blob(store_t *store, const uint8_t digest[SHA256_DIGEST_SIZE]) {
+    int fd = store_open_blob(store, digest);
+    if (fd == -1)
+        return -1;
+    uint8_t actual[SHA256_DIGEST_SIZE];
+    uint64_t size;
+    int result = hash_fd(fd, actual, &size);
+    close(fd);
+    if (result == 0 && memcmp(actual, digest, SHA256_DIGEST_SIZE) != 0) {
+        char path[PATH_MAX];
+        store_blob_path(store, digest, path, sizeof(path));
+        fprintf(stderr, "Blob %s does not match its digest\n", path);
+        errno = EBADMSG;
+        result = -1;
+    }
+    return result;
+}
+
+int store_foreach(store_t *store, void (*visit)(const store_entry_t *entry, void *arg), void *arg) {
+    // Copy the live entries out so visit can call back into the store without us holding the lock.
+    if (lock_store(store, LOCK_SH) == -1)
+        return -1;
+    uint32_t count = 0;
+    store_entry_t *copy = malloc((store->index->used + 1) * sizeof(store_entry_t));
+    if (copy) {
+        store_entry_t *entries = index_entries(store);
+        for (uint32_t i = 0; i < store->index->capacity; i++) {
+            if (entries[i].state == STORE_SLOT_USED)
+                copy[count++] = entries[i];
+        }
+    }
+    unlock_store(store);
+    if (!copy)
+        return -1;
+    for (uint32_t i = 0; i < count; i++)
+        visit(&copy[i], arg);
+    free(copy);
+    return 0;
+}
+
+/**
+ * Layers are split up as they are imported. Every regular file becomes a blob of its own, and what is left of the
+ * tarball, its headers with each file's contents swapped for a pax record naming the file's blob, is the layer's
+ * blob. extract.c clones the files back out of their blobs when it unpacks the layer.
+ * */
+
+typedef struct {
+    uint8_t (*digests)[SHA256_DIGEST_SIZE];
+    size_t count;
+    size_t cap;
+} digest_list_t;
+
+typedef struct {
+    FILE *out;              // the layer blob being written
+    sha256_t hash;          // of everything written to out
+    digest_list_t files;    // blobs the layer holds a reference to
+    int new_files;          // of those, the ones that weren't stored yet
+} layer_writer_t;
+
+static int add_digest(digest_list_t *list, const uint8_t digest[SHA256_DIGEST_SIZE]) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 256;
+        void *grown = realloc(list->digests, cap * SHA256_DIGEST_SIZE);
+        if (!grown)
+            return -1;
+        list->digests = grown;
+        list->cap = cap;
+    }
+    memcpy(list->digests[list->count++], digest, SHA256_DIGEST_SIZE);
+    return 0;
+}
+
+static void unref_all(store_t *store, const digest_list_t *list) {
+    for (size_t i = 0; i < list->count; i++)
+        store_unref(store, list->digests[i]);
+}
+
+static uint64_t parse_number(const char *field, size_t len) {
+    // GNU tar stores numbers too big for octal as big endian base-256 with the top bit set.
+    if ((unsigned char) field[0] & 0x80) {
+        uint64_t value = (unsigned char) field[0] & 0x7f;
+        for (size_t i = 1; i < len; i++)
+            value = value << 8 | (unsigned char) field[i];
+        return value;
+    }
+    uint64_t value = 0;
+    size_t i = 0;
+    while (i < len && field[i] == ' ')
+        i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value << 3 | (field[i] - '0');
+    return value;
+}
+
+static bool valid_checksum(const unsigned char *block) {
+    uint64_t expected = parse_number((const char *) block + 148, 8);
+    uint64_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += i >= 148 && i < 156 ? ' ' : block[i];
+    return sum == expected;
+}
+
+static void set_checksum(unsigned char *block) {
+    unsigned int sum = 0;
+    memset(block + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += block[i];
+    snprintf((char *) block + 148, 8, "%06o", sum);
+}
+
+static bool zero_block(const unsigned char *block) {
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        if (block[i])
+            return false;
+    }
+    return true;
+}
+
+static uint64_t padding(uint64_t size) {
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+static uint64_t entry_data(char type, uint64_t size, uint64_t *pax_size) {
+    // How much data follows a header, read the way extract.c reads it. Links and device nodes have none whatever
+    // their size field says, and a pax size is for the entry after it.
+    if (type == 'L' || type == 'K' || type == 'x' || type == 'g')
+        return size;
+    uint64_t data = *pax_size != UINT64_MAX ? *pax_size : size;
+    *pax_size = UINT64_MAX;
+    return type != '\0' && strchr("12346", type) ? 0 : data;
+}
+
+static int read_layer(gzFile in, void *buf, size_t len) {
+    // gzread passes plain tarballs through as they are. len is never more than COPY_CHUNK.
+    if (gzread(in, buf, len) == (int) len)
+        return 0;
+    int error;
+    const char *message = gzerror(in, &error);
+    fprintf(stderr, "Layer is %s\n", error != Z_OK && error != Z_BUF_ERROR ? message : "truncated");
+    errno = EIO;
+    return -1;
+}
+
+static int skip_layer(gzFile in, uint64_t len) {
+    char buf[16 * TAR_BLOCK];
+    while (len > 0) {
+        size_t take = len < sizeof(buf) ? len : sizeof(buf);
+        if (read_layer(in, buf, take) == -1)
+            return -1;
+        len -= take;
+    }
+    return 0;
+}
+
+static char *read_pax(gzFile in, uint64_t size) {
+    if (size > MAX_PAX_HEADER) {
+        fprintf(stderr, "Layer has an oversized pax header\n");
+        errno = EINVAL;
+        return NULL;
+    }
+    char *records = malloc(size + 1);
+    if (!records || read_layer(in, records, size) == -1 || skip_layer(in, padding(size)) == -1) {
+        free(records);
+        return NULL;
+    }
+    records[size] = '\0';
+    return records;
+}
+
+static bool pax_value(const char *records, size_t len, const char *key, char *value, size_t value_len) {
+    // Records look like "<length> <key>=<value>\n", the last one for a key wins.
+    bool found = false;
+    size_t key_len = strlen(key);
+    const char *p = records;
+    while (p < records + len) {
+        char *rest;
+        unsigned long record_len = strtoul(p, &rest, 10);
+        if (record_len == 0 || *rest != ' ' || p + record_len > records + len || p[record_len - 1] != '\n')
+            break;
+        rest++;
+        const char *end = p + record_len - 1;
+        if ((size_t) (end - rest) > key_len && strncmp(rest, key, key_len) == 0 && rest[key_len] == '=') {
+            snprintf(value, value_len, "%.*s", (int) (end - rest - key_len - 1), rest + key_len + 1);
+            found = true;
+        }
+        p += record_len;
+    }
+    return found;
+}
+
+static size_t pax_record(char *buf, size_t len, const char *key, const char *value) {
+    // The length at the front counts its own digits.
+    size_t body = strlen(key) + strlen(value) + 3;
+    size_t total = body + 1;
+    while ((size_t) snprintf(NULL, 0, "%zu", total) + body != total)
+        total = snprintf(NULL, 0, "%zu", total) + body;
+    return snprintf(buf, len, "%zu %s=%s\n", total, key, value);
+}
+
+static int emit(layer_writer_t *w, const void *data, size_t len) {
+    sha256_update(&w->hash, data, len);
+    return fwrite(data, 1, len, w->out) == len ? 0 : -1;
+}
+
+static int emit_padding(layer_writer_t *w, uint64_t size) {
+    static const char zeros[TAR_BLOCK];
+    return emit(w, zeros, padding(size));
+}
+
+static int copy_data(gzFile in, layer_writer_t *w, uint64_t size) {
+    // Also copies the padding after the data.
+    char buf[16 * TAR_BLOCK];
+    uint64_t left = size + padding(size);
+    while (left > 0) {
+        size_t take = left < sizeof(buf) ? left : sizeof(buf);
+        if (read_layer(in, buf, take) == -1 || emit(w, buf, take) == -1)
+            return -1;
+        left -= take;
+    }
+    return 0;
+}
+
+static int put_layer_file(store_t *store, gzFile in, uint64_t size, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    /**
+     * stores the next size bytes of the layer, a file's contents, as a blob without syncing it
+     * return:
+     * the blob's reference count, or -1 on error
+    **/
+    if (size <= COPY_CHUNK) {
+        // Hashed before anything is written, most files of a layer built on a stored base are stored already.
+        char *buf = malloc(size ? size : 1);
+        int refs = buf && read_layer(in, buf, size) == 0 ? put_data(store, buf, size, false, digest) : -1;
+        free(buf);
+        return refs;
+    }
+    // Too big to hold on to, it is hashed while it is copied into a temporary blob.
+    char tmp_path[PATH_MAX];
+    int fd = open_tmp_blob(store, tmp_path, sizeof(tmp_path));
+    char *buf = malloc(COPY_CHUNK);
+    sha256_t ctx;
+    sha256_init(&ctx);
+    uint64_t left = size;
+    while (fd != -1 && buf && left > 0) {
+        size_t take = left < COPY_CHUNK ? left : COPY_CHUNK;
+        if (read_layer(in, buf, take) == -1 || write_all(fd, buf, take) == -1)
+            break;
+        sha256_update(&ctx, buf, take);
+        left -= take;
+    }
+    free(buf);
+    if (fd == -1)
+        return -1;
+    close(fd);
+    if (left > 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    sha256_final(&ctx, digest);
+    return add_blob(store, digest, size, tmp_path);
+}
+
+static int split_file(store_t *store, gzFile in, layer_writer_t *w, unsigned char *header, uint64_t size) {
+    // The entry keeps everything but its contents, a pax header in front of it says which blob has them.
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    int refs = put_layer_file(store, in, size, digest);
+    if (refs == -1)
+        return -1;
+    if (add_digest(&w->files, digest) == -1) {
+        store_unref(store, digest);
+        return -1;
+    }
+    if (refs == 1)
+        w->new_files++;
+    if (skip_layer(in, padding(size)) == -1)
+        return -1;
+
+    char name[SHA256_HEX_SIZE + 4], size_text[24], records[256];
+    blob_name(digest, name, sizeof(name));
+    snprintf(size_text, sizeof(size_text), "%llu", (unsigned long long) size);
+    size_t len = pax_record(records, sizeof(records), "size", "0");
+    len += pax_record(records + len, sizeof(records) - len, EXTRACT_BLOB_KEY, name);
+    len += pax_record(records + len, sizeof(records) - len, EXTRACT_BLOB_SIZE_KEY, size_text);
+
+    unsigned char pax[TAR_BLOCK] = { 0 };
+    snprintf((char *) pax, 100, "././@PaxHeader");
+    snprintf((char *) pax + 100, 8, "%07o", 0644);
+    snprintf((char *) pax + 108, 8, "%07o", 0);
+    snprintf((char *) pax + 116, 8, "%07o", 0);
+    snprintf((char *) pax + 124, 12, "%011o", (unsigned int) len);
+    snprintf((char *) pax + 136, 12, "%011o", 0);
+    pax[156] = 'x';
+    memcpy(pax + 257, "ustar", 6);
+    memcpy(pax + 263, "00", 2);
+    set_checksum(pax);
+    snprintf((char *) header + 124, 12, "%011o", 0);
+    set_checksum(header);
+    if (emit(w, pax, TAR_BLOCK) == -1 || emit(w, records, len) == -1 || emit_padding(w, len) == -1 ||
+        emit(w, header, TAR_BLOCK) == -1)
+        return -1;
+    return 0;
+}
+
+static int split_layer(store_t *store, gzFile in, layer_writer_t *w) {
+    unsigned char block[TAR_BLOCK];
+    uint64_t pax_size = UINT64_MAX;
+    while (true) {
+        if (read_layer(in, block, TAR_BLOCK) == -1)
+            return -1;
+        if (zero_block(block))
+            return emit(w, block, TAR_BLOCK) == -1 || emit(w, block, TAR_BLOCK) == -1 ? -1 : 0;
+        if (!valid_checksum(block)) {
+            fprintf(stderr, "Layer is not a tarball, or it is corrupt\n");
+            errno = EINVAL;
+            return -1;
+        }
+        char type = block[156];
+        uint64_t size = entry_data(type, parse_number((const char *) block + 124, 12), &pax_size);
+        if (type == 'x') {
+            char *records = read_pax(in, size);
+            if (!records)
+                return -1;
+            char value[32];
+            int result = 0;
+            // Only the store gets to say a file is in a blob, extract.c would take a layer's word for it.
+            if (pax_value(records, size, EXTRACT_BLOB_KEY, value, sizeof(value)) ||
+                pax_value(records, size, EXTRACT_BLOB_SIZE_KEY, value, sizeof(value))) {
+                fprintf(stderr, "Layer already names store blobs, it has to be an ordinary tarball\n");
+                errno = EINVAL;
+                result = -1;
+            }
+            if (pax_value(records, size, "size", value, sizeof(value)))
+                pax_size = strtoull(value, NULL, 10);
+            if (result == 0 && (emit(w, block, TAR_BLOCK) == -1 || emit(w, records, size) == -1 ||
+                                emit_padding(w, size) == -1))
+                result = -1;
+            free(records);
+            if (result == -1)
+                return -1;
+        }
+        else if (type == '0' || type == '\0' || type == '7') {
+            if (split_file(store, in, w, block, size) == -1)
+                return -1;
+        }
+        else if (emit(w, block, TAR_BLOCK) == -1 || copy_data(in, w, size) == -1) {
+            return -1;
+        }
+    }
+}
+
+static int put_layer(store_t *store, const char *path, uint8_t digest[SHA256_DIGEST_SIZE], int *num_files,
+                     int *new_files) {
+    /**
+     * stores the layer tarball at path split into a blob per regular file and the layer blob naming them
+     * return:
+     * the layer blob's reference count, or -1 on error
+    **/
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    gzFile in = fd == -1 ? NULL : gzdopen(fd, "rb");
+    if (!in) {
+        fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    gzbuffer(in, COPY_CHUNK);
+    char tmp_path[PATH_MAX];
+    layer_writer_t w = { 0 };
+    sha256_init(&w.hash);
+    int tmp_fd = open_tmp_blob(store, tmp_path, sizeof(tmp_path));
+    if (tmp_fd != -1 && !(w.out = fdopen(tmp_fd, "w")))
+        close(tmp_fd);
+    int result = w.out ? split_layer(store, in, &w) : -1;
+    gzclose(in);
+    // Files were stored without syncing each one, one syncfs covers them all and the layer blob.
+    if (result == 0 && (fflush(w.out) == EOF || syncfs(fileno(w.out)) == -1)) {
+        perror("write layer blob");
+        result = -1;
+    }
+    if (w.out && fclose(w.out) == EOF)
+        result = -1;
+    int refs = -1;
+    if (result == 0) {
+        uint64_t size = w.hash.length;
+        sha256_final(&w.hash, digest);
+        refs = add_blob(store, digest, size, tmp_path);
+    }
+    else if (tmp_fd != -1) {
+        unlink(tmp_path);
+    }
+    // The files' references belong to the layer blob, a layer that was stored already has its own.
+    if (refs != 1)
+        unref_all(store, &w.files);
+    *num_files = w.files.count;
+    *new_files = w.new_files;
+    free(w.files.digests);
+    return refs;
+}
+
+static int layer_files(store_t *store, const uint8_t layer[SHA256_DIGEST_SIZE], digest_list_t *files) {
+    /**
+     * collects the file blobs a layer blob names
+     * return:
+     * 0 on success, -1 if the layer blob can't be read
+    **/
+    int fd = store_open_blob(store, layer);
+    gzFile in = fd == -1 ? NULL : gzdopen(fd, "rb");
+    if (!in) {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    unsigned char block[TAR_BLOCK];
+    uint64_t pax_size = UINT64_MAX;
+    int result;
+    while ((result = read_layer(in, block, TAR_BLOCK)) == 0 && !zero_block(block)) {
+        char type = block[156];
+        uint64_t size = entry_data(type, parse_number((const char *) block + 124, 12), &pax_size);
+        if (type != 'x') {
+            if ((result = skip_layer(in, size + padding(size))) == -1)
+                break;
+            continue;
+        }
+        char *records = read_pax(in, size);
+        if (!records) {
+            result = -1;
+            break;
+        }
+        char value[SHA256_HEX_SIZE + 4];
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        const char *hex;
+        if (pax_value(records, size, "size", value, sizeof(value)))
+            pax_size = strtoull(value, NULL, 10);
+        if (pax_value(records, size, EXTRACT_BLOB_KEY, value, sizeof(value)) && (hex = strrchr(value, '/')) &&
+            sha256_from_hex(hex + 1, digest) == 0)
+            result = add_digest(files, digest);
+        free(records);
+        if (result == -1)
+            break;
+    }
+    gzclose(in);
+    return result;
+}
+
+// The files' references belong to the layer blob, so they only go once nothing refers to it any more.
+static void release_layer(store_t *store, const uint8_t layer[SHA256_DIGEST_SIZE]) {
+    digest_list_t files = { 0 };
+    int listed = layer_files(store, layer, &files);
+    if (store_unref(store, layer) == 0 && listed == 0)
+        unref_all(store, &files);
+    free(files.digests);
+}
+
+static bool valid_image_name(const char *name) {
+    return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL && strlen(name) < STORE_MAX_NAME;
+}
+
+// prefix lets a temporary file sit next to the real one, hidden from image names by the leading dot.
+static int image_path(store_t *store, const char *prefix, const char *name, char *path, size_t len) {
+    return snprintf(path, len, "%s/images/%s%s", store->root, prefix, name) < (int) len ? 0 : -1;
+}
+
+// Image names are changed under their own lock, the store lock can't be held across calls into the store.
+static int lock_images(store_t *store) {
+    char path[PATH_MAX];
+    store_path(store, "images/.lock", path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1 || flock(fd, LOCK_EX) == -1) {
+        perror("lock store images");
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int read_image_manifest(store_t *store, const char *name, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    if (!valid_image_name(name))
+        return -1;
+    char path[PATH_MAX];
+    if (image_path(store, "", name, path, sizeof(path)) == -1)
+        return -1;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    char line[SHA256_HEX_SIZE + 16];
+    int result = -1;
+    if (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        result = sha256_from_hex(line, digest);
+    }
+    fclose(f);
+    return result;
+}
+
+static int read_manifest_layers(store_t *store, const uint8_t manifest[SHA256_DIGEST_SIZE],
+                                uint8_t layers[][SHA256_DIGEST_SIZE], int max_layers) {
+    int fd = store_open_blob(store, manifest);
+    if (fd == -1)
+        return -1;
+    FILE *f = fdopen(fd, "r");
+    if (!f) {
+        close(fd);
+        return -1;
+    }
+    int count = 0;
+    char line[SHA256_HEX_SIZE + 16];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (count == max_layers || sha256_from_hex(line, layers[count]) == -1) {
+            fclose(f);
+            return -1;
+        }
+        count++;
+    }
+    fclose(f);
+    return count;
+}
+
+// The layers' references belong to the manifest blob, so they only go once nothing refers to it any more.
+static void release_manifest(store_t *store, const uint8_t manifest[SHA256_DIGEST_SIZE]) {
+    uint8_t layers[STORE_MAX_LAYERS][SHA256_DIGEST_SIZE];
+    int num_layers = read_manifest_layers(store, manifest, layers, STORE_MAX_LAYERS);
+    if (store_unref(store, manifest) == 0) {
+        for (int i = 0; i < num_layers; i++)
+            release_layer(store, layers[i]);
+    }
+}
+
+int store_import_image(store_t *store, const char *name, const char **layer_paths, int num_layers,
+                       uint8_t manifest_digest[SHA256_DIGEST_SIZE]) {
+    if (!valid_image_name(name) || num_layers <= 0 || num_layers > STORE_MAX_LAYERS) {
+        fprintf(stderr, "Image needs a plain name and 1 to %d layers\n", STORE_MAX_LAYERS);
+        return -1;
+    }
+
+    uint8_t layers[STORE_MAX_LAYERS][SHA256_DIGEST_SIZE];
+    char manifest[STORE_MAX_LAYERS * (SHA256_HEX_SIZE + 8)];
+    size_t manifest_len = 0;
+    for (int i = 0; i < num_layers; i++) {
+        int num_files, new_files;
+        int refs = put_layer(store, layer_paths[i], layers[i], &num_files, &new_files);
+        if (refs == -1) {
+            for (int j = 0; j < i; j++)
+                release_layer(store, layers[j]);
+            return -1;
+        }
+        char hex[SHA256_HEX_SIZE];
+        sha256_to_hex(layers[i], hex);
+        fprintf(stderr, "Layer %s sha256:%s %s, %d of its %d files new\n", layer_paths[i], hex,
+                refs == 1 ? "stored" : "already stored", new_files, num_files);
+        manifest_len += snprintf(manifest + manifest_len, sizeof(manifest) - manifest_len, "sha256:%s\n", hex);
+    }
+
+    // An identical image already owns references to these layers through the same manifest.
+    int refs = store_put_buffer(store, manifest, manifest_len, manifest_digest);
+    if (refs != 1) {
+        for (int i = 0; i < num_layers; i++)
+            release_layer(store, layers[i]);
+        if (refs == -1)
+            return -1;
+    }
+
+    int images_lock = lock_images(store);
+    if (images_lock == -1) {
+        release_manifest(store, manifest_digest);
+        return -1;
+    }
+    uint8_t old_manifest[SHA256_DIGEST_SIZE];
+    bool replacing = read_image_manifest(store, name, old_manifest) == 0;
+
+    char path[PATH_MAX], tmp_path[PATH_MAX], hex[SHA256_HEX_SIZE];
+    sha256_to_hex(manifest_digest, hex);
+    FILE *f = NULL;
+    if (image_path(store, "", name, path, sizeof(path)) == 0 && image_path(store, ".", name, tmp_path, sizeof(tmp_path)) == 0)
+        f = fopen(tmp_path, "w");
+    int result = -1;
+    if (f) {
+        fprintf(f, "sha256:%s\n", hex);
+        if (fclose(f) == 0 && rename(tmp_path, path) == 0)
+            result = 0;
+    }
+    if (result == -1) {
+        perror("name image");
+        if (f)
+            unlink(tmp_path);
+        release_manifest(store, manifest_digest);
+    }
+    else if (replacing) {
+        release_manifest(store, old_manifest);
+    }
+    close(images_lock);
+    return result;
+}
+
+int store_image_layers(store_t *store, const char *name, uint8_t layers[][SHA256_DIGEST_SIZE], int max_layers) {
+    uint8_t manifest[SHA256_DIGEST_SIZE];
+    if (read_image_manifest(store, name, manifest) == -1)
+        return -1;
+    return read_manifest_layers(store, manifest, layers, max_layers);
+}
+
+int store_remove_image(store_t *store, const char *name) {
+    int images_lock = lock_images(store);
+    if (images_lock == -1)
+        return -1;
+    uint8_t manifest[SHA256_DIGEST_SIZE];
+    int result = read_image_manifest(store, name, manifest);
+    if (result == 0) {
+        char path[PATH_MAX];
+        image_path(store, "", name, path, sizeof(path));
+        unlink(path);
+        release_manifest(store, manifest);
+    }
+    close(images_lock);
+    return result;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sha256.h"
+
+/**
+ * Content addressed store for image layers and anything else that should only be kept once.
+ *
+ * Every blob is a file named after the SHA-256 of its contents under <root>/blobs/sha256/, so anything shared
+ * by several images is stored once no matter how many times it is added. Layers are split up on import, every
+ * regular file in one is a blob of its own and the layer's blob is the rest of the tarball with each file's
+ * contents replaced by the name of its blob. So a file that two different layers both contain is stored once,
+ * and unpacking a layer clones its files out of their blobs.
+ * <root>/index is a hash table mmap'd by every user of the store, keyed by digest, holding each blob's size and
+ * how many references it has. Blobs are deleted when their last reference goes away. They are hashed once, as
+ * they are stored, after that opening one only checks its size against the index.
+ *
+ * An image is a manifest blob listing its layers' digests, base layer first, plus a name under <root>/images
+ * pointing at the manifest. Importing an image on top of a base that is already stored only copies the files
+ * that are new.
+ *
+ * Processes share the store through an flock on <root>/lock, so it is safe to use from several at once.
+ * */
+
+#define STORE_DEFAULT_ROOT "/var/lib/drydock/store"
+// A containerfile tarball_path of store:<name> unpacks image name from the store at STORE_DEFAULT_ROOT.
+#define STORE_IMAGE_PREFIX "store:"
+#define STORE_MAX_LAYERS 64
+
+typedef struct {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint64_t size;
+    uint32_t refs;
+    uint32_t state;     // one of the STORE_SLOT_ values in store.c
+} store_entry_t;
+
+typedef struct store_index_header store_index_header_t;
+
+typedef struct {
+    char root[PATH_MAX];
+    int lock_fd;
+    int index_fd;
+    ino_t index_ino;                // tells us when another process has replaced the index while growing it
+    store_index_header_t *index;
+    size_t mapped_len;
+} store_t;
+
+/**
+ * Opens the store at root, creating it if needed
+ * returns 0 on success, -1 on error
+ * */
+int store_open(store_t *store, const char *root);
+
+void store_close(store_t *store);
+
+/**
+ * Adds a reference to the blob holding the contents of path, copying it into the store only if no blob with
+ * the same digest is there yet. Fills in digest.
+ * returns the blob's reference count, so 1 if it was newly stored, or -1 on error
+ * */
+int store_put_file(store_t *store, const char *path, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * Same as store_put_file for len bytes of data
+ * */
+int store_put_buffer(store_t *store, const void *data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * Adds a reference to a blob that is already stored
+ * returns its new reference count, or -1 if it is not in the store
+ * */
+int store_ref(store_t *store, const uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * Drops a reference, deleting the blob if it was the last one
+ * returns the remaining reference count, or -1 if it is not in the store
+ * */
+int store_unref(store_t *store, const uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * Copies the index entry for digest into entry
+ * returns 0 if the blob is stored, -1 if not
+ * */
+int store_lookup(store_t *store, const uint8_t digest[SHA256_DIGEST_SIZE], store_entry_t *entry);
+
+/**
+ * Opens a blob for reading after checking it is still the size it was stored with
+ * returns a file descriptor positioned at the start, or -1 with errno ENOENT if it is not stored or EBADMSG
+ * if it has been cut short or grown
+ * */
+int store_open_blob(store_t *store, const uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * Rehashes a blob to check its contents still match digest
+ * returns 0 if they do, -1 with errno EBADMSG if they don't, or as store_open_blob if it can't be opened
+ * */
+int store_verify_blob(store_t *store, const uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * Writes where the blob for digest lives into path
+ * */
+void store_blob_path(store_t *store, const uint8_t digest[SHA256_DIGEST_SIZE], char *path, size_t len);
+
+/**
+ * Writes the directory the blobs live under into path, what a layer's file blobs are named relative to
+ * */
+void store_blob_dir(store_t *store, char *path, size_t len);
+
+/**
+ * Calls visit with a copy of every index entry in use
+ * returns 0 on success, -1 on error
+ * */
+int store_foreach(store_t *store, void (*visit)(const store_entry_t *entry, void *arg), void *arg);
+
+/**
+ * Stores each layer, split into its files, and a manifest listing them, and names the manifest name. Replaces
+ * any image that already has that name.
+ * returns 0 on success, -1 on error
+ * */
+int store_import_image(store_t *store, const char *name, const char **layer_paths, int num_layers,
+                       uint8_t manifest_digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * Looks up the layers of image name, base layer first
+ * returns the number of layers filled into layers, or -1 if there is no such image
+ * */
+int store_image_layers(store_t *store, const char *name, uint8_t layers[][SHA256_DIGEST_SIZE], int max_layers);
+
+/**
+ * Forgets image name, dropping its references to its manifest and through that its layers
+ * returns 0 on success, -1 if there is no such image
+ * */
+int store_remove_image(store_t *store, const char *name);
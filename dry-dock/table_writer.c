@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/magic.h>
+#include <sys/mman.h>
+#include <sys/statfs.h>
+
+#include "../numa.h"
+#include "table_writer.h"
+
+#define TABLE_TMP_PATH TABLE_PATH ".tmp"
+
+// v1 reports no memory limit as a page-rounded LONG_MAX, anything this big means unlimited.
+#define TABLE_UNLIMITED_MEMORY (1LL << 62)
+
+// What one sample found, read outside the lock.
+typedef struct {
+    int64_t mem_limit;
+    int64_t pids_limit;
+    double cpu_limit;
+    int64_t mem_usage;
+    int64_t pids;
+    uint64_t cpu_usage_us;
+    int numa_home;
+    double numa_local;
+} sample_t;
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void begin_write(table_row_t *row) {
+    __atomic_store_n(&row->seq, row->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end_write(table_row_t *row) {
+    __atomic_store_n(&row->seq, row->seq + 1, __ATOMIC_RELEASE);
+}
+
+static int read_knob(table_writer_t *table, const char *controller, const char *name, const char *knob,
+                     char *buf, size_t len) {
+    // Every controller shares one directory on v2, v1 has a hierarchy per controller.
+    char path[256];
+    if (table->unified)
+        snprintf(path, sizeof(path), "/sys/fs/cgroup/drydock/%s/%s", name, knob);
+    else
+        snprintf(path, sizeof(path), "/sys/fs/cgroup/%s/drydock/%s/%s", controller, name, knob);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    ssize_t got = read(fd, buf, len - 1);
+    close(fd);
+    if (got <= 0)
+        return -1;
+    buf[got] = '\0';
+    return 0;
+}
+
+static int64_t read_number(table_writer_t *table, const char *controller, const char *name, const char *knob) {
+    // "max" and anything unreadable come back as -1, no limit or nothing known.
+    char buf[64];
+    if (read_knob(table, controller, name, knob, buf, sizeof(buf)) == -1 || strncmp(buf, "max", 3) == 0)
+        return -1;
+    return strtoll(buf, NULL, 10);
+}
+
+static void sample_numa(table_writer_t *table, const char *name, int numa_node, sample_t *sample) {
+    // v1 sums everything up on its first line in pages, v2 has a line per kind of memory in bytes. Only the
+    // shares matter, so anon and file stand in for the total on v2.
+    char buf[4096];
+    int64_t total = 0;
+    int64_t on_node[NUMA_MAX_NODES] = { 0 };
+    sample->numa_home = numa_node;
+    sample->numa_local = -1;
+    if (read_knob(table, "memory", name, "memory.numa_stat", buf, sizeof(buf)) == -1)
+        return;
+    char *saveptr;
+    for (char *line = strtok_r(buf, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        if (table->unified ? strncmp(line, "anon ", 5) != 0 && strncmp(line, "file ", 5) != 0 :
+                             strncmp(line, "total=", 6) != 0)
+            continue;
+        for (char *field = strstr(line, " N"); field; field = strstr(field + 1, " N")) {
+            char *end;
+            long node = strtol(field + 2, &end, 10);
+            if (*end != '=' || node < 0 || node >= NUMA_MAX_NODES)
+                continue;
+            int64_t amount = strtoll(end + 1, NULL, 10);
+            on_node[node] += amount;
+            total += amount;
+        }
+    }
+    if (sample->numa_home == -1) {
+        for (int node = 0; node < NUMA_MAX_NODES; node++) {
+            if (on_node[node] > 0 && (sample->numa_home == -1 || on_node[node] > on_node[sample->numa_home]))
+                sample->numa_home = node;
+        }
+    }
+    if (total > 0 && sample->numa_home != -1)
+        sample->numa_local = 100.0 * on_node[sample->numa_home] / total;
+}
+
+static void take_sample(table_writer_t *table, const char *name, int numa_node, sample_t *sample) {
+    char buf[512];
+    sample->pids = read_number(table, "pids", name, "pids.current");
+    sample->pids_limit = read_number(table, "pids", name, "pids.max");
+    sample->cpu_limit = -1;
+    sample->cpu_usage_us = 0;
+    if (table->unified) {
+        sample->mem_usage = read_number(table, "memory", name, "memory.current");
+        sample->mem_limit = read_number(table, "memory", name, "memory.max");
+        long long quota, period;
+        if (read_knob(table, "cpu", name, "cpu.max", buf, sizeof(buf)) == 0 &&
+            sscanf(buf, "%lld %lld", &quota, &period) == 2 && period > 0)
+            sample->cpu_limit = (double) quota / period;
+        char *usage;
+        if (read_knob(table, "cpu", name, "cpu.stat", buf, sizeof(buf)) == 0 && (usage = strstr(buf, "usage_usec ")))
+            sample->cpu_usage_us = strtoull(usage + strlen("usage_usec "), NULL, 10);
+    }
+    else {
+        sample->mem_usage = read_number(table, "memory", name, "memory.usage_in_bytes");
+        sample->mem_limit = read_number(table, "memory", name, "memory.limit_in_bytes");
+        if (sample->mem_limit >= TABLE_UNLIMITED_MEMORY)
+            sample->mem_limit = -1;
+        int64_t quota = read_number(table, "cpu", name, "cpu.cfs_quota_us");
+        int64_t period = read_number(table, "cpu", name, "cpu.cfs_period_us");
+        if (quota > 0 && period > 0)
+            sample->cpu_limit = (double) quota / period;
+        int64_t usage_ns = read_number(table, "cpuacct", name, "cpuacct.usage");
+        if (usage_ns > 0)
+            sample->cpu_usage_us = usage_ns / 1000;
+    }
+    sample_numa(table, name, numa_node, sample);
+}
+
+static void sample_rows(table_writer_t *table) {
+    uint32_t rows = __atomic_load_n(&table->header->rows, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < rows; i++) {
+        table_slot_t *slot = &table->slots[i];
+        char name[sizeof(slot->name)];
+        pthread_mutex_lock(&table->lock);
+        bool used = slot->used;
+        unsigned generation = slot->generation;
+        int numa_node = slot->numa_node;
+        memcpy(name, slot->name, sizeof(name));
+        pthread_mutex_unlock(&table->lock);
+        if (!used)
+            continue;
+
+        sample_t sample;
+        take_sample(table, name, numa_node, &sample);
+        double now = now_s();
+
+        pthread_mutex_lock(&table->lock);
+        // The container may have gone, and its row been given to another, while we were reading.
+        if (slot->used && slot->generation == generation) {
+            table_row_t *row = table_row(table->header, i);
+            begin_write(row);
+            row->mem_limit = sample.mem_limit;
+            row->pids_limit = sample.pids_limit;
+            row->cpu_limit = sample.cpu_limit;
+            row->mem_usage = sample.mem_usage;
+            row->pids = sample.pids;
+            row->cpu_usage_us = sample.cpu_usage_us;
+            row->numa_home = sample.numa_home;
+            row->numa_local = sample.numa_local;
+            if (slot->last_sampled > 0 && sample.cpu_usage_us >= slot->last_cpu_us)
+                row->cpu_percent = (sample.cpu_usage_us - slot->last_cpu_us) / 1e4 / (now - slot->last_sampled);
+            row->sampled = now;
+            end_write(row);
+            slot->last_cpu_us = sample.cpu_usage_us;
+            slot->last_sampled = now;
+        }
+        pthread_mutex_unlock(&table->lock);
+    }
+}
+
+static void *run_sampler(void *arg) {
+    table_writer_t *table = arg;
+    pthread_mutex_lock(&table->lock);
+    while (!table->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long) TABLE_SAMPLE_MS * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&table->wake, &table->lock, &deadline);
+        if (table->stopping)
+            break;
+        pthread_mutex_unlock(&table->lock);
+        sample_rows(table);
+        pthread_mutex_lock(&table->lock);
+    }
+    pthread_mutex_unlock(&table->lock);
+    return NULL;
+}
+
+int table_writer_open(table_writer_t *table) {
+    /**
+     * builds the table in a new file and renames it into place, so a reader never maps a half made one
+     * return:
+     * 0 on success, -1 on error
+    **/
+    memset(table, 0, sizeof(*table));
+    struct statfs fs;
+    table->unified = statfs("/sys/fs/cgroup", &fs) == 0 && fs.f_type == CGROUP2_SUPER_MAGIC;
+    table->size = sizeof(table_header_t) + (size_t) TABLE_MAX_CONTAINERS * sizeof(table_row_t);
+    table->fd = open(TABLE_TMP_PATH, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (table->fd == -1 || ftruncate(table->fd, table->size) == -1) {
+        perror("Could not create the container table");
+        if (table->fd != -1)
+            close(table->fd);
+        return -1;
+    }
+    table->header = mmap(NULL, table->size, PROT_READ | PROT_WRITE, MAP_SHARED, table->fd, 0);
+    if (table->header == MAP_FAILED) {
+        perror("Could not map the container table");
+        close(table->fd);
+        unlink(TABLE_TMP_PATH);
+        return -1;
+    }
+    table->header->magic = TABLE_MAGIC;
+    table->header->row_size = sizeof(table_row_t);
+    table->header->capacity = TABLE_MAX_CONTAINERS;
+    table->header->server_pid = getpid();
+    table->header->sample_ms = TABLE_SAMPLE_MS;
+    table->header->live = 1;
+    if (rename(TABLE_TMP_PATH, TABLE_PATH) == -1) {
+        perror("Could not publish the container table");
+        munmap(table->header, table->size);
+        close(table->fd);
+        unlink(TABLE_TMP_PATH);
+        return -1;
+    }
+    // Lowest rows first, so readers have as few as possible to look through.
+    for (uint32_t i = 0; i < TABLE_MAX_CONTAINERS; i++)
+        table->free_rows[i] = TABLE_MAX_CONTAINERS - 1 - i;
+    table->num_free = TABLE_MAX_CONTAINERS;
+    pthread_mutex_init(&table->lock, NULL);
+    pthread_cond_init(&table->wake, NULL);
+    if (pthread_create(&table->sampler, NULL, run_sampler, table) != 0) {
+        fprintf(stderr, "Could not start the container table sampler\n");
+        table_writer_close(table);
+        return -1;
+    }
+    return 0;
+}
+
+void table_writer_close(table_writer_t *table) {
+    pthread_mutex_lock(&table->lock);
+    bool sampling = !table->stopping;
+    table->stopping = true;
+    pthread_cond_signal(&table->wake);
+    pthread_mutex_unlock(&table->lock);
+    if (sampling && table->sampler)
+        pthread_join(table->sampler, NULL);
+    __atomic_store_n(&table->header->live, 0, __ATOMIC_RELEASE);
+    munmap(table->header, table->size);
+    close(table->fd);
+}
+
+int table_writer_add(table_writer_t *table, const container_record_t *container, bool reattached) {
+    pthread_mutex_lock(&table->lock);
+    if (table->num_free == 0) {
+        pthread_mutex_unlock(&table->lock);
+        return -1;
+    }
+    uint32_t i = table->free_rows[--table->num_free];
+    table_slot_t *slot = &table->slots[i];
+    slot->used = true;
+    slot->generation++;
+    memcpy(slot->name, container->name, sizeof(slot->name));
+    slot->numa_node = container->numa_node;
+    slot->last_sampled = 0;
+
+    table_row_t *row = table_row(table->header, i);
+    begin_write(row);
+    row->state = TABLE_RUNNING;
+    memcpy(row->name, container->name, sizeof(row->name));
+    row->pid = container->pid;
+    row->reattached = reattached;
+    row->created = container->created;
+    memcpy(row->netns, container->netns, sizeof(row->netns));
+    memcpy(row->rootfs, container->rootfs, sizeof(row->rootfs) - 1);
+    row->rootfs[sizeof(row->rootfs) - 1] = '\0';
+    row->mem_limit = row->pids_limit = -1;
+    row->cpu_limit = -1;
+    row->mem_usage = row->pids = -1;
+    row->cpu_usage_us = 0;
+    row->cpu_percent = 0;
+    row->numa_node = row->numa_home = container->numa_node;
+    row->numa_local = -1;
+    memset(row->stalls, 0, sizeof(row->stalls));
+    memset(row->stall_avg10, 0, sizeof(row->stall_avg10));
+    memset(row->stalled_at, 0, sizeof(row->stalled_at));
+    row->sampled = 0;
+    end_write(row);
+    if (i >= table->header->rows)
+        __atomic_store_n(&table->header->rows, i + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&table->lock);
+    return i;
+}
+
+void table_writer_remove(table_writer_t *table, int i) {
+    pthread_mutex_lock(&table->lock);
+    table->slots[i].used = false;
+    table_row_t *row = table_row(table->header, i);
+    begin_write(row);
+    row->state = TABLE_EMPTY;
+    end_write(row);
+    table->free_rows[table->num_free++] = i;
+    pthread_mutex_unlock(&table->lock);
+}
+
+void table_writer_pressure(table_writer_t *table, int i, int resource, double avg10) {
+    if (resource < 0 || resource >= TABLE_PRESSURE_RESOURCES)
+        return;
+    pthread_mutex_lock(&table->lock);
+    table_row_t *row = table_row(table->header, i);
+    begin_write(row);
+    row->stalls[resource]++;
+    row->stall_avg10[resource] = avg10;
+    row->stalled_at[resource] = now_s();
+    end_write(row);
+    pthread_mutex_unlock(&table->lock);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "container_table.h"
+#include "registry.h"
+
+/**
+ * The server's side of the shared container table. The event loop adds and removes rows as containers come and go,
+ * and a thread of its own refreshes every row's limits and usage from its cgroup each TABLE_SAMPLE_MS, so reading
+ * cgroup files never holds up the loop and never costs a reader anything.
+ * */
+
+typedef struct {
+    bool used;
+    unsigned generation;        // bumped whenever the row is reused, so a sample of the old container is dropped
+    char name[64];
+    int numa_node;
+    uint64_t last_cpu_us;
+    double last_sampled;
+} table_slot_t;
+
+typedef struct {
+    int fd;
+    table_header_t *header;
+    size_t size;
+    bool unified;               // cgroup v2
+    // Between the event loop and the sampler, readers never take it.
+    pthread_mutex_t lock;
+    table_slot_t slots[TABLE_MAX_CONTAINERS];
+    uint32_t free_rows[TABLE_MAX_CONTAINERS];
+    uint32_t num_free;
+    pthread_t sampler;
+    pthread_cond_t wake;
+    bool stopping;
+} table_writer_t;
+
+/**
+ * Publishes an empty table at TABLE_PATH in place of any earlier one and starts sampling
+ * returns 0 on success, -1 on error
+ * */
+int table_writer_open(table_writer_t *table);
+
+/**
+ * Stops sampling and marks the table as no longer live, the file stays for readers that still have it mapped
+ * */
+void table_writer_close(table_writer_t *table);
+
+/**
+ * Adds a row for container, its limits and usage are filled in by the next sample
+ * returns the row, or -1 if the table is full
+ * */
+int table_writer_add(table_writer_t *table, const container_record_t *container, bool reattached);
+
+/**
+ * Empties row so it can be reused
+ * */
+void table_writer_remove(table_writer_t *table, int row);
+
+/**
+ * Records that row's container has just stalled on resource, avg10 as its pressure file gave it
+ * */
+void table_writer_pressure(table_writer_t *table, int row, int resource, double avg10);
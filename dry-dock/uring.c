@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int setup_buffers(uring_t *ring, unsigned count, unsigned size) {
+    // The ring of buffer descriptors has to be page aligned, mmap gives us that.
+    ring->buf_ring_size = count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return -1;
+    }
+    ring->buf_base = malloc((size_t) count * size);
+    if (!ring->buf_base)
+        return -1;
+    ring->buf_count = count;
+    ring->buf_size = size;
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t) (uintptr_t) ring->buf_ring,
+        .ring_entries = count,
+        .bgid = URING_BUFFER_GROUP,
+    };
+    if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        return -1;
+    for (unsigned i = 0; i < count; i++)
+        uring_recycle_buffer(ring, i);
+    return 0;
+}
+
+int uring_init(uring_t *ring, unsigned entries, unsigned count, unsigned size) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Only the event loop thread uses the ring, and it doesn't need to be interrupted to run completions it will
+    // pick up on its next io_uring_enter anyway.
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+    ring->fd = io_uring_setup(entries, &params);
+    if (ring->fd == -1 && errno == EINVAL) {
+        // Older kernels don't know some of those, they are only optimisations.
+        memset(&params, 0, sizeof(params));
+        ring->fd = io_uring_setup(entries, &params);
+    }
+    if (ring->fd == -1)
+        return -1;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        errno = ENOSYS;
+        uring_destroy(ring);
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > ring->sq_ring_size)
+        ring->sq_ring_size = cq_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+    // One mapping covers both rings.
+    ring->cq_ring = ring->sq_ring;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    unsigned *array = (unsigned *) (sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+    ring->sq_local_tail = ring->sq_submitted = *ring->sq_tail;
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    if (setup_buffers(ring, count, size) == -1) {
+        int saved_errno = errno;
+        uring_destroy(ring);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+void uring_destroy(uring_t *ring) {
+    if (ring->buf_ring)
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    free(ring->buf_base);
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd != -1)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        if (uring_submit_and_wait(ring, 0) == -1)
+            return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head >= ring->sq_entries)
+            return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr) {
+    // The entries have to be written before the kernel can see the new tail.
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sq_local_tail - ring->sq_submitted;
+    while (true) {
+        ring->syscalls++;
+        int submitted = io_uring_enter(ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        if (submitted == -1) {
+            // A signal can interrupt the wait, by then everything has been submitted.
+            if (errno == EINTR && to_submit == 0)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        ring->sq_submitted += submitted;
+        return 0;
+    }
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+int uring_register_files(uring_t *ring, unsigned count) {
+    struct io_uring_rsrc_register reg = {
+        .nr = count,
+        .flags = IORING_RSRC_REGISTER_SPARSE,
+    };
+    return io_uring_register(ring->fd, IORING_REGISTER_FILES2, &reg, sizeof(reg)) == -1 ? -1 : 0;
+}
+
+char *uring_buffer(uring_t *ring, unsigned short bid) {
+    return ring->buf_base + (size_t) bid * ring->buf_size;
+}
+
+void uring_recycle_buffer(uring_t *ring, unsigned short bid) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (uint64_t) (uintptr_t) uring_buffer(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
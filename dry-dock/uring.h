@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/**
+ * Just enough io_uring, on the raw syscalls, for the server's event loop.
+ *
+ * Submissions pile up in the SQ ring and reach the kernel in the same io_uring_enter that waits for completions, so
+ * one pass of the loop is one syscall however many sockets it touches. Receives take their memory from a ring of
+ * buffers registered with the kernel, so a connection that is waiting for a request holds no buffer of its own, and
+ * sockets can be put in a table of fixed files so the kernel doesn't look up and reference count the fd on every
+ * operation. Needs Linux 5.19 or newer, uring_init fails on anything older.
+ * */
+
+typedef struct {
+    int fd;
+    // submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;     // sqes handed out, published to the kernel on submit
+    unsigned sq_submitted;      // sqes published so far
+    struct io_uring_sqe *sqes;
+    // completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // provided buffers
+    struct io_uring_buf_ring *buf_ring;
+    char *buf_base;
+    unsigned buf_count;
+    unsigned buf_size;
+    unsigned short buf_tail;
+    // for munmap
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t sqes_size;
+    size_t buf_ring_size;
+    unsigned long syscalls;     // io_uring_enter calls
+} uring_t;
+
+#define URING_BUFFER_GROUP 0
+
+/**
+ * Sets up a ring with room for entries submissions and twice as many completions, and count provided buffers of
+ * size bytes each
+ * returns 0 on success, -1 on error with errno set
+ * */
+int uring_init(uring_t *ring, unsigned entries, unsigned count, unsigned size);
+
+void uring_destroy(uring_t *ring);
+
+/**
+ * Hands out a zeroed submission entry, submitting what is queued first if the ring is full
+ * returns NULL if the kernel won't take any more
+ * */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/**
+ * Submits everything queued and waits until at least wait_nr completions are ready
+ * returns 0 on success, -1 on error with errno set
+ * */
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr);
+
+/**
+ * returns the oldest completion not yet seen, or NULL if there is none
+ * */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+/**
+ * Registers a table of count fixed files, all empty, to be filled with IORING_OP_FILES_UPDATE
+ * returns 0 on success, -1 on error with errno set
+ * */
+int uring_register_files(uring_t *ring, unsigned count);
+
+/**
+ * The provided buffer a completion with IORING_CQE_F_BUFFER used, and giving it back once its data has been copied
+ * */
+char *uring_buffer(uring_t *ring, unsigned short bid);
+void uring_recycle_buffer(uring_t *ring, unsigned short bid);
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "worker_pool.h"
+
+// Which of the pool's threads is running, so tasks it submits stay on its own queue.
+static __thread worker_pool_t *CURRENT_POOL;
+static __thread int CURRENT_QUEUE;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void push(pool_queue_t *queue, pool_task_t *task, lane_t lane) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail[lane])
+        queue->tail[lane]->next = task;
+    else
+        queue->head[lane] = task;
+    queue->tail[lane] = task;
+    __atomic_store_n(&queue->count[lane], queue->count[lane] + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static pool_task_t *take_from(worker_pool_t *pool, pool_queue_t *queue, lane_t lane) {
+    // Oldest first, whether it is the queue's own thread or a thief asking.
+    if (__atomic_load_n(&queue->count[lane], __ATOMIC_RELAXED) == 0)
+        return NULL;
+    pthread_mutex_lock(&queue->lock);
+    pool_task_t *task = queue->head[lane];
+    if (task) {
+        queue->head[lane] = task->next;
+        if (!queue->head[lane])
+            queue->tail[lane] = NULL;
+        __atomic_store_n(&queue->count[lane], queue->count[lane] - 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&pool->lanes[lane].queued, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+static pool_task_t *find_task(worker_pool_t *pool, int self, bool *stolen) {
+    for (lane_t lane = LANE_CONTROL; lane < NUM_LANES; lane++) {
+        // A bulk slot is claimed before looking, and given back if there was nothing to take.
+        if (lane == LANE_BULK && __atomic_fetch_add(&pool->running_bulk, 1, __ATOMIC_ACQ_REL) >= pool->max_bulk) {
+            __atomic_fetch_sub(&pool->running_bulk, 1, __ATOMIC_ACQ_REL);
+            return NULL;
+        }
+        for (int i = 0; i < pool->num_threads; i++) {
+            pool_task_t *task = take_from(pool, &pool->queues[(self + i) % pool->num_threads], lane);
+            if (task) {
+                *stolen = i > 0;
+                return task;
+            }
+        }
+        if (lane == LANE_BULK)
+            __atomic_fetch_sub(&pool->running_bulk, 1, __ATOMIC_ACQ_REL);
+    }
+    return NULL;
+}
+
+static bool runnable(worker_pool_t *pool) {
+    return __atomic_load_n(&pool->lanes[LANE_CONTROL].queued, __ATOMIC_ACQUIRE) > 0 ||
+           (__atomic_load_n(&pool->lanes[LANE_BULK].queued, __ATOMIC_ACQUIRE) > 0 &&
+            __atomic_load_n(&pool->running_bulk, __ATOMIC_ACQUIRE) < pool->max_bulk);
+}
+
+static void wake(worker_pool_t *pool, int count) {
+    pthread_mutex_lock(&pool->idle_lock);
+    if (pool->idle > 0) {
+        if (count == 1)
+            pthread_cond_signal(&pool->work_ready);
+        else
+            pthread_cond_broadcast(&pool->work_ready);
+    }
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+static void *run_tasks(void *arg) {
+    worker_pool_t *pool = arg;
+    int self = __atomic_fetch_add(&pool->next_queue, 1, __ATOMIC_RELAXED) % pool->num_threads;
+    CURRENT_POOL = pool;
+    CURRENT_QUEUE = self;
+    while (true) {
+        bool stolen = false;
+        pool_task_t *task = NULL;
+        while (!__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE) && !(task = find_task(pool, self, &stolen))) {
+            pthread_mutex_lock(&pool->idle_lock);
+            // Anything submitted since we looked has already been counted, so we look again rather than sleep
+            // through it.
+            if (!pool->stopping && !runnable(pool)) {
+                pool->idle++;
+                pthread_cond_wait(&pool->work_ready, &pool->idle_lock);
+                pool->idle--;
+            }
+            pthread_mutex_unlock(&pool->idle_lock);
+        }
+        if (!task)
+            break;
+
+        lane_t lane = task->lane;
+        double wait_ms = now_ms() - task->queued_ms;
+        pthread_mutex_lock(&pool->stats_lock);
+        lane_stats_t *stats = &pool->lanes[lane];
+        stats->run++;
+        stats->stolen += stolen;
+        stats->total_wait_ms += wait_ms;
+        if (wait_ms > stats->max_wait_ms)
+            stats->max_wait_ms = wait_ms;
+        pthread_mutex_unlock(&pool->stats_lock);
+
+        pool->run(task);
+        if (lane == LANE_BULK) {
+            // Whoever was held back by the cap can go now.
+            __atomic_fetch_sub(&pool->running_bulk, 1, __ATOMIC_ACQ_REL);
+            if (__atomic_load_n(&pool->lanes[LANE_BULK].queued, __ATOMIC_ACQUIRE) > 0)
+                wake(pool, 1);
+        }
+    }
+    return NULL;
+}
+
+int worker_pool_start(worker_pool_t *pool, int num_threads, pool_run_t run) {
+    memset(pool, 0, sizeof(*pool));
+    pool->run = run;
+    pool->num_threads = num_threads;
+    pool->max_bulk = num_threads > 1 ? num_threads - 1 : 1;
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_mutex_init(&pool->stats_lock, NULL);
+    for (int i = 0; i < num_threads; i++)
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, run_tasks, pool) != 0) {
+            fprintf(stderr, "Could not start worker threads\n");
+            pool->num_threads = i;
+            worker_pool_stop(pool);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void worker_pool_stop(worker_pool_t *pool) {
+    pthread_mutex_lock(&pool->idle_lock);
+    __atomic_store_n(&pool->stopping, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->idle_lock);
+    for (int i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+}
+
+void worker_pool_submit(worker_pool_t *pool, pool_task_t *first, int count, lane_t lane) {
+    // Counted before they are visible, so a thread going to sleep either finds them or sees the count and looks
+    // again.
+    pthread_mutex_lock(&pool->stats_lock);
+    lane_stats_t *stats = &pool->lanes[lane];
+    unsigned long queued = __atomic_add_fetch(&stats->queued, count, __ATOMIC_ACQ_REL);
+    if (queued > stats->peak)
+        stats->peak = queued;
+    pthread_mutex_unlock(&pool->stats_lock);
+
+    double now = now_ms();
+    bool own = CURRENT_POOL == pool;
+    pool_task_t *task = first;
+    for (int i = 0; i < count; i++) {
+        pool_task_t *next = task->next;
+        task->next = NULL;
+        task->lane = lane;
+        task->queued_ms = now;
+        int queue = CURRENT_QUEUE;
+        if (!own)
+            queue = __atomic_fetch_add(&pool->next_queue, 1, __ATOMIC_RELAXED) % pool->num_threads;
+        push(&pool->queues[queue], task, lane);
+        task = next;
+    }
+    wake(pool, count);
+}
+
+void worker_pool_format_stats(worker_pool_t *pool, char *buf, size_t len) {
+    static const char *names[NUM_LANES] = { "control", "bulk" };
+    pthread_mutex_lock(&pool->idle_lock);
+    int idle = pool->idle;
+    pthread_mutex_unlock(&pool->idle_lock);
+    size_t used = snprintf(buf, len, "workers: %d, %d idle, %d running bulk work (at most %d)\n", pool->num_threads,
+                           idle, __atomic_load_n(&pool->running_bulk, __ATOMIC_RELAXED), pool->max_bulk);
+    pthread_mutex_lock(&pool->stats_lock);
+    for (lane_t lane = LANE_CONTROL; lane < NUM_LANES && used < len; lane++) {
+        lane_stats_t *stats = &pool->lanes[lane];
+        used += snprintf(buf + used, len - used,
+                         "%s lane: %lu queued (peak %lu), %lu run, %lu stolen, wait avg %.2fms max %.2fms\n",
+                         names[lane], __atomic_load_n(&stats->queued, __ATOMIC_RELAXED), stats->peak, stats->run,
+                         stats->stolen, stats->run ? stats->total_wait_ms / stats->run : 0.0, stats->max_wait_ms);
+    }
+    pthread_mutex_unlock(&pool->stats_lock);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * A pool of threads for work that can block for a long time, each with its own queue per lane.
+ *
+ * Tasks are spread over the queues as they are submitted and a thread that runs out of its own work steals the
+ * oldest task from another's, so one thread stuck on a slow task doesn't leave the tasks behind it waiting. Every
+ * thread takes control work, like launching a container, before it looks at bulk work, like unpacking an image,
+ * and at most all threads but one run bulk work at once so control work always has somewhere to go.
+ * */
+
+#define WORKER_POOL_MAX_THREADS 64
+
+typedef enum {
+    LANE_CONTROL,
+    LANE_BULK,
+    NUM_LANES,
+} lane_t;
+
+/**
+ * Embedded in whatever the caller wants run, the pool only touches these fields.
+ * */
+typedef struct pool_task {
+    struct pool_task *next;
+    lane_t lane;
+    double queued_ms;
+} pool_task_t;
+
+typedef void (*pool_run_t)(pool_task_t *task);
+
+typedef struct {
+    pthread_mutex_t lock;
+    pool_task_t *head[NUM_LANES];
+    pool_task_t *tail[NUM_LANES];
+    int count[NUM_LANES];       // read without the lock to skip empty queues when looking for work
+} pool_queue_t;
+
+typedef struct {
+    unsigned long queued;       // waiting right now
+    unsigned long peak;         // most ever waiting at once
+    unsigned long run;
+    unsigned long stolen;       // run by a thread other than the one it was queued for
+    double total_wait_ms;
+    double max_wait_ms;
+} lane_stats_t;
+
+typedef struct {
+    pool_queue_t queues[WORKER_POOL_MAX_THREADS];
+    pthread_t threads[WORKER_POOL_MAX_THREADS];
+    int num_threads;
+    pool_run_t run;
+    unsigned next_queue;        // round robin for tasks submitted from outside the pool
+    int max_bulk;               // threads that may run bulk work at once
+    int running_bulk;
+    // Threads with nothing to do sleep here, queued counts every task in every queue.
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work_ready;
+    int idle;
+    unsigned long queued;
+    bool stopping;
+    pthread_mutex_t stats_lock;
+    lane_stats_t lanes[NUM_LANES];
+} worker_pool_t;
+
+/**
+ * Starts num_threads threads that call run for every task submitted
+ * returns 0 on success, -1 on error
+ * */
+int worker_pool_start(worker_pool_t *pool, int num_threads, pool_run_t run);
+
+/**
+ * Waits for running tasks to finish and stops every thread, tasks still queued are never run
+ * */
+void worker_pool_stop(worker_pool_t *pool);
+
+/**
+ * Queues count tasks linked through next, all in the same lane. From one of the pool's own threads they go on its
+ * own queue, otherwise they are spread over all of them
+ * */
+void worker_pool_submit(worker_pool_t *pool, pool_task_t *first, int count, lane_t lane);
+
+/**
+ * Writes human readable queue depths, wait times and steal counts for each lane into buf
+ * */
+void worker_pool_format_stats(worker_pool_t *pool, char *buf, size_t len);
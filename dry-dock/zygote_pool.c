@@ -0,0 +1,425 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "../container.h"
+#include "../netns_pool.h"
+#include "zygote_pool.h"
+
+// The runtime finds its end of the zygote socket here.
+#define ZYGOTE_CHILD_FD 3
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void release_zygote(zygote_pool_t *pool, zygote_profile_t *profile, zygote_t *zygote) {
+    // A parked zygote that reads EOF instead of a command exits and removes its own cgroups, and with that no
+    // longer needs room on its node. One that is running a command hands its node over in launched_t first.
+    placement_release(pool->placement, zygote->numa_node, profile->cpu_cores);
+    close(zygote->fd);
+    free(zygote);
+}
+
+static zygote_t *spawn_zygote(zygote_pool_t *pool, zygote_profile_t *profile) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) {
+        perror("socketpair");
+        return NULL;
+    }
+    zygote_t *zygote = calloc(1, sizeof(zygote_t));
+    if (!zygote) {
+        close(fds[0]);
+        close(fds[1]);
+        return NULL;
+    }
+    pthread_mutex_lock(&pool->lock);
+    unsigned long id = ++pool->next_id;
+    pthread_mutex_unlock(&pool->lock);
+    snprintf(zygote->name, sizeof(zygote->name), "%d-%lu", getpid(), id);
+
+    // Everything the child needs is prepared before fork since other threads may hold locks we would need.
+    char fd_arg[16];
+    char node_arg[16];
+    snprintf(fd_arg, sizeof(fd_arg), "%d", ZYGOTE_CHILD_FD);
+    zygote->numa_node = placement_pick(pool->placement, profile->cpu_cores);
+    snprintf(node_arg, sizeof(node_arg), "%d", zygote->numa_node);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        placement_release(pool->placement, zygote->numa_node, profile->cpu_cores);
+        free(zygote);
+        return NULL;
+    }
+    if (pid == 0) {
+        // Only the runtime's end should survive the exec, dup2 drops close-on-exec unless it is a no-op.
+        if (fds[1] == ZYGOTE_CHILD_FD)
+            fcntl(fds[1], F_SETFD, 0);
+        else
+            dup2(fds[1], ZYGOTE_CHILD_FD);
+        char *argv[] = { CONTAINER_RUNTIME_PATH, "-n", zygote->name, "-z", fd_arg, NULL, NULL, NULL, NULL, NULL,
+                         NULL };
+        int argc = 5;
+        if (profile->overlay)
+            argv[argc++] = "-o";
+        if (zygote->numa_node != -1) {
+            argv[argc++] = "-N";
+            argv[argc++] = node_arg;
+        }
+        if (profile->config)
+            argv[argc++] = profile->config;
+        argv[argc++] = profile->rootfs;
+        execv(CONTAINER_RUNTIME_PATH, argv);
+        _exit(127);
+    }
+    close(fds[1]);
+    zygote->pid = pid;
+    zygote->fd = fds[0];
+
+    // Blocks until the container has finished all of its setup.
+    char ready[ZYGOTE_MAX_READY];
+    ssize_t got;
+    while ((got = recv(zygote->fd, ready, sizeof(ready), 0)) == -1 && errno == EINTR) {}
+    if (got < 1 || ready[0] != ZYGOTE_READY) {
+        fprintf(stderr, "Zygote for %s never became ready\n", profile->rootfs);
+        release_zygote(pool, profile, zygote);
+        return NULL;
+    }
+    size_t netns_len = got - 1;
+    if (netns_len >= sizeof(zygote->netns))
+        netns_len = sizeof(zygote->netns) - 1;
+    memcpy(zygote->netns, ready + 1, netns_len);
+    zygote->netns[netns_len] = '\0';
+    return zygote;
+}
+
+static int run_in_zygote(zygote_t *zygote, const char *command, size_t command_len, const int *fds, int num_fds) {
+    struct iovec iov = { .iov_base = (void *) command, .iov_len = command_len };
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    // The fds ride along with the command, so the container gets them in the same message or not at all.
+    if (num_fds > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+    }
+    if (sendmsg(zygote->fd, &msg, MSG_NOSIGNAL) != (ssize_t) command_len)
+        return -1;
+    int status;
+    ssize_t got;
+    while ((got = recv(zygote->fd, &status, sizeof(status), 0)) == -1 && errno == EINTR) {}
+    if (got != sizeof(status))
+        return -1;
+    return status;
+}
+
+static bool same_config(const char *a, const char *b) {
+    if (!a || !b)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+// Must hold pool->lock.
+static zygote_t *pop_zygote(zygote_profile_t *profile) {
+    zygote_t *zygote = profile->parked;
+    if (zygote) {
+        profile->parked = zygote->next;
+        profile->num_parked--;
+    }
+    return zygote;
+}
+
+// Must hold pool->lock, and the profile must already be off pool->profiles.
+static void free_profile(zygote_pool_t *pool, zygote_profile_t *profile) {
+    zygote_t *zygote;
+    while ((zygote = pop_zygote(profile)))
+        release_zygote(pool, profile, zygote);
+    free(profile->rootfs);
+    free(profile->config);
+    free(profile);
+}
+
+// Must hold pool->lock.
+static zygote_profile_t *find_or_add_profile(zygote_pool_t *pool, const char *rootfs, const char *config,
+                                             bool overlay) {
+    zygote_profile_t *profile;
+    for (profile = pool->profiles; profile; profile = profile->next) {
+        if (strcmp(profile->rootfs, rootfs) == 0 && same_config(profile->config, config) &&
+            profile->overlay == overlay)
+            return profile;
+    }
+    profile = calloc(1, sizeof(zygote_profile_t));
+    if (!profile)
+        return NULL;
+    profile->rootfs = strdup(rootfs);
+    profile->config = config ? strdup(config) : NULL;
+    profile->overlay = overlay;
+    profile->cpu_cores = placement_config_cores(config);
+    profile->next = pool->profiles;
+    pool->profiles = profile;
+    return profile;
+}
+
+// Must hold pool->lock.
+static void evict_idle_profiles(zygote_pool_t *pool, double now, double *wake_ms) {
+    zygote_profile_t **link = &pool->profiles;
+    while (*link) {
+        zygote_profile_t *profile = *link;
+        double idle_until = profile->last_used_ms + ZYGOTE_PROFILE_IDLE_MS;
+        if (idle_until <= now && profile->num_launching == 0 && profile->num_starting == 0) {
+            *link = profile->next;
+            free_profile(pool, profile);
+            pool->evicted_idle++;
+            continue;
+        }
+        if (idle_until < *wake_ms)
+            *wake_ms = idle_until;
+        link = &profile->next;
+    }
+}
+
+// Must hold pool->lock.
+static bool make_room(zygote_pool_t *pool, zygote_profile_t *wanting) {
+    /**
+     * releases a parked zygote of the least recently used profile, if that was used before wanting was
+     * return:
+     * true if one was released
+    **/
+    zygote_profile_t *victim = NULL;
+    for (zygote_profile_t *profile = pool->profiles; profile; profile = profile->next) {
+        if (profile->num_parked > 0 && profile->last_used_ms < wanting->last_used_ms &&
+            (!victim || profile->last_used_ms < victim->last_used_ms))
+            victim = profile;
+    }
+    if (!victim)
+        return false;
+    release_zygote(pool, victim, pop_zygote(victim));
+    pool->evicted_for_room++;
+    return true;
+}
+
+// Must hold pool->lock.
+static zygote_profile_t *profile_to_refill(zygote_pool_t *pool, double now, double *wake_ms) {
+    size_t held = 0;
+    for (zygote_profile_t *profile = pool->profiles; profile; profile = profile->next)
+        held += profile->num_parked + profile->num_starting;
+    for (zygote_profile_t *profile = pool->profiles; profile; profile = profile->next) {
+        if (profile->num_parked + profile->num_starting >= pool->target_size)
+            continue;
+        if (profile->retry_ms > now) {
+            if (profile->retry_ms < *wake_ms)
+                *wake_ms = profile->retry_ms;
+            continue;
+        }
+        if (held < pool->max_parked || make_room(pool, profile))
+            return profile;
+    }
+    return NULL;
+}
+
+// Must hold pool->lock.
+static void move_to_back(zygote_pool_t *pool, zygote_profile_t *profile) {
+    zygote_profile_t **link = &pool->profiles;
+    while (*link != profile)
+        link = &(*link)->next;
+    *link = profile->next;
+    while (*link)
+        link = &(*link)->next;
+    *link = profile;
+    profile->next = NULL;
+}
+
+static void *refill_zygotes(void *arg) {
+    zygote_pool_t *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stopping) {
+        double now = now_ms();
+        double wake_ms = now + ZYGOTE_PROFILE_IDLE_MS;
+        evict_idle_profiles(pool, now, &wake_ms);
+        zygote_profile_t *profile = profile_to_refill(pool, now, &wake_ms);
+        if (!profile) {
+            // Woken early by every launch, otherwise when a profile may be retried or has gone idle.
+            struct timespec until = { .tv_sec = wake_ms / 1000, .tv_nsec = (long) (wake_ms * 1e6) % 1000000000 };
+            pthread_cond_timedwait(&pool->refill, &pool->lock, &until);
+            continue;
+        }
+
+        // Profiles take turns, so one whose zygotes keep failing can't hold up the others.
+        move_to_back(pool, profile);
+        profile->num_starting++;
+        pthread_mutex_unlock(&pool->lock);
+        zygote_t *zygote = spawn_zygote(pool, profile);
+        pthread_mutex_lock(&pool->lock);
+        profile->num_starting--;
+
+        if (zygote) {
+            zygote->next = profile->parked;
+            profile->parked = zygote;
+            profile->num_parked++;
+        }
+        else {
+            // Don't spin on an image that can't start, a launch request will try again.
+            profile->retry_ms = now_ms() + ZYGOTE_RETRY_MS;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void record_launch(launch_stats_t *stats, double ms) {
+    stats->count++;
+    stats->total_ms += ms;
+    if (ms > stats->max_ms)
+        stats->max_ms = ms;
+}
+
+size_t zygote_pool_default_max_parked(void) {
+    DIR *dir = opendir(NETNS_DIR);
+    if (!dir)
+        return 0;
+    size_t namespaces = 0;
+    struct dirent *d;
+    while ((d = readdir(dir))) {
+        int index;
+        if (sscanf(d->d_name, "netns%d", &index) == 1)
+            namespaces++;
+    }
+    closedir(dir);
+    return namespaces / 2;
+}
+
+int zygote_pool_init(zygote_pool_t *pool, size_t target_size, size_t max_parked, placement_t *placement) {
+    memset(pool, 0, sizeof(*pool));
+    pool->target_size = target_size;
+    pool->max_parked = max_parked;
+    pool->placement = placement;
+    pthread_mutex_init(&pool->lock, NULL);
+    // Its waits have deadlines from now_ms.
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->refill, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&pool->refill_thread, NULL, refill_zygotes, pool) != 0) {
+        fprintf(stderr, "Could not start zygote refill thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+void zygote_pool_destroy(zygote_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->refill);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(pool->refill_thread, NULL);
+
+    while (pool->profiles) {
+        zygote_profile_t *profile = pool->profiles;
+        pool->profiles = profile->next;
+        free_profile(pool, profile);
+    }
+    pthread_cond_destroy(&pool->refill);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+int zygote_pool_launch(zygote_pool_t *pool, const char *rootfs, const char *config, bool overlay,
+                       const char *command, size_t command_len, const int *fds, int num_fds,
+                       launched_t *launched) {
+    double start = now_ms();
+
+    pthread_mutex_lock(&pool->lock);
+    zygote_profile_t *profile = find_or_add_profile(pool, rootfs, config, overlay);
+    if (!profile) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    profile->num_launching++;
+    profile->last_used_ms = start;
+    zygote_t *zygote = pop_zygote(profile);
+    pthread_cond_signal(&pool->refill);
+    pthread_mutex_unlock(&pool->lock);
+
+    // A parked zygote may have died since it was parked, in which case move on to the next one.
+    int status = -1;
+    bool hit = false;
+    while (zygote) {
+        status = run_in_zygote(zygote, command, command_len, fds, num_fds);
+        if (status != -1) {
+            hit = true;
+            break;
+        }
+        release_zygote(pool, profile, zygote);
+        pthread_mutex_lock(&pool->lock);
+        zygote = pop_zygote(profile);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (!hit) {
+        zygote = spawn_zygote(pool, profile);
+        if (zygote)
+            status = run_in_zygote(zygote, command, command_len, fds, num_fds);
+    }
+
+    double elapsed = now_ms() - start;
+
+    if (zygote) {
+        if (status != -1) {
+            launched->pid = zygote->pid;
+            memcpy(launched->name, zygote->name, sizeof(launched->name));
+            memcpy(launched->netns, zygote->netns, sizeof(launched->netns));
+        }
+        // A running container keeps its node's cores until it exits, the server gives them back then.
+        launched->numa_node = -1;
+        launched->cpu_cores = profile->cpu_cores;
+        if (status == 0) {
+            launched->numa_node = zygote->numa_node;
+            zygote->numa_node = -1;
+        }
+        release_zygote(pool, profile, zygote);
+    }
+    pthread_mutex_lock(&pool->lock);
+    record_launch(hit ? &pool->hits : &pool->misses, elapsed);
+    profile->num_launching--;
+    pthread_mutex_unlock(&pool->lock);
+    return status;
+}
+
+void zygote_pool_format_stats(zygote_pool_t *pool, char *buf, size_t len) {
+    pthread_mutex_lock(&pool->lock);
+    size_t parked = 0;
+    size_t profiles = 0;
+    for (zygote_profile_t *profile = pool->profiles; profile; profile = profile->next) {
+        parked += profile->num_parked;
+        profiles++;
+    }
+    launch_stats_t *hits = &pool->hits;
+    launch_stats_t *misses = &pool->misses;
+    snprintf(buf, len,
+             "pool hits: %lu avg %.2fms max %.2fms\n"
+             "pool misses: %lu avg %.2fms max %.2fms\n"
+             "parked: %zu (target %zu per profile, at most %zu), %zu profiles, %lu evicted idle, "
+             "%lu zygotes evicted for room\n",
+             hits->count, hits->count ? hits->total_ms / hits->count : 0.0, hits->max_ms,
+             misses->count, misses->count ? misses->total_ms / misses->count : 0.0, misses->max_ms,
+             parked, pool->target_size, pool->max_parked, profiles, pool->evicted_idle, pool->evicted_for_room);
+    pthread_mutex_unlock(&pool->lock);
+}
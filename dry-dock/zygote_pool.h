@@ -0,0 +1,116 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "placement.h"
+
+#define CONTAINER_RUNTIME_PATH "../container"
+#define ZYGOTE_POOL_DEFAULT_SIZE 2
+// A profile nobody has launched from for this long gives its zygotes back.
+#define ZYGOTE_PROFILE_IDLE_MS (5 * 60 * 1000)
+// How long a profile whose zygote failed to start is left alone before the refill thread tries it again.
+#define ZYGOTE_RETRY_MS 1000
+
+/**
+ * A container that has gone through all of its setup (namespaces, cgroups, chroot, /proc) and is parked
+ * waiting for the command it should exec.
+ * */
+typedef struct zygote {
+    pid_t pid;          // the container runtime process
+    int fd;             // our end of the zygote socket
+    char name[64];      // container name, also names its cgroups
+    char netns[64];     // network namespace it leased, empty if it didn't say
+    int numa_node;      // it was placed on, -1 if it floats
+    struct zygote *next;
+} zygote_t;
+
+/**
+ * What is known about a container once its command has been exec'd.
+ * */
+typedef struct {
+    pid_t pid;          // the container runtime process, it exits once the container has
+    char name[64];
+    char netns[64];
+    int numa_node;      // -1 if it floats, otherwise cpu_cores stay committed there until it exits
+    double cpu_cores;
+} launched_t;
+
+/**
+ * Containers started from the same image with the same limits and rootfs mode are interchangeable, so each combination
+ * gets its own set of parked zygotes.
+ * */
+typedef struct zygote_profile {
+    char *rootfs;
+    char *config;       // NULL to use the runtime's default limits
+    bool overlay;       // rootfs is mounted read-only under a per-container overlay
+    double cpu_cores;   // the CPU limit config asks for, what each of its zygotes commits to its node
+    zygote_t *parked;
+    size_t num_parked;
+    size_t num_starting;
+    size_t num_launching;   // launches holding on to the profile, it isn't evicted while there are any
+    double last_used_ms;    // of the last launch, on CLOCK_MONOTONIC
+    double retry_ms;        // not refilled before this, after a zygote failed to start
+    struct zygote_profile *next;
+} zygote_profile_t;
+
+typedef struct {
+    unsigned long count;
+    double total_ms;
+    double max_ms;
+} launch_stats_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t refill;
+    pthread_t refill_thread;
+    size_t target_size;         // parked zygotes to keep per profile
+    size_t max_parked;          // across all profiles, each one holds a network namespace
+    placement_t *placement;
+    zygote_profile_t *profiles;
+    launch_stats_t hits;
+    launch_stats_t misses;
+    unsigned long next_id;
+    unsigned long evicted_idle;     // profiles
+    unsigned long evicted_for_room; // zygotes of a less recently used profile, to park one for another
+    bool stopping;
+} zygote_pool_t;
+
+/**
+ * Sets up an empty pool and starts the thread that keeps it topped up in the background. Each zygote is put on the
+ * NUMA node placement picks as it is started. Every parked zygote holds one of the host's network namespaces, so
+ * no more than max_parked are kept across all profiles. Once that many are parked, the least recently used
+ * profile gives one up to a profile that was used more recently, and a profile that goes unused for
+ * ZYGOTE_PROFILE_IDLE_MS is dropped along with its zygotes
+ * returns 0 on success, -1 on error
+ * */
+int zygote_pool_init(zygote_pool_t *pool, size_t target_size, size_t max_parked, placement_t *placement);
+
+/**
+ * returns half the network namespaces in the host's pool, the other half is left for running containers
+ * */
+size_t zygote_pool_default_max_parked(void);
+
+/**
+ * Stops refilling and releases every parked zygote, which makes them exit and clean up after themselves
+ * */
+void zygote_pool_destroy(zygote_pool_t *pool);
+
+/**
+ * Runs command (packed as NUL separated arguments) in a container for the rootfs/config/overlay profile.
+ * Uses a parked zygote when one is available, otherwise starts one on the spot. Either way the profile is
+ * marked for refilling. fds, if num_fds isn't 0, are passed on to the container as its command's stdin, stdout
+ * and stderr followed by an optional exit status pipe, see ZYGOTE_MAX_FDS.
+ * returns 0 once the command has been exec'd, filling in launched, an errno value if the exec failed,
+ * or -1 if no container could be started
+ * */
+int zygote_pool_launch(zygote_pool_t *pool, const char *rootfs, const char *config, bool overlay,
+                       const char *command, size_t command_len, const int *fds, int num_fds,
+                       launched_t *launched);
+
+/**
+ * Writes human readable hit/miss counts and launch latencies into buf
+ * */
+void zygote_pool_format_stats(zygote_pool_t *pool, char *buf, size_t len);
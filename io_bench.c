@@ -0,0 +1,254 @@
+/**
+Shows whether a container's block I/O limits keep a noisy neighbour from starving the containers next to it. A
+victim times small random direct reads while a neighbour does large direct writes to the same disk: first with the
+victim on its own, then next to a neighbour with no limits, then next to one whose cgroup caps it at write_bps
+(default 20 MB/s) through io_write_bps. Needs to run as root, in a directory on a real disk.
+Usage: ./io_bench [-d dir] [-s seconds] [-w write_bps]
+*/
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cgroups.h"
+
+#define NOISY_BLOCK                   (1 << 20)
+#define NOISY_FILE_SIZE               (256LL << 20) // Written over and over, so the disk never fills up.
+#define VICTIM_BLOCK                  4096
+#define VICTIM_FILE_SIZE              (64LL << 20)
+#define SETTLE_US                     500000 // Let the neighbour get going before the victim is timed.
+#define MAX_SAMPLES                   (1 << 22)
+
+static double now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+static int silence_stdout() {
+  // The backends narrate what they are doing on stdout, keep that out of the numbers we print.
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+  close(devnull);
+  return saved_stdout;
+}
+
+static void restore_stdout(int saved_stdout) {
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+}
+
+static void run_noisy(const char* path, int start_fd, uint64_t* written) {
+  // Nothing is written until we have been moved into our cgroup, which the parent says by closing start_fd.
+  char go;
+  while (read(start_fd, &go, 1) > 0) {}
+  int fd = open(path, O_WRONLY | O_CREAT | O_DIRECT | O_CLOEXEC, 0600);
+  void* block;
+  if (fd == -1 || posix_memalign(&block, VICTIM_BLOCK, NOISY_BLOCK) != 0) {
+    perror("Noisy neighbour could not open its file");
+    _exit(1);
+  }
+  memset(block, 0xab, NOISY_BLOCK);
+  off_t offset = 0;
+  while (1) {
+    ssize_t done = pwrite(fd, block, NOISY_BLOCK, offset);
+    if (done <= 0) {
+      perror("Noisy neighbour could not write");
+      _exit(1);
+    }
+    __atomic_add_fetch(written, done, __ATOMIC_RELAXED);
+    offset = (offset + done) % NOISY_FILE_SIZE;
+  }
+}
+
+static pid_t start_noisy(const char* path, uint64_t* written, container_params_t* limits, cgroup_t* cgroup) {
+  // limits NULL leaves the neighbour wherever we are, with nothing holding it back.
+  int start[2];
+  if (pipe(start) == -1) {
+    perror("pipe");
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(start[1]);
+    run_noisy(path, start[0], written);
+  }
+  close(start[0]);
+  if (pid != -1 && limits) {
+    int saved_stdout = silence_stdout();
+    setup_cgroups(cgroup, limits);
+    attach_to_cgroups(cgroup, pid);
+    restore_stdout(saved_stdout);
+  }
+  close(start[1]);
+  return pid;
+}
+
+static void run_phase(const char* phase, const char* dir, int seconds, bool noisy, container_params_t* limits,
+  double* samples) {
+  char victim_path[4096];
+  char noisy_path[4096];
+  snprintf(victim_path, sizeof(victim_path), "%s/io_bench.victim", dir);
+  snprintf(noisy_path, sizeof(noisy_path), "%s/io_bench.noisy", dir);
+  // Direct reads all go to the disk, the page cache can't hide what the neighbour is doing to it.
+  int fd = open(victim_path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+  void* block;
+  if (fd == -1 || posix_memalign(&block, VICTIM_BLOCK, VICTIM_BLOCK) != 0) {
+    perror("Victim could not open its file");
+    return;
+  }
+  uint64_t* written = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (written == MAP_FAILED) {
+    perror("mmap");
+    close(fd);
+    free(block);
+    return;
+  }
+  *written = 0;
+
+  cgroup_t cgroup = { .version = detect_cgroup_version(), .name = "io_bench_noisy", .dir_fd = -1 };
+  pid_t pid = noisy ? start_noisy(noisy_path, written, limits, &cgroup) : -1;
+  if (noisy && pid == -1) {
+    noisy = false;
+  }
+  if (noisy) {
+    usleep(SETTLE_US);
+  }
+  uint64_t written_before = __atomic_load_n(written, __ATOMIC_RELAXED);
+  double start = now_us();
+  double end = start + seconds * 1e6;
+  int n = 0;
+  unsigned int seed = 1;
+  double now = start;
+  while (now < end && n < MAX_SAMPLES) {
+    off_t offset = (off_t) (rand_r(&seed) % (VICTIM_FILE_SIZE / VICTIM_BLOCK)) * VICTIM_BLOCK;
+    if (pread(fd, block, VICTIM_BLOCK, offset) != VICTIM_BLOCK) {
+      perror("Victim could not read");
+      break;
+    }
+    double done = now_us();
+    samples[n++] = done - now;
+    now = done;
+  }
+  double elapsed = now - start;
+  uint64_t noisy_bytes = __atomic_load_n(written, __ATOMIC_RELAXED) - written_before;
+  close(fd);
+  free(block);
+
+  if (noisy) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    if (limits) {
+      int saved_stdout = silence_stdout();
+      clean_up_cgroups(&cgroup);
+      restore_stdout(saved_stdout);
+    }
+  }
+  munmap(written, sizeof(uint64_t));
+  if (n == 0) {
+    return;
+  }
+
+  qsort(samples, n, sizeof(double), compare_doubles);
+  printf("%-10s victim reads %8.0f/s p50=%8.1fus p99=%8.1fus max=%9.1fus", phase, n / (elapsed / 1e6),
+    samples[n / 2], samples[(n * 99) / 100], samples[n - 1]);
+  if (noisy) {
+    printf("  neighbour writes %7.1f MB/s", noisy_bytes / (elapsed / 1e6) / 1e6);
+  }
+  printf("\n");
+}
+
+static int fill_file(const char* path, long long size) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT | O_CLOEXEC, 0600);
+  void* block;
+  if (fd == -1 || posix_memalign(&block, VICTIM_BLOCK, NOISY_BLOCK) != 0) {
+    return -1;
+  }
+  memset(block, 0xcd, NOISY_BLOCK);
+  for (long long offset = 0; offset < size; offset += NOISY_BLOCK) {
+    if (pwrite(fd, block, NOISY_BLOCK, offset) != NOISY_BLOCK) {
+      close(fd);
+      free(block);
+      return -1;
+    }
+  }
+  free(block);
+  return close(fd);
+}
+
+int main(int argc, char* argv[]) {
+  const char* dir = ".";
+  int seconds = 5;
+  char* write_bps = "20000000";
+  int opt;
+  while ((opt = getopt(argc, argv, "d:s:w:")) != -1) {
+    switch (opt) {
+      case 'd':
+        dir = optarg;
+        break;
+      case 's':
+        seconds = atoi(optarg);
+        break;
+      case 'w':
+        write_bps = optarg;
+        break;
+      default:
+        fprintf(stderr, "Usage: ./io_bench [-d dir] [-s seconds] [-w write_bps]\n");
+        return 1;
+    }
+  }
+  char device[32];
+  if (seconds <= 0 || find_io_device(dir, device, sizeof(device)) == -1) {
+    fprintf(stderr, "%s has to be on a disk and seconds more than 0\n", dir);
+    return 1;
+  }
+
+  // The neighbour gets everything a container would, only its disk writes are held back.
+  container_params_t limits = {
+    .mem_limit = "268435456",
+    .mem_plus_swap_limit = "268435456",
+    .pid_limit = "10",
+    .cpu_period = "100000",
+    .cpu_quota = "-1",
+    .io_device = (char*) dir,
+    .io_write_bps = write_bps
+  };
+
+  char victim_path[4096];
+  char noisy_path[4096];
+  snprintf(victim_path, sizeof(victim_path), "%s/io_bench.victim", dir);
+  snprintf(noisy_path, sizeof(noisy_path), "%s/io_bench.noisy", dir);
+  if (fill_file(victim_path, VICTIM_FILE_SIZE) == -1) {
+    perror("Could not write the victim's file");
+    return 1;
+  }
+  double* samples = calloc(MAX_SAMPLES, sizeof(double));
+  printf("cgroup v%d, disk %s, %d s per phase, neighbour capped at %s bytes/s\n", detect_cgroup_version(), device,
+    seconds, write_bps);
+  run_phase("alone", dir, seconds, false, NULL, samples);
+  run_phase("noisy", dir, seconds, true, NULL, samples);
+  run_phase("contained", dir, seconds, true, &limits, samples);
+  free(samples);
+  unlink(victim_path);
+  unlink(noisy_path);
+  return 0;
+}
@@ -0,0 +1,226 @@
+/**
+Measures how long the runtime takes to start and stop containers. Launches ./container over and over, first one
+at a time and then with several in flight, and reads each launch's trace (see trace.h) to find when the
+workload was exec'd and when it exited. Needs to run as root.
+Usage: ./launch_bench [-O] [-r rootfs] [-x executable] [-n launches] [-j concurrency] [-o results_file]
+-O launches every container on an overlay of rootfs (./container -o) instead of chrooting into it.
+
+Results are one line per mode and metric in key=value form so runs from different builds can be diffed:
+  mode=serial concurrency=1 launches=200 failures=0 elapsed_s=1.234 launches_per_sec=162.1
+  mode=serial metric=launch_to_exec_us p50=... p90=... p99=... max=...
+*/
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RUNTIME_PATH "./container"
+#define BENCH_FORMAT_VERSION 1
+
+typedef struct {
+  pid_t pid;
+  double spawn_us;   // when we forked the runtime
+  double reaped_us;  // when we saw the runtime exit
+  char trace_path[64];
+} launch_t;
+
+typedef struct {
+  double* launch_to_exec;  // runtime forked -> workload exec'd
+  double* exit_to_cleanup; // workload exited -> runtime gone with everything cleaned up
+  int num_samples;
+  int failures;
+} results_t;
+
+static const char* rootfs = ".";
+static const char* executable = "/bin/true";
+static const char* rootfs_flag = NULL; // "-o" in overlay mode
+
+static double now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+static void start_launch(launch_t* launch, int id) {
+  snprintf(launch->trace_path, sizeof(launch->trace_path), "/tmp/launch_bench.%d.%d.json", getpid(), id);
+  unlink(launch->trace_path);
+  char name[32];
+  snprintf(name, sizeof(name), "bench-%d-%d", getpid(), id);
+
+  launch->spawn_us = now_us();
+  launch->pid = fork();
+  if (launch->pid == 0) {
+    // Runtime chatter would only measure the terminal.
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    if (rootfs_flag != NULL) {
+      execl(RUNTIME_PATH, RUNTIME_PATH, rootfs_flag, "-n", name, "-t", launch->trace_path, rootfs, executable,
+        (char*) NULL);
+    }
+    else {
+      execl(RUNTIME_PATH, RUNTIME_PATH, "-n", name, "-t", launch->trace_path, rootfs, executable, (char*) NULL);
+    }
+    _exit(127);
+  }
+}
+
+// Returns where a named event starts and ends in the trace, in microseconds, or -1 if it is missing.
+static int find_event(const char* trace, const char* name, double* start, double* end) {
+  char needle[64];
+  snprintf(needle, sizeof(needle), "{\"name\":\"%s\",", name);
+  const char* line = strstr(trace, needle);
+  if (line == NULL) {
+    return -1;
+  }
+  const char* ts = strstr(line, "\"ts\":");
+  if (ts == NULL) {
+    return -1;
+  }
+  *start = strtod(ts + strlen("\"ts\":"), NULL);
+  const char* dur = strstr(line, "\"dur\":");
+  const char* line_end = strchr(line, '\n');
+  *end = *start;
+  if (dur != NULL && (line_end == NULL || dur < line_end)) {
+    *end += strtod(dur + strlen("\"dur\":"), NULL);
+  }
+  return 0;
+}
+
+static void finish_launch(launch_t* launch, int status, results_t* results) {
+  char trace[16384];
+  ssize_t len = -1;
+  int fd = open(launch->trace_path, O_RDONLY);
+  if (fd != -1) {
+    len = read(fd, trace, sizeof(trace) - 1);
+    close(fd);
+  }
+  unlink(launch->trace_path);
+
+  double exec_us, run_start_us, run_end_us;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || len <= 0) {
+    results->failures++;
+    return;
+  }
+  trace[len] = '\0';
+  if (find_event(trace, "exec", &exec_us, &exec_us) == -1 || find_event(trace, "run", &run_start_us, &run_end_us) == -1) {
+    results->failures++;
+    return;
+  }
+  results->launch_to_exec[results->num_samples] = exec_us - launch->spawn_us;
+  results->exit_to_cleanup[results->num_samples] = launch->reaped_us - run_end_us;
+  results->num_samples++;
+}
+
+static void report_metric(FILE* out, const char* mode, const char* metric, double* samples, int n) {
+  if (n == 0) {
+    fprintf(out, "mode=%s metric=%s samples=0\n", mode, metric);
+    return;
+  }
+  qsort(samples, n, sizeof(double), compare_doubles);
+  fprintf(out, "mode=%s metric=%s samples=%d p50=%.1f p90=%.1f p99=%.1f max=%.1f\n", mode, metric, n,
+    samples[(n * 50) / 100], samples[(n * 90) / 100], samples[(n * 99) / 100], samples[n - 1]);
+}
+
+static void run_mode(FILE* out, const char* mode, int launches, int concurrency) {
+  results_t results = {
+    .launch_to_exec = calloc(launches, sizeof(double)),
+    .exit_to_cleanup = calloc(launches, sizeof(double))
+  };
+  launch_t* in_flight = calloc(concurrency, sizeof(launch_t));
+  int started = 0;
+  int running = 0;
+
+  double start = now_us();
+  while (started < launches || running > 0) {
+    // Keep the pipeline full.
+    for (int slot = 0; slot < concurrency && started < launches; ++slot) {
+      if (in_flight[slot].pid == 0) {
+        start_launch(&in_flight[slot], started++);
+        running++;
+      }
+    }
+
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    double reaped = now_us();
+    if (pid == -1) {
+      perror("waitpid");
+      break;
+    }
+    for (int slot = 0; slot < concurrency; ++slot) {
+      if (in_flight[slot].pid == pid) {
+        in_flight[slot].reaped_us = reaped;
+        finish_launch(&in_flight[slot], status, &results);
+        in_flight[slot].pid = 0;
+        running--;
+        break;
+      }
+    }
+  }
+  double elapsed = (now_us() - start) / 1e6;
+
+  fprintf(out, "mode=%s concurrency=%d launches=%d failures=%d elapsed_s=%.3f launches_per_sec=%.1f\n",
+    mode, concurrency, launches, results.failures, elapsed, launches / elapsed);
+  report_metric(out, mode, "launch_to_exec_us", results.launch_to_exec, results.num_samples);
+  report_metric(out, mode, "exit_to_cleanup_us", results.exit_to_cleanup, results.num_samples);
+  fflush(out);
+
+  free(in_flight);
+  free(results.launch_to_exec);
+  free(results.exit_to_cleanup);
+}
+
+int main(int argc, char* argv[]) {
+  int launches = 200;
+  int concurrency = 8;
+  const char* output_path = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "Or:x:n:j:o:")) != -1) {
+    switch (opt) {
+      case 'O': rootfs_flag = "-o"; break;
+      case 'r': rootfs = optarg; break;
+      case 'x': executable = optarg; break;
+      case 'n': launches = atoi(optarg); break;
+      case 'j': concurrency = atoi(optarg); break;
+      case 'o': output_path = optarg; break;
+      default:
+        fprintf(stderr, "Usage: ./launch_bench [-O] [-r rootfs] [-x executable] [-n launches] [-j concurrency] [-o results_file]\n");
+        return 1;
+    }
+  }
+  if (launches <= 0 || concurrency <= 0) {
+    fprintf(stderr, "launches and concurrency have to be positive\n");
+    return 1;
+  }
+
+  FILE* out = stdout;
+  if (output_path != NULL && (out = fopen(output_path, "w")) == NULL) {
+    perror("Failed to open results file");
+    return 1;
+  }
+
+  fprintf(out, "# launch_bench format=%d rootfs=%s rootfs_mode=%s executable=%s\n", BENCH_FORMAT_VERSION, rootfs,
+    rootfs_flag != NULL ? "overlay" : "chroot", executable);
+  run_mode(out, "serial", launches, 1);
+  run_mode(out, "concurrent", launches, concurrency);
+
+  if (out != stdout) {
+    fclose(out);
+  }
+  return 0;
+}
@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "netlink.h"
+
+int netlink_open(int ns_fd) {
+  int original_ns = -1;
+  if (ns_fd != -1) {
+    // A netlink socket talks to whichever namespace it was created in, no matter where it is used later.
+    original_ns = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (original_ns == -1 || setns(ns_fd, CLONE_NEWNET) == -1) {
+      perror("Failed to enter network namespace for netlink");
+      if (original_ns != -1) {
+        close(original_ns);
+      }
+      return -1;
+    }
+  }
+
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd == -1) {
+    perror("Failed to open netlink socket");
+  }
+  else {
+    struct sockaddr_nl local = { .nl_family = AF_NETLINK };
+    if (bind(fd, (struct sockaddr*) &local, sizeof(local)) == -1) {
+      perror("Failed to bind netlink socket");
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  if (original_ns != -1) {
+    if (setns(original_ns, CLONE_NEWNET) == -1) {
+      perror("Failed to return to original network namespace");
+      if (fd != -1) {
+        close(fd);
+      }
+      fd = -1;
+    }
+    close(original_ns);
+  }
+  return fd;
+}
+
+void netlink_batch_init(netlink_batch_t* batch, int fd) {
+  static unsigned int seq = 0;
+  if (seq == 0) {
+    seq = getpid();
+  }
+  batch->fd = fd;
+  batch->first_seq = seq;
+  batch->next_seq = seq;
+  batch->len = 0;
+  batch->last = NULL;
+  // Leave room so sequence numbers of back to back batches on one socket never overlap.
+  seq += 1024;
+}
+
+struct nlmsghdr* netlink_add_message(netlink_batch_t* batch, int type, int flags, const void* header,
+  size_t header_len) {
+  size_t len = NLMSG_LENGTH(header_len);
+  if (batch->len + NLMSG_ALIGN(len) > sizeof(batch->buf)) {
+    return NULL;
+  }
+  struct nlmsghdr* message = (struct nlmsghdr*) (batch->buf + batch->len);
+  memset(message, 0, NLMSG_ALIGN(len));
+  message->nlmsg_len = len;
+  message->nlmsg_type = type;
+  message->nlmsg_flags = flags | NLM_F_REQUEST | NLM_F_ACK;
+  message->nlmsg_seq = batch->next_seq++;
+  memcpy(NLMSG_DATA(message), header, header_len);
+  batch->len += NLMSG_ALIGN(len);
+  batch->last = message;
+  return message;
+}
+
+int netlink_add_attr(netlink_batch_t* batch, int type, const void* data, size_t len) {
+  size_t attr_len = RTA_LENGTH(len);
+  if (batch->last == NULL || batch->len + RTA_ALIGN(attr_len) > sizeof(batch->buf)) {
+    return -1;
+  }
+  struct rtattr* attr = (struct rtattr*) (batch->buf + batch->len);
+  memset(attr, 0, RTA_ALIGN(attr_len));
+  attr->rta_type = type;
+  attr->rta_len = attr_len;
+  if (len > 0) {
+    memcpy(RTA_DATA(attr), data, len);
+  }
+  batch->len += RTA_ALIGN(attr_len);
+  batch->last->nlmsg_len = (batch->buf + batch->len) - (char*) batch->last;
+  return 0;
+}
+
+struct rtattr* netlink_begin_nest(netlink_batch_t* batch, int type, const void* header, size_t header_len) {
+  struct rtattr* nest = (struct rtattr*) (batch->buf + batch->len);
+  if (netlink_add_attr(batch, type, header, header_len) == -1) {
+    return NULL;
+  }
+  return nest;
+}
+
+void netlink_end_nest(netlink_batch_t* batch, struct rtattr* nest) {
+  nest->rta_len = (batch->buf + batch->len) - (char*) nest;
+}
+
+int netlink_send(netlink_batch_t* batch) {
+  int num_requests = batch->next_seq - batch->first_seq;
+  if (num_requests == 0) {
+    return 0;
+  }
+  struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+  if (sendto(batch->fd, batch->buf, batch->len, 0, (struct sockaddr*) &kernel, sizeof(kernel)) == -1) {
+    return -1;
+  }
+
+  int first_error = 0;
+  int acked = 0;
+  char reply[NETLINK_BATCH_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+  while (acked < num_requests) {
+    ssize_t len = recv(batch->fd, reply, sizeof(reply), 0);
+    if (len == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    for (struct nlmsghdr* message = (struct nlmsghdr*) reply; NLMSG_OK(message, len);
+         message = NLMSG_NEXT(message, len)) {
+      if (message->nlmsg_type != NLMSG_ERROR || message->nlmsg_seq < batch->first_seq ||
+          message->nlmsg_seq >= batch->next_seq) {
+        continue;
+      }
+      struct nlmsgerr* ack = NLMSG_DATA(message);
+      if (ack->error != 0 && first_error == 0) {
+        first_error = -ack->error;
+      }
+      acked++;
+    }
+  }
+
+  netlink_batch_init(batch, batch->fd);
+  if (first_error != 0) {
+    errno = first_error;
+    return -1;
+  }
+  return 0;
+}
+
+int netlink_dump(int fd, int type, const void* header, size_t header_len,
+  void (*handler)(struct nlmsghdr* message, void* arg), void* arg) {
+  netlink_batch_t request;
+  netlink_batch_init(&request, fd);
+  struct nlmsghdr* message = netlink_add_message(&request, type, NLM_F_DUMP, header, header_len);
+  // A dump ends with NLMSG_DONE, there is no ack to wait for.
+  message->nlmsg_flags &= ~NLM_F_ACK;
+  struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+  if (sendto(fd, request.buf, request.len, 0, (struct sockaddr*) &kernel, sizeof(kernel)) == -1) {
+    return -1;
+  }
+
+  // Dumps come back in chunks as large as the kernel likes, a short buffer would truncate them.
+  char reply[32768] __attribute__((aligned(NLMSG_ALIGNTO)));
+  while (1) {
+    ssize_t len = recv(fd, reply, sizeof(reply), 0);
+    if (len == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    for (message = (struct nlmsghdr*) reply; NLMSG_OK(message, len); message = NLMSG_NEXT(message, len)) {
+      if (message->nlmsg_seq != request.first_seq) {
+        continue;
+      }
+      if (message->nlmsg_type == NLMSG_DONE) {
+        return 0;
+      }
+      if (message->nlmsg_type == NLMSG_ERROR) {
+        struct nlmsgerr* error = NLMSG_DATA(message);
+        errno = -error->error;
+        return -1;
+      }
+      handler(message, arg);
+    }
+  }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+// Minimal rtnetlink client. Requests are queued into a batch and go to the kernel in a single sendmsg, which
+// handles them in order and acks each one, so a whole network setup costs one round trip instead of one per
+// `ip` invocation.
+
+#define NETLINK_BATCH_SIZE            8192
+
+typedef struct {
+  int fd;
+  unsigned int first_seq;
+  unsigned int next_seq;
+  size_t len;
+  struct nlmsghdr* last;  // the message attributes are being appended to
+  char buf[NETLINK_BATCH_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+} netlink_batch_t;
+
+/**
+ * Opens an rtnetlink socket inside the network namespace ns_fd refers to, or the current one if ns_fd is -1.
+ * Switches this thread's network namespace for a moment, so don't call it while other threads rely on it.
+ * returns the socket, or -1 on error
+ * */
+int netlink_open(int ns_fd);
+
+/**
+ * Starts an empty batch of requests for the socket fd.
+ * */
+void netlink_batch_init(netlink_batch_t* batch, int fd);
+
+/**
+ * Queues a request of type (RTM_NEWLINK, ...) made of the fixed header (ifinfomsg, ifaddrmsg, ...) of
+ * header_len bytes. NLM_F_REQUEST and NLM_F_ACK are always added to flags.
+ * returns the queued message, or NULL if the batch is full
+ * */
+struct nlmsghdr* netlink_add_message(netlink_batch_t* batch, int type, int flags, const void* header,
+  size_t header_len);
+
+/**
+ * Appends an attribute to the last queued message.
+ * returns 0 on success, -1 if the batch is full
+ * */
+int netlink_add_attr(netlink_batch_t* batch, int type, const void* data, size_t len);
+
+/**
+ * Opens a nested attribute on the last queued message, everything appended until netlink_end_nest goes in it.
+ * Some nests start with a fixed header before their attributes (VETH_INFO_PEER has an ifinfomsg), pass NULL
+ * and 0 if this one doesn't.
+ * returns the nest to close, or NULL if the batch is full
+ * */
+struct rtattr* netlink_begin_nest(netlink_batch_t* batch, int type, const void* header, size_t header_len);
+void netlink_end_nest(netlink_batch_t* batch, struct rtattr* nest);
+
+/**
+ * Sends every queued request and waits for all of them to be acked, then empties the batch.
+ * returns 0 if every request succeeded, otherwise -1 with errno set from the first one that failed
+ * */
+int netlink_send(netlink_batch_t* batch);
+
+/**
+ * Runs a dump request (RTM_GETLINK, ...) and calls handler with each message that comes back.
+ * returns 0 on success, -1 with errno set on error
+ * */
+int netlink_dump(int fd, int type, const void* header, size_t header_len,
+  void (*handler)(struct nlmsghdr* message, void* arg), void* arg);
@@ -0,0 +1,126 @@
+/**
+Compares per-container network setup over rtnetlink (netns_pool.c) with the ip based scripts in networking/.
+For each iteration it creates a namespace with its veth pair, scrubs it the way it is after every container
+exits, and deletes it, timing the first two. Needs to run as root from the top of the repository.
+Usage: ./netns_bench [iterations] [index]
+
+index picks the namespace used (netns<index>, 10.0.(3+index).0/24) and should be outside the pool.
+*/
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "netns_pool.h"
+
+static double now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+static void report(const char* backend, const char* phase, double* samples, int n) {
+  qsort(samples, n, sizeof(double), compare_doubles);
+  double total = 0;
+  for (int i = 0; i < n; ++i) {
+    total += samples[i];
+  }
+  printf("%-7s %-7s mean=%8.1fus p50=%8.1fus p99=%8.1fus max=%8.1fus\n", backend, phase,
+    total / n, samples[n / 2], samples[(n * 99) / 100], samples[n - 1]);
+}
+
+// Runs a networking/netns.sh function the way the scripts do, a fresh bash each time.
+static int run_script(const char* command, int index) {
+  char script[256];
+  snprintf(script, sizeof(script), "source networking/netns.sh && %s %d", command, index);
+  pid_t pid = fork();
+  if (pid == 0) {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    execl("/bin/bash", "bash", "-c", script, (char*) NULL);
+    _exit(127);
+  }
+  int status;
+  if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+static int native_create(int index) { return create_netns(index); }
+static int native_scrub(int index) { return scrub_netns(index); }
+static int native_delete(int index) { return delete_netns(index); }
+static int script_create(int index) { return run_script("netns_create", index); }
+static int script_scrub(int index) { return run_script("netns_scrub", index); }
+static int script_delete(int index) { return run_script("netns_delete", index); }
+
+static int bench_backend(const char* name, int (*create)(int), int (*scrub)(int), int (*delete)(int),
+  int iterations, int index) {
+  double* setup = calloc(iterations, sizeof(double));
+  double* scrubbing = calloc(iterations, sizeof(double));
+  int result = 0;
+
+  for (int i = 0; i < iterations; ++i) {
+    double start = now_us();
+    if (create(index) == -1) {
+      fprintf(stderr, "%s: failed to create netns%d\n", name, index);
+      result = -1;
+      break;
+    }
+    setup[i] = now_us() - start;
+
+    start = now_us();
+    int scrubbed = scrub(index);
+    scrubbing[i] = now_us() - start;
+    delete(index);
+    if (scrubbed == -1) {
+      fprintf(stderr, "%s: failed to scrub netns%d\n", name, index);
+      result = -1;
+      break;
+    }
+  }
+
+  if (result == 0) {
+    report(name, "create", setup, iterations);
+    report(name, "scrub", scrubbing, iterations);
+  }
+  free(setup);
+  free(scrubbing);
+  return result;
+}
+
+int main(int argc, char const *argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 100;
+  int index = argc > 2 ? atoi(argv[2]) : 200;
+  if (iterations <= 0 || index < 0 || index >= NETNS_MAX_POOL_SIZE) {
+    fprintf(stderr, "Usage: ./netns_bench [iterations] [index]\n");
+    return 1;
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), NETNS_PATH_FORMAT, index);
+  if (access(path, F_OK) == 0) {
+    fprintf(stderr, "%s already exists, pick an index outside the pool\n", path);
+    return 1;
+  }
+
+  printf("netns%d, %d iterations\n", index, iterations);
+  fflush(stdout);
+  int failed = bench_backend("netlink", native_create, native_scrub, native_delete, iterations, index);
+  fflush(stdout);
+  failed |= bench_backend("scripts", script_create, script_scrub, script_delete, iterations, index);
+  return failed ? 1 : 0;
+}
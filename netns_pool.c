@@ -0,0 +1,476 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <net/if.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/if_link.h>
+#include <linux/veth.h>
+
+#include "netlink.h"
+#include "netns_pool.h"
+
+// Loopback is always the first interface of a namespace.
+#define LOOPBACK_IFINDEX              1
+
+typedef struct {
+  netlink_batch_t* batch;
+  char peer_name[IFNAMSIZ];
+  int peer_ifindex;       // 0 until the link dump finds the namespace's end of the pair
+} scrub_t;
+
+typedef struct {
+  const char* name;
+  int ifindex;
+} link_lookup_t;
+
+static int try_acquire_netns(netns_lease_t* lease, int index) {
+  char lock_path[PATH_MAX];
+  snprintf(lock_path, sizeof(lock_path), NETNS_LOCK_FORMAT, index);
+  int fd = open(lock_path, O_RDONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    return -1;
+  }
+  if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+    close(fd);
+    return -1;
+  }
+  lease->index = index;
+  lease->lock_fd = fd;
+  snprintf(lease->path, sizeof(lease->path), NETNS_PATH_FORMAT, index);
+  return 0;
+}
+
+int acquire_netns(netns_lease_t* lease) {
+  puts("Claiming a network namespace...");
+  if (mkdir("/var/run/drydock", S_IRWXU) == -1 && errno != EEXIST) {
+    perror("Failed to create /var/run/drydock");
+  }
+  if (mkdir(NETNS_LOCK_DIR, S_IRWXU) == -1 && errno != EEXIST) {
+    perror("Failed to create " NETNS_LOCK_DIR);
+    return -1;
+  }
+
+  struct timespec retry_delay = { .tv_sec = 0, .tv_nsec = 10 * 1000 * 1000 };
+  for (int waited_ms = 0; waited_ms <= NETNS_ACQUIRE_TIMEOUT_MS; waited_ms += 10) {
+    // The pool is netns0 up to the first index that does not exist.
+    int index;
+    char path[PATH_MAX];
+    for (index = 0; ; ++index) {
+      snprintf(path, sizeof(path), NETNS_PATH_FORMAT, index);
+      if (access(path, F_OK) != 0) {
+        break;
+      }
+      if (try_acquire_netns(lease, index) == 0) {
+        printf("Using network namespace %s\n", lease->path);
+        return 0;
+      }
+    }
+    if (index == 0) {
+      fputs("No network namespaces found, run make network-setup first\n", stderr);
+      return -1;
+    }
+    // Every namespace is in use or still being scrubbed, one should free up shortly.
+    nanosleep(&retry_delay, NULL);
+  }
+  fputs("Timed out waiting for a free network namespace\n", stderr);
+  return -1;
+}
+
+static in_addr_t netns_ip(int index, int host) {
+  return htonl((10 << 24) | ((NETNS_SUBNET_BASE + index) << 8) | host);
+}
+
+static int open_netns(int index) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), NETNS_PATH_FORMAT, index);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    perror("Failed to open network namespace");
+  }
+  return fd;
+}
+
+static void queue_link_up(netlink_batch_t* batch, int ifindex) {
+  struct ifinfomsg link = { .ifi_family = AF_UNSPEC, .ifi_index = ifindex, .ifi_flags = IFF_UP, .ifi_change = IFF_UP };
+  netlink_add_message(batch, RTM_NEWLINK, 0, &link, sizeof(link));
+}
+
+static void queue_address(netlink_batch_t* batch, int ifindex, in_addr_t address) {
+  struct ifaddrmsg addr = { .ifa_family = AF_INET, .ifa_prefixlen = 24, .ifa_scope = RT_SCOPE_UNIVERSE, .ifa_index = ifindex };
+  netlink_add_message(batch, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, &addr, sizeof(addr));
+  netlink_add_attr(batch, IFA_LOCAL, &address, sizeof(address));
+  netlink_add_attr(batch, IFA_ADDRESS, &address, sizeof(address));
+}
+
+static const char* link_name(struct nlmsghdr* message) {
+  struct ifinfomsg* link = NLMSG_DATA(message);
+  int len = IFLA_PAYLOAD(message);
+  for (struct rtattr* attr = IFLA_RTA(link); RTA_OK(attr, len); attr = RTA_NEXT(attr, len)) {
+    if (attr->rta_type == IFLA_IFNAME) {
+      return RTA_DATA(attr);
+    }
+  }
+  return "";
+}
+
+static void match_link(struct nlmsghdr* message, void* arg) {
+  link_lookup_t* lookup = arg;
+  if (strcmp(link_name(message), lookup->name) == 0) {
+    lookup->ifindex = ((struct ifinfomsg*) NLMSG_DATA(message))->ifi_index;
+  }
+}
+
+// if_nametoindex only sees our own namespace. The peer's index can't be assumed either, a new namespace may
+// already hold fallback tunnel devices (sit0, tunl0, ...) that took the low ones.
+static int find_link(int ns_socket, const char* name) {
+  link_lookup_t lookup = { .name = name, .ifindex = 0 };
+  struct ifinfomsg links = { .ifi_family = AF_UNSPEC };
+  if (netlink_dump(ns_socket, RTM_GETLINK, &links, sizeof(links), match_link, &lookup) == -1) {
+    return 0;
+  }
+  if (lookup.ifindex == 0) {
+    errno = ENODEV;
+  }
+  return lookup.ifindex;
+}
+
+// Everything on the namespace's side once its end of the pair exists.
+static void queue_netns_config(netlink_batch_t* batch, int index, int peer_ifindex) {
+  queue_link_up(batch, LOOPBACK_IFINDEX);
+  queue_address(batch, peer_ifindex, netns_ip(index, 2));
+  struct rtmsg route = {
+    .rtm_family = AF_INET,
+    .rtm_table = RT_TABLE_MAIN,
+    .rtm_protocol = RTPROT_BOOT,
+    .rtm_scope = RT_SCOPE_UNIVERSE,
+    .rtm_type = RTN_UNICAST
+  };
+  in_addr_t gateway = netns_ip(index, 1);
+  int oif = peer_ifindex;
+  netlink_add_message(batch, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE, &route, sizeof(route));
+  netlink_add_attr(batch, RTA_GATEWAY, &gateway, sizeof(gateway));
+  netlink_add_attr(batch, RTA_OIF, &oif, sizeof(oif));
+}
+
+int setup_netns_link(int index) {
+  if (index < 0 || index >= NETNS_MAX_POOL_SIZE) {
+    fprintf(stderr, "Network namespace %d has no 10.0.x.0/24 subnet left, the pool holds at most %d\n", index,
+      NETNS_MAX_POOL_SIZE);
+    return -1;
+  }
+  char host_name[IFNAMSIZ];
+  char peer_name[IFNAMSIZ];
+  snprintf(host_name, sizeof(host_name), NETNS_HOST_LINK_FORMAT, index);
+  snprintf(peer_name, sizeof(peer_name), NETNS_PEER_LINK_FORMAT, index);
+  int ns_fd = open_netns(index);
+  if (ns_fd == -1) {
+    return -1;
+  }
+  int host_ns_fd = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+  int ns_socket = netlink_open(ns_fd);
+  int host_socket = netlink_open(-1);
+  int result = -1;
+  if (host_ns_fd == -1 || ns_socket == -1 || host_socket == -1) {
+    goto out;
+  }
+
+  // The pair is created from inside the namespace and the host's end is pushed out, so the namespace's end is
+  // already in place when it is configured.
+  netlink_batch_t batch;
+  netlink_batch_init(&batch, ns_socket);
+  struct ifinfomsg peer_link = { .ifi_family = AF_UNSPEC, .ifi_flags = IFF_UP, .ifi_change = IFF_UP };
+  netlink_add_message(&batch, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, &peer_link, sizeof(peer_link));
+  netlink_add_attr(&batch, IFLA_IFNAME, peer_name, strlen(peer_name) + 1);
+  struct rtattr* link_info = netlink_begin_nest(&batch, IFLA_LINKINFO, NULL, 0);
+  netlink_add_attr(&batch, IFLA_INFO_KIND, "veth", strlen("veth"));
+  struct rtattr* info_data = netlink_begin_nest(&batch, IFLA_INFO_DATA, NULL, 0);
+  // The kernel refuses to bring up the end it is moving to another namespace, that happens on the host below.
+  struct ifinfomsg host_link = { .ifi_family = AF_UNSPEC };
+  struct rtattr* peer = netlink_begin_nest(&batch, VETH_INFO_PEER, &host_link, sizeof(host_link));
+  netlink_add_attr(&batch, IFLA_IFNAME, host_name, strlen(host_name) + 1);
+  netlink_add_attr(&batch, IFLA_NET_NS_FD, &host_ns_fd, sizeof(host_ns_fd));
+  netlink_end_nest(&batch, peer);
+  netlink_end_nest(&batch, info_data);
+  netlink_end_nest(&batch, link_info);
+
+  if (netlink_send(&batch) == -1) {
+    perror("Failed to create veth pair");
+    goto out;
+  }
+  int peer_ifindex = find_link(ns_socket, peer_name);
+  if (peer_ifindex == 0) {
+    perror("Failed to find namespace end of veth pair");
+    goto out;
+  }
+  netlink_batch_init(&batch, ns_socket);
+  queue_netns_config(&batch, index, peer_ifindex);
+  if (netlink_send(&batch) == -1) {
+    perror("Failed to address namespace end of veth pair");
+    goto out;
+  }
+
+  // The host has interfaces of its own, so its end's index is only known now.
+  int host_ifindex = if_nametoindex(host_name);
+  if (host_ifindex == 0) {
+    perror("Failed to find host end of veth pair");
+    goto out;
+  }
+  netlink_batch_init(&batch, host_socket);
+  queue_link_up(&batch, host_ifindex);
+  queue_address(&batch, host_ifindex, netns_ip(index, 1));
+  if (netlink_send(&batch) == -1) {
+    perror("Failed to address host end of veth pair");
+    goto out;
+  }
+  result = 0;
+
+out:
+  if (host_socket != -1) {
+    close(host_socket);
+  }
+  if (ns_socket != -1) {
+    close(ns_socket);
+  }
+  if (host_ns_fd != -1) {
+    close(host_ns_fd);
+  }
+  close(ns_fd);
+  return result;
+}
+
+int create_netns(int index) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), NETNS_PATH_FORMAT, index);
+  if (mkdir(NETNS_DIR, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1 && errno != EEXIST) {
+    perror("Failed to create " NETNS_DIR);
+    return -1;
+  }
+  int fd = open(path, O_RDONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("Failed to create network namespace file");
+    return -1;
+  }
+  close(fd);
+
+  // Named the same way `ip netns add` does it, by bind mounting the new namespace onto its file. A child makes
+  // it so our own namespace is left alone.
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (unshare(CLONE_NEWNET) == -1 || mount("/proc/self/ns/net", path, "none", MS_BIND, NULL) == -1) {
+      perror("Failed to create network namespace");
+      _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_SUCCESS);
+  }
+  int status;
+  if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    unlink(path);
+    return -1;
+  }
+  if (setup_netns_link(index) == -1) {
+    delete_netns(index);
+    return -1;
+  }
+  return 0;
+}
+
+int delete_netns(int index) {
+  // The kernel tears a namespace down in the background, remove the host's end of the pair now so the name is
+  // free straight away.
+  char host_name[IFNAMSIZ];
+  snprintf(host_name, sizeof(host_name), NETNS_HOST_LINK_FORMAT, index);
+  int host_ifindex = if_nametoindex(host_name);
+  int host_socket = host_ifindex == 0 ? -1 : netlink_open(-1);
+  if (host_socket != -1) {
+    netlink_batch_t batch;
+    netlink_batch_init(&batch, host_socket);
+    struct ifinfomsg link = { .ifi_family = AF_UNSPEC, .ifi_index = host_ifindex };
+    netlink_add_message(&batch, RTM_DELLINK, 0, &link, sizeof(link));
+    if (netlink_send(&batch) == -1 && errno != ENODEV) {
+      perror("Failed to remove host end of veth pair");
+    }
+    close(host_socket);
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), NETNS_PATH_FORMAT, index);
+  umount2(path, MNT_DETACH);
+  if (unlink(path) == -1) {
+    perror("Failed to remove network namespace");
+    return -1;
+  }
+  snprintf(path, sizeof(path), NETNS_LOCK_FORMAT, index);
+  unlink(path);
+  return 0;
+}
+
+// Dump handlers for scrub_netns, each queues a delete for whatever the container could have added. Resending
+// the dumped message with a delete type is enough for the kernel to find what it refers to.
+static void queue_link_removal(struct nlmsghdr* message, void* arg) {
+  scrub_t* scrub = arg;
+  struct ifinfomsg* link = NLMSG_DATA(message);
+  if (link->ifi_index == LOOPBACK_IFINDEX) {
+    return;
+  }
+  if (strcmp(link_name(message), scrub->peer_name) == 0) {
+    scrub->peer_ifindex = link->ifi_index;
+    return;
+  }
+  struct ifinfomsg removal = { .ifi_family = AF_UNSPEC, .ifi_index = link->ifi_index };
+  netlink_add_message(scrub->batch, RTM_DELLINK, 0, &removal, sizeof(removal));
+}
+
+static void queue_address_removal(struct nlmsghdr* message, void* arg) {
+  scrub_t* scrub = arg;
+  struct ifaddrmsg* addr = NLMSG_DATA(message);
+  // IPv6 link local addresses only come back by taking the link down and up, so they stay. Links are dumped
+  // before addresses, so the peer has been found by now if it is still there.
+  if (scrub->peer_ifindex != 0 && (int) addr->ifa_index == scrub->peer_ifindex && addr->ifa_scope != RT_SCOPE_LINK) {
+    netlink_add_message(scrub->batch, RTM_DELADDR, 0, addr, NLMSG_PAYLOAD(message, 0));
+  }
+}
+
+static void queue_route_removal(struct nlmsghdr* message, void* arg) {
+  scrub_t* scrub = arg;
+  struct rtmsg* route = NLMSG_DATA(message);
+  if (route->rtm_table == RT_TABLE_MAIN) {
+    netlink_add_message(scrub->batch, RTM_DELROUTE, 0, route, NLMSG_PAYLOAD(message, 0));
+  }
+}
+
+// iptables has no rtnetlink interface, so rules the container added still need the real thing. Tables only
+// show up in a namespace once something uses them, which keeps this off the common path.
+static void flush_firewall(int ns_fd) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (setns(ns_fd, CLONE_NEWNET) == -1) {
+      _exit(EXIT_FAILURE);
+    }
+    char tables[256];
+    int fd = open("/proc/self/net/ip_tables_names", O_RDONLY);
+    ssize_t len = fd == -1 ? 0 : read(fd, tables, sizeof(tables));
+    if (len <= 0) {
+      _exit(EXIT_SUCCESS);
+    }
+    pid_t filter = fork();
+    if (filter == 0) {
+      execlp("iptables", "iptables", "-F", (char*) NULL);
+      _exit(127);
+    }
+    waitpid(filter, NULL, 0);
+    execlp("iptables", "iptables", "-t", "nat", "-F", (char*) NULL);
+    _exit(127);
+  }
+  if (pid != -1) {
+    waitpid(pid, NULL, 0);
+  }
+}
+
+int scrub_netns(int index) {
+  int ns_fd = open_netns(index);
+  if (ns_fd == -1) {
+    return -1;
+  }
+  int ns_socket = netlink_open(ns_fd);
+  if (ns_socket == -1) {
+    close(ns_fd);
+    return -1;
+  }
+
+  // Removing a link costs the kernel a few RCU grace periods, so the veth pair is kept and only what was
+  // added on top of it goes. Routes go first, deleting addresses would take some of them along.
+  netlink_batch_t batch;
+  netlink_batch_init(&batch, ns_socket);
+  scrub_t scrub = { .batch = &batch, .peer_ifindex = 0 };
+  snprintf(scrub.peer_name, sizeof(scrub.peer_name), NETNS_PEER_LINK_FORMAT, index);
+  struct rtmsg routes = { .rtm_family = AF_INET };
+  struct ifinfomsg links = { .ifi_family = AF_UNSPEC };
+  struct ifaddrmsg addresses = { .ifa_family = AF_UNSPEC };
+  int result = 0;
+  if (netlink_dump(ns_socket, RTM_GETROUTE, &routes, sizeof(routes), queue_route_removal, &scrub) == -1 ||
+      netlink_dump(ns_socket, RTM_GETLINK, &links, sizeof(links), queue_link_removal, &scrub) == -1 ||
+      netlink_dump(ns_socket, RTM_GETADDR, &addresses, sizeof(addresses), queue_address_removal, &scrub) == -1) {
+    perror("Failed to list network namespace's configuration");
+    result = -1;
+  }
+  // Deleting one end of a pair takes the other with it, and an address can take routes with it, so some of
+  // these can find what they were after already gone.
+  else if (netlink_send(&batch) == -1 && errno != ENODEV && errno != ESRCH && errno != EADDRNOTAVAIL) {
+    perror("Failed to clear network namespace");
+    result = -1;
+  }
+  else if (scrub.peer_ifindex != 0) {
+    queue_link_up(&batch, scrub.peer_ifindex);
+    queue_netns_config(&batch, index, scrub.peer_ifindex);
+    if (netlink_send(&batch) == -1) {
+      perror("Failed to reconfigure network namespace");
+      result = -1;
+    }
+  }
+  close(ns_socket);
+
+  if (result == 0) {
+    flush_firewall(ns_fd);
+    // The container deleted or renamed its end of the pair, which took the host's end with it.
+    if (scrub.peer_ifindex == 0) {
+      result = setup_netns_link(index);
+    }
+  }
+  close(ns_fd);
+  return result;
+}
+
+void release_netns(netns_lease_t* lease) {
+  puts("Scrubbing network namespace...");
+
+  // The scrub script lives next to the runtime binary, wherever we were started from. Without it the netlink
+  // scrub below still runs, there is just nothing to fall back to.
+  char exe[PATH_MAX];
+  char script[PATH_MAX] = "";
+  ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  if (len == -1) {
+    perror("Failed to find the runtime's directory");
+  }
+  else {
+    exe[len] = '\0';
+    snprintf(script, sizeof(script), "%s/%s", dirname(exe), NETNS_SCRUB_SCRIPT);
+  }
+  char index[16];
+  snprintf(index, sizeof(index), "%d", lease->index);
+
+  // Don't make the container's exit wait on the scrub. The scrubber inherits the lock and keeps the namespace
+  // out of the pool until it is done. The script is only there for kernels the netlink path can't handle.
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("Failed to fork network namespace scrubber");
+  }
+  else if (pid == 0) {
+    if (scrub_netns(lease->index) == 0) {
+      _exit(EXIT_SUCCESS);
+    }
+    if (script[0] == '\0') {
+      _exit(EXIT_FAILURE);
+    }
+    fputs("Falling back to " NETNS_SCRUB_SCRIPT "\n", stderr);
+    fcntl(lease->lock_fd, F_SETFD, 0);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    execl("/bin/bash", "bash", script, index, (char*) NULL);
+    _exit(127);
+  }
+  close(lease->lock_fd);
+  lease->lock_fd = -1;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <limits.h>
+
+// Pool of pre-created network namespaces made by networking/setup.sh. A container holds an flock on its
+// namespace's lock file for as long as it uses it, so the kernel hands it back if the runtime dies.
+
+#define NETNS_DIR                     "/var/run/netns"
+#define NETNS_PATH_FORMAT             "/var/run/netns/netns%d"
+#define NETNS_LOCK_DIR                "/var/run/drydock/netns"
+#define NETNS_LOCK_FORMAT             "/var/run/drydock/netns/netns%d.lock"
+#define NETNS_SCRUB_SCRIPT            "networking/scrub.sh" // relative to the directory holding the runtime
+#define NETNS_ACQUIRE_TIMEOUT_MS      5000
+
+// Namespace i is connected to the host through veth-default<i> (10.0.(3+i).1) <-> veth-netns<i> (10.0.(3+i).2),
+// the same layout networking/netns.sh builds. Both ends are found by name, the kernel picks their indexes.
+#define NETNS_HOST_LINK_FORMAT        "veth-default%d"
+#define NETNS_PEER_LINK_FORMAT        "veth-netns%d"
+#define NETNS_SUBNET_BASE             3
+// The third octet runs out at 255.
+#define NETNS_MAX_POOL_SIZE           (256 - NETNS_SUBNET_BASE)
+
+typedef struct {
+  int index;
+  int lock_fd;
+  char path[PATH_MAX]; // what the container should setns into
+} netns_lease_t;
+
+/**
+ * Claims a network namespace nobody else is using, waiting a little for one to be freed if they are all busy.
+ * returns 0 on success, -1 if the pool does not exist or stayed exhausted
+ * */
+int acquire_netns(netns_lease_t* lease);
+
+/**
+ * Scrubs the namespace in the background and gives it back to the pool once that is done.
+ * */
+void release_netns(netns_lease_t* lease);
+
+/**
+ * Creates network namespace index and its veth pair, like netns_create in networking/netns.sh.
+ * returns 0 on success, -1 on error
+ * */
+int create_netns(int index);
+
+/**
+ * Removes network namespace index, its veth pair goes with it.
+ * returns 0 on success, -1 on error
+ * */
+int delete_netns(int index);
+
+/**
+ * Creates the veth pair for network namespace index, addresses it, brings it up and adds the default route.
+ * Three netlink round trips on the namespace's side, creating the pair, finding its end and configuring it,
+ * and one on the host's.
+ * returns 0 on success, -1 on error
+ * */
+int setup_netns_link(int index);
+
+/**
+ * Puts network namespace index back the way create_netns left it, undoing whatever the last container did.
+ * returns 0 on success, -1 on error
+ * */
+int scrub_netns(int index);
@@ -0,0 +1,60 @@
+/**
+Builds and tears down the pool of network namespaces over rtnetlink, without running ip once per step.
+networking/setup.sh and networking/teardown.sh use it when it has been built and fall back to ip otherwise.
+Usage: ./netns_setup create pool_size
+       ./netns_setup delete
+       ./netns_setup scrub index
+*/
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "netns_pool.h"
+
+static void print_usage() {
+  fprintf(stderr, "Usage: ./netns_setup create pool_size | delete | scrub index\n");
+}
+
+int main(int argc, char const *argv[]) {
+  if (argc < 2) {
+    print_usage();
+    return 1;
+  }
+
+  if (strcmp(argv[1], "create") == 0 && argc == 3) {
+    int pool_size = atoi(argv[2]);
+    if (pool_size < 1 || pool_size > NETNS_MAX_POOL_SIZE) {
+      fprintf(stderr, "The pool holds 1 to %d network namespaces, one 10.0.x.0/24 subnet each\n", NETNS_MAX_POOL_SIZE);
+      return 1;
+    }
+    for (int i = 0; i < pool_size; ++i) {
+      if (create_netns(i) == -1) {
+        fprintf(stderr, "Failed to create network namespace %d\n", i);
+        return 1;
+      }
+    }
+    return 0;
+  }
+  if (strcmp(argv[1], "delete") == 0 && argc == 2) {
+    // Same as how the pool is found, netns0 up to the first one that is missing.
+    char path[PATH_MAX];
+    for (int i = 0; ; ++i) {
+      snprintf(path, sizeof(path), NETNS_PATH_FORMAT, i);
+      if (access(path, F_OK) != 0) {
+        return 0;
+      }
+      if (delete_netns(i) == -1) {
+        return 1;
+      }
+    }
+  }
+  if (strcmp(argv[1], "scrub") == 0 && argc == 3) {
+    return scrub_netns(atoi(argv[2])) == 0 ? 0 : 1;
+  }
+  print_usage();
+  return 1;
+}
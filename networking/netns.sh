@@ -0,0 +1,62 @@
+# Shared by setup.sh, teardown.sh and scrub.sh. Network namespace i of the pool is netns$i, connected to the
+# host through veth-default$i (10.0.(3+i).1) <-> veth-netns$i (10.0.(3+i).2). Sourced, not run directly.
+
+NETNS_SUBNET_BASE=3
+NETNS_LOCK_DIR=/var/run/drydock/netns
+# Native version of netns_create/netns_delete, see netns_pool.c. Only there once `make netns_setup` has run.
+NETNS_SETUP="$(dirname "${BASH_SOURCE[0]}")/../netns_setup"
+
+netns_host_ip() { echo "10.0.$((NETNS_SUBNET_BASE + $1)).1"; }
+netns_peer_ip() { echo "10.0.$((NETNS_SUBNET_BASE + $1)).2"; }
+
+netns_create_link() {
+  local i=$1
+  ip link add veth-default$i type veth peer name veth-netns$i
+  ip link set veth-netns$i netns netns$i
+  ip addr add $(netns_host_ip $i)/24 dev veth-default$i
+  ip link set veth-default$i up
+  ip -n netns$i addr add $(netns_peer_ip $i)/24 dev veth-netns$i
+  ip -n netns$i link set veth-netns$i up
+  ip -n netns$i route add default via $(netns_host_ip $i)
+}
+
+netns_create() {
+  local i=$1
+  ip netns add netns$i
+  ip -n netns$i link set lo up
+  netns_create_link $i
+}
+
+# Puts a namespace back the way netns_create left it, undoing whatever the last container did to it.
+netns_scrub() {
+  local i=$1
+  local link
+  for link in $(ip -n netns$i -o link show | awk -F': ' '{ print $2 }' | cut -d@ -f1); do
+    if [ "$link" != lo ] && [ "$link" != veth-netns$i ]; then
+      ip -n netns$i link delete "$link"
+    fi
+  done
+  if command -v iptables > /dev/null; then
+    ip netns exec netns$i iptables -F
+    ip netns exec netns$i iptables -t nat -F
+  fi
+  ip -n netns$i link set lo up
+  if ip -n netns$i link show veth-netns$i > /dev/null 2>&1; then
+    ip -n netns$i addr flush dev veth-netns$i
+    ip -n netns$i route flush all
+    ip -n netns$i addr add $(netns_peer_ip $i)/24 dev veth-netns$i
+    ip -n netns$i link set veth-netns$i up
+    ip -n netns$i route add default via $(netns_host_ip $i)
+  else
+    # Deleting either end of a veth pair takes the other one with it.
+    netns_create_link $i
+  fi
+}
+
+netns_delete() {
+  local i=$1
+  # The namespace itself is torn down in the background, free up the host end's name now.
+  ip link delete veth-default$i 2> /dev/null
+  ip netns delete netns$i
+  rm -f $NETNS_LOCK_DIR/netns$i.lock
+}
@@ -0,0 +1,3 @@
+# Run by the container runtime once a container is done with network namespace $1.
+source "$(dirname "$0")/netns.sh"
+netns_scrub $1
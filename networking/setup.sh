@@ -1,14 +1,23 @@
-ip netns add netns0
-ip netns exec netns0 ip link set lo up
-ip link add veth-default type veth peer name veth-netns0
-ip link set veth-netns0 netns netns0
-ip addr add 10.0.3.1/24 dev veth-default
-ip netns exec netns0 ip addr add 10.0.3.2/24 dev veth-netns0
-ip link set veth-default up
-ip netns exec netns0 ip link set veth-netns0 up
-sudo bash -c 'echo 1 > /proc/sys/net/ipv4/ip_forward'
-iptables -A FORWARD -o eth0 -i veth-default -j ACCEPT
-iptables -A FORWARD -i eth0 -o veth-default -j ACCEPT
-iptables -t nat -A POSTROUTING -s 10.0.3.2/24 -o eth0 -j MASQUERADE
-ip netns exec netns0 ip route add default via 10.0.3.1
+# Creates a pool of network namespaces, each container gets one of them to itself.
+# Usage: setup.sh [pool_size]
+source "$(dirname "$0")/netns.sh"
+POOL_SIZE=${1:-8}
+# Each namespace gets 10.0.(3+i).0/24, so the third octet runs out after 253 of them.
+if [ "$POOL_SIZE" -lt 1 ] || [ "$POOL_SIZE" -gt $((256 - NETNS_SUBNET_BASE)) ]; then
+  echo "The pool holds 1 to $((256 - NETNS_SUBNET_BASE)) network namespaces" >&2
+  exit 1
+fi
 
+# The netlink based tool is much quicker than running ip for every step, use it when it has been built.
+if [ -x "$NETNS_SETUP" ]; then
+  "$NETNS_SETUP" create $POOL_SIZE
+else
+  for i in $(seq 0 $((POOL_SIZE - 1))); do
+    netns_create $i
+  done
+fi
+mkdir -p $NETNS_LOCK_DIR
+sudo bash -c 'echo 1 > /proc/sys/net/ipv4/ip_forward'
+iptables -A FORWARD -o eth0 -i veth-default+ -j ACCEPT
+iptables -A FORWARD -i eth0 -o veth-default+ -j ACCEPT
+iptables -t nat -A POSTROUTING -s 10.0.0.0/16 -o eth0 -j MASQUERADE
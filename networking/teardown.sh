@@ -1,2 +1,13 @@
-sudo ip netns delete netns0
+source "$(dirname "$0")/netns.sh"
+
+if [ -x "$NETNS_SETUP" ]; then
+  "$NETNS_SETUP" delete
+fi
+# Also catches any namespaces past a gap in the numbering, which the tool stops at.
+for ns in $(ip netns list | awk '{ print $1 }' | grep '^netns[0-9]*$'); do
+  netns_delete ${ns#netns}
+done
+iptables -D FORWARD -o eth0 -i veth-default+ -j ACCEPT
+iptables -D FORWARD -i eth0 -o veth-default+ -j ACCEPT
+iptables -t nat -D POSTROUTING -s 10.0.0.0/16 -o eth0 -j MASQUERADE
 sudo bash -c 'echo 0 > /proc/sys/net/ipv4/ip_forward'
@@ -0,0 +1,90 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "numa.h"
+
+static int read_list(const char* path, char* buf, size_t len) {
+  // Reads a one line sysfs file, dropping its newline.
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+  ssize_t got = read(fd, buf, len - 1);
+  close(fd);
+  if (got <= 0) {
+    return -1;
+  }
+  buf[got] = '\0';
+  buf[strcspn(buf, "\n")] = '\0';
+  return 0;
+}
+
+
+int parse_numa_list(const char* list, bool* members, int max) {
+  if (list[0] == '\0') {
+    return 0;
+  }
+  int count = 0;
+  const char* c = list;
+  do {
+    char* end;
+    long first = strtol(c, &end, 10);
+    long last = first;
+    if (end == c || first < 0) {
+      return -1;
+    }
+    if (*end == '-') {
+      c = end + 1;
+      last = strtol(c, &end, 10);
+      if (end == c || last < first) {
+        return -1;
+      }
+    }
+    for (long i = first; members && i <= last && i < max; i++) {
+      members[i] = true;
+    }
+    count += last - first + 1;
+    c = end;
+  } while (*c++ == ',');
+  return c[-1] == '\0' ? count : -1;
+}
+
+
+int read_numa_topology(const char* path, numa_topology_t* topology) {
+  // A node without memory (CPUs only) or without CPUs (memory only, like CXL) is no place to put a container.
+  char list[4096];
+  char file[PATH_MAX];
+  bool has_memory[NUMA_MAX_NODES] = { false };
+  topology->num_nodes = 0;
+  snprintf(file, sizeof(file), "%s/has_memory", path);
+  if (read_list(file, list, sizeof(list)) == -1 || parse_numa_list(list, has_memory, NUMA_MAX_NODES) == -1) {
+    return -1;
+  }
+  for (int id = 0; id < NUMA_MAX_NODES; id++) {
+    numa_node_t* node = &topology->nodes[topology->num_nodes];
+    snprintf(file, sizeof(file), "%s/node%d/cpulist", path, id);
+    if (!has_memory[id] || read_list(file, node->cpus, sizeof(node->cpus)) == -1) {
+      continue;
+    }
+    node->num_cpus = parse_numa_list(node->cpus, NULL, 0);
+    if (node->num_cpus > 0) {
+      node->id = id;
+      topology->num_nodes++;
+    }
+  }
+  return topology->num_nodes > 0 ? 0 : -1;
+}
+
+
+const numa_node_t* find_numa_node(const numa_topology_t* topology, int id) {
+  for (int i = 0; i < topology->num_nodes; i++) {
+    if (topology->nodes[i].id == id) {
+      return &topology->nodes[i];
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+
+// NUMA layout as the kernel describes it under /sys/devices/system/node. Only nodes that have both CPUs and memory
+// are listed, a container placed on a node runs on its CPUs and allocates from its memory.
+#define NUMA_NODE_PATH                "/sys/devices/system/node"
+#define NUMA_MAX_NODES                64
+
+typedef struct {
+  int id;
+  int num_cpus;
+  char cpus[256]; // In the kernel's list format, like 0-15,32-47, ready to go into cpuset.cpus.
+} numa_node_t;
+
+typedef struct {
+  int num_nodes;
+  numa_node_t nodes[NUMA_MAX_NODES];
+} numa_topology_t;
+
+/**
+ * Reads which nodes there are and the CPUs of each from path, normally NUMA_NODE_PATH.
+ * returns 0 on success, -1 if the machine doesn't describe its nodes
+ * */
+int read_numa_topology(const char* path, numa_topology_t* topology);
+
+/**
+ * Finds node id in topology.
+ * returns the node, or NULL if there is no such node or it has no CPUs or no memory
+ * */
+const numa_node_t* find_numa_node(const numa_topology_t* topology, int id);
+
+/**
+ * Counts the CPUs or nodes in a list like 4-7 or 0,2,5-6, marking each one below max in members if it isn't NULL.
+ * returns how many there are, or -1 if the list doesn't parse
+ * */
+int parse_numa_list(const char* list, bool* members, int max);
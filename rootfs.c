@@ -0,0 +1,95 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rootfs.h"
+
+int prepare_overlay_rootfs(const char* image, char* lower, size_t lower_len) {
+  char resolved[PATH_MAX];
+  if (realpath(image, resolved) == NULL) {
+    perror("Failed to find container image");
+    return -1;
+  }
+  // These separate overlayfs mount options and lower layers, there is no escaping them.
+  if (strpbrk(resolved, ",:") != NULL) {
+    fprintf(stderr, "Container image path %s can't contain ',' or ':' in overlay mode\n", resolved);
+    return -1;
+  }
+  if ((size_t) snprintf(lower, lower_len, "%s", resolved) >= lower_len) {
+    fputs("Container image path is too long\n", stderr);
+    return -1;
+  }
+
+  if (mkdir("/var/run/drydock", S_IRWXU) == -1 && errno != EEXIST) {
+    perror("Failed to create /var/run/drydock");
+    return -1;
+  }
+  if (mkdir(OVERLAY_SCRATCH_DIR, S_IRWXU) == -1 && errno != EEXIST) {
+    perror("Failed to create " OVERLAY_SCRATCH_DIR);
+    return -1;
+  }
+  return 0;
+}
+
+int enter_overlay_rootfs(const char* lower) {
+  // Nothing mounted from here on may show up in the host's namespace, and pivot_root refuses shared mounts.
+  if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) == -1) {
+    perror("Failed to make mounts private");
+    return -1;
+  }
+
+  // The upper layer lives in memory, charged to the container's memory cgroup, and is gone once nothing in
+  // the mount namespace is left to hold it.
+  if (mount("tmpfs", OVERLAY_SCRATCH_DIR, "tmpfs", MS_NOSUID | MS_NODEV, "mode=0755") == -1) {
+    perror("Failed to mount overlay scratch space");
+    return -1;
+  }
+  if (mkdir(OVERLAY_SCRATCH_DIR "/upper", S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1 ||
+      mkdir(OVERLAY_SCRATCH_DIR "/work", S_IRWXU) == -1 ||
+      mkdir(OVERLAY_SCRATCH_DIR "/root", S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1) {
+    perror("Failed to create overlay directories");
+    return -1;
+  }
+
+  char options[PATH_MAX + 128];
+  snprintf(options, sizeof(options), "lowerdir=%s,upperdir=%s,workdir=%s", lower,
+    OVERLAY_SCRATCH_DIR "/upper", OVERLAY_SCRATCH_DIR "/work");
+  if (mount("overlay", OVERLAY_SCRATCH_DIR "/root", "overlay", 0, options) == -1) {
+    perror("Failed to mount overlay");
+    return -1;
+  }
+
+  // pivot_root with the same old and new root stacks the old root underneath the new one, where it can be
+  // detached without needing a directory for it inside the image.
+  if (chdir(OVERLAY_SCRATCH_DIR "/root") == -1) {
+    perror("Failed to navigate to overlay root");
+    return -1;
+  }
+  if (syscall(SYS_pivot_root, ".", ".") == -1) {
+    perror("pivot_root failed");
+    return -1;
+  }
+  if (umount2(".", MNT_DETACH) == -1) {
+    perror("Failed to detach the host's root");
+    return -1;
+  }
+  if (chdir("/") == -1) {
+    perror("Failed to navigate to new root");
+    return -1;
+  }
+
+  // Writes land in the upper layer, so an image without a /proc mount point still gets one.
+  if (mkdir("/proc", S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == -1 && errno != EEXIST) {
+    perror("Failed to create /proc");
+    return -1;
+  }
+  return 0;
+}
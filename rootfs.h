@@ -0,0 +1,26 @@
+#pragma once
+
+#include <limits.h>
+#include <stddef.h>
+
+// Overlay mode: the image directory is a read-only lower layer shared by every container started from it, and
+// each container writes into its own upper layer on a tmpfs that only exists in its mount namespace. Starting
+// a container copies nothing, containers from the same image share its page cache, and the upper layer
+// disappears with the container's last process.
+
+// Same path in every container's mount namespace, each one mounts its own tmpfs here.
+#define OVERLAY_SCRATCH_DIR           "/var/run/drydock/overlay"
+
+/**
+ * Host side, before the container is cloned. Makes sure the scratch mount point exists and turns image into the
+ * absolute path overlayfs needs, since the container resolves it after other mounts have been made.
+ * returns 0 on success, -1 if the image can't be used as a lower layer
+ * */
+int prepare_overlay_rootfs(const char* image, char* lower, size_t lower_len);
+
+/**
+ * Container side, in a new mount namespace. Mounts a writable overlay of lower and pivot_roots into it,
+ * leaving the working directory at the new root. The host's tree is no longer reachable afterwards.
+ * returns 0 on success, -1 on error
+ * */
+int enter_overlay_rootfs(const char* lower);
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+typedef struct {
+  uint32_t num_events;
+  trace_event_t events[TRACE_MAX_EVENTS];
+} trace_buffer_t;
+
+// Shared with the container through MAP_SHARED, NULL when tracing is off.
+static trace_buffer_t* trace_buffer;
+static const char* trace_path;
+static const char* trace_container_name;
+
+int trace_init(const char* path, const char* container_name) {
+  if (path == NULL) {
+    return 0;
+  }
+  trace_buffer = mmap(NULL, sizeof(trace_buffer_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (trace_buffer == MAP_FAILED) {
+    perror("Failed to allocate trace buffer");
+    trace_buffer = NULL;
+    return -1;
+  }
+  trace_path = path;
+  trace_container_name = container_name;
+  return 0;
+}
+
+uint64_t trace_now() {
+  if (trace_buffer == NULL) {
+    return 0;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void trace_record(const char* name, trace_side_t side, uint64_t start_ns, uint64_t end_ns) {
+  // Several processes write here at once, so claim a slot atomically. Anything past the end is dropped.
+  uint32_t slot = __atomic_fetch_add(&trace_buffer->num_events, 1, __ATOMIC_RELAXED);
+  if (slot >= TRACE_MAX_EVENTS) {
+    return;
+  }
+  trace_event_t* event = &trace_buffer->events[slot];
+  event->name = name;
+  event->side = side;
+  event->pid = getpid();
+  event->start_ns = start_ns;
+  event->end_ns = end_ns;
+}
+
+void trace_span(const char* name, trace_side_t side, uint64_t start_ns) {
+  if (trace_buffer == NULL) {
+    return;
+  }
+  trace_record(name, side, start_ns, trace_now());
+}
+
+void trace_instant(const char* name, trace_side_t side) {
+  if (trace_buffer == NULL) {
+    return;
+  }
+  uint64_t now = trace_now();
+  trace_record(name, side, now, now);
+}
+
+void trace_flush() {
+  if (trace_buffer == NULL) {
+    return;
+  }
+
+  int fd = open(trace_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd == -1) {
+    perror("Failed to open trace file");
+    return;
+  }
+  // Launches sharing a trace file must not interleave their lines or both write the opening bracket.
+  if (flock(fd, LOCK_EX) == -1) {
+    perror("Failed to lock trace file");
+  }
+
+  FILE* f = fdopen(fd, "a");
+  if (f == NULL) {
+    perror("Failed to open trace file");
+    close(fd);
+    return;
+  }
+
+  // The JSON array format lets the closing bracket (and a trailing comma) be left off, which is what makes it
+  // possible to keep appending launches to the same file.
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size == 0) {
+    fputs("[\n", f);
+  }
+
+  uint32_t num_events = trace_buffer->num_events;
+  if (num_events > TRACE_MAX_EVENTS) {
+    num_events = TRACE_MAX_EVENTS;
+  }
+  // Everything from one launch shares a Chrome "process", named after the container, with a row per real process.
+  pid_t launch_pid = getpid();
+  fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"container %s\"}},\n",
+    launch_pid, trace_container_name);
+  for (uint32_t i = 0; i < num_events; ++i) {
+    trace_event_t* event = &trace_buffer->events[i];
+    const char* side = event->side == TRACE_HOST ? "host" : "container";
+    if (event->start_ns == event->end_ns) {
+      fprintf(f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d},\n",
+        event->name, side, event->start_ns / 1e3, launch_pid, event->pid);
+    }
+    else {
+      fprintf(f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d},\n",
+        event->name, side, event->start_ns / 1e3, (event->end_ns - event->start_ns) / 1e3, launch_pid, event->pid);
+    }
+  }
+
+  // Closing the stream flushes it and drops the lock along with the fd.
+  if (fclose(f) != 0) {
+    perror("Failed to write trace file");
+  }
+  munmap(trace_buffer, sizeof(trace_buffer_t));
+  trace_buffer = NULL;
+}
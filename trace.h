@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Per-phase launch tracing. Events from the runtime, the container's init and the command it execs all land in
+// one shared buffer, and the runtime appends them to a Chrome trace (chrome://tracing, Perfetto) when it exits.
+// Timestamps come from CLOCK_MONOTONIC, so traces from different launches on the same host line up.
+
+#define TRACE_MAX_EVENTS              64
+
+typedef enum {
+  TRACE_HOST = 0,      // the runtime process that sets up and cleans up after the container
+  TRACE_CONTAINER = 1  // the container's init and the command it runs
+} trace_side_t;
+
+typedef struct {
+  const char* name;
+  trace_side_t side;
+  pid_t pid;
+  uint64_t start_ns;
+  uint64_t end_ns;
+} trace_event_t;
+
+/**
+ * Turns tracing on if path is not NULL. Has to happen before the container is cloned so it shares the buffer.
+ * returns 0 on success, -1 if the buffer could not be allocated
+ * */
+int trace_init(const char* path, const char* container_name);
+
+/**
+ * returns the current CLOCK_MONOTONIC time in nanoseconds, or 0 if tracing is off
+ * */
+uint64_t trace_now();
+
+/**
+ * Records a phase that started at start_ns (from trace_now) and ends now.
+ * */
+void trace_span(const char* name, trace_side_t side, uint64_t start_ns);
+
+/**
+ * Records a single point in time, like the moment just before exec.
+ * */
+void trace_instant(const char* name, trace_side_t side);
+
+/**
+ * Appends every recorded event to the trace file as Chrome trace JSON. Safe to call from concurrent launches
+ * sharing one file.
+ * */
+void trace_flush();